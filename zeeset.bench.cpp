@@ -1,9 +1,29 @@
 #include "zeeset.h"
+#include "zeesetwal.h"
+#include "zeesetconcurrent.h"
+#include "zeesetlazy.h"
+#include "zeesetbtree.h"
+#include "zeesetbuckets.h"
+#include "zeesetwindow.h"
+#include "zeesetrolling.h"
 #include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+
+// usage: zeeset.bench [--sizes 100000,1000000] [--ops 100000] [--threads 1,2,4] [--suites ops,dict,...] [--json out.json]
+//
+// every case reports ops/sec and p50/p99/p999/max latency (ns, timer overhead included),
+// --json writes all results as a JSON array for regression tracking
 
 struct SortData {
-    int x;
-    int y;
+    int x = 0;
+    int y = 0;
 
     bool operator==(const SortData &rhs) const {
         return x == rhs.x && y == rhs.y;
@@ -21,71 +41,1489 @@ std::ostream &operator<<(std::ostream &os, const SortData &ins) {
     return os;
 }
 
-int main() {
-    ZeeSet<unsigned, SortData, 32, 30> rank;
+// a score behind a class type, which keeps the btree on its binary search
+struct BoxedScore {
+    unsigned long v = 0;
+
+    bool operator==(const BoxedScore &rhs) const {
+        return v == rhs.v;
+    }
+
+    bool operator<(const BoxedScore &rhs) const {
+        return v < rhs.v;
+    }
+};
+
+std::ostream &operator<<(std::ostream &os, const BoxedScore &ins) {
+    os << ins.v;
+    return os;
+}
+
+struct Options {
+    std::vector<unsigned> SIZES = {100000, 1000000};
+    unsigned OPS = 100000;
+    std::vector<unsigned> THREADS = {1, 2, 4, 8};
+    std::set<std::string> SUITES;
+    std::string JSON_PATH;
+
+    bool Enabled(const std::string &suite) const {
+        return SUITES.empty() || SUITES.count(suite);
+    }
+};
+
+struct Result {
+    std::string SUITE;
+    std::string OP;
+    std::vector<std::pair<std::string, std::string>> PARAMS;
+    std::vector<std::pair<std::string, double>> METRICS;
+};
+
+static std::vector<Result> g_results;
+
+using Params = std::vector<std::pair<std::string, std::string>>;
+using Clock = std::chrono::steady_clock;
+
+static void Report(const std::string &suite, const std::string &op, const Params &params,
+        const std::vector<std::pair<std::string, double>> &metrics) {
+    Result r{suite, op, params, metrics};
+
+    std::cout << suite << " " << op;
+    for(auto &p: params) {
+        std::cout << " " << p.first << "=" << p.second;
+    }
+    for(auto &m: metrics) {
+        std::cout << " " << m.first << "=" << (unsigned long long)std::llround(m.second);
+    }
+    std::cout << "\n";
+
+    g_results.emplace_back(r);
+}
+
+static double ElapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static uint64_t ElapsedNs(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+// n operations took seconds of wall time in total, latencies holds one entry per operation
+static void ReportLatencies(const std::string &suite, const std::string &op, const Params &params, unsigned n,
+        double seconds, std::vector<uint64_t> &latencies) {
+    if(latencies.empty()) {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        size_t i = (size_t)(p * (latencies.size() - 1));
+        return (double)latencies[i];
+    };
+
+    Report(suite, op, params, {
+            {"ops", (double)n},
+            {"ops_per_sec", seconds > 0 ? n / seconds : 0},
+            {"p50_ns", percentile(0.50)},
+            {"p99_ns", percentile(0.99)},
+            {"p999_ns", percentile(0.999)},
+            {"max_ns", (double)latencies.back()},
+        });
+}
+
+// times every call of op(i) for i in [0, n)
+template<typename Function>
+static void Measure(const std::string &suite, const std::string &op, const Params &params, unsigned n, Function f) {
+    std::vector<uint64_t> latencies;
+    latencies.reserve(n);
+
+    Clock::time_point start = Clock::now();
+    for(unsigned i = 0; i < n; ++i) {
+        Clock::time_point t0 = Clock::now();
+        f(i);
+        latencies.emplace_back(ElapsedNs(t0));
+    }
+
+    ReportLatencies(suite, op, params, n, ElapsedMs(start) / 1000, latencies);
+}
+
+static void WriteJson(const std::string &path) {
+    std::ofstream os(path);
+
+    auto quote = [](const std::string &s) {
+        std::string out = "\"";
+        for(char c: s) {
+            if(c == '"' || c == '\\') {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + "\"";
+    };
+
+    os << "[\n";
+    for(size_t i = 0; i < g_results.size(); ++i) {
+        const Result &r = g_results[i];
+        os << "  {\"suite\": " << quote(r.SUITE) << ", \"op\": " << quote(r.OP);
+        for(auto &p: r.PARAMS) {
+            os << ", " << quote(p.first) << ": " << quote(p.second);
+        }
+        for(auto &m: r.METRICS) {
+            os << ", " << quote(m.first) << ": " << m.second;
+        }
+        os << "}" << (i + 1 < g_results.size() ? "," : "") << "\n";
+    }
+    os << "]\n";
+}
+
+// score distributions
+enum Distribution {
+    UNIFORM,
+    ZIPFIAN,
+    MOSTLY_TIES,
+};
+
+static const char *DistributionName(Distribution d) {
+    switch(d) {
+        case UNIFORM: return "uniform";
+        case ZIPFIAN: return "zipfian";
+        default: return "mostly_ties";
+    }
+}
+
+// zipfian over [0, n) with theta 0.99, small scores most frequent (Gray et al., as in YCSB)
+class ZipfGenerator {
+public:
+    ZipfGenerator(unsigned long n, double theta = 0.99) : m_n(n), m_theta(theta) {
+        double zeta2 = 0;
+        for(unsigned long i = 1; i <= 2; ++i) {
+            zeta2 += 1 / std::pow((double)i, theta);
+        }
+
+        m_zetan = 0;
+        for(unsigned long i = 1; i <= n; ++i) {
+            m_zetan += 1 / std::pow((double)i, theta);
+        }
+
+        m_alpha = 1 / (1 - theta);
+        m_eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / m_zetan);
+    }
+
+    unsigned long operator()(std::mt19937 &rng) {
+        double u = (double)rng() / ((double)rng.max() + 1);
+        double uz = u * m_zetan;
+
+        if(uz < 1) {
+            return 0;
+        }
+        if(uz < 1 + std::pow(0.5, m_theta)) {
+            return 1;
+        }
+        return (unsigned long)(m_n * std::pow(m_eta * u - m_eta + 1, m_alpha)) % m_n;
+    }
+
+private:
+    unsigned long m_n;
+    double m_theta;
+    double m_zetan;
+    double m_alpha;
+    double m_eta;
+};
+
+class ScoreGenerator {
+public:
+    ScoreGenerator(Distribution d, unsigned n) : m_distribution(d), m_n(n), m_zipf(d == ZIPFIAN ? n : 2) {}
+
+    unsigned long operator()(std::mt19937 &rng) {
+        switch(m_distribution) {
+            case UNIFORM: return rng() % (m_n * 10ul);
+            case ZIPFIAN: return m_zipf(rng);
+            default: return rng() % 10;
+        }
+    }
+
+    // width of a value range holding about count elements
+    unsigned long Width(unsigned long count) {
+        switch(m_distribution) {
+            case UNIFORM: return count * 10;
+            case ZIPFIAN: return count;
+            default: return 0;
+        }
+    }
+
+private:
+    Distribution m_distribution;
+    unsigned m_n;
+    ZipfGenerator m_zipf;
+};
+
+template<typename T> struct TypeName;
+template<> struct TypeName<unsigned> { static const char *Get() { return "u32"; } };
+template<> struct TypeName<unsigned long> { static const char *Get() { return "u64"; } };
+template<> struct TypeName<std::string> { static const char *Get() { return "string"; } };
+template<> struct TypeName<SortData> { static const char *Get() { return "sortdata"; } };
+template<> struct TypeName<BoxedScore> { static const char *Get() { return "boxed_u64"; } };
+
+static void MakeKey(unsigned id, unsigned &key) {
+    key = id * 2654435761u;
+}
+
+static void MakeKey(unsigned id, std::string &key) {
+    key = "player:" + std::to_string(id);
+}
+
+static void MakeValue(unsigned long score, unsigned id, unsigned long &value) {
+    value = score;
+}
+
+static void MakeValue(unsigned long score, unsigned id, SortData &value) {
+    value.x = (int)score;
+    value.y = (int)id;
+}
+
+static void MakeValue(unsigned long score, unsigned id, BoxedScore &value) {
+    value.v = score;
+}
+
+// every public ZeeSet operation on one set type, size and score distribution
+template<typename SetType>
+static void BenchOps(const Options &options, unsigned n, Distribution distribution) {
+    using K = typename SetType::KEY_TYPE;
+    using V = typename SetType::VALUE_TYPE;
+
+    SetType rank;
+    ScoreGenerator score(distribution, n);
     std::mt19937 rng;
-    rng.seed(time(NULL));
-
-    unsigned max_id = 100000;
-    unsigned max_op = 1000000;
-
-    for(unsigned i = 0; i < max_op; ++i) {
-        unsigned op = (unsigned)rng() % 10;
-        unsigned id = (unsigned)rng() % max_id;
-
-        switch(op) {
-            case 0:
-            case 1:
-            case 2:
-            case 3:
-            case 4:
-            case 5:
-            case 6:
-                {
-                    SortData s;
-                    rank.Update(id, s);
-                }
-                break;
-            default:
-                {
+    rng.seed(n);
+
+    std::vector<K> keys(n);
+    for(unsigned i = 0; i < n; ++i) {
+        MakeKey(i, keys[i]);
+        V v;
+        MakeValue(score(rng), i, v);
+        rank.Update(keys[i], v);
+    }
+
+    unsigned ops = options.OPS < n ? options.OPS : n;
+    // scans return up to 100 elements each, some distributions make value ranges much larger
+    unsigned scan_ops = ops < 10000 ? ops : 10000;
+    Params params = {
+        {"key", TypeName<K>::Get()},
+        {"value", TypeName<V>::Get()},
+        {"distribution", DistributionName(distribution)},
+        {"size", std::to_string(n)},
+    };
+    // callbacks must have an effect, or the compiler drops the whole walk
+    unsigned long sink = 0;
+    auto ignore = [&sink](unsigned long r, const K &key, const V &value) { sink += r; };
+    auto pick = [&sink](unsigned long r, const K &key, const V &value) -> bool { sink += r; return true; };
+
+    {
+        std::vector<std::pair<K, V>> inserts(ops);
+        for(unsigned i = 0; i < ops; ++i) {
+            MakeKey(n + i, inserts[i].first);
+            MakeValue(score(rng), n + i, inserts[i].second);
+        }
+
+        Measure("ops", "update_insert", params, ops, [&](unsigned i) {
+                    rank.Update(inserts[i].first, inserts[i].second);
+                });
+
+        for(auto &kv: inserts) {
+            rank.Delete(kv.first);
+        }
+    }
+
+    {
+        std::vector<std::pair<unsigned, V>> moves(ops);
+        for(unsigned i = 0; i < ops; ++i) {
+            moves[i].first = rng() % n;
+            MakeValue(score(rng), moves[i].first, moves[i].second);
+        }
+
+        Measure("ops", "update_move", params, ops, [&](unsigned i) {
+                    rank.Update(keys[moves[i].first], moves[i].second);
+                });
+    }
+
+    {
+        std::vector<unsigned> probes(ops);
+        for(unsigned &p: probes) {
+            p = rng() % n;
+        }
+
+        Measure("ops", "get_rank_of_element", params, ops, [&](unsigned i) {
+                    sink += rank.GetRankOfElement(keys[probes[i]]);
+                });
+
+        Measure("ops", "get_value_by_key", params, ops, [&](unsigned i) {
+                    V v;
+                    sink += rank.GetValueByKey(keys[probes[i]], v);
+                });
+    }
+
+    Measure("ops", "get_element_by_rank", params, ops, [&](unsigned i) {
+                K key;
+                V value;
+                sink += rank.GetElementByRank(rng() % n + 1, key, value);
+            });
+
+    Measure("ops", "get_elements_by_ranged_rank_100", params, scan_ops, [&](unsigned i) {
+                unsigned long low = rng() % n + 1;
+                rank.GetElementsByRangedRank(low, low + 99, ignore);
+            });
+
+    {
+        std::vector<std::pair<V, V>> ranges(scan_ops);
+        for(unsigned i = 0; i < scan_ops; ++i) {
+            unsigned long low = score(rng);
+            MakeValue(low, 0, ranges[i].first);
+            MakeValue(low + score.Width(100), n, ranges[i].second);
+        }
+
+        Measure("ops", "get_elements_by_ranged_value", params, scan_ops, [&](unsigned i) {
+                    rank.GetElementsByRangedValue(ranges[i].first, true, ranges[i].second, true, ignore);
+                });
+
+        Measure("ops", "get_elements_count_by_ranged_value", params, ops, [&](unsigned i) {
+                    auto &range = ranges[i % scan_ops];
+                    sink += rank.GetElementsCountByRangedValue(range.first, true, range.second, true);
+                });
+
+        Measure("ops", "foreach_elements_of_nearby_value_10", params, scan_ops, [&](unsigned i) {
+                    rank.ForeachElementsOfNearbyValue(ranges[i].first, 5, 5, pick);
+                });
+    }
+
+    Measure("ops", "foreach_elements_of_nearby_rank_10", params, scan_ops, [&](unsigned i) {
+                rank.ForeachElementsOfNearbyRank(rng() % n + 1, 5, 5, pick);
+            });
+
+    {
+        std::vector<unsigned> victims(ops);
+        for(unsigned i = 0; i < ops; ++i) {
+            victims[i] = rng() % n;
+        }
+
+        Measure("ops", "delete", params, ops, [&](unsigned i) {
+                    rank.Delete(keys[victims[i]]);
+                });
+    }
+
+    Measure("ops", "optimize", params, 3, [&](unsigned i) {
+                rank.Optimize(i == 2);
+            });
+
+    if(sink == 1) {
+        std::cout << "\n";
+    }
+}
+
+static void SuiteOps(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        for(Distribution d: {UNIFORM, ZIPFIAN, MOSTLY_TIES}) {
+            BenchOps<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, n, d);
+            BenchOps<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, n, d);
+            BenchOps<ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, n, d);
+        }
+    }
+}
+
+// 70/30 Update/Delete churn, per allocator, with node memory against fixed MAX_LEVEL nodes
+template<typename SetType>
+static void BenchChurn(const Options &options, const char *allocator, unsigned n) {
+    SetType rank;
+    std::mt19937 rng;
+    rng.seed(n);
+
+    for(unsigned i = 0; i < n; ++i) {
+        rank.Update(rng() % n, SortData{(int)(rng() % n), (int)i});
+    }
+
+    Measure("allocator", "churn_70_update_30_delete", {{"allocator", allocator}, {"size", std::to_string(n)}}, options.OPS * 10, [&](unsigned i) {
+                unsigned id = rng() % n;
+
+                if(rng() % 10 < 7) {
+                    rank.Update(id, SortData{(int)(rng() % n), (int)id});
+                } else {
                     rank.Delete(id);
                 }
-                break;
+            });
+
+    size_t bytes = rank.NodesMemory();
+
+    Report("allocator", "node_memory", {{"allocator", allocator}, {"size", std::to_string(n)}}, {
+            {"nodes", (double)rank.Count()},
+            {"node_bytes", (double)bytes},
+            {"avg_node_bytes", rank.Count() ? (double)bytes / rank.Count() : 0},
+            {"fixed_node_bytes", (double)rank.FixedNodeSize()},
+            {"saved_bytes", (double)(rank.FixedNodeSize() * rank.Count() - bytes)},
+        });
+}
+
+static void SuiteAllocator(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        BenchChurn<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, "default", n);
+        BenchChurn<ZeeSet<unsigned, SortData, 32, 25, ZeeSlabAllocator<>, ZeeHashDict>>(options, "slab", n);
+    }
+}
+
+template<typename SetType>
+static void BenchDict(const Options &options, const char *dict, unsigned n) {
+    SetType rank;
+    std::mt19937 rng;
+    rng.seed(n);
+    Params params = {{"dict", dict}, {"size", std::to_string(n)}};
+
+    Measure("dict", "update_insert", params, n, [&](unsigned i) {
+                rank.Update(i * 2654435761u, SortData{(int)(rng() % n), (int)i});
+            });
+
+    Measure("dict", "update_move", params, options.OPS, [&](unsigned i) {
+                rank.Update((unsigned)(rng() % n) * 2654435761u, SortData{(int)(rng() % n), (int)i});
+            });
+
+    unsigned long sum = 0;
+    Measure("dict", "get_rank_of_element", params, options.OPS, [&](unsigned i) {
+                sum += rank.GetRankOfElement((unsigned)(rng() % n) * 2654435761u);
+            });
+
+    Measure("dict", "delete", params, n, [&](unsigned i) {
+                rank.Delete(i * 2654435761u);
+            });
+
+    if(sum == 1) {
+        std::cout << "\n";
+    }
+}
+
+static void SuiteDict(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        BenchDict<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeMapDict>>(options, "map", n);
+        BenchDict<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, "hash", n);
+    }
+}
+
+// the same workload on each ordering engine: skiplist against order-statistic B+tree and score buckets,
+// MOSTLY_TIES puts n/10 elements in each bucket, the buckets' worst case
+template<typename SetType>
+static void BenchEngine(const Options &options, const char *engine, unsigned n, Distribution distribution) {
+    using V = typename SetType::VALUE_TYPE;
+
+    SetType rank;
+    ScoreGenerator score(distribution, n);
+    std::mt19937 rng;
+    rng.seed(n);
+
+    Params params = {{"engine", engine}, {"distribution", DistributionName(distribution)}, {"size", std::to_string(n)}};
+    unsigned ops = options.OPS < n ? options.OPS : n;
+    unsigned scan_ops = ops < 10000 ? ops : 10000;
+    unsigned long sink = 0;
+    auto ignore = [&sink](unsigned long r, const unsigned &key, const V &value) { sink += r; };
+
+    Measure("engine", "update_insert", params, n, [&](unsigned i) {
+                V v;
+                MakeValue(score(rng), i, v);
+                rank.Update(i, v);
+            });
+
+    Measure("engine", "update_move", params, ops, [&](unsigned i) {
+                unsigned id = rng() % n;
+                V v;
+                MakeValue(score(rng), id, v);
+                rank.Update(id, v);
+            });
+
+    Measure("engine", "get_rank_of_element", params, ops, [&](unsigned i) {
+                sink += rank.GetRankOfElement(rng() % n);
+            });
+
+    Measure("engine", "get_element_by_rank", params, ops, [&](unsigned i) {
+                unsigned key;
+                V value;
+                sink += rank.GetElementByRank(rng() % n + 1, key, value);
+            });
+
+    Measure("engine", "get_elements_by_ranged_rank_100", params, scan_ops, [&](unsigned i) {
+                unsigned long low = rng() % n + 1;
+                rank.GetElementsByRangedRank(low, low + 99, ignore);
+            });
+
+    Measure("engine", "get_elements_count_by_ranged_value", params, ops, [&](unsigned i) {
+                unsigned long low = score(rng);
+                V v_low, v_high;
+                MakeValue(low, 0, v_low);
+                MakeValue(low + score.Width(100), n, v_high);
+                sink += rank.GetElementsCountByRangedValue(v_low, true, v_high, true);
+            });
+
+    size_t bytes = rank.NodesMemory();
+
+    Report("engine", "node_memory", params, {
+            {"nodes", (double)rank.Count()},
+            {"node_bytes", (double)bytes},
+            {"avg_node_bytes", rank.Count() ? (double)bytes / rank.Count() : 0},
+        });
+
+    Measure("engine", "delete", params, ops, [&](unsigned i) {
+                rank.Delete(rng() % n);
+            });
+
+    if(sink == 1) {
+        std::cout << "\n";
+    }
+}
+
+// searches inside btree nodes: vector scans of u64 scores against binary search of the same scores boxed
+template<typename SetType>
+static void BenchSearch(const Options &options, const char *search, unsigned n) {
+    using V = typename SetType::VALUE_TYPE;
+
+    SetType rank;
+    ScoreGenerator score(UNIFORM, n);
+    std::mt19937 rng;
+    rng.seed(n);
+
+#if defined(__AVX2__)
+    const char *isa = "avx2";
+#elif defined(__SSE4_2__)
+    const char *isa = "sse4.2";
+#else
+    const char *isa = "scalar";
+#endif
+
+    Params params = {{"search", search}, {"isa", isa}, {"value", TypeName<V>::Get()}, {"size", std::to_string(n)}};
+    unsigned long sink = 0;
+
+    for(unsigned i = 0; i < n; ++i) {
+        V v;
+        MakeValue(score(rng), i, v);
+        rank.Update(i, v);
+    }
+
+    Measure("search", "first_greater_equal_value", params, options.OPS, [&](unsigned i) {
+                unsigned key;
+                V v, value;
+                MakeValue(score(rng), 0, v);
+                sink += rank.GetElementOfFirstGreaterEqualValue(v, key, value, NULL);
+            });
+
+    Measure("search", "last_less_value", params, options.OPS, [&](unsigned i) {
+                unsigned key;
+                V v, value;
+                MakeValue(score(rng), 0, v);
+                sink += rank.GetElementOfLastLessValue(v, key, value, NULL);
+            });
+
+    Measure("search", "count_ranged_value", params, options.OPS, [&](unsigned i) {
+                unsigned long low = score(rng);
+                V v_low, v_high;
+                MakeValue(low, 0, v_low);
+                MakeValue(low + score.Width(100), 0, v_high);
+                sink += rank.GetElementsCountByRangedValue(v_low, true, v_high, true);
+            });
+
+    // looks the element up by its key first, then descends by (value, key)
+    Measure("search", "get_rank_of_element", params, options.OPS, [&](unsigned i) {
+                sink += rank.GetRankOfElement(rng() % n);
+            });
+
+    Measure("search", "update_move", params, options.OPS, [&](unsigned i) {
+                V v;
+                MakeValue(score(rng), 0, v);
+                rank.Update(rng() % n, v);
+            });
+
+    if(sink == 1) {
+        std::cout << "\n";
+    }
+}
+
+static void SuiteSearch(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        BenchSearch<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict,
+            ZeeBTree<unsigned, unsigned long>>>(options, "vector", n);
+        BenchSearch<ZeeSet<unsigned, BoxedScore, 32, 25, ZeeDefaultAllocator, ZeeHashDict,
+            ZeeBTree<unsigned, BoxedScore>>>(options, "binary", n);
+    }
+}
+
+static void SuiteEngine(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        for(Distribution d: {UNIFORM, MOSTLY_TIES}) {
+            BenchEngine<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, "skiplist", n, d);
+            BenchEngine<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict,
+                ZeeBTree<unsigned, unsigned long>>>(options, "btree", n, d);
+            BenchEngine<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict,
+                ZeeScoreBuckets<unsigned, unsigned long, 0, 0xffffffff>>>(options, "buckets", n, d);
+            BenchEngine<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>(options, "skiplist_sortdata", n, d);
+            BenchEngine<ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict,
+                ZeeBTree<unsigned, SortData>>>(options, "btree_sortdata", n, d);
+        }
+    }
+}
+
+// rank by searching from header (comparing values and keys) against climbing back from the node
+static void SuiteRankOfNode(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        using SkiplistType = ZeeSkiplist<unsigned, SortData>;
+        SkiplistType skiplist;
+        std::vector<SkiplistType::Node *> nodes;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        nodes.reserve(n);
+        for(unsigned i = 0; i < n; ++i) {
+            nodes.emplace_back(skiplist.Insert(i, SortData{(int)(rng() % 100), (int)(rng() % n)}));
+        }
+
+        std::vector<SkiplistType::Node *> probes(options.OPS);
+        for(auto &p: probes) {
+            p = nodes[rng() % n];
+        }
+
+        unsigned long sum_search = 0, sum_climb = 0;
+        Params params = {{"size", std::to_string(n)}};
+
+        Measure("rank_of_node", "search_from_header", params, options.OPS, [&](unsigned i) {
+                    sum_search += skiplist.GetRankOfElement(probes[i]->KEY, probes[i]->VALUE);
+                });
+        Measure("rank_of_node", "climb_from_node", params, options.OPS, [&](unsigned i) {
+                    sum_climb += skiplist.GetRankByNode(probes[i]);
+                });
+
+        if(sum_search != sum_climb) {
+            std::cout << "rank_of_node MISMATCH\n";
         }
     }
+}
 
-    rank.Clear();
+static void SuiteBulkLoad(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
 
-    //std::cout << rank.DumpLevels() << "\n";
-    std::cout << "TestSelf=" << rank.TestSelf() << "\n";
+    for(unsigned n: options.SIZES) {
+        std::vector<std::pair<unsigned, SortData>> entries;
+        std::mt19937 rng;
+        rng.seed(n);
 
-    for(unsigned i = 0; i < max_op; ++i) {
-        unsigned op = (unsigned)rng() % 10;
-        unsigned id = (unsigned)rng() % max_id;
+        entries.reserve(n);
+        for(unsigned i = 0; i < n; ++i) {
+            entries.emplace_back(i * 2654435761u, SortData{(int)(rng() % n), (int)i});
+        }
+
+        unsigned threads = std::thread::hardware_concurrency();
+        Params params = {{"size", std::to_string(n)}, {"threads", std::to_string(threads)}};
 
-        switch(op) {
-            case 0:
-            case 1:
-            case 2:
-            case 3:
-            case 4:
-            case 6:
-                {
-                    SortData s;
-                    rank.Update(id, s);
+        Measure("bulk_load", "update_loop", params, 1, [&](unsigned i) {
+                    SetType rank;
+                    for(auto &kv: entries) {
+                        rank.Update(kv.first, kv.second);
+                    }
+                });
+        Measure("bulk_load", "bulk_load", params, 1, [&](unsigned i) {
+                    SetType rank;
+                    rank.BulkLoad(entries.begin(), entries.end(), threads);
+                });
+    }
+}
+
+// 16 per-server boards of n/16 players each (keys overlap, as players move between servers) merged
+// into one: Update per element against UnionStore/InterStore on one thread and on all cores
+static void SuiteAlgebra(const Options &options) {
+    using SetType = ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        std::vector<std::unique_ptr<SetType>> boards;
+        std::vector<SetType *> sets;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        for(unsigned b = 0; b < 16; ++b) {
+            boards.emplace_back(new SetType());
+            sets.emplace_back(boards.back().get());
+            for(unsigned i = 0; i < n / 16; ++i) {
+                boards.back()->Update(rng() % n, rng() % ((unsigned long)n * 10));
+            }
+        }
+
+        unsigned threads = std::thread::hardware_concurrency();
+        Params params = {{"size", std::to_string(n)}, {"sets", "16"}, {"threads", std::to_string(threads)}};
+
+        Measure("algebra", "update_loop_union_sum", params, 1, [&](unsigned i) {
+                    SetType merged;
+                    for(SetType *set: sets) {
+                        set->ForeachElements([&merged](unsigned long r, const unsigned &key, const unsigned long &value) {
+                                    unsigned long sum = 0;
+                                    merged.GetValueByKey(key, sum);
+                                    merged.Update(key, sum + value);
+                                });
+                    }
+                });
+        Measure("algebra", "union_sum", params, 1, [&](unsigned i) {
+                    SetType merged;
+                    merged.UnionStore(sets);
+                });
+        Measure("algebra", "union_sum_threads", params, 1, [&](unsigned i) {
+                    SetType merged;
+                    merged.UnionStore(sets, {}, SetType::AGGREGATE_SUM, threads);
+                });
+        Measure("algebra", "inter_max", params, 1, [&](unsigned i) {
+                    SetType merged;
+                    merged.InterStore(sets, {}, SetType::AGGREGATE_MAX);
+                });
+        Measure("algebra", "inter_max_threads", params, 1, [&](unsigned i) {
+                    SetType merged;
+                    merged.InterStore(sets, {}, SetType::AGGREGATE_MAX, threads);
+                });
+    }
+}
+
+// applies the same batches of random score changes once through Update and once through
+// UpdateBatch (then the same for deletes), timing every batch
+static void SuiteBatch(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        for(unsigned batch: {10u, 100u, 1000u, 10000u, 100000u}) {
+            if(batch > n) {
+                continue;
+            }
+
+            unsigned rounds = std::max(1u, options.OPS / batch);
+            std::vector<std::vector<std::pair<unsigned, SortData>>> updates(rounds);
+            std::vector<std::vector<unsigned>> deletes(rounds);
+            std::mt19937 rng;
+            rng.seed(n + batch);
+
+            for(unsigned r = 0; r < rounds; ++r) {
+                for(unsigned i = 0; i < batch; ++i) {
+                    updates[r].emplace_back(rng() % n, SortData{(int)(rng() % n), (int)i});
+                    deletes[r].emplace_back(rng() % n);
                 }
-                break;
-            default:
-                {
-                    rank.Delete(id);
+            }
+
+            for(int batched = 0; batched < 2; ++batched) {
+                SetType rank;
+                for(unsigned i = 0; i < n; ++i) {
+                    rank.Update(i, SortData{(int)(rng() % n), (int)i});
+                }
+
+                std::vector<uint64_t> update_latencies;
+                std::vector<uint64_t> delete_latencies;
+                uint64_t update_ns = 0;
+                uint64_t delete_ns = 0;
+
+                for(unsigned r = 0; r < rounds; ++r) {
+                    Clock::time_point t0 = Clock::now();
+                    if(batched) {
+                        rank.UpdateBatch(updates[r].begin(), updates[r].end());
+                    } else {
+                        for(auto &kv: updates[r]) {
+                            rank.Update(kv.first, kv.second);
+                        }
+                    }
+                    update_latencies.emplace_back(ElapsedNs(t0));
+                    update_ns += update_latencies.back();
+                }
+
+                for(unsigned r = 0; r < rounds; ++r) {
+                    Clock::time_point t0 = Clock::now();
+                    if(batched) {
+                        rank.DeleteBatch(deletes[r].begin(), deletes[r].end());
+                    } else {
+                        for(unsigned key: deletes[r]) {
+                            rank.Delete(key);
+                        }
+                    }
+                    delete_latencies.emplace_back(ElapsedNs(t0));
+                    delete_ns += delete_latencies.back();
                 }
-                break;
+
+                Params params = {{"size", std::to_string(n)}, {"batch", std::to_string(batch)}};
+                double elements = (double)rounds * batch;
+                auto report = [&](const char *op, std::vector<uint64_t> &latencies, uint64_t ns) {
+                    std::sort(latencies.begin(), latencies.end());
+                    Report("batch", op, params, {
+                            {"elements", elements},
+                            {"elements_per_sec", ns > 0 ? elements * 1e9 / ns : 0},
+                            {"ns_per_element", ns / elements},
+                            {"p50_batch_ns", (double)latencies[(size_t)(0.50 * (latencies.size() - 1))]},
+                            {"p99_batch_ns", (double)latencies[(size_t)(0.99 * (latencies.size() - 1))]},
+                        });
+                };
+
+                report(batched ? "update_batch" : "update_loop", update_latencies, update_ns);
+                report(batched ? "delete_batch" : "delete_loop", delete_latencies, delete_ns);
+            }
         }
     }
+}
 
-    //std::cout << rank.DumpLevels() << "\n";
-    std::cout << "TestSelf=" << rank.TestSelf() << "\n";
-    
-    return 0;
+// ranks of 200..2000 random keys per call (friend-list leaderboards), looping GetRankOfElement
+// against one GetRanksOfElements
+static void SuiteRankBatch(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        SetType rank;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        for(unsigned i = 0; i < n; ++i) {
+            rank.Update(i * 2654435761u, SortData{(int)(rng() % n), (int)i});
+        }
+
+        for(unsigned batch: {200u, 2000u}) {
+            unsigned rounds = std::max(1u, options.OPS / batch);
+            std::vector<std::vector<unsigned>> probes(rounds);
+            std::vector<unsigned long> ranks(batch);
+            unsigned long sink = 0;
+
+            for(auto &keys: probes) {
+                for(unsigned i = 0; i < batch; ++i) {
+                    keys.emplace_back((unsigned)(rng() % n) * 2654435761u);
+                }
+            }
+
+            Params params = {{"size", std::to_string(n)}, {"batch", std::to_string(batch)}};
+
+            Measure("rank_batch", "rank_loop", params, rounds, [&](unsigned i) {
+                        for(size_t j = 0; j < batch; ++j) {
+                            ranks[j] = rank.GetRankOfElement(probes[i][j]);
+                        }
+                        sink += ranks[batch - 1];
+                    });
+            Measure("rank_batch", "ranks_of_elements", params, rounds, [&](unsigned i) {
+                        rank.GetRanksOfElements(probes[i].begin(), probes[i].end(), ranks.data());
+                        sink += ranks[batch - 1];
+                    });
+
+            if(sink == 1) {
+                std::cout << "\n";
+            }
+        }
+    }
+}
+
+// "top 100" reads with and without the top-N cache, and what keeping it costs updates: moves anywhere
+// in the ranking, and moves into and out of the head (scores of rank <= 200 or so)
+static void SuiteTop(const Options &options) {
+    using SetType = ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        for(size_t cache: {(size_t)0, (size_t)100}) {
+            SetType rank;
+            std::mt19937 rng;
+            rng.seed(n);
+
+            for(unsigned i = 0; i < n; ++i) {
+                rank.Update(i, rng() % ((unsigned long)n * 10));
+            }
+
+            if(cache) {
+                rank.EnableTopCache(cache);
+            }
+
+            Params params = {{"size", std::to_string(n)}, {"cache", std::to_string(cache)}};
+            unsigned long sink = 0;
+            auto add = [&sink](unsigned long r, const unsigned &key, const unsigned long &value) { sink += value; };
+
+            Measure("top", "top_100", params, options.OPS, [&](unsigned i) {
+                        rank.GetElementsByRangedRank(1, 100, add);
+                    });
+
+            Measure("top", "by_rank_head", params, options.OPS, [&](unsigned i) {
+                        unsigned key;
+                        unsigned long value;
+                        sink += rank.GetElementByRank(rng() % 100 + 1, key, value);
+                    });
+
+            Measure("top", "update_move", params, options.OPS, [&](unsigned i) {
+                        rank.Update(rng() % n, rng() % ((unsigned long)n * 10));
+                    });
+
+            Measure("top", "update_head", params, options.OPS, [&](unsigned i) {
+                        rank.Update(rng() % n, rng() % 2000);
+                    });
+
+            ZeeTopCacheStats stats = rank.GetTopCacheStats();
+            Report("top", "cache", params, {
+                    {"hits", (double)stats.HITS},
+                    {"misses", (double)stats.MISSES},
+                    {"invalidations", (double)stats.INVALIDATIONS},
+                    {"rebuilds", (double)stats.REBUILDS},
+                });
+
+            if(sink == 1) {
+                std::cout << "\n";
+            }
+        }
+    }
+}
+
+// one clock unit per update, so a ttl of n keeps about n distinct keys live
+struct TickClock {
+    uint64_t NOW = 0;
+
+    uint64_t Now() const {
+        return NOW;
+    }
+};
+
+static void SuiteWindow(const Options &options) {
+    using SetType = ZeeWindowedSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, TickClock>;
+
+    for(unsigned n: options.SIZES) {
+        // expiring a few elements per update against one sweep of everything due every n / 10 updates
+        for(unsigned long per_update: {0UL, 16UL}) {
+            SetType rank(n, per_update);
+            std::mt19937 rng;
+            rng.seed(n);
+
+            unsigned long keys = (unsigned long)n * 4;
+            unsigned long sweep = n / 10 ? n / 10 : 1;
+            auto update = [&](unsigned i) {
+                rank.GetClock().NOW++;
+                rank.Update(rng() % keys, rng() % ((unsigned long)n * 10));
+                if(!per_update && i % sweep == 0) {
+                    rank.ExpireSome((unsigned long)-1);
+                }
+            };
+
+            for(unsigned i = 0; i < n * 2; ++i) {
+                update(i);
+            }
+
+            Params params = {{"size", std::to_string(n)}, {"expire_per_update", std::to_string(per_update)}};
+            unsigned long sink = 0;
+
+            Measure("window", "update", params, options.OPS, update);
+
+            Measure("window", "rank", params, options.OPS, [&](unsigned i) {
+                        sink += rank.GetRankOfElement(rng() % keys);
+                    });
+
+            Report("window", "expiry", params, {
+                    {"live", (double)rank.Count()},
+                    {"expired", (double)rank.ExpiredCount()},
+                });
+
+            if(sink == 1) {
+                std::cout << "\n";
+            }
+        }
+    }
+}
+
+// n players, 60 buckets of n / 10 deltas each: rotating the ring against one Update per expiring delta
+static void SuiteRolling(const Options &options) {
+    using SetType = ZeeRollingSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+    const size_t buckets = 60;
+    const unsigned rotations = 10;
+
+    for(unsigned n: options.SIZES) {
+        std::mt19937 rng;
+        rng.seed(n);
+
+        // the bench keeps its own ring so the baseline can replay the expiring deltas
+        std::vector<std::vector<std::pair<unsigned, unsigned long>>> ring(buckets);
+        auto fill = [&](std::vector<std::pair<unsigned, unsigned long>> &bucket) {
+            bucket.resize(n / 10);
+            for(auto &kv: bucket) {
+                kv = std::make_pair((unsigned)(rng() % n), (unsigned long)(rng() % 100 + 1));
+            }
+        };
+
+        SetType rolling(buckets);
+        ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> plain;
+
+        for(size_t b = 0; b < buckets; ++b) {
+            fill(ring[b]);
+            rolling.AddBatch(ring[b].begin(), ring[b].end());
+            for(auto &kv: ring[b]) {
+                unsigned long total = 0;
+                plain.GetValueByKey(kv.first, total);
+                plain.Update(kv.first, total + kv.second);
+            }
+            if(b + 1 < buckets) {
+                rolling.Rotate();
+            }
+        }
+
+        Params params = {{"size", std::to_string(n)}, {"buckets", std::to_string(buckets)}, {"deltas_per_bucket", std::to_string(n / 10)}};
+        std::vector<uint64_t> batched, looped;
+        double batched_ms = 0, looped_ms = 0;
+
+        for(unsigned r = 0; r < rotations; ++r) {
+            std::vector<std::pair<unsigned, unsigned long>> &oldest = ring[r % buckets];
+
+            Clock::time_point start = Clock::now();
+            rolling.Rotate();
+            batched.emplace_back(ElapsedNs(start));
+            batched_ms += batched.back() / 1e6;
+
+            start = Clock::now();
+            for(auto &kv: oldest) {
+                unsigned long total = 0;
+                plain.GetValueByKey(kv.first, total);
+                if(total == kv.second) {
+                    plain.Delete(kv.first);
+                } else {
+                    plain.Update(kv.first, total - kv.second);
+                }
+            }
+            looped.emplace_back(ElapsedNs(start));
+            looped_ms += looped.back() / 1e6;
+
+            fill(oldest);
+            rolling.AddBatch(oldest.begin(), oldest.end());
+            for(auto &kv: oldest) {
+                unsigned long total = 0;
+                plain.GetValueByKey(kv.first, total);
+                plain.Update(kv.first, total + kv.second);
+            }
+        }
+
+        ReportLatencies("rolling", "rotate_batch", params, rotations, batched_ms / 1000, batched);
+        ReportLatencies("rolling", "rotate_update_loop", params, rotations, looped_ms / 1000, looped);
+        Report("rolling", "players", params, {
+                {"ranked", (double)rolling.Count()},
+                {"same", (double)(rolling.Count() == plain.Count())},
+            });
+    }
+}
+
+// exact ranks against descents stopped at a bound of 0.1% and 1% of the ranks, with the errors made
+static void SuitePercentile(const Options &options) {
+    using SetType = ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        SetType rank;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        for(unsigned i = 0; i < n; ++i) {
+            rank.Update(i, rng() % ((unsigned long)n * 10));
+        }
+
+        Params params = {{"size", std::to_string(n)}};
+        unsigned long sink = 0;
+
+        Measure("percentile", "rank_exact", params, options.OPS, [&](unsigned i) {
+                    sink += rank.GetRankOfElement(rng() % n);
+                });
+
+        for(double permille: {1.0, 10.0}) {
+            unsigned long max_error = (unsigned long)(permille * n / 1000);
+            Params approx_params = {{"size", std::to_string(n)}, {"max_error", std::to_string(max_error)}};
+
+            Measure("percentile", "rank_approx", approx_params, options.OPS, [&](unsigned i) {
+                        sink += rank.GetApproxRankOfElement(rng() % n, max_error);
+                    });
+
+            double total_error = 0;
+            unsigned long worst = 0, bound = 0;
+            for(unsigned i = 0; i < options.OPS; ++i) {
+                unsigned key = rng() % n;
+                unsigned long error;
+                unsigned long approx = rank.GetApproxRankOfElement(key, max_error, &error);
+                unsigned long exact = rank.GetRankOfElement(key);
+                unsigned long diff = approx > exact ? approx - exact : exact - approx;
+
+                total_error += diff;
+                worst = std::max(worst, diff);
+                bound = std::max(bound, error);
+            }
+
+            Report("percentile", "rank_approx_accuracy", approx_params, {
+                    {"mean_error", options.OPS ? total_error / options.OPS : 0},
+                    {"max_error", (double)worst},
+                    {"max_bound", (double)bound},
+                    {"mean_error_ppm", options.OPS && n ? total_error / options.OPS * 1e6 / n : 0},
+                });
+        }
+
+        Measure("percentile", "percentile_of_element", params, options.OPS, [&](unsigned i) {
+                    double percentile = 0;
+                    rank.GetPercentileOfElement(rng() % n, percentile, 0.1);
+                    sink += (unsigned long)(percentile * 1000);
+                });
+
+        Measure("percentile", "value_at_percentile", params, options.OPS, [&](unsigned i) {
+                    unsigned long value;
+                    sink += rank.GetValueAtPercentile((rng() % 100000) / 1000.0, value);
+                });
+
+        if(sink == 1) {
+            std::cout << "\n";
+        }
+    }
+}
+
+static void SuiteOptimize(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict> rank;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        for(unsigned i = 0; i < n; ++i) {
+            rank.Update(i, SortData{(int)(rng() % n), (int)i});
+        }
+
+        Params params = {{"size", std::to_string(n)}};
+        long sum = 0;
+        auto scan = [&rank, &sum](unsigned i) {
+            rank.ForeachElements([&sum](unsigned long r, const unsigned &key, const SortData &value) {
+                        sum += value.x;
+                    });
+        };
+
+        Measure("optimize", "full_scan_before", params, 3, scan);
+        Measure("optimize", "optimize", params, 1, [&](unsigned i) { rank.Optimize(false); });
+        Measure("optimize", "optimize_relocate", params, 1, [&](unsigned i) { rank.Optimize(true); });
+        Measure("optimize", "full_scan_after_relocate", params, 3, scan);
+    }
+}
+
+static void SuiteSnapshot(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        SetType rank;
+        std::mt19937 rng;
+        rng.seed(n);
+
+        for(unsigned i = 0; i < n; ++i) {
+            rank.Update(i * 2654435761u, SortData{(int)(rng() % n), (int)i});
+        }
+
+        std::vector<std::pair<unsigned, SortData>> entries;
+        entries.reserve(n);
+        rank.ForeachElements([&entries](unsigned long r, const unsigned &key, const SortData &value) {
+                    entries.emplace_back(key, value);
+                });
+
+        Params params = {{"size", std::to_string(n)}};
+        std::string image;
+
+        Measure("snapshot", "save", params, 1, [&](unsigned i) {
+                    std::ostringstream os;
+                    rank.SaveSnapshot(os);
+                    image = os.str();
+                });
+        Measure("snapshot", "load", params, 1, [&](unsigned i) {
+                    SetType loaded;
+                    std::istringstream is(image);
+                    loaded.LoadSnapshot(is);
+                });
+        Measure("snapshot", "replay_update", params, 1, [&](unsigned i) {
+                    SetType replayed;
+                    for(auto &kv: entries) {
+                        replayed.Update(kv.first, kv.second);
+                    }
+                });
+    }
+}
+
+static void SuiteWal(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+    std::string log_path = "zeeset.bench.log";
+
+    for(unsigned n: options.SIZES) {
+        for(int with_log = 0; with_log < 2; ++with_log) {
+            SetType rank;
+            ZeeSetWal<unsigned, SortData> wal;
+            std::mt19937 rng;
+            rng.seed(n);
+
+            remove(log_path.c_str());
+            if(with_log) {
+                wal.Open(log_path, 10);
+                rank.SetLog(&wal);
+            }
+
+            Measure("wal", "update", {{"log", with_log ? "on" : "off"}, {"size", std::to_string(n)}}, n, [&](unsigned i) {
+                        rank.Update(rng() % n, SortData{(int)(rng() % n), (int)i});
+                    });
+
+            rank.SetLog(NULL);
+        }
+    }
+
+    remove(log_path.c_str());
 }
 
+// update cost with snapshots off, on, and on while an old snapshot pins every node (so each
+// update copies its path), plus the cost of taking a snapshot
+static void SuiteMvcc(const Options &options) {
+    using SetType = ZeeSet<unsigned, SortData, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+    for(unsigned n: options.SIZES) {
+        const char *modes[] = {"off", "on", "on_pinned"};
+
+        for(int mode = 0; mode < 3; ++mode) {
+            SetType rank;
+            std::mt19937 rng;
+            rng.seed(n);
+
+            for(unsigned i = 0; i < n; ++i) {
+                rank.Update(i, SortData{(int)(rng() % n), (int)i});
+            }
+
+            if(mode > 0) {
+                rank.EnableSnapshots();
+            }
+
+            SetType::SNAPSHOT_TYPE pinned;
+            Params params = {{"snapshots", modes[mode]}, {"size", std::to_string(n)}};
+
+            Measure("mvcc", "update", params, options.OPS, [&](unsigned i) {
+                        if(mode == 2 && i % 1000 == 0) {
+                            pinned = rank.Snapshot();
+                        }
+                        rank.Update(rng() % n, SortData{(int)(rng() % n), (int)i});
+                    });
+
+            if(mode == 1) {
+                Measure("mvcc", "snapshot", {{"size", std::to_string(n)}}, options.OPS, [&](unsigned i) {
+                            pinned = rank.Snapshot();
+                        });
+
+                unsigned long sink = 0;
+                Measure("mvcc", "page_100", {{"size", std::to_string(n)}}, options.OPS / 100, [&](unsigned i) {
+                            unsigned long low = rng() % n + 1;
+                            pinned.GetElementsByRangedRank(low, low + 99, [&sink](unsigned long r, const unsigned &key, const SortData &value) {
+                                        sink += key;
+                                    });
+                        });
+
+                if(sink == 1) {
+                    std::cout << "\n";
+                }
+            }
+        }
+    }
+}
+
+// 95% reads (rank lookups, 10-element rank scans and nearby queries) and 5% updates from every thread,
+// shows how reads scale with threads through the reader-writer lock against a plain mutex
+template<typename SetType>
+static void BenchConcurrent(const Options &options, const char *lock, unsigned n, unsigned threads) {
+    SetType rank;
+    std::mt19937 seed_rng;
+    seed_rng.seed(n);
+
+    for(unsigned i = 0; i < n; ++i) {
+        rank.Update(i, seed_rng() % (n * 10ul));
+    }
+
+    unsigned ops_per_thread = options.OPS / threads;
+    std::vector<std::vector<uint64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    std::atomic<unsigned long> sink(0);
+
+    Clock::time_point start = Clock::now();
+    for(unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+                    std::mt19937 rng;
+                    rng.seed(n + t);
+                    unsigned long sum = 0;
+                    auto add = [&sum](unsigned long r, const unsigned &key, const unsigned long &value) { sum += r; };
+                    auto pick = [&sum](unsigned long r, const unsigned &key, const unsigned long &value) -> bool { sum += r; return true; };
+
+                    latencies[t].reserve(ops_per_thread);
+                    for(unsigned i = 0; i < ops_per_thread; ++i) {
+                        unsigned op = rng() % 100;
+                        unsigned key = rng() % n;
+                        Clock::time_point t0 = Clock::now();
+
+                        if(op < 5) {
+                            rank.Update(key, rng() % (n * 10ul));
+                        } else if(op < 65) {
+                            sum += rank.GetRankOfElement(key);
+                        } else if(op < 85) {
+                            rank.GetElementsByRangedRank(key + 1, key + 10, add);
+                        } else {
+                            rank.ForeachElementsOfNearbyRank(key + 1, 5, 5, pick);
+                        }
+
+                        latencies[t].emplace_back(ElapsedNs(t0));
+                    }
+
+                    sink += sum;
+                });
+    }
+
+    for(auto &w: workers) {
+        w.join();
+    }
+    double seconds = ElapsedMs(start) / 1000;
+
+    std::vector<uint64_t> all;
+    for(auto &l: latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+
+    ReportLatencies("concurrent", "read_95_write_5", {{"lock", lock}, {"size", std::to_string(n)}, {"threads", std::to_string(threads)}},
+            ops_per_thread * threads, seconds, all);
+
+    if(sink == 1) {
+        std::cout << "\n";
+    }
+}
+
+static void SuiteConcurrent(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        for(unsigned threads: options.THREADS) {
+            BenchConcurrent<ConcurrentZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeRWLock>>(options, "rwlock", n, threads);
+            BenchConcurrent<ConcurrentZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeMutexLock>>(options, "mutex", n, threads);
+        }
+    }
+}
+
+// 5% updates, 50% rank lookups, 25% value lookups and 20% value-range scans from every thread:
+// the lazy skiplist against a mutex-wrapped ZeeSet
+template<typename SetType>
+static void BenchLazy(const Options &options, const char *set, unsigned n, unsigned threads) {
+    SetType rank;
+    std::mt19937 seed_rng;
+    seed_rng.seed(n);
+
+    for(unsigned i = 0; i < n; ++i) {
+        rank.Update(i, seed_rng() % (n * 10ul));
+    }
+
+    unsigned ops_per_thread = options.OPS / threads;
+    std::vector<std::vector<uint64_t>> latencies(threads);
+    std::vector<std::thread> workers;
+    std::atomic<unsigned long> sink(0);
+
+    Clock::time_point start = Clock::now();
+    for(unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+                    std::mt19937 rng;
+                    rng.seed(n + t);
+                    unsigned long sum = 0;
+                    auto add = [&sum](const auto &... element) { ++sum; };
+
+                    latencies[t].reserve(ops_per_thread);
+                    for(unsigned i = 0; i < ops_per_thread; ++i) {
+                        unsigned op = rng() % 100;
+                        unsigned key = rng() % n;
+                        Clock::time_point t0 = Clock::now();
+
+                        if(op < 5) {
+                            rank.Update(key, rng() % (n * 10ul));
+                        } else if(op < 55) {
+                            sum += rank.GetRankOfElement(key);
+                        } else if(op < 80) {
+                            unsigned long value;
+                            sum += rank.GetValueByKey(key, value);
+                        } else {
+                            unsigned long low = rng() % (n * 10ul);
+                            rank.GetElementsByRangedValue(low, true, low + 100, true, add);
+                        }
+
+                        latencies[t].emplace_back(ElapsedNs(t0));
+                    }
+
+                    sink += sum;
+                });
+    }
+
+    for(auto &w: workers) {
+        w.join();
+    }
+    double seconds = ElapsedMs(start) / 1000;
+
+    std::vector<uint64_t> all;
+    for(auto &l: latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+
+    ReportLatencies("lazy", "mixed_95_read", {{"set", set}, {"size", std::to_string(n)}, {"threads", std::to_string(threads)}},
+            ops_per_thread * threads, seconds, all);
+
+    if(sink == 1) {
+        std::cout << "\n";
+    }
+}
+
+static void SuiteLazy(const Options &options) {
+    for(unsigned n: options.SIZES) {
+        for(unsigned threads: options.THREADS) {
+            BenchLazy<ConcurrentZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeMutexLock>>(options, "mutex_zeeset", n, threads);
+            BenchLazy<ZeeLazySet<unsigned, unsigned long>>(options, "lazy", n, threads);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    Options options;
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+        std::vector<std::string> items;
+        std::stringstream ss(value);
+
+        for(std::string item; std::getline(ss, item, ',');) {
+            items.emplace_back(item);
+        }
+
+        if(arg == "--sizes") {
+            options.SIZES.clear();
+            for(auto &item: items) {
+                options.SIZES.emplace_back((unsigned)strtoul(item.c_str(), NULL, 10));
+            }
+        } else if(arg == "--threads") {
+            options.THREADS.clear();
+            for(auto &item: items) {
+                options.THREADS.emplace_back((unsigned)strtoul(item.c_str(), NULL, 10));
+            }
+        } else if(arg == "--ops") {
+            options.OPS = (unsigned)strtoul(value.c_str(), NULL, 10);
+        } else if(arg == "--suites") {
+            options.SUITES.insert(items.begin(), items.end());
+        } else if(arg == "--json") {
+            options.JSON_PATH = value;
+        } else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, void (*)(const Options &)>> suites = {
+        {"ops", SuiteOps},
+        {"allocator", SuiteAllocator},
+        {"dict", SuiteDict},
+        {"engine", SuiteEngine},
+        {"search", SuiteSearch},
+        {"rank_of_node", SuiteRankOfNode},
+        {"bulk_load", SuiteBulkLoad},
+        {"algebra", SuiteAlgebra},
+        {"batch", SuiteBatch},
+        {"rank_batch", SuiteRankBatch},
+        {"top", SuiteTop},
+        {"window", SuiteWindow},
+        {"rolling", SuiteRolling},
+        {"percentile", SuitePercentile},
+        {"optimize", SuiteOptimize},
+        {"snapshot", SuiteSnapshot},
+        {"wal", SuiteWal},
+        {"mvcc", SuiteMvcc},
+        {"concurrent", SuiteConcurrent},
+        {"lazy", SuiteLazy},
+    };
+
+    for(auto &suite: suites) {
+        if(options.Enabled(suite.first)) {
+            suite.second(options);
+        }
+    }
+
+    if(!options.JSON_PATH.empty()) {
+        WriteJson(options.JSON_PATH);
+    }
+
+    return 0;
+}
@@ -9,62 +9,1581 @@
 #include <sstream>
 #include <cassert>
 #include <vector>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <functional>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <limits>
+#include <cmath>
+
+// cache hint for batched lookups, compiles to nothing where unsupported
+#if defined(__GNUC__) || defined(__clang__)
+#define ZEESET_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define ZEESET_PREFETCH(p)
+#endif
+
+// node allocator using global operator new/delete for every node
+class ZeeDefaultAllocator {
+public:
+    // ReleaseAll() frees every allocation at once
+    static constexpr bool RELEASE_ALL = false;
+
+    void *Allocate(size_t size) {
+        return ::operator new(size);
+    }
+
+    void Deallocate(void *p, size_t size) {
+        ::operator delete(p);
+    }
+
+    void ReleaseAll() {}
+};
+
+// node allocator carving nodes from slabs of SlabSize bytes
+// freed nodes are kept on a free list per size class (i.e. per node height) and recycled,
+// ReleaseAll() drops every slab in O(slabs)
+template<size_t SlabSize = 64 * 1024>
+class ZeeSlabAllocator {
+public:
+    static constexpr bool RELEASE_ALL = true;
+    static constexpr size_t SLAB_SIZE = SlabSize;
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+
+    ZeeSlabAllocator() = default;
+
+    ~ZeeSlabAllocator() {
+        ReleaseAll();
+    }
+
+    ZeeSlabAllocator(const ZeeSlabAllocator &) = delete;
+    ZeeSlabAllocator(ZeeSlabAllocator &&) = delete;
+    ZeeSlabAllocator &operator=(const ZeeSlabAllocator &) = delete;
+    ZeeSlabAllocator &operator=(ZeeSlabAllocator &&) = delete;
+
+    void *Allocate(size_t size) {
+        size_t size_class = SizeClass(size);
+
+        if(size_class < m_free_lists.size() && m_free_lists[size_class]) {
+            FreeChunk *chunk = m_free_lists[size_class];
+            m_free_lists[size_class] = chunk->NEXT;
+            return chunk;
+        }
+
+        size = size_class * ALIGN;
+
+        if(size > (size_t)(m_slab_end - m_slab_cursor)) {
+            size_t slab_size = size > SLAB_SIZE ? size : SLAB_SIZE;
+            m_slab_cursor = (char *)::operator new(slab_size);
+            m_slab_end = m_slab_cursor + slab_size;
+            m_slabs.emplace_back(m_slab_cursor);
+        }
+
+        void *p = m_slab_cursor;
+        m_slab_cursor += size;
+        return p;
+    }
+
+    void Deallocate(void *p, size_t size) {
+        size_t size_class = SizeClass(size);
+
+        if(size_class >= m_free_lists.size()) {
+            m_free_lists.resize(size_class + 1, NULL);
+        }
+
+        FreeChunk *chunk = (FreeChunk *)p;
+        chunk->NEXT = m_free_lists[size_class];
+        m_free_lists[size_class] = chunk;
+    }
+
+    void ReleaseAll() {
+        for(char *slab: m_slabs) {
+            ::operator delete(slab);
+        }
+
+        m_slabs.clear();
+        m_free_lists.clear();
+        m_slab_cursor = NULL;
+        m_slab_end = NULL;
+    }
+
+    size_t SlabCount() {
+        return m_slabs.size();
+    }
+
+private:
+    struct FreeChunk {
+        FreeChunk *NEXT;
+    };
+
+    static size_t SizeClass(size_t size) {
+        if(size < sizeof(FreeChunk)) {
+            size = sizeof(FreeChunk);
+        }
+        return (size + ALIGN - 1) / ALIGN;
+    }
+
+    std::vector<FreeChunk *> m_free_lists;
+    std::vector<char *> m_slabs;
+    char *m_slab_cursor = NULL;
+    char *m_slab_end = NULL;
+};
+
+// ordered dictionary over std::map
+template<typename KeyType, typename MappedType>
+class ZeeMapDict {
+public:
+    using KEY_TYPE = KeyType;
+    using MAPPED_TYPE = MappedType;
+
+    MAPPED_TYPE *Find(const KEY_TYPE &key) {
+        auto iter = m_map.find(key);
+        return iter == m_map.end() ? NULL : &iter->second;
+    }
+
+    // returns true if key was not present
+    bool Set(const KEY_TYPE &key, const MAPPED_TYPE &mapped) {
+        auto result = m_map.insert(std::make_pair(key, mapped));
+
+        if(!result.second) {
+            result.first->second = mapped;
+        }
+
+        return result.second;
+    }
+
+    bool Erase(const KEY_TYPE &key) {
+        return m_map.erase(key) != 0;
+    }
+
+    size_t Size() {
+        return m_map.size();
+    }
+
+    void Clear() {
+        m_map.clear();
+    }
+
+    bool Reserve(size_t n) {
+        return true;
+    }
+
+    void Prefetch(const KEY_TYPE &key) {}
+
+private:
+    std::map<KEY_TYPE, MAPPED_TYPE> m_map;
+};
+
+// hash used by ZeeHashDict, specialize it for custom key types
+template<typename KeyType>
+struct ZeeHash {
+    size_t operator()(const KeyType &key) const {
+        return std::hash<KeyType>()(key);
+    }
+};
+
+// open-addressing hash dictionary (linear probing, backward-shift deletion)
+template<typename KeyType, typename MappedType>
+class ZeeHashDict {
+public:
+    using KEY_TYPE = KeyType;
+    using MAPPED_TYPE = MappedType;
+
+    static constexpr size_t MIN_CAPACITY = 16;
+    // grow when size exceeds LOAD_PERCENT of capacity
+    static constexpr size_t LOAD_PERCENT = 75;
+    // slots a table may have, std::vector cannot index more
+    static constexpr size_t MAX_CAPACITY = PTRDIFF_MAX / sizeof(std::pair<KeyType, MappedType>);
+
+    MAPPED_TYPE *Find(const KEY_TYPE &key) {
+        if(m_size == 0) {
+            return NULL;
+        }
+
+        for(size_t i = Index(key); m_used[i]; i = (i + 1) & m_mask) {
+            if(m_slots[i].first == key) {
+                return &m_slots[i].second;
+            }
+        }
+
+        return NULL;
+    }
+
+    // returns true if key was not present
+    bool Set(const KEY_TYPE &key, const MAPPED_TYPE &mapped) {
+        if((m_size + 1) * 100 > m_slots.size() * LOAD_PERCENT) {
+            Rehash(m_slots.empty() ? MIN_CAPACITY : m_slots.size() * 2);
+        }
+
+        size_t i = Index(key);
+
+        for(; m_used[i]; i = (i + 1) & m_mask) {
+            if(m_slots[i].first == key) {
+                m_slots[i].second = mapped;
+                return false;
+            }
+        }
+
+        m_used[i] = 1;
+        m_slots[i].first = key;
+        m_slots[i].second = mapped;
+        m_size++;
+        return true;
+    }
+
+    bool Erase(const KEY_TYPE &key) {
+        if(m_size == 0) {
+            return false;
+        }
+
+        size_t i = Index(key);
+
+        for(; m_used[i]; i = (i + 1) & m_mask) {
+            if(m_slots[i].first == key) {
+                break;
+            }
+        }
+
+        if(!m_used[i]) {
+            return false;
+        }
+
+        // shift back followers whose probe sequence passes through the hole
+        for(size_t j = (i + 1) & m_mask; m_used[j]; j = (j + 1) & m_mask) {
+            size_t ideal = Index(m_slots[j].first);
+
+            if(((j - ideal) & m_mask) >= ((j - i) & m_mask)) {
+                m_slots[i] = std::move(m_slots[j]);
+                i = j;
+            }
+        }
+
+        m_used[i] = 0;
+        m_slots[i] = std::pair<KEY_TYPE, MAPPED_TYPE>();
+        m_size--;
+        return true;
+    }
+
+    size_t Size() {
+        return m_size;
+    }
+
+    void Clear() {
+        m_slots.clear();
+        m_slots.shrink_to_fit();
+        m_used.clear();
+        m_used.shrink_to_fit();
+        m_size = 0;
+        m_mask = 0;
+        m_shift = 0;
+    }
+
+    // makes room for n elements without growing, false (nothing reserved) if no table holds that many
+    bool Reserve(size_t n) {
+        size_t capacity = MIN_CAPACITY;
+
+        while(n > Holds(capacity)) {
+            if(capacity > MAX_CAPACITY / 2) {
+                return false;
+            }
+            capacity *= 2;
+        }
+
+        if(capacity > m_slots.size()) {
+            Rehash(capacity);
+        }
+
+        return true;
+    }
+
+    // pulls the home slot of key into cache ahead of a Find
+    void Prefetch(const KEY_TYPE &key) {
+        if(m_size == 0) {
+            return;
+        }
+
+        size_t i = Index(key);
+        ZEESET_PREFETCH(&m_used[i]);
+        ZEESET_PREFETCH(&m_slots[i]);
+    }
+
+private:
+    // elements a table of capacity slots holds before growing, floor(capacity * LOAD_PERCENT / 100) without overflow
+    static size_t Holds(size_t capacity) {
+        return capacity / 100 * LOAD_PERCENT + capacity % 100 * LOAD_PERCENT / 100;
+    }
+
+    size_t Index(const KEY_TYPE &key) const {
+        // fibonacci hashing spreads weak hashes (e.g. identity hash of integers)
+        return (size_t)(((uint64_t)ZeeHash<KEY_TYPE>()(key) * 0x9E3779B97F4A7C15ull) >> m_shift) & m_mask;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<std::pair<KEY_TYPE, MAPPED_TYPE>> slots(capacity);
+        std::vector<unsigned char> used(capacity, 0);
+
+        slots.swap(m_slots);
+        used.swap(m_used);
+
+        m_mask = capacity - 1;
+        m_shift = 64;
+        for(size_t c = capacity; c > 1; c >>= 1) {
+            --m_shift;
+        }
+
+        for(size_t k = 0; k < used.size(); ++k) {
+            if(!used[k]) {
+                continue;
+            }
+
+            size_t i = Index(slots[k].first);
+            while(m_used[i]) {
+                i = (i + 1) & m_mask;
+            }
+
+            m_used[i] = 1;
+            m_slots[i] = std::move(slots[k]);
+        }
+    }
+
+    std::vector<std::pair<KEY_TYPE, MAPPED_TYPE>> m_slots;
+    std::vector<unsigned char> m_used;
+    size_t m_size = 0;
+    size_t m_mask = 0;
+    int m_shift = 0;
+};
+
+// sorts [begin, end) with comp, splitting the work over threads and merging the sorted runs
+template<typename Iterator, typename Compare>
+void ZeeParallelSort(Iterator begin, Iterator end, Compare comp, unsigned threads) {
+    size_t n = end - begin;
+
+    if(threads <= 1 || n < threads * 4096) {
+        std::sort(begin, end, comp);
+        return;
+    }
+
+    std::vector<Iterator> bounds;
+    for(unsigned t = 0; t <= threads; ++t) {
+        bounds.emplace_back(begin + n * t / threads);
+    }
+
+    std::vector<std::thread> workers;
+    for(unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&bounds, t, comp]() {
+                    std::sort(bounds[t], bounds[t + 1], comp);
+                });
+    }
+    for(std::thread &w: workers) {
+        w.join();
+    }
+
+    for(size_t width = 1; width < threads; width *= 2) {
+        for(size_t t = 0; t + width < threads; t += width * 2) {
+            size_t last = t + width * 2 < threads ? t + width * 2 : threads;
+            std::inplace_merge(bounds[t], bounds[t + width], bounds[last], comp);
+        }
+    }
+}
+
+// calls f(i) for every i of [0, count), spread over up to threads threads
+template<typename Function> /* std::function<void(size_t i)> */
+void ZeeParallelFor(size_t count, unsigned threads, Function f) {
+    if(threads <= 1 || count <= 1) {
+        for(size_t i = 0; i < count; ++i) {
+            f(i);
+        }
+        return;
+    }
+
+    size_t workers_count = threads < count ? threads : count;
+    std::vector<std::thread> workers;
+    for(size_t t = 0; t < workers_count; ++t) {
+        workers.emplace_back([t, count, workers_count, &f]() {
+                    for(size_t i = t; i < count; i += workers_count) {
+                        f(i);
+                    }
+                });
+    }
+    for(std::thread &w: workers) {
+        w.join();
+    }
+}
+
+// streaming 64-bit checksum of snapshot and log bytes, independent of how the bytes are split
+class ZeeChecksum {
+public:
+    void Update(const void *data, size_t size) {
+        const unsigned char *p = (const unsigned char *)data;
+        m_length += size;
+
+        while(size && m_tail_bytes) {
+            m_tail |= (uint64_t)*p++ << (m_tail_bytes * 8);
+            --size;
+
+            if(++m_tail_bytes == 8) {
+                Mix(m_tail);
+                m_tail = 0;
+                m_tail_bytes = 0;
+            }
+        }
+
+        for(; size >= 8; p += 8, size -= 8) {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            Mix(word);
+        }
+
+        while(size--) {
+            m_tail |= (uint64_t)*p++ << (m_tail_bytes++ * 8);
+        }
+    }
+
+    uint64_t Digest() const {
+        uint64_t h = m_hash ^ (m_tail * 0x87c37b91114253d5ull) ^ m_length;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    void Mix(uint64_t word) {
+        m_hash ^= word * 0x87c37b91114253d5ull;
+        m_hash = (m_hash << 31) | (m_hash >> 33);
+        m_hash *= 0x4cf5ad432745937full;
+    }
+
+    uint64_t m_hash = 0x9E3779B97F4A7C15ull;
+    uint64_t m_tail = 0;
+    int m_tail_bytes = 0;
+    uint64_t m_length = 0;
+};
+
+// byte sink/source for ZeeSerializer, checksumming everything that passes through
+class ZeeWriter {
+public:
+    explicit ZeeWriter(std::ostream &os) : m_os(&os) {}
+
+    // appends to buffer instead of a stream
+    explicit ZeeWriter(std::string &buffer) : m_buffer(&buffer) {}
+
+    bool Write(const void *data, size_t size) {
+        m_checksum.Update(data, size);
+
+        if(m_buffer) {
+            m_buffer->append((const char *)data, size);
+            return true;
+        }
+
+        m_os->write((const char *)data, size);
+        return m_os->good();
+    }
+
+    ZeeChecksum &Checksum() {
+        return m_checksum;
+    }
+
+private:
+    std::ostream *m_os = NULL;
+    std::string *m_buffer = NULL;
+    ZeeChecksum m_checksum;
+};
+
+class ZeeReader {
+public:
+    explicit ZeeReader(std::istream &is) : m_is(&is) {}
+
+    // reads from size bytes at data instead of a stream
+    ZeeReader(const char *data, size_t size) : m_data(data), m_data_end(data + size) {}
+
+    bool Read(void *data, size_t size) {
+        if(m_is) {
+            m_is->read((char *)data, size);
+
+            if((size_t)m_is->gcount() != size) {
+                return false;
+            }
+        } else {
+            if(size > (size_t)(m_data_end - m_data)) {
+                return false;
+            }
+
+            memcpy(data, m_data, size);
+            m_data += size;
+        }
+
+        m_checksum.Update(data, size);
+        return true;
+    }
+
+    // bytes left in a memory source, unknown ((size_t)-1) for a stream
+    size_t Remaining() const {
+        return m_is ? (size_t)-1 : (size_t)(m_data_end - m_data);
+    }
+
+    ZeeChecksum &Checksum() {
+        return m_checksum;
+    }
+
+private:
+    std::istream *m_is = NULL;
+    const char *m_data = NULL;
+    const char *m_data_end = NULL;
+    ZeeChecksum m_checksum;
+};
+
+// receives every logged mutation of a ZeeSet (see ZeeSet::SetLog), e.g. ZeeSetWal
+template<typename KeyType, typename ValueType>
+class ZeeSetLog {
+public:
+    virtual ~ZeeSetLog() = default;
+
+    virtual void OnUpdate(const KeyType &key, const ValueType &value) = 0;
+    virtual void OnDelete(const KeyType &key) = 0;
+    virtual void OnDeleteByRangedRank(unsigned long rank_low, unsigned long rank_high) = 0;
+    virtual void OnDeleteByRangedValue(const ValueType &v_low, bool include_v_low, const ValueType &v_high, bool include_v_high) = 0;
+    virtual void OnClear() = 0;
+};
+
+// how KEY and VALUE are written to snapshots and logs, in host byte order
+// trivially copyable types are written raw, specialize it for other types
+template<typename T>
+struct ZeeSerializer {
+    static_assert(std::is_trivially_copyable<T>::value, "specialize ZeeSerializer for this type");
+
+    static bool Write(ZeeWriter &w, const T &v) {
+        return w.Write(&v, sizeof(v));
+    }
+
+    static bool Read(ZeeReader &r, T &v) {
+        return r.Read(&v, sizeof(v));
+    }
+};
+
+template<>
+struct ZeeSerializer<std::string> {
+    static bool Write(ZeeWriter &w, const std::string &v) {
+        uint32_t size = (uint32_t)v.size();
+        return w.Write(&size, sizeof(size)) && w.Write(v.data(), v.size());
+    }
+
+    // the length is not checksummed yet, so a corrupt one must not allocate more than the source
+    // holds: memory sources are checked up front, streams grow the string as the bytes arrive
+    static bool Read(ZeeReader &r, std::string &v) {
+        static constexpr size_t CHUNK = 64 * 1024;
+        uint32_t size;
+
+        if(!r.Read(&size, sizeof(size)) || size > r.Remaining()) {
+            return false;
+        }
+
+        v.clear();
+        for(size_t done = 0; done < size;) {
+            size_t n = std::min(CHUNK, size - done);
+            v.resize(done + n);
+
+            if(!r.Read(&v[done], n)) {
+                return false;
+            }
+
+            done += n;
+        }
+
+        return true;
+    }
+};
+
+// opt-in instrumentation: build with -DZEESET_ENABLE_STATS for counters, or -DZEESET_ENABLE_LATENCY
+// for counters plus per-operation latency histograms, without either every ZEESET_STATS(...)
+// statement compiles to nothing and GetStats() returns zeros
+#if defined(ZEESET_ENABLE_LATENCY) && !defined(ZEESET_ENABLE_STATS)
+#define ZEESET_ENABLE_STATS
+#endif
+
+#ifdef ZEESET_ENABLE_STATS
+#define ZEESET_STATS(...) __VA_ARGS__
+#else
+#define ZEESET_STATS(...)
+#endif
+
+// snapshot of a skiplist's counters (see ZeeSkiplist::GetStats)
+struct ZeeSetStats {
+    enum Op {
+        OP_INSERT,
+        OP_UPDATE,
+        OP_DELETE,
+        OP_UPDATE_BATCH,
+        OP_DELETE_BATCH,
+        OP_RANK,
+        OP_RANK_BATCH,
+        OP_BY_RANK,
+        OP_RANGED_RANK,
+        OP_RANGED_VALUE,
+        OP_COUNT_RANGED_VALUE,
+        OP_DELETE_RANGED_RANK,
+        OP_DELETE_RANGED_VALUE,
+        OP_BOUND_VALUE,
+        OP_NEARBY_RANK,
+        OP_NEARBY_VALUE,
+        OP_FOREACH,
+        OP_BUILD,
+        OP_OPTIMIZE,
+        OP_MAX,
+    };
+
+    static constexpr int MAX_HEIGHT = 64;
+    // bucket i counts calls that took [2^i, 2^(i+1)) ns
+    static constexpr int LATENCY_BUCKETS = 40;
+
+    uint64_t CALLS[OP_MAX] = {};
+    // nodes stepped to while searching forward or climbing back
+    uint64_t NODES_TRAVERSED = 0;
+    // key and value comparisons
+    uint64_t COMPARISONS = 0;
+    // updates whose new value still fits between the neighbours, and those removed and re-inserted
+    uint64_t UPDATES_IN_PLACE = 0;
+    uint64_t UPDATES_REINSERTED = 0;
+    // element node memory requested from the allocator, header excluded
+    uint64_t BYTES_ALLOCATED = 0;
+    uint64_t BYTES_FREED = 0;
+    // live nodes of height h are counted in NODES_BY_HEIGHT[h - 1]
+    uint64_t NODES_BY_HEIGHT[MAX_HEIGHT] = {};
+    // filled only with ZEESET_ENABLE_LATENCY
+    uint64_t LATENCY[OP_MAX][LATENCY_BUCKETS] = {};
+
+    static const char *OpName(int op) {
+        static const char *names[OP_MAX] = {
+            "insert", "update", "delete", "update_batch", "delete_batch", "rank", "rank_batch", "by_rank",
+            "ranged_rank", "ranged_value", "count_ranged_value", "delete_ranged_rank", "delete_ranged_value",
+            "bound_value", "nearby_rank", "nearby_value", "foreach", "build", "optimize",
+        };
+
+        return op >= 0 && op < OP_MAX ? names[op] : "unknown";
+    }
+
+    // upper bound (ns) of the bucket holding percentile p in [0, 1] of op's latencies, 0 if none recorded
+    uint64_t LatencyPercentile(int op, double p) const {
+        uint64_t total = 0;
+        for(int i = 0; i < LATENCY_BUCKETS; ++i) {
+            total += LATENCY[op][i];
+        }
+
+        if(total == 0) {
+            return 0;
+        }
+
+        uint64_t target = (uint64_t)(p * (total - 1)) + 1;
+        uint64_t seen = 0;
+
+        for(int i = 0; i < LATENCY_BUCKETS; ++i) {
+            seen += LATENCY[op][i];
+            if(seen >= target) {
+                return (uint64_t)2 << i;
+            }
+        }
+
+        return (uint64_t)2 << (LATENCY_BUCKETS - 1);
+    }
+
+    std::string Dump() const {
+        std::ostringstream ss;
+
+        for(int op = 0; op < OP_MAX; ++op) {
+            if(CALLS[op]) {
+                ss << OpName(op) << " calls=" << CALLS[op];
+                if(LatencyPercentile(op, 1)) {
+                    ss << " p50<" << LatencyPercentile(op, 0.5) << "ns p99<" << LatencyPercentile(op, 0.99) << "ns";
+                }
+                ss << "\n";
+            }
+        }
+
+        ss << "traversed=" << NODES_TRAVERSED << " comparisons=" << COMPARISONS
+            << " in_place=" << UPDATES_IN_PLACE << " reinserted=" << UPDATES_REINSERTED
+            << " bytes_allocated=" << BYTES_ALLOCATED << " bytes_freed=" << BYTES_FREED << "\nheights";
+
+        for(int h = 0; h < MAX_HEIGHT; ++h) {
+            if(NODES_BY_HEIGHT[h]) {
+                ss << " " << h + 1 << ":" << NODES_BY_HEIGHT[h];
+            }
+        }
+
+        return ss.str();
+    }
+};
+
+// live counters behind ZeeSetStats, bumped with relaxed load + store instead of an atomic add so that
+// counting costs no locked instruction; concurrent readers may lose increments but never tear a counter
+struct ZeeStatsCounters {
+    using Counter = std::atomic<uint64_t>;
+
+    Counter CALLS[ZeeSetStats::OP_MAX];
+    Counter NODES_TRAVERSED;
+    Counter COMPARISONS;
+    Counter UPDATES_IN_PLACE;
+    Counter UPDATES_REINSERTED;
+    Counter BYTES_ALLOCATED;
+    Counter BYTES_FREED;
+    Counter NODES_BY_HEIGHT[ZeeSetStats::MAX_HEIGHT];
+    Counter LATENCY[ZeeSetStats::OP_MAX][ZeeSetStats::LATENCY_BUCKETS];
+
+    ZeeStatsCounters() {
+        Reset(true);
+    }
+
+    static void Add(Counter &c, uint64_t n = 1) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void Sub(Counter &c, uint64_t n = 1) {
+        c.store(c.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    void NodeAllocated(int height, size_t bytes) {
+        Add(BYTES_ALLOCATED, bytes);
+        Add(NODES_BY_HEIGHT[height - 1]);
+    }
+
+    void NodeFreed(int height, size_t bytes) {
+        Add(BYTES_FREED, bytes);
+        Sub(NODES_BY_HEIGHT[height - 1]);
+    }
+
+    // every node released at once (see ZeeSlabAllocator::ReleaseAll)
+    void AllNodesFreed() {
+        BYTES_FREED.store(BYTES_ALLOCATED.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for(Counter &c: NODES_BY_HEIGHT) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // memory and height gauges describe live nodes and are kept unless all is set
+    void Reset(bool all) {
+        for(Counter &c: CALLS) {
+            c.store(0, std::memory_order_relaxed);
+        }
+
+        for(auto &op: LATENCY) {
+            for(Counter &c: op) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        NODES_TRAVERSED.store(0, std::memory_order_relaxed);
+        COMPARISONS.store(0, std::memory_order_relaxed);
+        UPDATES_IN_PLACE.store(0, std::memory_order_relaxed);
+        UPDATES_REINSERTED.store(0, std::memory_order_relaxed);
+
+        if(all) {
+            BYTES_ALLOCATED.store(0, std::memory_order_relaxed);
+            BYTES_FREED.store(0, std::memory_order_relaxed);
+            for(Counter &c: NODES_BY_HEIGHT) {
+                c.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Snapshot(ZeeSetStats &stats) const {
+        for(int op = 0; op < ZeeSetStats::OP_MAX; ++op) {
+            stats.CALLS[op] = CALLS[op].load(std::memory_order_relaxed);
+
+            for(int i = 0; i < ZeeSetStats::LATENCY_BUCKETS; ++i) {
+                stats.LATENCY[op][i] = LATENCY[op][i].load(std::memory_order_relaxed);
+            }
+        }
+
+        stats.NODES_TRAVERSED = NODES_TRAVERSED.load(std::memory_order_relaxed);
+        stats.COMPARISONS = COMPARISONS.load(std::memory_order_relaxed);
+        stats.UPDATES_IN_PLACE = UPDATES_IN_PLACE.load(std::memory_order_relaxed);
+        stats.UPDATES_REINSERTED = UPDATES_REINSERTED.load(std::memory_order_relaxed);
+        stats.BYTES_ALLOCATED = BYTES_ALLOCATED.load(std::memory_order_relaxed);
+        stats.BYTES_FREED = BYTES_FREED.load(std::memory_order_relaxed);
+
+        for(int h = 0; h < ZeeSetStats::MAX_HEIGHT; ++h) {
+            stats.NODES_BY_HEIGHT[h] = NODES_BY_HEIGHT[h].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// counts one call of op for the enclosing scope, and times it with ZEESET_ENABLE_LATENCY
+class ZeeStatsScope {
+public:
+    ZeeStatsScope(ZeeStatsCounters &counters, int op) : m_counters(counters), m_op(op) {
+        ZeeStatsCounters::Add(counters.CALLS[op]);
+#ifdef ZEESET_ENABLE_LATENCY
+        m_start = std::chrono::steady_clock::now();
+#endif
+    }
+
+    ~ZeeStatsScope() {
+#ifdef ZEESET_ENABLE_LATENCY
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+        int bucket = 0;
+
+        while(ns > 1 && bucket < ZeeSetStats::LATENCY_BUCKETS - 1) {
+            ns >>= 1;
+            ++bucket;
+        }
+
+        ZeeStatsCounters::Add(m_counters.LATENCY[m_op][bucket]);
+#endif
+    }
+
+    ZeeStatsScope(const ZeeStatsScope &) = delete;
+    ZeeStatsScope &operator=(const ZeeStatsScope &) = delete;
+
+private:
+    ZeeStatsCounters &m_counters;
+    int m_op;
+#ifdef ZEESET_ENABLE_LATENCY
+    std::chrono::steady_clock::time_point m_start;
+#endif
+};
+
+// Persistent treap ordered by (value, key) with subtree sizes. Nodes are reference counted and
+// shared between the live tree and its snapshots: a mutation copies every shared node on its path
+// and changes nodes owned by the live tree alone in place, so taking a snapshot is O(1) and each
+// later mutation costs O(log n) copies at most.
+//
+// The live tree belongs to one thread (see ZeeSet::EnableSnapshots). Snapshots are immutable and
+// may be read and released on any thread.
+template<typename KeyType, typename ValueType>
+class ZeePersistentTree {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+
+    struct Node {
+        KEY_TYPE KEY;
+        VALUE_TYPE VALUE;
+        Node *LEFT = NULL;
+        Node *RIGHT = NULL;
+        unsigned long SIZE = 1;
+        uint32_t PRIORITY = 0;
+        std::atomic<uint32_t> REFS{1};
+
+        Node(const KEY_TYPE &key, const VALUE_TYPE &value, uint32_t priority) :
+            KEY(key), VALUE(value), PRIORITY(priority) {}
+    };
+
+    ZeePersistentTree() {
+        m_rng.seed(time(NULL));
+    }
+
+    ~ZeePersistentTree() {
+        Release(m_root);
+    }
+
+    ZeePersistentTree(const ZeePersistentTree &) = delete;
+    ZeePersistentTree &operator=(const ZeePersistentTree &) = delete;
+
+    void Clear() {
+        Release(m_root);
+        m_root = NULL;
+    }
+
+    unsigned long Length() {
+        return Size(m_root);
+    }
+
+    void Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        m_root = InsertNode(m_root, new Node(key, value, (uint32_t)m_rng()));
+    }
+
+    void Erase(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        m_root = EraseNode(m_root, key, value);
+    }
+
+    // drops the elements at ranks [rank_low, rank_high]
+    void EraseByRangedRank(unsigned long rank_low, unsigned long rank_high) {
+        if(rank_low == 0 || rank_low > rank_high) {
+            return;
+        }
+
+        Node *left, *middle, *right;
+        SplitByRank(m_root, rank_low - 1, left, middle);
+        SplitByRank(middle, rank_high - rank_low + 1, middle, right);
+        Release(middle);
+        m_root = Merge(left, right);
+    }
+
+    // replaces all elements with those pulled from produce in (value, key) order,
+    // builds the treap of random priorities in O(n) along its right spine
+    template<typename Producer> /* std::function<bool(KEY_TYPE &key, VALUE_TYPE &value)> */
+    void BuildFromSorted(Producer produce) {
+        Clear();
+
+        std::vector<Node *> spine;
+        KEY_TYPE key;
+        VALUE_TYPE value;
+
+        while(produce(key, value)) {
+            Node *x = new Node(key, value, (uint32_t)m_rng());
+            Node *last = NULL;
+
+            while(!spine.empty() && spine.back()->PRIORITY < x->PRIORITY) {
+                last = spine.back();
+                spine.pop_back();
+                Pull(last);
+            }
+
+            x->LEFT = last;
+            if(!spine.empty()) {
+                spine.back()->RIGHT = x;
+            }
+            spine.emplace_back(x);
+        }
+
+        while(spine.size() > 1) {
+            Pull(spine.back());
+            spine.pop_back();
+        }
+
+        if(!spine.empty()) {
+            Pull(spine.back());
+            m_root = spine.back();
+        }
+    }
+
+    // takes a reference for a snapshot
+    Node *Share() {
+        if(m_root) {
+            m_root->REFS.fetch_add(1, std::memory_order_relaxed);
+        }
+        return m_root;
+    }
+
+    static void Release(Node *n) {
+        while(n && n->REFS.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            Release(n->LEFT);
+            Node *right = n->RIGHT;
+            delete n;
+            n = right;
+        }
+    }
+
+    static unsigned long Size(Node *n) {
+        return n ? n->SIZE : 0;
+    }
+
+    static bool Less(const KEY_TYPE &k1, const VALUE_TYPE &v1, const KEY_TYPE &k2, const VALUE_TYPE &v2) {
+        return v1 < v2 || (v1 == v2 && k1 < k2);
+    }
+
+    // elements ordered before value (with inclusive, those not ordered after it)
+    static unsigned long CountByValue(Node *n, const VALUE_TYPE &value, bool inclusive) {
+        unsigned long count = 0;
+
+        while(n) {
+            if(inclusive ? !(value < n->VALUE) : n->VALUE < value) {
+                count += Size(n->LEFT) + 1;
+                n = n->RIGHT;
+            } else {
+                n = n->LEFT;
+            }
+        }
+
+        return count;
+    }
+
+    static unsigned long RankOf(Node *n, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        unsigned long rank = 0;
+
+        while(n) {
+            if(Less(key, value, n->KEY, n->VALUE)) {
+                n = n->LEFT;
+            } else if(Less(n->KEY, n->VALUE, key, value)) {
+                rank += Size(n->LEFT) + 1;
+                n = n->RIGHT;
+            } else {
+                return rank + Size(n->LEFT) + 1;
+            }
+        }
+
+        return 0;
+    }
+
+    // in-order walk from rank_low while cb returns true
+    template<typename Function> /* std::function<bool(unsigned long rank, Node *)> */
+    static void Walk(Node *n, unsigned long rank_low, Function cb) {
+        if(rank_low == 0) {
+            return;
+        }
+
+        std::vector<Node *> stack;
+        unsigned long r = rank_low;
+
+        while(n) {
+            unsigned long left = Size(n->LEFT);
+
+            if(r <= left) {
+                stack.emplace_back(n);
+                n = n->LEFT;
+            } else if(r == left + 1) {
+                stack.emplace_back(n);
+                break;
+            } else {
+                r -= left + 1;
+                n = n->RIGHT;
+            }
+        }
+
+        if(!n) {
+            return;
+        }
+
+        unsigned long rank = rank_low;
+
+        while(!stack.empty()) {
+            Node *x = stack.back();
+            stack.pop_back();
+
+            if(!cb(rank++, x)) {
+                return;
+            }
+
+            for(Node *y = x->RIGHT; y; y = y->LEFT) {
+                stack.emplace_back(y);
+            }
+        }
+    }
+
+    // heap order, search order and sizes hold everywhere below n
+    static bool TestSelf(Node *n) {
+        if(!n) {
+            return true;
+        }
+
+        if(n->SIZE != Size(n->LEFT) + Size(n->RIGHT) + 1) {
+            return false;
+        }
+
+        if(n->LEFT && (n->LEFT->PRIORITY > n->PRIORITY || !Less(n->LEFT->KEY, n->LEFT->VALUE, n->KEY, n->VALUE))) {
+            return false;
+        }
+
+        if(n->RIGHT && (n->RIGHT->PRIORITY > n->PRIORITY || !Less(n->KEY, n->VALUE, n->RIGHT->KEY, n->RIGHT->VALUE))) {
+            return false;
+        }
+
+        return TestSelf(n->LEFT) && TestSelf(n->RIGHT);
+    }
+
+    bool TestSelf() {
+        return TestSelf(m_root);
+    }
+
+private:
+    static void Pull(Node *n) {
+        n->SIZE = Size(n->LEFT) + Size(n->RIGHT) + 1;
+    }
+
+    // functions below take over one reference of each node argument and return one of the result
+
+    // n itself if the live tree holds its only reference, otherwise a private copy
+    static Node *Unique(Node *n) {
+        if(n->REFS.load(std::memory_order_acquire) == 1) {
+            return n;
+        }
+
+        Node *copy = new Node(n->KEY, n->VALUE, n->PRIORITY);
+        copy->LEFT = n->LEFT;
+        copy->RIGHT = n->RIGHT;
+        copy->SIZE = n->SIZE;
+
+        if(copy->LEFT) {
+            copy->LEFT->REFS.fetch_add(1, std::memory_order_relaxed);
+        }
+        if(copy->RIGHT) {
+            copy->RIGHT->REFS.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        Release(n);
+        return copy;
+    }
+
+    // left gets the first count elements of n, right the rest
+    static void SplitByRank(Node *n, unsigned long count, Node *&left, Node *&right) {
+        if(!n) {
+            left = right = NULL;
+            return;
+        }
+
+        n = Unique(n);
+
+        if(Size(n->LEFT) < count) {
+            SplitByRank(n->RIGHT, count - Size(n->LEFT) - 1, n->RIGHT, right);
+            left = n;
+        } else {
+            SplitByRank(n->LEFT, count, left, n->LEFT);
+            right = n;
+        }
+
+        Pull(n);
+    }
+
+    // left gets the elements ordered before (value, key), right the rest
+    static void Split(Node *n, const KEY_TYPE &key, const VALUE_TYPE &value, Node *&left, Node *&right) {
+        if(!n) {
+            left = right = NULL;
+            return;
+        }
+
+        n = Unique(n);
+
+        if(Less(n->KEY, n->VALUE, key, value)) {
+            Split(n->RIGHT, key, value, n->RIGHT, right);
+            left = n;
+        } else {
+            Split(n->LEFT, key, value, left, n->LEFT);
+            right = n;
+        }
+
+        Pull(n);
+    }
+
+    static Node *Merge(Node *left, Node *right) {
+        if(!left) {
+            return right;
+        }
+
+        if(!right) {
+            return left;
+        }
+
+        if(left->PRIORITY > right->PRIORITY) {
+            left = Unique(left);
+            left->RIGHT = Merge(left->RIGHT, right);
+            Pull(left);
+            return left;
+        } else {
+            right = Unique(right);
+            right->LEFT = Merge(left, right->LEFT);
+            Pull(right);
+            return right;
+        }
+    }
+
+    static Node *InsertNode(Node *n, Node *x) {
+        if(!n) {
+            return x;
+        }
+
+        if(x->PRIORITY > n->PRIORITY) {
+            Split(n, x->KEY, x->VALUE, x->LEFT, x->RIGHT);
+            Pull(x);
+            return x;
+        }
+
+        n = Unique(n);
+
+        if(Less(x->KEY, x->VALUE, n->KEY, n->VALUE)) {
+            n->LEFT = InsertNode(n->LEFT, x);
+        } else {
+            n->RIGHT = InsertNode(n->RIGHT, x);
+        }
+
+        Pull(n);
+        return n;
+    }
+
+    static Node *EraseNode(Node *n, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        if(!n) {
+            return NULL;
+        }
+
+        n = Unique(n);
+
+        if(Less(key, value, n->KEY, n->VALUE)) {
+            n->LEFT = EraseNode(n->LEFT, key, value);
+        } else if(Less(n->KEY, n->VALUE, key, value)) {
+            n->RIGHT = EraseNode(n->RIGHT, key, value);
+        } else {
+            Node *merged = Merge(n->LEFT, n->RIGHT);
+            n->LEFT = n->RIGHT = NULL;
+            Release(n);
+            return merged;
+        }
+
+        Pull(n);
+        return n;
+    }
+
+    Node *m_root = NULL;
+    std::mt19937 m_rng;
+};
+
+// Point-in-time, read-only view of a ZeeSet (see ZeeSet::Snapshot), unaffected by later mutations
+// of the set. Copies share the same version. Unlike SaveSnapshot, nothing is serialized.
+template<typename KeyType, typename ValueType>
+class ZeeSetSnapshot {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using TREE_TYPE = ZeePersistentTree<KeyType, ValueType>;
+    using NODE_TYPE = typename TREE_TYPE::Node;
+
+    ZeeSetSnapshot() = default;
+
+    // takes over one reference of root
+    explicit ZeeSetSnapshot(NODE_TYPE *root) : m_root(root) {}
+
+    ~ZeeSetSnapshot() {
+        TREE_TYPE::Release(m_root);
+    }
+
+    ZeeSetSnapshot(const ZeeSetSnapshot &other) : m_root(other.m_root) {
+        if(m_root) {
+            m_root->REFS.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    ZeeSetSnapshot(ZeeSetSnapshot &&other) : m_root(other.m_root) {
+        other.m_root = NULL;
+    }
+
+    ZeeSetSnapshot &operator=(ZeeSetSnapshot other) {
+        std::swap(m_root, other.m_root);
+        return *this;
+    }
+
+    unsigned long Length() const {
+        return TREE_TYPE::Size(m_root);
+    }
+
+    unsigned long MaxRank() const {
+        return Length();
+    }
+
+    // the snapshot holds no key dictionary, the element's value at snapshot time is needed
+    unsigned long GetRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value) const {
+        return TREE_TYPE::RankOf(m_root, key, value);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) const {
+        bool found = false;
+
+        TREE_TYPE::Walk(m_root, rank, [&key, &value, &found](unsigned long r, NODE_TYPE *n) {
+                    key = n->KEY;
+                    value = n->VALUE;
+                    found = true;
+                    return false;
+                });
+
+        return found;
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) const {
+        if(rank_low > rank_high) {
+            return;
+        }
+
+        TREE_TYPE::Walk(m_root, rank_low, [rank_high, &cb](unsigned long rank, NODE_TYPE *n) {
+                    if(rank > rank_high) {
+                        return false;
+                    }
+
+                    cb(rank, n->KEY, n->VALUE);
+                    return true;
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) const {
+        GetElementsByRangedRank(1, Length(), cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) const {
+        unsigned long rank_low = TREE_TYPE::CountByValue(m_root, v_low, !include_v_low) + 1;
+        unsigned long rank_high = TREE_TYPE::CountByValue(m_root, v_high, include_v_high);
+
+        GetElementsByRangedRank(rank_low, rank_high, cb);
+    }
+
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) const {
+        unsigned long rank_low = TREE_TYPE::CountByValue(m_root, v_low, !include_v_low) + 1;
+        unsigned long rank_high = TREE_TYPE::CountByValue(m_root, v_high, include_v_high);
+
+        return rank_low <= rank_high ? rank_high - rank_low + 1 : 0;
+    }
+
+    bool TestSelf() const {
+        return TREE_TYPE::TestSelf(m_root);
+    }
+
+private:
+    NODE_TYPE *m_root = NULL;
+};
+
+// counters of a ZeeTopCache (see ZeeSet::GetTopCacheStats)
+struct ZeeTopCacheStats {
+    // rank reads answered from the cache, and those left to the engine
+    uint64_t HITS = 0;
+    uint64_t MISSES = 0;
+    // elements patched into or out of the head by mutations
+    uint64_t INVALIDATIONS = 0;
+    // head re-read from the engine wholesale (EnableTopCache, BulkLoad, LoadSnapshot)
+    uint64_t REBUILDS = 0;
+};
+
+// The first SIZE elements of a ZeeSet in rank order, copied into one array (see ZeeSet::EnableTopCache).
+// The cache holds a prefix of the ranking at all times: a change above the last cached element is
+// patched into the array, one below it is not looked at, and the array is topped up from the engine
+// (one element by rank per missing slot) after elements leave it.
+template<typename KeyType, typename ValueType>
+class ZeeTopCache {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using ELEMENT_TYPE = std::pair<KeyType, ValueType>;
+
+    explicit ZeeTopCache(size_t size) : m_size(size) {
+        m_elements.reserve(size + 1);
+    }
+
+    size_t Size() const {
+        return m_size;
+    }
+
+    // (key, value) may be cached, cheap enough to test before every patch
+    bool Covers(const KEY_TYPE &key, const VALUE_TYPE &value) const {
+        return !m_elements.empty() && !Less(m_elements.back(), key, value);
+    }
+
+    // drops (key, value) if cached
+    void Erase(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        if(!Covers(key, value)) {
+            return;
+        }
+
+        auto it = LowerBound(key, value);
+        if(it != m_elements.end() && it->first == key) {
+            m_elements.erase(it);
+            ZeeStatsCounters::Add(m_invalidations);
+        }
+    }
+
+    // caches (key, value) if it ranks before the last cached element, elements past it are
+    // left to Refill since others may rank between
+    void Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        if(!Covers(key, value)) {
+            return;
+        }
+
+        m_elements.insert(LowerBound(key, value), ELEMENT_TYPE(key, value));
+        if(m_elements.size() > m_size) {
+            m_elements.pop_back();
+        }
+        ZeeStatsCounters::Add(m_invalidations);
+    }
+
+    // drops the cached elements of ranks [rank_low, rank_high]
+    void EraseByRangedRank(unsigned long rank_low, unsigned long rank_high) {
+        if(rank_low == 0 || rank_low > rank_high || rank_low > m_elements.size()) {
+            return;
+        }
+
+        unsigned long end = rank_high < m_elements.size() ? rank_high : m_elements.size();
+        m_elements.erase(m_elements.begin() + (rank_low - 1), m_elements.begin() + end);
+        ZeeStatsCounters::Add(m_invalidations);
+    }
+
+    void Clear() {
+        m_elements.clear();
+    }
+
+    // tops the cache up to min(Size(), length) elements, get(rank, key, value) reads the engine
+    template<typename Function> /* std::function<bool(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value)> */
+    void Refill(unsigned long length, Function get) {
+        ELEMENT_TYPE e;
+
+        while(m_elements.size() < m_size && m_elements.size() < length && get(m_elements.size() + 1, e.first, e.second)) {
+            m_elements.emplace_back(std::move(e));
+        }
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value)> */
+    void Rebuild(unsigned long length, Function get) {
+        m_elements.clear();
+        Refill(length, get);
+        ZeeStatsCounters::Add(m_rebuilds);
+    }
+
+    // answers ranks [rank_low, rank_high] if they are all cached or past the last element,
+    // false leaves the query to the engine
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    bool GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, unsigned long length, Function cb) {
+        if(rank_high > m_elements.size() && m_elements.size() < length) {
+            ZeeStatsCounters::Add(m_misses);
+            return false;
+        }
+
+        ZeeStatsCounters::Add(m_hits);
+
+        for(unsigned long rank = rank_low ? rank_low : 1; rank_low && rank <= rank_high && rank <= m_elements.size(); ++rank) {
+            const ELEMENT_TYPE &e = m_elements[rank - 1];
+            cb(rank, e.first, e.second);
+        }
+
+        return true;
+    }
+
+    bool GetElementByRank(unsigned long rank, unsigned long length, KEY_TYPE &key, VALUE_TYPE &value, bool &found) {
+        if(rank > m_elements.size() && m_elements.size() < length) {
+            ZeeStatsCounters::Add(m_misses);
+            return false;
+        }
+
+        ZeeStatsCounters::Add(m_hits);
+
+        found = rank > 0 && rank <= m_elements.size();
+        if(found) {
+            key = m_elements[rank - 1].first;
+            value = m_elements[rank - 1].second;
+        }
+
+        return true;
+    }
+
+    ZeeTopCacheStats GetStats() const {
+        ZeeTopCacheStats stats;
+        stats.HITS = m_hits.load(std::memory_order_relaxed);
+        stats.MISSES = m_misses.load(std::memory_order_relaxed);
+        stats.INVALIDATIONS = m_invalidations.load(std::memory_order_relaxed);
+        stats.REBUILDS = m_rebuilds.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // the cache must equal the first min(Size(), length) elements get(rank, key, value) reads
+    template<typename Function> /* std::function<bool(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value)> */
+    bool TestSelf(unsigned long length, Function get) const {
+        if(m_elements.size() != (m_size < length ? m_size : length)) {
+            return false;
+        }
+
+        ELEMENT_TYPE e;
+        for(size_t i = 0; i < m_elements.size(); ++i) {
+            if(!get(i + 1, e.first, e.second) || !(e.first == m_elements[i].first) || !(e.second == m_elements[i].second)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    // e ranks before (key, value)
+    static bool Less(const ELEMENT_TYPE &e, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return e.second < value || (e.second == value && e.first < key);
+    }
+
+    typename std::vector<ELEMENT_TYPE>::iterator LowerBound(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return std::lower_bound(m_elements.begin(), m_elements.end(), ELEMENT_TYPE(key, value),
+                [](const ELEMENT_TYPE &e, const ELEMENT_TYPE &x) {
+                    return Less(e, x.first, x.second);
+                });
+    }
+
+    size_t m_size;
+    std::vector<ELEMENT_TYPE> m_elements;
+
+    // bumped under a shared lock by concurrent readers (see ZeeStatsCounters)
+    ZeeStatsCounters::Counter m_hits{0};
+    ZeeStatsCounters::Counter m_misses{0};
+    ZeeStatsCounters::Counter m_invalidations{0};
+    ZeeStatsCounters::Counter m_rebuilds{0};
+};
 
 // KeyType and ValueType must be comparable
-template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25>
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25, typename Allocator = ZeeDefaultAllocator>
 class ZeeSkiplist {
 public:
     using KEY_TYPE = KeyType;
     using VALUE_TYPE = ValueType;
+    using ALLOCATOR_TYPE = Allocator;
 
     static constexpr int MAX_LEVEL = MaxLevel;
     static constexpr int BRANCH_PROB_PERCENT = BranchProbPercent;
     static constexpr float BRANCH_PROB = BranchProbPercent / 100.f;
 
-private:
+    // nodes are handed out as handles (see Insert, UpdateByNode, DeleteByNode),
+    // KEY and VALUE may be read but must only be changed through the skiplist
     struct Node {
         KEY_TYPE KEY;
         VALUE_TYPE VALUE;
         Node *BACKWARD = NULL;
-        
+        // predecessor on the node's top level (NULL for header), lets a node find its
+        // predecessors and rank by climbing back instead of searching from header
+        Node *TOP_BACKWARD = NULL;
+        int HEIGHT = 0;
+
         struct Level {
             Node *FORWARD = NULL;
             unsigned long SPAN = 0;
         };
 
-        Level LEVEL[MAX_LEVEL];
+        // HEIGHT levels, allocated in one block with the node (see CreateNode)
+        Level LEVEL[];
 
         Node(const KEY_TYPE &key, const VALUE_TYPE &value) :
             KEY(key), VALUE(value) {}
 
+        Node(KEY_TYPE &&key, VALUE_TYPE &&value) :
+            KEY(std::move(key)), VALUE(std::move(value)) {}
+
         Node() = default;
         ~Node() = default;
 
         void Reset() {
             BACKWARD = NULL;
+            TOP_BACKWARD = NULL;
 
-            for(int i = 0; i < MAX_LEVEL; ++i) {
+            for(int i = 0; i < HEIGHT; ++i) {
                 LEVEL[i].FORWARD = NULL;
                 LEVEL[i].SPAN = 0;
             }
         }
     };
 
+private:
     Node *m_header = NULL;
     Node *m_tail = NULL;
     unsigned long m_length = 0;
     int m_level = 1;
 
     std::mt19937 m_rng;
+    Allocator m_allocator;
+
+    ZEESET_STATS(
+        static_assert(MAX_LEVEL <= ZeeSetStats::MAX_HEIGHT, "MAX_LEVEL exceeds ZeeSetStats::MAX_HEIGHT");
+        ZeeStatsCounters m_stats;
+    )
 public:
     ZeeSkiplist() {
-        m_header = CreateNode();
+        m_header = CreateHeader();
         m_rng.seed(time(NULL));
     }
 
     ~ZeeSkiplist() {
         Clear();
-        FreeNode(m_header);
+        FreeHeader(m_header);
     }
 
     ZeeSkiplist(const ZeeSkiplist &) = delete;
@@ -75,10 +1594,23 @@ public:
     void Clear() {
         Node *x = m_header->LEVEL[0].FORWARD;
 
-        while(x) {
-            Node *next = x->LEVEL[0].FORWARD;
-            FreeNode(x);
-            x = next;
+        if(Allocator::RELEASE_ALL) {
+            if(!std::is_trivially_destructible<Node>::value) {
+                while(x) {
+                    Node *next = x->LEVEL[0].FORWARD;
+                    x->~Node();
+                    x = next;
+                }
+            }
+
+            m_allocator.ReleaseAll();
+            ZEESET_STATS(m_stats.AllNodesFreed());
+        } else {
+            while(x) {
+                Node *next = x->LEVEL[0].FORWARD;
+                FreeNode(x);
+                x = next;
+            }
         }
 
         m_header->Reset();
@@ -95,17 +1627,57 @@ public:
         return m_length;
     }
 
+    // zeros unless built with ZEESET_ENABLE_STATS or ZEESET_ENABLE_LATENCY
+    ZeeSetStats GetStats() {
+        ZeeSetStats stats;
+        ZEESET_STATS(m_stats.Snapshot(stats));
+        return stats;
+    }
+
+    // restarts call, traversal, comparison, update and latency counters, memory and heights stay live
+    void ResetStats() {
+        ZEESET_STATS(m_stats.Reset(false));
+    }
+
 private:
-    Node *CreateNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
-        return new Node(key, value);
+    static size_t NodeSize(int height) {
+        return sizeof(Node) + sizeof(typename Node::Level) * height;
+    }
+
+    Node *CreateNode(int height, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *n = new(m_allocator.Allocate(NodeSize(height))) Node(key, value);
+        ZEESET_STATS(m_stats.NodeAllocated(height, NodeSize(height)));
+        n->HEIGHT = height;
+        n->Reset();
+        return n;
     }
 
-    Node *CreateNode() {
-        return new Node();
+    Node *CreateNode(int height, KEY_TYPE &&key, VALUE_TYPE &&value) {
+        Node *n = new(m_allocator.Allocate(NodeSize(height))) Node(std::move(key), std::move(value));
+        ZEESET_STATS(m_stats.NodeAllocated(height, NodeSize(height)));
+        n->HEIGHT = height;
+        n->Reset();
+        return n;
     }
 
     void FreeNode(Node *n) {
-        delete n;
+        int height = n->HEIGHT;
+        n->~Node();
+        m_allocator.Deallocate(n, NodeSize(height));
+        ZEESET_STATS(m_stats.NodeFreed(height, NodeSize(height)));
+    }
+
+    // header lives outside the allocator, so ReleaseAll() never takes it
+    Node *CreateHeader() {
+        Node *n = new(::operator new(NodeSize(MAX_LEVEL))) Node();
+        n->HEIGHT = MAX_LEVEL;
+        n->Reset();
+        return n;
+    }
+
+    void FreeHeader(Node *n) {
+        n->~Node();
+        ::operator delete(n);
     }
 
     int RandomLevel() {
@@ -116,31 +1688,96 @@ private:
         return level < MAX_LEVEL ? level : MAX_LEVEL;
     }
 
+    // level of the node at rank in a perfectly balanced skiplist: every (100 / BRANCH_PROB_PERCENT)-th node
+    // is promoted one level up
+    static int DeterministicLevel(unsigned long rank) {
+        const unsigned long period = BRANCH_PROB_PERCENT < 50 ? 100 / BRANCH_PROB_PERCENT : 2;
+        int level = 1;
+
+        while(level < MAX_LEVEL && rank % period == 0) {
+            rank /= period;
+            ++level;
+        }
+
+        return level;
+    }
+
+    // appends nodes in (value, key) order, linking every level in one pass
+    struct LinkCursor {
+        Node *LAST[MAX_LEVEL];
+        unsigned long LAST_RANK[MAX_LEVEL];
+    };
+
+    // skiplist must hold no node
+    void BeginLink(LinkCursor &cursor) {
+        m_header->Reset();
+        m_tail = NULL;
+        m_length = 0;
+        m_level = 1;
+
+        for(int i = 0; i < MAX_LEVEL; ++i) {
+            cursor.LAST[i] = m_header;
+            cursor.LAST_RANK[i] = 0;
+        }
+    }
+
+    void LinkLast(LinkCursor &cursor, Node *x) {
+        unsigned long rank = ++m_length;
+        int level = x->HEIGHT;
+
+        x->TOP_BACKWARD = (cursor.LAST[level - 1] == m_header) ? NULL : cursor.LAST[level - 1];
+        x->BACKWARD = m_tail;
+
+        for(int i = 0; i < level; ++i) {
+            cursor.LAST[i]->LEVEL[i].FORWARD = x;
+            cursor.LAST[i]->LEVEL[i].SPAN = rank - cursor.LAST_RANK[i];
+            cursor.LAST[i] = x;
+            cursor.LAST_RANK[i] = rank;
+        }
+
+        if(level > m_level) {
+            m_level = level;
+        }
+
+        m_tail = x;
+    }
+
+    void EndLink(LinkCursor &cursor) {
+        for(int i = 0; i < m_level; ++i) {
+            cursor.LAST[i]->LEVEL[i].FORWARD = NULL;
+            cursor.LAST[i]->LEVEL[i].SPAN = m_length - cursor.LAST_RANK[i];
+        }
+    }
+
     bool key_compare_less(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
         return k1 < k2;
     }
 
     bool key_compare_equal(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
         return k1 == k2;
     }
 
     bool value_compare_less(const VALUE_TYPE &v1, const VALUE_TYPE &v2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
         return v1 < v2;
     }
 
     bool value_compare_equal(const VALUE_TYPE &v1, const VALUE_TYPE &v2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
         return v1 == v2;
     }
 
     Node *InsertNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
-        return InsertNodeOnly(CreateNode(key, value));
+        return InsertNodeOnly(CreateNode(RandomLevel(), key, value));
     }
 
+    // links n at its own HEIGHT, so a removed node can be re-inserted as is
     Node *InsertNodeOnly(Node *n) {
         Node *update[MAX_LEVEL];
         Node *x;
         unsigned long rank[MAX_LEVEL];
-        int level;
 
         x = m_header;
 
@@ -151,11 +1788,20 @@ private:
                           key_compare_less(x->LEVEL[i].FORWARD->KEY, n->KEY))) ) {
                 rank[i] += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
             update[i] = x;
         }
 
-        level = RandomLevel();
+        return LinkNode(n, update, rank);
+    }
+
+    // links n after update[i] on its levels, rank[i] is the rank of update[i]
+    Node *LinkNode(Node *n, Node *update[MAX_LEVEL], unsigned long rank[MAX_LEVEL]) {
+        Node *x;
+        int level;
+
+        level = n->HEIGHT;
 
         if(level > m_level) {
             for(int i = m_level; i < level; ++i) {
@@ -179,6 +1825,14 @@ private:
             update[i]->LEVEL[i].SPAN++;
         }
 
+        for(int i = 0; i < level; ++i) {
+            Node *next = x->LEVEL[i].FORWARD;
+            if(next && next->HEIGHT == i + 1) {
+                next->TOP_BACKWARD = x;
+            }
+        }
+
+        x->TOP_BACKWARD = (update[level - 1] == m_header) ? NULL : update[level - 1];
         x->BACKWARD = (update[0] == m_header) ? NULL : update[0];
         if(x->LEVEL[0].FORWARD) {
             x->LEVEL[0].FORWARD->BACKWARD = x;
@@ -189,9 +1843,122 @@ private:
         return x;
     }
 
+    // Finger search: update[]/rank[] hold the search path of the previous target (all header and 0
+    // to start) and are moved forward to the predecessors of (key, value), which must not sort before
+    // the previous target. Successors on the path never move backwards going up, so only the lowest
+    // levels whose successor now falls before the target are searched again, and targets close
+    // together cost O(log distance) instead of O(log n).
+    void FingerSearch(const KEY_TYPE &key, const VALUE_TYPE &value, Node *update[MAX_LEVEL], unsigned long rank[MAX_LEVEL]) {
+        Node *x;
+        int top = -1;
+
+        while( top + 1 < m_level ) {
+            x = update[top + 1]->LEVEL[top + 1].FORWARD;
+            if( !x || !( value_compare_less(x->VALUE, value) ||
+                        ( value_compare_equal(x->VALUE, value) && key_compare_less(x->KEY, key))) ) {
+                break;
+            }
+            ++top;
+        }
+
+        x = top >= 0 ? update[top] : m_header;
+        for(int i = top; i >= 0; --i) {
+            rank[i] = i == top ? rank[top] : rank[i + 1];
+            while( x->LEVEL[i].FORWARD && ( value_compare_less(x->LEVEL[i].FORWARD->VALUE, value) ||
+                        ( value_compare_equal(x->LEVEL[i].FORWARD->VALUE, value) &&
+                          key_compare_less(x->LEVEL[i].FORWARD->KEY, key))) ) {
+                rank[i] += x->LEVEL[i].SPAN;
+                x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+            }
+            update[i] = x;
+        }
+    }
+
+    void BeginFingerSearch(Node *update[MAX_LEVEL], unsigned long rank[MAX_LEVEL]) {
+        for(int i = 0; i < MAX_LEVEL; ++i) {
+            update[i] = m_header;
+            rank[i] = 0;
+        }
+    }
+
+    // links unlinked nodes sorted by (VALUE, KEY), each found by a finger search from the previous one
+    void InsertNodesSorted(Node **nodes, size_t count) {
+        Node *update[MAX_LEVEL];
+        unsigned long rank[MAX_LEVEL];
+
+        BeginFingerSearch(update, rank);
+
+        for(size_t j = 0; j < count; ++j) {
+            FingerSearch(nodes[j]->KEY, nodes[j]->VALUE, update, rank);
+            Node *x = LinkNode(nodes[j], update, rank);
+
+            // x is the predecessor of the next node on its own levels
+            unsigned long r = rank[0] + 1;
+            for(int i = 0; i < x->HEIGHT; ++i) {
+                update[i] = x;
+                rank[i] = r;
+            }
+        }
+    }
+
+    // GetRankOfNode for many nodes, climbing LANES of them in lockstep: every step prefetches the next
+    // predecessor of a lane, which is read only after the other lanes have stepped, so their cache
+    // misses overlap instead of following one another
+    void GetRankOfNodes(Node **nodes, size_t count, unsigned long *ranks) {
+        static constexpr size_t LANES = 16;
+        // y is the node whose span at level HEIGHT - 1 is added next, HEIGHT that of the node climbed from
+        struct Lane {
+            Node *Y;
+            int HEIGHT;
+            size_t INDEX;
+        };
+        Lane lanes[LANES];
+        size_t active = 0;
+        size_t next = 0;
+
+        auto start = [this, nodes, ranks](Lane &lane, size_t i) {
+            Node *x = nodes[i];
+            lane.Y = x->TOP_BACKWARD ? x->TOP_BACKWARD : m_header;
+            lane.HEIGHT = x->HEIGHT;
+            lane.INDEX = i;
+            ranks[i] = 0;
+            ZEESET_PREFETCH(&lane.Y->LEVEL[lane.HEIGHT - 1]);
+        };
+
+        while(active < LANES && next < count) {
+            start(lanes[active++], next++);
+        }
+
+        while(active > 0) {
+            for(size_t j = 0; j < active; ) {
+                Lane &lane = lanes[j];
+                ranks[lane.INDEX] += lane.Y->LEVEL[lane.HEIGHT - 1].SPAN;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+
+                if(lane.Y != m_header) {
+                    lane.HEIGHT = lane.Y->HEIGHT;
+                    lane.Y = lane.Y->TOP_BACKWARD ? lane.Y->TOP_BACKWARD : m_header;
+                    ZEESET_PREFETCH(&lane.Y->LEVEL[lane.HEIGHT - 1]);
+                    ++j;
+                } else if(next < count) {
+                    start(lane, next++);
+                    ++j;
+                } else {
+                    lane = lanes[--active];
+                }
+            }
+        }
+    }
+
     void RemoveNodeOnly(Node *x, Node *update[MAX_LEVEL]) {
         for(int i = 0; i < m_level; ++i) {
             if( update[i]->LEVEL[i].FORWARD == x ) {
+                Node *next = x->LEVEL[i].FORWARD;
+                if(next && next->HEIGHT == i + 1) {
+                    next->TOP_BACKWARD = (update[i] == m_header) ? NULL : update[i];
+                }
+
                 update[i]->LEVEL[i].SPAN += x->LEVEL[i].SPAN - 1;
                 update[i]->LEVEL[i].FORWARD = x->LEVEL[i].FORWARD;
             } else {
@@ -220,6 +1987,7 @@ private:
                         ( value_compare_equal(x->LEVEL[i].FORWARD->VALUE, value) &&
                           key_compare_less(x->LEVEL[i].FORWARD->KEY, key))) ) {
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
             update[i] = x;
         }
@@ -248,6 +2016,7 @@ private:
                         ( value_compare_equal(x->LEVEL[i].FORWARD->VALUE, value) &&
                           key_compare_less(x->LEVEL[i].FORWARD->KEY, key))) ) {
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
             update[i] = x;
         }
@@ -261,12 +2030,54 @@ private:
         if( (x->BACKWARD == NULL || value_compare_less(x->BACKWARD->VALUE, new_value)) &&
                 (x->LEVEL[0].FORWARD == NULL || value_compare_less(new_value, x->LEVEL[0].FORWARD->VALUE))) {
             x->VALUE = new_value;
+            ZEESET_STATS(m_stats.Add(m_stats.UPDATES_IN_PLACE));
+            return x;
+        }
+
+        RemoveNodeOnly(x, update);
+        x->Reset();
+        x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
+
+        return InsertNodeOnly(x);
+    }
+
+    // predecessors of x on every level, found by climbing back from x without comparisons
+    void GetPredecessorsOfNode(Node *x, Node *update[MAX_LEVEL]) {
+        Node *y = x->BACKWARD;
+
+        for(int i = 0; i < m_level; ++i) {
+            while(y && y->HEIGHT <= i) {
+                y = y->TOP_BACKWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+            }
+            update[i] = y ? y : m_header;
+        }
+    }
+
+    void DeleteNode(Node *x) {
+        Node *update[MAX_LEVEL];
+
+        GetPredecessorsOfNode(x, update);
+        RemoveNodeOnly(x, update);
+        FreeNode(x);
+    }
+
+    Node *UpdateNode(Node *x, const VALUE_TYPE &new_value) {
+        if( (x->BACKWARD == NULL || value_compare_less(x->BACKWARD->VALUE, new_value)) &&
+                (x->LEVEL[0].FORWARD == NULL || value_compare_less(new_value, x->LEVEL[0].FORWARD->VALUE))) {
+            x->VALUE = new_value;
+            ZEESET_STATS(m_stats.Add(m_stats.UPDATES_IN_PLACE));
             return x;
         }
 
+        Node *update[MAX_LEVEL];
+
+        GetPredecessorsOfNode(x, update);
         RemoveNodeOnly(x, update);
         x->Reset();
         x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
 
         return InsertNodeOnly(x);
     }
@@ -282,6 +2093,7 @@ private:
                           !key_compare_less( key, x->LEVEL[i].FORWARD->KEY ))) ) {
                 rank += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
 
             if(x && key_compare_equal(x->KEY, key) && value_compare_equal(x->VALUE, value)) {
@@ -292,6 +2104,58 @@ private:
         return 0;
     }
 
+    // GetRankOfNode(key, value), but the descent stops at the first level where (key, value) is known
+    // to lie between x and its forward node within max_error ranks of their middle, which it answers.
+    // Tall levels span 1 / BRANCH_PROB^i ranks, so a loose bound skips the bottom of the descent.
+    // *error receives how far the answer may be from the exact rank (0 once the element is reached).
+    // (key, value) must be present
+    unsigned long GetApproxRankOfNode(const KEY_TYPE &key, const VALUE_TYPE &value, unsigned long max_error, unsigned long &error) {
+        Node *x;
+        unsigned long rank = 0;
+
+        x = m_header;
+        for(int i = m_level - 1; i >= 0; --i) {
+            while( x->LEVEL[i].FORWARD && ( value_compare_less(x->LEVEL[i].FORWARD->VALUE, value) ||
+                        ( value_compare_equal(x->LEVEL[i].FORWARD->VALUE, value) &&
+                          !key_compare_less( key, x->LEVEL[i].FORWARD->KEY ))) ) {
+                rank += x->LEVEL[i].SPAN;
+                x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+            }
+
+            if(x != m_header && key_compare_equal(x->KEY, key) && value_compare_equal(x->VALUE, value)) {
+                error = 0;
+                return rank;
+            }
+
+            // the element ranks in [low, high], strictly between x and its forward node
+            unsigned long low = rank + 1;
+            unsigned long high = x->LEVEL[i].FORWARD ? rank + x->LEVEL[i].SPAN - 1 : m_length;
+
+            if(high >= low && (high - low + 1) / 2 <= max_error) {
+                error = (high - low + 1) / 2;
+                return low + (high - low) / 2;
+            }
+        }
+
+        error = 0;
+        return 0;
+    }
+
+    // climbs back along top levels summing spans, no value or key is compared
+    unsigned long GetRankOfNode(Node *x) {
+        unsigned long rank = 0;
+
+        while(x) {
+            Node *prev = x->TOP_BACKWARD;
+            rank += (prev ? prev : m_header)->LEVEL[x->HEIGHT - 1].SPAN;
+            x = prev;
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        return rank;
+    }
+
     Node *GetNodeByRank(unsigned long rank) {
         if(rank == 0 || rank > m_length) {
             return NULL;
@@ -305,6 +2169,7 @@ private:
             while( x->LEVEL[i].FORWARD && (traversed + x->LEVEL[i].SPAN) <= rank ) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
 
             if(traversed == rank) {
@@ -380,6 +2245,7 @@ private:
             while( x->LEVEL[i].FORWARD && (traversed + x->LEVEL[i].SPAN) < rank_low ) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
             update[i] = x;
         }
@@ -412,6 +2278,7 @@ private:
             while(x->LEVEL[i].FORWARD && !value_compare_less(value, x->LEVEL[i].FORWARD->VALUE)) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
         }
 
@@ -439,6 +2306,7 @@ private:
             while(x->LEVEL[i].FORWARD && value_compare_less(x->LEVEL[i].FORWARD->VALUE, value)) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
         }
 
@@ -466,6 +2334,7 @@ private:
             while(x->LEVEL[i].FORWARD && value_compare_less(x->LEVEL[i].FORWARD->VALUE, value)) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
         }
 
@@ -493,6 +2362,7 @@ private:
             while(x->LEVEL[i].FORWARD && !value_compare_less(value, x->LEVEL[i].FORWARD->VALUE)) {
                 traversed += x->LEVEL[i].SPAN;
                 x = x->LEVEL[i].FORWARD;
+                ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
             }
         }
 
@@ -507,23 +2377,115 @@ private:
     }
 
 public:
-    void Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
-        InsertNode(key, value);
+    Node *Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_INSERT));
+        return InsertNode(key, value);
     }
 
     bool Delete(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
         return DeleteNode(key, value, NULL);
     }
 
     bool Update(const KEY_TYPE &key, const VALUE_TYPE &value, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
         return UpdateNode(key, value, new_value) != NULL;
     }
 
+    // x is a handle returned by Insert/UpdateByNode, no search from header is needed
+    void DeleteByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
+        DeleteNode(x);
+    }
+
+    // returns x, the node is re-linked but never re-allocated
+    Node *UpdateByNode(Node *x, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
+        return UpdateNode(x, new_value);
+    }
+
+    // ranks[i] receives the rank of nodes[i]
+    void GetRanksByNodes(Node **nodes, size_t count, unsigned long *ranks) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK_BATCH));
+        GetRankOfNodes(nodes, count, ranks);
+    }
+
+    // batch updates: new elements come from CreateUnlinked, moved ones from UnlinkForUpdate, and all
+    // of them are linked at once by InsertSortedByNodes
+    Node *CreateUnlinked(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return CreateNode(RandomLevel(), key, value);
+    }
+
+    // sets new_value in place and returns NULL if x keeps its position, otherwise unlinks x,
+    // sets new_value and returns x, which must then be passed to InsertSortedByNodes
+    Node *UnlinkForUpdate(Node *x, const VALUE_TYPE &new_value) {
+        if( (x->BACKWARD == NULL || value_compare_less(x->BACKWARD->VALUE, new_value)) &&
+                (x->LEVEL[0].FORWARD == NULL || value_compare_less(new_value, x->LEVEL[0].FORWARD->VALUE))) {
+            x->VALUE = new_value;
+            ZEESET_STATS(m_stats.Add(m_stats.UPDATES_IN_PLACE));
+            return NULL;
+        }
+
+        Node *update[MAX_LEVEL];
+
+        GetPredecessorsOfNode(x, update);
+        RemoveNodeOnly(x, update);
+        x->Reset();
+        x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
+
+        return x;
+    }
+
+    // nodes must be unlinked, distinct and sorted by (VALUE, KEY)
+    void InsertSortedByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE_BATCH));
+        InsertNodesSorted(nodes, count);
+    }
+
+    // each node finds its predecessors by climbing back, so the order of nodes does not matter
+    void DeleteByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            DeleteNode(nodes[i]);
+        }
+    }
+
     unsigned long GetRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
         return GetRankOfNode(key, value);
     }
 
+    // rank of a present (key, value) within max_error, *error (if given) receives the actual bound
+    unsigned long GetApproxRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value, unsigned long max_error, unsigned long *error) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        unsigned long bound;
+        unsigned long rank = GetApproxRankOfNode(key, value, max_error, bound);
+
+        if(error) {
+            *error = bound;
+        }
+
+        return rank;
+    }
+
+    // node of rank 1 (NULL if empty), the following ones are reached through Next
+    Node *First() {
+        return m_header->LEVEL[0].FORWARD;
+    }
+
+    // NULL after the last node
+    Node *Next(Node *x) {
+        return x->LEVEL[0].FORWARD;
+    }
+
+    unsigned long GetRankByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        return GetRankOfNode(x);
+    }
+
     bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BY_RANK));
         Node *n = GetNodeByRank(rank);
 
         if(n) {
@@ -538,6 +2500,7 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_RANK));
         GetNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n) {
                     cb(rank, n->KEY, n->VALUE);
                 });
@@ -545,6 +2508,7 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElements(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
         ForeachNode([cb](unsigned long rank, Node *n){
                     cb(rank, n->KEY, n->VALUE);
                 });
@@ -552,6 +2516,7 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsReverse(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
         ForeachNodeReverse([cb](unsigned long rank, Node *n){
                     cb(rank, n->KEY, n->VALUE);
                 });
@@ -559,12 +2524,14 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void DeleteByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_RANK));
         DeleteNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n){
                     cb(rank, n->KEY, n->VALUE);
                 });
     }
 
     bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
         Node *n = GetNodeOfFirstGreaterValue(v, rank);
 
         if(n) {
@@ -577,6 +2544,7 @@ public:
     }
 
     bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
         Node *n = GetNodeOfFirstGreaterEqualValue(v, rank);
 
         if(n) {
@@ -589,6 +2557,7 @@ public:
     }
 
     bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
         Node *n = GetNodeOfLastLessValue(v, rank);
 
         if(n) {
@@ -601,6 +2570,7 @@ public:
     }
 
     bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
         Node *n = GetNodeOfLastLessEqualValue(v, rank);
 
         if(n) {
@@ -614,6 +2584,7 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_VALUE));
         unsigned long rank;
         Node *first = include_v_low ? GetNodeOfFirstGreaterEqualValue(v_low, &rank) :
             GetNodeOfFirstGreaterValue(v_low, &rank);
@@ -638,6 +2609,7 @@ public:
     }
 
     unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_COUNT_RANGED_VALUE));
         unsigned long rank;
         Node *first = include_v_low ? GetNodeOfFirstGreaterEqualValue(v_low, &rank) :
             GetNodeOfFirstGreaterValue(v_low, &rank);
@@ -659,6 +2631,7 @@ public:
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void DeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_VALUE));
         unsigned long rank;
         Node *first = include_v_low ? GetNodeOfFirstGreaterEqualValue(v_low, &rank) :
             GetNodeOfFirstGreaterValue(v_low, &rank);
@@ -675,11 +2648,14 @@ public:
             return;
         }
 
-        DeleteByRangedRank(rank, rank2, cb);
+        DeleteNodeByRangedRank(rank, rank2, [cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
     }
 
     template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_RANK));
         Node *x = GetNodeByRank(rank);
 
         if(!x) {
@@ -721,6 +2697,7 @@ public:
     template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb)
     {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_VALUE));
         unsigned long rank = 0;
         Node *x = GetNodeOfFirstGreaterEqualValue(value, &rank);
 
@@ -775,7 +2752,7 @@ public:
         while(x) {
             ss << "(" << ++i << ") " << x << ":" << "[" << x->KEY << "]" << "=" << x->VALUE;
 
-            for(size_t k = 0; k < MAX_LEVEL && (x->LEVEL[k].FORWARD || x->LEVEL[k].SPAN); ++k) {
+            for(int k = 0; k < x->HEIGHT; ++k) {
                 ss << " {" << k << ":" << x->LEVEL[k].SPAN << ":" << x->LEVEL[k].FORWARD << "}";
             }
 
@@ -792,211 +2769,613 @@ public:
     bool TestSelf() {
         Node *x = m_header->LEVEL[0].FORWARD;
 
-        while(x && x->LEVEL[0].FORWARD) {
-            if(x->LEVEL[0].FORWARD->VALUE < x->VALUE) {
-                return false;
+        while(x && x->LEVEL[0].FORWARD) {
+            if(x->LEVEL[0].FORWARD->VALUE < x->VALUE) {
+                return false;
+            }
+
+            x = x->LEVEL[0].FORWARD;
+        }
+
+        for(int i = 0; i < m_level; ++i) {
+            Node *prev = NULL;
+
+            for(Node *y = m_header->LEVEL[i].FORWARD; y; y = y->LEVEL[i].FORWARD) {
+                if(i == 0 && y->BACKWARD != prev) {
+                    return false;
+                }
+
+                if(y->HEIGHT == i + 1 && y->TOP_BACKWARD != prev) {
+                    return false;
+                }
+
+                prev = y;
+            }
+        }
+
+        return true;
+    }
+
+    // replaces all elements with [begin, end) of std::pair<KEY_TYPE, VALUE_TYPE>, which must be sorted by
+    // (value, key) with unique keys, nodes get deterministic levels and are linked in O(n)
+    template<typename Iterator, typename Function> /* std::function<void(Node *)> */
+    void BuildFromSorted(Iterator begin, Iterator end, Function on_node) {
+        BuildFromSorted([&begin, &end](KEY_TYPE &key, VALUE_TYPE &value) -> bool {
+                    if(begin == end) {
+                        return false;
+                    }
+
+                    key = begin->first;
+                    value = begin->second;
+                    ++begin;
+                    return true;
+                }, on_node);
+    }
+
+    // same as above, elements are pulled from produce until it returns false
+    template<typename Producer, typename Function> /* std::function<bool(KEY_TYPE &key, VALUE_TYPE &value)>, std::function<void(Node *)> */
+    void BuildFromSorted(Producer produce, Function on_node) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BUILD));
+        Clear();
+
+        LinkCursor cursor;
+        BeginLink(cursor);
+
+        KEY_TYPE key;
+        VALUE_TYPE value;
+
+        while(produce(key, value)) {
+            Node *x = CreateNode(DeterministicLevel(m_length + 1), std::move(key), std::move(value));
+            LinkLast(cursor, x);
+            on_node(x);
+        }
+
+        EndLink(cursor);
+    }
+
+    // bytes held by element nodes (header excluded)
+    size_t NodesMemory() {
+        size_t bytes = 0;
+
+        for(Node *x = m_header->LEVEL[0].FORWARD; x; x = x->LEVEL[0].FORWARD) {
+            bytes += NodeSize(x->HEIGHT);
+        }
+
+        return bytes;
+    }
+
+    // bytes of one node if every node carried MAX_LEVEL levels
+    static size_t FixedNodeSize() {
+        return NodeSize(MAX_LEVEL);
+    }
+
+    // any value can be held (see ZeeScoreBuckets for an engine that restricts them)
+    static bool InRange(const VALUE_TYPE &value) {
+        return true;
+    }
+
+    // re-construct tree-like structure: levels become those of a perfectly balanced skiplist
+    // (see DeterministicLevel) and all levels are relinked in one O(n) sweep,
+    // with relocate every node is re-allocated in rank order so that range scans walk memory sequentially
+    void Optimize(bool relocate = false) {
+        Optimize(relocate, [](Node *n) {});
+    }
+
+    // nodes whose height changes (every node with relocate) are re-allocated,
+    // on_relocate is called with every new node
+    template<typename Function> /* std::function<void(Node *)> */
+    void Optimize(bool relocate, Function on_relocate) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_OPTIMIZE));
+        std::vector<Node *> old_nodes;
+        Node *x = m_header->LEVEL[0].FORWARD;
+
+        LinkCursor cursor;
+        BeginLink(cursor);
+
+        while(x) {
+            Node *next = x->LEVEL[0].FORWARD;
+            int level = DeterministicLevel(m_length + 1);
+
+            if(!relocate && x->HEIGHT == level) {
+                x->Reset();
+                LinkLast(cursor, x);
+            } else {
+                Node *y = CreateNode(level, std::move(x->KEY), std::move(x->VALUE));
+                LinkLast(cursor, y);
+                on_relocate(y);
+
+                // old nodes are kept until all new ones are allocated, so new ones don't reuse their holes
+                if(relocate) {
+                    old_nodes.emplace_back(x);
+                } else {
+                    FreeNode(x);
+                }
+            }
+
+            x = next;
+        }
+
+        EndLink(cursor);
+
+        for(Node *n: old_nodes) {
+            FreeNode(n);
+        }
+    }
+};
+
+// Dict is the key dictionary policy: ZeeMapDict (ordered) or ZeeHashDict,
+// it maps each key to its engine node, so VALUE is stored only once in the node.
+// Engine keeps the elements ordered: ZeeSkiplist, or ZeeBTree from zeesetbtree.h
+// (MaxLevel and BranchProbPercent only apply to the default skiplist)
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25, typename Allocator = ZeeDefaultAllocator,
+    template<typename, typename> class Dict = ZeeMapDict,
+    typename Engine = ZeeSkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator>>
+class ZeeSet {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using ENGINE_TYPE = Engine;
+    using NODE_TYPE = typename ENGINE_TYPE::Node;
+    using DICT_TYPE = Dict<KeyType, NODE_TYPE *>;
+    using SNAPSHOT_TYPE = ZeeSetSnapshot<KeyType, ValueType>;
+
+    ZeeSet() = default;
+    ~ZeeSet() = default;
+
+    ZeeSet(const ZeeSet &) = delete;
+    ZeeSet(ZeeSet &&) = delete;
+    ZeeSet &operator=(const ZeeSet &) = delete;
+    ZeeSet &operator=(ZeeSet &&) = delete;
+
+    unsigned long Length() {
+        return m_engine.Length();
+    }
+
+    unsigned long MaxRank() {
+        return m_engine.MaxRank();
+    }
+
+    size_t Count() {
+        return m_dict.Size();
+    }
+
+    void Clear() {
+        if(m_log) {
+            m_log->OnClear();
+        }
+
+        ClearElements();
+    }
+
+    // mutations are reported to log (NULL to detach), bulk replacements (BulkLoad, LoadSnapshot,
+    // UnionStore, InterStore) as OnClear followed by OnUpdate for every element they leave
+    void SetLog(ZeeSetLog<KEY_TYPE, VALUE_TYPE> *log) {
+        m_log = log;
+    }
+
+    // false (nothing changed) if the engine cannot hold value
+    bool Update(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        if(!ENGINE_TYPE::InRange(value)) {
+            return false;
+        }
+
+        if(m_log) {
+            m_log->OnUpdate(key, value);
+        }
+
+        NODE_TYPE **node = m_dict.Find(key);
+
+        if(!node) {
+            m_dict.Set(key, m_engine.Insert(key, value));
+
+            if(m_tree) {
+                m_tree->Insert(key, value);
+            }
+
+            if(m_top) {
+                m_top->Insert(key, value);
+            }
+        } else {
+            if(m_tree && !((*node)->VALUE == value)) {
+                m_tree->Erase(key, (*node)->VALUE);
+                m_tree->Insert(key, value);
+            }
+
+            if(m_top && !((*node)->VALUE == value)) {
+                m_top->Erase(key, (*node)->VALUE);
+                m_top->Insert(key, value);
+            }
+
+            m_engine.UpdateByNode(*node, value);
+        }
+
+        RefillTop();
+        return true;
+    }
+
+    void Delete(const KEY_TYPE &key) {
+        NODE_TYPE **node = m_dict.Find(key);
+
+        if(!node){
+            return;
+        }
+
+        if(m_log) {
+            m_log->OnDelete(key);
+        }
+
+        if(m_tree) {
+            m_tree->Erase(key, (*node)->VALUE);
+        }
+
+        if(m_top) {
+            m_top->Erase(key, (*node)->VALUE);
+        }
+
+        m_engine.DeleteByNode(*node);
+        m_dict.Erase(key);
+        RefillTop();
+    }
+
+    // same result as calling Update for each of [begin, end) of std::pair<KEY_TYPE, VALUE_TYPE> in order
+    // (the last occurrence of a repeated key wins), but every key is looked up once, moved and new
+    // elements are linked together in (value, key) order, each search starting from the previous one.
+    // false (nothing changed) if the engine cannot hold one of the values
+    template<typename Iterator>
+    bool UpdateBatch(Iterator begin, Iterator end) {
+        std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> entries(begin, end);
+        std::vector<NODE_TYPE *> pending;
+
+        if(!AllInRange(entries)) {
+            return false;
+        }
+
+        KeepLastOccurrences(entries);
+        pending.reserve(entries.size());
+
+        for(auto &kv: entries) {
+            if(m_log) {
+                m_log->OnUpdate(kv.first, kv.second);
+            }
+
+            NODE_TYPE **node = m_dict.Find(kv.first);
+
+            if(!node) {
+                NODE_TYPE *x = m_engine.CreateUnlinked(kv.first, kv.second);
+                m_dict.Set(kv.first, x);
+                pending.emplace_back(x);
+
+                if(m_tree) {
+                    m_tree->Insert(kv.first, kv.second);
+                }
+
+                if(m_top) {
+                    m_top->Insert(kv.first, kv.second);
+                }
+            } else if(!((*node)->VALUE == kv.second)) {
+                if(m_tree) {
+                    m_tree->Erase(kv.first, (*node)->VALUE);
+                    m_tree->Insert(kv.first, kv.second);
+                }
+
+                if(m_top) {
+                    m_top->Erase(kv.first, (*node)->VALUE);
+                    m_top->Insert(kv.first, kv.second);
+                }
+
+                NODE_TYPE *x = m_engine.UnlinkForUpdate(*node, kv.second);
+                if(x) {
+                    pending.emplace_back(x);
+                }
+            }
+        }
+
+        std::sort(pending.begin(), pending.end(), [](const NODE_TYPE *a, const NODE_TYPE *b) {
+                    return a->VALUE < b->VALUE || (a->VALUE == b->VALUE && a->KEY < b->KEY);
+                });
+
+        m_engine.InsertSortedByNodes(pending.data(), pending.size());
+        RefillTop();
+        return true;
+    }
+
+    // same result as calling Delete for each key of [begin, end)
+    template<typename Iterator>
+    void DeleteBatch(Iterator begin, Iterator end) {
+        std::vector<NODE_TYPE *> nodes;
+
+        for(Iterator it = begin; it != end; ++it) {
+            NODE_TYPE **node = m_dict.Find(*it);
+
+            if(!node) {
+                continue;
+            }
+
+            if(m_log) {
+                m_log->OnDelete(*it);
+            }
+
+            if(m_tree) {
+                m_tree->Erase(*it, (*node)->VALUE);
+            }
+
+            if(m_top) {
+                m_top->Erase(*it, (*node)->VALUE);
             }
 
-            x = x->LEVEL[0].FORWARD;
+            nodes.emplace_back(*node);
+            m_dict.Erase(*it);
         }
 
-        return true;
+        m_engine.DeleteByNodes(nodes.data(), nodes.size());
+        RefillTop();
     }
 
-    // re-construct tree-like structure
-    void Optimize() {
-        std::vector<Node *> all_nodes;
-        all_nodes.reserve(m_length);
+    unsigned long GetRankOfElement(const KEY_TYPE &key) {
+        NODE_TYPE **node = m_dict.Find(key);
 
-        for(Node *x = m_header->LEVEL[0].FORWARD; x; ) {
-            Node *next = x->LEVEL[0].FORWARD;
+        if(!node) {
+            return 0;
+        }
 
-            x->Reset();
-            all_nodes.emplace_back(x);
+        return m_engine.GetRankByNode(*node);
+    }
 
-            x = next;
-        }
+    // GetRankOfElement within max_error ranks: the engine's descent stops as soon as the bound holds
+    // (see ZeeSkiplist::GetApproxRankOfNode). *error (if given) receives the bound of the answer
+    unsigned long GetApproxRankOfElement(const KEY_TYPE &key, unsigned long max_error, unsigned long *error = NULL) {
+        NODE_TYPE **node = m_dict.Find(key);
 
-        m_header->Reset();
-        m_tail = NULL;
-        m_length = 0;
-        m_level = 1;
+        if(!node) {
+            if(error) {
+                *error = 0;
+            }
 
-        for(Node *x: all_nodes) {
-            InsertNodeOnly(x);
+            return 0;
         }
+
+        return m_engine.GetApproxRankOfElement(key, (*node)->VALUE, max_error, error);
     }
-};
 
-template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25>
-class ZeeSet {
-public:
-    using KEY_TYPE = KeyType;
-    using VALUE_TYPE = ValueType;
+    // share of elements ranked at or before key, in (0, 100]. A max_error_percent above 0 allows that
+    // many percentage points of error (at most 100, NaN counts as 0) and answers from GetApproxRankOfElement
+    bool GetPercentileOfElement(const KEY_TYPE &key, double &percentile, double max_error_percent = 0) {
+        NODE_TYPE **node = m_dict.Find(key);
 
-    ZeeSet() = default;
-    ~ZeeSet() = default;
+        if(!node) {
+            return false;
+        }
 
-    ZeeSet(const ZeeSet &) = delete;
-    ZeeSet(ZeeSet &&) = delete;
-    ZeeSet &operator=(const ZeeSet &) = delete;
-    ZeeSet &operator=(ZeeSet &&) = delete;
+        // the product below converts to unsigned long only from [0, length]
+        max_error_percent = max_error_percent > 0 ? std::min(max_error_percent, 100.0) : 0;
 
-    unsigned long Length() {
-        return m_skiplist.Length();
-    }
+        unsigned long length = m_engine.Length();
+        unsigned long rank = max_error_percent > 0 ?
+            m_engine.GetApproxRankOfElement(key, (*node)->VALUE, (unsigned long)(max_error_percent * length / 100), NULL) :
+            m_engine.GetRankByNode(*node);
 
-    unsigned long MaxRank() {
-        return m_skiplist.MaxRank();
+        percentile = 100.0 * rank / length;
+        return true;
     }
 
-    size_t Count() {
-        return m_dict.size();
-    }
+    // value at percentile by nearest rank: the element of rank ceil(percentile * Count() / 100), at least 1.
+    // percentile is clamped to [0, 100], NaN returns false
+    bool GetValueAtPercentile(double percentile, VALUE_TYPE &value) {
+        unsigned long length = m_engine.Length();
 
-    void Clear() {
-        m_dict.clear();
-        m_skiplist.Clear();
-    }
+        if(length == 0 || std::isnan(percentile)) {
+            return false;
+        }
 
-    void Update(const KEY_TYPE &key, const VALUE_TYPE &value) {
-        auto iter = m_dict.find(key);
+        percentile = std::max(0.0, std::min(percentile, 100.0));
 
-        if(iter == m_dict.end()) {
-            m_skiplist.Insert(key, value);
-            m_dict[key] = value;
-        } else {
-            m_skiplist.Update(key, iter->second, value);
-            m_dict[key] = value;
+        double position = percentile * length / 100;
+        unsigned long rank = (unsigned long)position;
+        KEY_TYPE key;
+
+        if(rank < position || rank == 0) {
+            ++rank;
         }
+
+        return GetElementByRank(rank, key, value);
     }
 
-    void Delete(const KEY_TYPE &key) {
-        auto iter = m_dict.find(key);
+    // ranks[i] receives the rank of the i-th key of [begin, end), 0 if absent. Same result as
+    // GetRankOfElement per key, but dictionary slots are prefetched a few keys ahead and the climbs
+    // of many nodes are interleaved, so their cache misses overlap (see ZeeSkiplist::GetRankOfNodes)
+    template<typename Iterator>
+    void GetRanksOfElements(Iterator begin, Iterator end, unsigned long *ranks) {
+        static constexpr size_t PREFETCH_DISTANCE = 8;
+        std::vector<NODE_TYPE *> nodes;
+        std::vector<size_t> indexes;
+        Iterator ahead = begin;
 
-        if(iter == m_dict.end()){
-            return;
+        for(size_t d = 0; d < PREFETCH_DISTANCE && ahead != end; ++d, ++ahead) {
+            m_dict.Prefetch(*ahead);
         }
 
-        m_skiplist.Delete(key, iter->second);
-        m_dict.erase(iter);
-    }
+        size_t i = 0;
+        for(Iterator it = begin; it != end; ++it, ++i) {
+            if(ahead != end) {
+                m_dict.Prefetch(*ahead);
+                ++ahead;
+            }
 
-    unsigned long GetRankOfElement(const KEY_TYPE &key) {
-        auto iter = m_dict.find(key);
+            NODE_TYPE **node = m_dict.Find(*it);
+            ranks[i] = 0;
 
-        if(iter == m_dict.end()) {
-            return 0;
+            if(node) {
+                ZEESET_PREFETCH(*node);
+                nodes.emplace_back(*node);
+                indexes.emplace_back(i);
+            }
         }
 
-        return m_skiplist.GetRankOfElement(key, iter->second);
+        std::vector<unsigned long> found_ranks(nodes.size());
+        m_engine.GetRanksByNodes(nodes.data(), nodes.size(), found_ranks.data());
+
+        for(size_t j = 0; j < nodes.size(); ++j) {
+            ranks[indexes[j]] = found_ranks[j];
+        }
     }
 
     bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
-        return m_skiplist.GetElementByRank(rank, key, value);
+        bool found;
+
+        if(m_top && m_top->GetElementByRank(rank, m_engine.Length(), key, value, found)) {
+            return found;
+        }
+
+        return m_engine.GetElementByRank(rank, key, value);
     }
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
-        m_skiplist.GetElementsByRangedRank(rank_low, rank_high, cb);
+        if(m_top && m_top->GetElementsByRangedRank(rank_low, rank_high, m_engine.Length(), cb)) {
+            return;
+        }
+
+        m_engine.GetElementsByRangedRank(rank_low, rank_high, cb);
     }
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElements(Function cb) {
-        m_skiplist.ForeachElements(cb);
+        m_engine.ForeachElements(cb);
     }
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsReverse(Function cb) {
-        m_skiplist.ForeachElementsReverse(cb);
+        m_engine.ForeachElementsReverse(cb);
     }
 
     template<typename Function> /* std::function<void(unsigned long, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void DeleteByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
-        m_skiplist.DeleteByRangedRank(rank_low, rank_high, [this, cb](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value){
-                    this->m_dict.erase(key);
+        if(m_log) {
+            m_log->OnDeleteByRangedRank(rank_low, rank_high);
+        }
+
+        // the engine starts a range at rank 0 from rank 1 but still removes rank_high - rank_low + 1 elements
+        if(m_tree && rank_low <= rank_high) {
+            m_tree->EraseByRangedRank(rank_low ? rank_low : 1, rank_low ? rank_high : rank_high + 1);
+        }
+
+        if(m_top && rank_low <= rank_high) {
+            m_top->EraseByRangedRank(rank_low ? rank_low : 1, rank_low ? rank_high : rank_high + 1);
+        }
+
+        m_engine.DeleteByRangedRank(rank_low, rank_high, [this, cb](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value){
+                    this->m_dict.Erase(key);
 
                     if(cb) {
                         cb( rank, key, value );
                     }
                 });
+
+        RefillTop();
     }
 
     bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
-        return m_skiplist.GetElementOfFirstGreaterValue(v, key, value, rank);
+        return m_engine.GetElementOfFirstGreaterValue(v, key, value, rank);
     }
 
     bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
-        return m_skiplist.GetElementOfFirstGreaterEqualValue(v, key, value, rank);
+        return m_engine.GetElementOfFirstGreaterEqualValue(v, key, value, rank);
     }
 
     bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
-        return m_skiplist.GetElementOfLastLessValue(v, key, value, rank);
+        return m_engine.GetElementOfLastLessValue(v, key, value, rank);
     }
 
     bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
-        return m_skiplist.GetElementOfLastLessEqualValue(v, key, value, rank);
+        return m_engine.GetElementOfLastLessEqualValue(v, key, value, rank);
     }
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
-        m_skiplist.GetElementsByRangedValue(v_low, include_v_low, v_high, include_v_high, cb);
+        m_engine.GetElementsByRangedValue(v_low, include_v_low, v_high, include_v_high, cb);
     }
 
     unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
-        return m_skiplist.GetElementsCountByRangedValue(v_low, include_v_low, v_high, include_v_high);
+        return m_engine.GetElementsCountByRangedValue(v_low, include_v_low, v_high, include_v_high);
     }
 
     std::string DumpLevels() {
         std::ostringstream ss;
-        ss << m_skiplist.DumpLevels() << "\n";
+        ss << m_engine.DumpLevels() << "\n";
         ss << "dictionary size=" << Count();
         return ss.str();
     }
 
     template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void DeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
-        m_skiplist.DeleteByRangedValue(v_low, include_v_low, v_high, include_v_high, [this, cb](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
-                    this->m_dict.erase(key);
+        if(m_log) {
+            m_log->OnDeleteByRangedValue(v_low, include_v_low, v_high, include_v_high);
+        }
+
+        // ranks reported are those before the deletion, the tree drops the same rank range
+        unsigned long rank_low = 0, rank_high = 0;
+
+        m_engine.DeleteByRangedValue(v_low, include_v_low, v_high, include_v_high, [this, cb, &rank_low, &rank_high](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                    this->m_dict.Erase(key);
+
+                    if(!rank_low) {
+                        rank_low = rank;
+                    }
+                    rank_high = rank;
 
                     if(cb) {
                         cb(rank, key, value);
                     }
                 });
+
+        if(m_tree) {
+            m_tree->EraseByRangedRank(rank_low, rank_high);
+        }
+
+        if(m_top) {
+            m_top->EraseByRangedRank(rank_low, rank_high);
+            RefillTop();
+        }
     }
 
     template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
-        m_skiplist.ForeachElementsOfNearbyRank(rank, lower_count, upper_count, pick_cb);
+        m_engine.ForeachElementsOfNearbyRank(rank, lower_count, upper_count, pick_cb);
     }
 
     template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
     void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb)
     {
-        m_skiplist.ForeachElementsOfNearbyValue(value, lower_count, upper_count, pick_cb);
+        m_engine.ForeachElementsOfNearbyValue(value, lower_count, upper_count, pick_cb);
     }
 
     bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
-        auto iter = m_dict.find(key);
+        NODE_TYPE **node = m_dict.Find(key);
 
-        if(iter == m_dict.end()) {
+        if(!node) {
             return false;
         }
 
-        value = iter->second;
+        value = (*node)->VALUE;
         return true;
     }
 
     bool HasKey(const KEY_TYPE &key) {
-        return m_dict.count(key) != 0;
+        return m_dict.Find(key) != NULL;
     }
 
     bool TestSelf() {
-        if(m_dict.size() != m_skiplist.Length()) {
+        if(m_dict.Size() != m_engine.Length()) {
+            return false;
+        }
+
+        if(!m_engine.TestSelf()) {
             return false;
         }
 
-        if(!m_skiplist.TestSelf()) {
+        if(m_top && !m_top->TestSelf(m_engine.Length(), [this](unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+                    return this->m_engine.GetElementByRank(rank, key, value);
+                })) {
             return false;
         }
 
@@ -1005,39 +3384,531 @@ public:
 
         ForeachElements([&data, &result](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value){
                     if(data.count(key)) {
-                        result = result || false;
+                        result = false;
                     }
 
                     data[key] = value;
                 });
 
-        if(!result || m_dict.size() != data.size()) {
+        if(!result || m_dict.Size() != data.size()) {
+            return false;
+        }
+
+        for(auto &kv: data) {
+            NODE_TYPE **node = m_dict.Find(kv.first);
+
+            if(!node || !((*node)->KEY == kv.first) || !((*node)->VALUE == kv.second)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // replaces all elements with [begin, end) of std::pair<KEY_TYPE, VALUE_TYPE> in any order,
+    // sorts once (over threads if more than 1) and builds engine and dictionary in one linear pass,
+    // the last occurrence of a repeated key wins. false (nothing changed) if the engine cannot hold one of the values
+    template<typename Iterator>
+    bool BulkLoad(Iterator begin, Iterator end, unsigned threads = 1) {
+        std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> entries(begin, end);
+
+        if(!AllInRange(entries)) {
+            return false;
+        }
+
+        KeepLastOccurrences(entries);
+
+        ZeeParallelSort(entries.begin(), entries.end(),
+                [](const std::pair<KEY_TYPE, VALUE_TYPE> &a, const std::pair<KEY_TYPE, VALUE_TYPE> &b) {
+                    return a.second < b.second || (a.second == b.second && a.first < b.first);
+                }, threads);
+
+        ReplaceWithSorted(entries);
+        LogReplaced();
+        return true;
+    }
+
+    // how UnionStore and InterStore combine the weighted values of a key held by several sets
+    enum Aggregate {
+        AGGREGATE_SUM,
+        AGGREGATE_MIN,
+        AGGREGATE_MAX,
+    };
+
+    // Replaces all elements with every key of sets, valued by aggregate over the sets holding it of
+    // value * weights[i] (weights shorter than sets count 1 for the rest), as ZUNIONSTORE does.
+    // For integral values products and sums saturate at VALUE_TYPE's limits and products truncate
+    // toward zero; weights that are not finite, or negative for an unsigned VALUE_TYPE, and results the
+    // engine cannot hold return false and leave the set unchanged.
+    // Sets may include this one and may be other ZeeSet types of the same KEY_TYPE and VALUE_TYPE.
+    // Each set is read once into a run sorted by key, the runs are merged k ways, and the result is
+    // sorted once and built in one linear pass as BulkLoad does; with threads > 1 the runs are read
+    // and sorted in parallel and the merge is split into key ranges.
+    template<typename SetType>
+    bool UnionStore(const std::vector<SetType *> &sets, const std::vector<double> &weights = {},
+            Aggregate aggregate = AGGREGATE_SUM, unsigned threads = 1) {
+        return StoreMerged(sets, weights, aggregate, false, threads);
+    }
+
+    // same as UnionStore, keeping only the keys held by every set, as ZINTERSTORE does
+    template<typename SetType>
+    bool InterStore(const std::vector<SetType *> &sets, const std::vector<double> &weights = {},
+            Aggregate aggregate = AGGREGATE_SUM, unsigned threads = 1) {
+        return StoreMerged(sets, weights, aggregate, true, threads);
+    }
+
+    // snapshot layout (host byte order):
+    //   "ZSET" | u32 version | u32 sizeof(KEY_TYPE) | u32 sizeof(VALUE_TYPE) | u64 count |
+    //   count * (key, value) in rank order, see ZeeSerializer | u64 checksum of all preceding bytes
+    static constexpr uint32_t SNAPSHOT_VERSION = 1;
+    // most dictionary entries LoadSnapshot reserves before count is verified, larger snapshots grow past it
+    static constexpr uint64_t SNAPSHOT_RESERVE_LIMIT = 1 << 20;
+
+    bool SaveSnapshot(std::ostream &os) {
+        ZeeWriter w(os);
+        uint32_t version = SNAPSHOT_VERSION;
+        uint32_t key_size = sizeof(KEY_TYPE);
+        uint32_t value_size = sizeof(VALUE_TYPE);
+        uint64_t count = m_engine.Length();
+        bool ok = w.Write("ZSET", 4) && w.Write(&version, sizeof(version)) &&
+            w.Write(&key_size, sizeof(key_size)) && w.Write(&value_size, sizeof(value_size)) &&
+            w.Write(&count, sizeof(count));
+
+        m_engine.ForeachElements([&w, &ok](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                    ok = ok && ZeeSerializer<KEY_TYPE>::Write(w, key) && ZeeSerializer<VALUE_TYPE>::Write(w, value);
+                });
+
+        uint64_t checksum = w.Checksum().Digest();
+        return ok && w.Write(&checksum, sizeof(checksum));
+    }
+
+    // replaces all elements, entries are linked as they are read (see ZeeSkiplist::BuildFromSorted),
+    // returns false and leaves the set empty if the snapshot is malformed
+    bool LoadSnapshot(std::istream &is) {
+        ZeeReader r(is);
+        char magic[4];
+        uint32_t version, key_size, value_size;
+        uint64_t count;
+
+        ClearElements();
+
+        if(!r.Read(magic, 4) || memcmp(magic, "ZSET", 4) != 0 ||
+                !r.Read(&version, sizeof(version)) || version != SNAPSHOT_VERSION ||
+                !r.Read(&key_size, sizeof(key_size)) || key_size != sizeof(KEY_TYPE) ||
+                !r.Read(&value_size, sizeof(value_size)) || value_size != sizeof(VALUE_TYPE) ||
+                !r.Read(&count, sizeof(count))) {
+            LogReplaced();
+            return false;
+        }
+
+        uint64_t n = 0;
+        bool ok = true;
+        NODE_TYPE *prev = NULL;
+
+        // count is only trusted once the checksum matches, so the reserve is bounded by the bytes left too
+        m_dict.Reserve((size_t)std::min(count, std::min((uint64_t)r.Remaining(), SNAPSHOT_RESERVE_LIMIT)));
+        m_engine.BuildFromSorted([&r, &n, &ok, count](KEY_TYPE &key, VALUE_TYPE &value) -> bool {
+                    if(!ok || n == count) {
+                        return false;
+                    }
+
+                    ++n;
+                    ok = ZeeSerializer<KEY_TYPE>::Read(r, key) && ZeeSerializer<VALUE_TYPE>::Read(r, value) && ENGINE_TYPE::InRange(value);
+                    return ok;
+                }, [this, &ok, &prev](NODE_TYPE *x) {
+                    // entries must be ordered with unique keys
+                    if(prev && !(prev->VALUE < x->VALUE || (prev->VALUE == x->VALUE && prev->KEY < x->KEY))) {
+                        ok = false;
+                    }
+                    prev = x;
+
+                    if(!this->m_dict.Set(x->KEY, x)) {
+                        ok = false;
+                    }
+                });
+
+        uint64_t digest = r.Checksum().Digest();
+        uint64_t checksum;
+
+        if(!ok || n != count || !r.Read(&checksum, sizeof(checksum)) || checksum != digest) {
+            ClearElements();
+            LogReplaced();
             return false;
         }
 
-        auto i = m_dict.begin();
-        auto j = data.begin();
+        RebuildTree();
+        RebuildTop();
+        LogReplaced();
+        return true;
+    }
+
+    // see ZeeSkiplist::Optimize
+    void Optimize(bool relocate = false) {
+        m_engine.Optimize(relocate, [this](NODE_TYPE *n) {
+                    this->m_dict.Set(n->KEY, n);
+                });
+    }
+
+    size_t NodesMemory() {
+        return m_engine.NodesMemory();
+    }
+
+    static size_t FixedNodeSize() {
+        return ENGINE_TYPE::FixedNodeSize();
+    }
+
+    // Point-in-time views: from now on every mutation is mirrored into a persistent tree
+    // (about O(log n) extra per mutation), so Snapshot() is O(1) and its view stays valid however
+    // the set changes afterwards. EnableSnapshots() itself is O(n).
+    // Snapshot() must be called from the thread that mutates the set (or under its write lock);
+    // the snapshots it returns may be read from any thread.
+    void EnableSnapshots() {
+        if(!m_tree) {
+            m_tree.reset(new ZeePersistentTree<KEY_TYPE, VALUE_TYPE>());
+            RebuildTree();
+        }
+    }
+
+    // snapshots already taken stay valid
+    void DisableSnapshots() {
+        m_tree.reset();
+    }
+
+    bool SnapshotsEnabled() {
+        return m_tree != NULL;
+    }
+
+    // empty if snapshots are not enabled
+    SNAPSHOT_TYPE Snapshot() {
+        return m_tree ? SNAPSHOT_TYPE(m_tree->Share()) : SNAPSHOT_TYPE();
+    }
+
+    // Top-N reads: from now on a copy of the first size elements is kept in one array, patched by
+    // mutations that reach them (a comparison with the last cached element for those that don't), so
+    // GetElementsByRangedRank and GetElementByRank within the first size ranks scan the array instead
+    // of the engine. EnableTopCache() itself reads size elements by rank.
+    void EnableTopCache(size_t size) {
+        if(!m_top || m_top->Size() != size) {
+            m_top.reset(new ZeeTopCache<KEY_TYPE, VALUE_TYPE>(size));
+            RebuildTop();
+        }
+    }
+
+    void DisableTopCache() {
+        m_top.reset();
+    }
+
+    bool TopCacheEnabled() {
+        return m_top != NULL;
+    }
+
+    // zeros if the cache is not enabled
+    ZeeTopCacheStats GetTopCacheStats() {
+        return m_top ? m_top->GetStats() : ZeeTopCacheStats();
+    }
+
+    // engine counters, see ZeeSkiplist::GetStats
+    ZeeSetStats GetStats() {
+        return m_engine.GetStats();
+    }
+
+    void ResetStats() {
+        m_engine.ResetStats();
+    }
 
-        for(; i != m_dict.end() && j != data.end(); ++i, ++j) {
-            if(!(i->first == j->first)) {
+private:
+    static bool AllInRange(const std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> &entries) {
+        for(auto &kv: entries) {
+            if(!ENGINE_TYPE::InRange(kv.second)) {
                 return false;
             }
+        }
+
+        return true;
+    }
+
+    // drops every entry whose key occurs again later, keeping the order of the rest
+    static void KeepLastOccurrences(std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> &entries) {
+        Dict<KEY_TYPE, size_t> last_index;
+        last_index.Reserve(entries.size());
+
+        for(size_t i = 0; i < entries.size(); ++i) {
+            last_index.Set(entries[i].first, i);
+        }
+
+        if(last_index.Size() != entries.size()) {
+            size_t n = 0;
+            for(size_t i = 0; i < entries.size(); ++i) {
+                if(*last_index.Find(entries[i].first) != i) {
+                    continue;
+                }
+                // a self-move may empty the entry
+                if(n != i) {
+                    entries[n] = std::move(entries[i]);
+                }
+                ++n;
+            }
+            entries.resize(n);
+        }
+    }
+
+    // replaces all elements with entries, sorted by (value, key) with unique keys
+    void ReplaceWithSorted(std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> &entries) {
+        ClearElements();
+        m_dict.Reserve(entries.size());
+        m_engine.BuildFromSorted(entries.begin(), entries.end(), [this](NODE_TYPE *n) {
+                    this->m_dict.Set(n->KEY, n);
+                });
+
+        RebuildTree();
+        RebuildTop();
+    }
+
+    // reports a bulk replacement to the log as the Clear and Updates that rebuild the set
+    void LogReplaced() {
+        if(!m_log) {
+            return;
+        }
+
+        m_log->OnClear();
+        m_engine.ForeachElements([this](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                    this->m_log->OnUpdate(key, value);
+                });
+    }
+
+    static VALUE_TYPE Aggregated(const VALUE_TYPE &a, const VALUE_TYPE &b, Aggregate aggregate) {
+        switch(aggregate) {
+        case AGGREGATE_MIN:
+            return b < a ? b : a;
+        case AGGREGATE_MAX:
+            return a < b ? b : a;
+        default:
+            if(std::is_integral<VALUE_TYPE>::value) {
+                if(b > 0 && a > std::numeric_limits<VALUE_TYPE>::max() - b) {
+                    return std::numeric_limits<VALUE_TYPE>::max();
+                }
+                if(b < 0 && a < std::numeric_limits<VALUE_TYPE>::lowest() - b) {
+                    return std::numeric_limits<VALUE_TYPE>::lowest();
+                }
+            }
+            return a + b;
+        }
+    }
+
+    // value * weight, integral products saturate instead of converting an out-of-range double
+    static VALUE_TYPE Weighted(const VALUE_TYPE &value, double weight) {
+        // a weight of 1 keeps 64-bit values exact
+        if(weight == 1) {
+            return value;
+        }
+
+        double product = (double)value * weight;
+
+        if(std::is_integral<VALUE_TYPE>::value) {
+            if(!(product > (double)std::numeric_limits<VALUE_TYPE>::lowest())) {
+                return std::numeric_limits<VALUE_TYPE>::lowest();
+            }
+            if(!(product < (double)std::numeric_limits<VALUE_TYPE>::max())) {
+                return std::numeric_limits<VALUE_TYPE>::max();
+            }
+        }
+
+        return (VALUE_TYPE)product;
+    }
+
+    // merges the key ranges [begins[i], ends[i]) of every run into out, see UnionStore
+    static void MergeRuns(const std::vector<std::vector<std::pair<KEY_TYPE, VALUE_TYPE>>> &runs, std::vector<size_t> begins,
+            const std::vector<size_t> &ends, Aggregate aggregate, bool intersect, std::vector<std::pair<KEY_TYPE, VALUE_TYPE>> &out) {
+        std::vector<size_t> &pos = begins;
+        std::vector<size_t> heap;
+
+        // runs by their next key, smallest on top
+        auto later = [&runs, &pos](size_t a, size_t b) {
+            return runs[b][pos[b]].first < runs[a][pos[a]].first;
+        };
+
+        for(size_t i = 0; i < runs.size(); ++i) {
+            if(pos[i] < ends[i]) {
+                heap.emplace_back(i);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+
+        while(!heap.empty()) {
+            std::pair<KEY_TYPE, VALUE_TYPE> e = runs[heap.front()][pos[heap.front()]];
+            size_t holders = 0;
+
+            // keys are unique within a run, so each run holding the key pops once
+            while(!heap.empty() && runs[heap.front()][pos[heap.front()]].first == e.first) {
+                size_t i = heap.front();
+                std::pop_heap(heap.begin(), heap.end(), later);
+                heap.pop_back();
+
+                if(holders++) {
+                    e.second = Aggregated(e.second, runs[i][pos[i]].second, aggregate);
+                }
+
+                if(++pos[i] < ends[i]) {
+                    heap.emplace_back(i);
+                    std::push_heap(heap.begin(), heap.end(), later);
+                }
+            }
+
+            if(!intersect || holders == runs.size()) {
+                out.emplace_back(std::move(e));
+            }
+        }
+    }
+
+    template<typename SetType>
+    bool StoreMerged(const std::vector<SetType *> &sets, const std::vector<double> &weights, Aggregate aggregate, bool intersect, unsigned threads) {
+        static_assert(std::is_arithmetic<VALUE_TYPE>::value, "UnionStore and InterStore need an arithmetic VALUE_TYPE");
+        using ENTRY = std::pair<KEY_TYPE, VALUE_TYPE>;
 
-            if(!(i->second == j->second)) {
+        for(double weight: weights) {
+            if(!std::isfinite(weight) || (weight < 0 && !std::is_signed<VALUE_TYPE>::value)) {
                 return false;
             }
         }
 
-        return i == m_dict.end() && j == data.end();
+        size_t k = sets.size();
+        std::vector<std::vector<ENTRY>> runs(k);
+        unsigned sort_threads = threads > k ? threads / (unsigned)(k ? k : 1) : 1;
+
+        // every set is read before this one (which may be among them) is replaced
+        ZeeParallelFor(k, threads, [&sets, &weights, &runs, sort_threads](size_t i) {
+                    double weight = i < weights.size() ? weights[i] : 1;
+                    std::vector<ENTRY> &run = runs[i];
+
+                    run.reserve(sets[i]->Length());
+                    sets[i]->ForeachElements([&run, weight](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                                run.emplace_back(key, Weighted(value, weight));
+                            });
+
+                    ZeeParallelSort(run.begin(), run.end(), [](const ENTRY &a, const ENTRY &b) {
+                                return a.first < b.first;
+                            }, sort_threads);
+                });
+
+        // key ranges split at keys of the longest run, each merged on its own
+        size_t longest = 0, total = 0;
+        for(size_t i = 0; i < k; ++i) {
+            total += runs[i].size();
+            if(runs[i].size() > runs[longest].size()) {
+                longest = i;
+            }
+        }
+
+        size_t parts = threads > 1 && total >= (size_t)threads * 4096 ? threads : 1;
+        std::vector<std::vector<size_t>> bounds(parts + 1, std::vector<size_t>(k));
+
+        for(size_t i = 0; i < k; ++i) {
+            bounds[parts][i] = runs[i].size();
+        }
+        for(size_t t = 1; t < parts; ++t) {
+            const KEY_TYPE &split = runs[longest][runs[longest].size() * t / parts].first;
+
+            for(size_t i = 0; i < k; ++i) {
+                bounds[t][i] = std::lower_bound(runs[i].begin(), runs[i].end(), split, [](const ENTRY &e, const KEY_TYPE &key) {
+                            return e.first < key;
+                        }) - runs[i].begin();
+            }
+        }
+
+        std::vector<std::vector<ENTRY>> merged(parts);
+        ZeeParallelFor(parts, threads, [&runs, &bounds, &merged, aggregate, intersect](size_t t) {
+                    MergeRuns(runs, bounds[t], bounds[t + 1], aggregate, intersect, merged[t]);
+                });
+
+        std::vector<ENTRY> entries;
+        if(parts == 1) {
+            entries.swap(merged[0]);
+        } else {
+            size_t count = 0;
+            for(auto &part: merged) {
+                count += part.size();
+            }
+
+            entries.reserve(count);
+            for(auto &part: merged) {
+                std::move(part.begin(), part.end(), std::back_inserter(entries));
+                std::vector<ENTRY>().swap(part);
+            }
+        }
+        std::vector<std::vector<ENTRY>>().swap(runs);
+
+        if(!AllInRange(entries)) {
+            return false;
+        }
+
+        ZeeParallelSort(entries.begin(), entries.end(), [](const ENTRY &a, const ENTRY &b) {
+                    return a.second < b.second || (a.second == b.second && a.first < b.first);
+                }, threads);
+
+        ReplaceWithSorted(entries);
+        LogReplaced();
+        return true;
     }
 
-    void Optimize() {
-        return m_skiplist.Optimize();
+    void ClearElements() {
+        m_dict.Clear();
+        m_engine.Clear();
+
+        if(m_tree) {
+            m_tree->Clear();
+        }
+
+        if(m_top) {
+            m_top->Clear();
+        }
     }
 
-private:
-    ZeeSkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent> m_skiplist;
-    std::map<KEY_TYPE, VALUE_TYPE> m_dict;
+    void RebuildTree() {
+        if(!m_tree) {
+            return;
+        }
+
+        NODE_TYPE *x = NULL;
+        bool first = true;
+
+        m_tree->BuildFromSorted([this, &x, &first](KEY_TYPE &key, VALUE_TYPE &value) -> bool {
+                    x = first ? this->m_engine.First() : this->m_engine.Next(x);
+                    first = false;
+
+                    if(!x) {
+                        return false;
+                    }
+
+                    key = x->KEY;
+                    value = x->VALUE;
+                    return true;
+                });
+    }
+
+    // reads the first elements left in the top cache after a mutation took some out
+    void RefillTop() {
+        if(m_top) {
+            m_top->Refill(m_engine.Length(), [this](unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+                        return this->m_engine.GetElementByRank(rank, key, value);
+                    });
+        }
+    }
+
+    void RebuildTop() {
+        if(m_top) {
+            m_top->Rebuild(m_engine.Length(), [this](unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+                        return this->m_engine.GetElementByRank(rank, key, value);
+                    });
+        }
+    }
+
+    ENGINE_TYPE m_engine;
+    DICT_TYPE m_dict;
+    ZeeSetLog<KEY_TYPE, VALUE_TYPE> *m_log = NULL;
+    // mirror for Snapshot(), NULL unless EnableSnapshots()
+    std::unique_ptr<ZeePersistentTree<KEY_TYPE, VALUE_TYPE>> m_tree;
+    // first elements for EnableTopCache(), NULL unless enabled
+    std::unique_ptr<ZeeTopCache<KEY_TYPE, VALUE_TYPE>> m_top;
 };
 
 #endif
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <string>
 #include <string.h>
+#include <map>
+#include <vector>
+#include <sstream>
+#include <cmath>
+#include <functional>
 #include "zeeset.h"
 
 int main() {
@@ -247,6 +252,605 @@ int main() {
             std::cout << "foreach rank reverse " << rank << ": " << "[" << key << "]=" << value << "\n";
             });
 
+    {
+        ZeeSet<std::string, unsigned long, 32, 30, ZeeSlabAllocator<1024>> slab_rank;
+
+        for(int round = 0; round < 3; ++round) {
+            for(unsigned i = 0; i < max_id * 10; ++i) {
+                static char buf[1024];
+                snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 5));
+                if(rng() % 4) {
+                    slab_rank.Update(std::string(buf), rng() % max_value);
+                } else {
+                    slab_rank.Delete(std::string(buf));
+                }
+            }
+
+            std::cout << "slab allocator round " << round << " count=" << slab_rank.Count() << " TestSelf=" << slab_rank.TestSelf() << "\n";
+            slab_rank.Clear();
+        }
+    }
+
+    {
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> hash_rank;
+        std::map<std::string, unsigned long> expect;
+
+        for(unsigned i = 0; i < max_id * 100; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            if(rng() % 3) {
+                unsigned long v = rng() % max_value;
+                hash_rank.Update(std::string(buf), v);
+                expect[buf] = v;
+            } else {
+                hash_rank.Delete(std::string(buf));
+                expect.erase(buf);
+            }
+        }
+
+        bool same = hash_rank.Count() == expect.size();
+        for(auto &kv: expect) {
+            unsigned long v;
+            same = same && hash_rank.GetValueByKey(kv.first, v) && v == kv.second;
+        }
+
+        hash_rank.ForeachElements([&hash_rank, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                    same = same && hash_rank.GetRankOfElement(key) == rank;
+                });
+
+        std::cout << "hash dict count=" << hash_rank.Count() << " match=" << same << " TestSelf=" << hash_rank.TestSelf() << "\n";
+    }
+
+    {
+        // sizes no table can hold are refused instead of overflowing the capacity
+        ZeeHashDict<unsigned, unsigned> dict;
+        bool refused = !dict.Reserve((size_t)-1) && !dict.Reserve((size_t)-1 / 2) && dict.Size() == 0;
+        bool reserved = dict.Reserve(1000);
+
+        for(unsigned i = 0; i < 1000; ++i) {
+            reserved = reserved && dict.Set(i, i * 2);
+        }
+        for(unsigned i = 0; i < 1000; ++i) {
+            reserved = reserved && dict.Find(i) && *dict.Find(i) == i * 2;
+        }
+
+        std::cout << "hash dict reserve match=" << (refused && reserved) << "\n";
+    }
+
+    {
+        std::vector<std::pair<std::string, unsigned long>> entries;
+
+        for(unsigned i = 0; i < max_id * 100; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 50));
+            entries.emplace_back(std::string(buf), rng() % max_value);
+        }
+
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> loaded;
+        ZeeSet<std::string, unsigned long> replayed;
+
+        loaded.BulkLoad(entries.begin(), entries.end(), 4);
+        for(auto &kv: entries) {
+            replayed.Update(kv.first, kv.second);
+        }
+
+        bool same = loaded.Count() == replayed.Count();
+        replayed.ForeachElements([&loaded, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                    std::string k;
+                    unsigned long v;
+                    same = same && loaded.GetElementByRank(rank, k, v) && k == key && v == value && loaded.GetRankOfElement(key) == rank;
+                });
+
+        std::cout << "bulk load count=" << loaded.Count() << " match=" << same << " TestSelf=" << loaded.TestSelf() << "\n";
+
+        for(unsigned i = 0; i < max_id * 10; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 60));
+            loaded.Update(std::string(buf), rng() % max_value);
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 60));
+            loaded.Delete(std::string(buf));
+        }
+
+        std::cout << "bulk load then update count=" << loaded.Count() << " TestSelf=" << loaded.TestSelf() << "\n";
+
+        for(int relocate = 0; relocate < 2; ++relocate) {
+            std::vector<std::pair<std::string, unsigned long>> before;
+            loaded.ForeachElements([&before](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        before.emplace_back(key, value);
+                    });
+
+            loaded.Optimize(relocate);
+
+            same = loaded.Count() == before.size();
+            loaded.ForeachElements([&loaded, &before, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        same = same && before[rank - 1].first == key && before[rank - 1].second == value && loaded.GetRankOfElement(key) == rank;
+                    });
+
+            std::cout << "optimize relocate=" << relocate << " match=" << same << " TestSelf=" << loaded.TestSelf() << "\n";
+        }
+    }
+
+    {
+        ZeeSet<std::string, unsigned long> saved;
+
+        for(unsigned i = 0; i < max_id * 10; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            saved.Update(std::string(buf), rng() % max_value);
+        }
+
+        std::stringstream ss;
+        bool save_ok = saved.SaveSnapshot(ss);
+        std::string image = ss.str();
+
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> loaded;
+        std::istringstream is(image);
+        bool load_ok = loaded.LoadSnapshot(is);
+
+        bool same = loaded.Count() == saved.Count();
+        saved.ForeachElements([&loaded, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                    unsigned long v;
+                    same = same && loaded.GetValueByKey(key, v) && v == value && loaded.GetRankOfElement(key) == rank;
+                });
+
+        std::cout << "snapshot bytes=" << image.size() << " save=" << save_ok << " load=" << load_ok << " match=" << same << " TestSelf=" << loaded.TestSelf() << "\n";
+
+        image[image.size() / 2] ^= 0x20;
+        std::istringstream corrupted(image);
+        bool corrupted_ok = loaded.LoadSnapshot(corrupted);
+        std::istringstream truncated(image.substr(0, image.size() / 3));
+        bool truncated_ok = loaded.LoadSnapshot(truncated);
+
+        std::cout << "snapshot corrupted load=" << corrupted_ok << " truncated load=" << truncated_ok << " count=" << loaded.Count() << "\n";
+
+        // a corrupt string length fails the load instead of allocating it
+        std::string huge = ss.str();
+        uint32_t length = 0xfffffff0;
+        memcpy(&huge[huge.find('K') - sizeof(length)], &length, sizeof(length));
+        std::istringstream huge_stream(huge);
+        bool huge_ok = loaded.LoadSnapshot(huge_stream);
+        std::string key;
+        ZeeReader r((const char *)&length, sizeof(length));
+        bool huge_memory_ok = ZeeSerializer<std::string>::Read(r, key);
+
+        std::cout << "snapshot huge length load=" << huge_ok << " memory read=" << huge_memory_ok << "\n";
+
+        // a corrupt element count fails the load instead of reserving for it
+        bool huge_count_ok = false;
+        for(uint64_t count: {(uint64_t)0x100000000ull, (uint64_t)-1}) {
+            std::string counted = ss.str();
+            memcpy(&counted[16], &count, sizeof(count));
+            std::istringstream counted_stream(counted);
+            huge_count_ok = huge_count_ok || loaded.LoadSnapshot(counted_stream);
+        }
+
+        std::cout << "snapshot huge count load=" << huge_count_ok << " count=" << loaded.Count() << " TestSelf=" << loaded.TestSelf() << "\n";
+    }
+
+    {
+        using SetType = ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+        using Elements = std::vector<std::pair<std::string, unsigned long>>;
+
+        SetType live;
+        std::vector<std::pair<SetType::SNAPSHOT_TYPE, Elements>> views;
+        std::function<void(unsigned long, const std::string &, const unsigned long &)> ignore;
+
+        auto elements_of = [](auto &&set) {
+            Elements out;
+            set.ForeachElements([&out](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        out.emplace_back(key, value);
+                    });
+            return out;
+        };
+
+        for(unsigned i = 0; i < max_id * 5; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            live.Update(std::string(buf), rng() % max_value);
+        }
+
+        live.EnableSnapshots();
+
+        for(unsigned round = 0; round < 20; ++round) {
+            views.emplace_back(live.Snapshot(), elements_of(live));
+
+            for(unsigned i = 0; i < max_id; ++i) {
+                static char buf[1024];
+                snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+                unsigned op = rng() % 100;
+
+                if(op < 70) {
+                    live.Update(std::string(buf), rng() % max_value);
+                } else if(op < 95) {
+                    live.Delete(std::string(buf));
+                } else if(op < 98) {
+                    unsigned long low = rng() % (live.Length() + 1) + 1;
+                    live.DeleteByRangedRank(low, low + rng() % 5, ignore);
+                } else {
+                    unsigned long low = rng() % max_value;
+                    live.DeleteByRangedValue(low, rng() % 2, low + rng() % 10, rng() % 2, ignore);
+                }
+            }
+        }
+
+        bool same = true;
+        for(auto &view: views) {
+            same = same && view.first.TestSelf() && elements_of(view.first) == view.second;
+
+            for(size_t r = 0; r < view.second.size(); r += 7) {
+                std::string k;
+                unsigned long v;
+                auto &e = view.second[r];
+                same = same && view.first.GetElementByRank(r + 1, k, v) && k == e.first && v == e.second &&
+                    view.first.GetRankOfElement(e.first, e.second) == r + 1;
+            }
+
+            unsigned long count = 0;
+            view.first.GetElementsByRangedValue(10, true, 20, false, [&count](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        ++count;
+                    });
+            same = same && count == view.first.GetElementsCountByRangedValue(10, true, 20, false);
+        }
+
+        SetType::SNAPSHOT_TYPE last = live.Snapshot();
+        same = same && elements_of(last) == elements_of(live);
+
+        Elements entries = elements_of(live);
+        live.BulkLoad(entries.rbegin(), entries.rend());
+        same = same && elements_of(live.Snapshot()) == elements_of(live) && elements_of(last) == entries;
+
+        std::cout << "mvcc snapshots=" << views.size() << " match=" << same << " TestSelf=" << live.TestSelf() << "\n";
+    }
+
+    {
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> batched;
+        ZeeSet<std::string, unsigned long> replayed;
+        bool same = true;
+
+        batched.EnableSnapshots();
+
+        for(unsigned round = 0; round < 50; ++round) {
+            std::vector<std::pair<std::string, unsigned long>> updates;
+            std::vector<std::string> deletes;
+
+            // small batches and large ones, with repeated keys and values clustered around a moving center
+            unsigned batch = round % 5 == 0 ? max_id * 50 : rng() % (max_id * 2) + 1;
+            unsigned long center = rng() % (max_value * 10);
+
+            for(unsigned i = 0; i < batch; ++i) {
+                static char buf[1024];
+                snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 40));
+                updates.emplace_back(std::string(buf), center + rng() % max_value);
+            }
+            for(unsigned i = 0; i < batch / 4; ++i) {
+                static char buf[1024];
+                snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 40));
+                deletes.emplace_back(std::string(buf));
+            }
+
+            batched.UpdateBatch(updates.begin(), updates.end());
+            batched.DeleteBatch(deletes.begin(), deletes.end());
+            for(auto &kv: updates) {
+                replayed.Update(kv.first, kv.second);
+            }
+            for(auto &key: deletes) {
+                replayed.Delete(key);
+            }
+
+            same = same && batched.Count() == replayed.Count() && batched.TestSelf();
+            replayed.ForeachElements([&batched, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        std::string k;
+                        unsigned long v;
+                        same = same && batched.GetElementByRank(rank, k, v) && k == key && v == value && batched.GetRankOfElement(key) == rank;
+                    });
+        }
+
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>::SNAPSHOT_TYPE view = batched.Snapshot();
+        same = same && view.Length() == batched.Length();
+        view.ForeachElements([&batched, &same](unsigned long rank, const std::string &key, const unsigned long &value) {
+                    same = same && batched.GetRankOfElement(key) == rank;
+                });
+
+        // present, absent and repeated keys
+        std::vector<std::string> probes;
+        for(unsigned i = 0; i < max_id * 50; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 50));
+            probes.emplace_back(std::string(buf));
+        }
+
+        std::vector<unsigned long> batched_ranks(probes.size());
+        std::vector<unsigned long> replayed_ranks(probes.size());
+        batched.GetRanksOfElements(probes.begin(), probes.end(), batched_ranks.data());
+        replayed.GetRanksOfElements(probes.begin(), probes.end(), replayed_ranks.data());
+
+        bool ranks_same = true;
+        for(size_t i = 0; i < probes.size(); ++i) {
+            ranks_same = ranks_same && batched_ranks[i] == batched.GetRankOfElement(probes[i]) && replayed_ranks[i] == batched_ranks[i];
+        }
+
+        std::cout << "batch count=" << batched.Count() << " match=" << same << " ranks match=" << ranks_same << " TestSelf=" << batched.TestSelf() << "\n";
+    }
+
+    {
+        using Callback = std::function<void(unsigned long, const std::string &, const unsigned long &)>;
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> cached;
+        ZeeSet<std::string, unsigned long> plain;
+        bool same = true;
+        bool test_self = true;
+
+        cached.EnableTopCache(max_id / 2);
+
+        // most changes land at the head: values are small and the set stays near max_id * 2 elements
+        for(unsigned round = 0; round < 3000; ++round) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 2));
+            std::string key(buf);
+            unsigned op = rng() % 100;
+
+            if(op < 55) {
+                unsigned long value = rng() % max_value;
+                cached.Update(key, value);
+                plain.Update(key, value);
+            } else if(op < 80) {
+                cached.Delete(key);
+                plain.Delete(key);
+            } else if(op < 88) {
+                std::vector<std::pair<std::string, unsigned long>> updates;
+                std::vector<std::string> deletes;
+                unsigned batch = rng() % max_id;
+                for(unsigned i = 0; i < batch; ++i) {
+                    snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 2));
+                    updates.emplace_back(std::string(buf), rng() % max_value);
+                    snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 2));
+                    deletes.emplace_back(std::string(buf));
+                }
+                cached.UpdateBatch(updates.begin(), updates.end());
+                plain.UpdateBatch(updates.begin(), updates.end());
+                cached.DeleteBatch(deletes.begin(), deletes.end());
+                plain.DeleteBatch(deletes.begin(), deletes.end());
+            } else if(op < 93) {
+                unsigned long low = rng() % max_id, high = low + rng() % 5;
+                cached.DeleteByRangedRank(low, high, Callback());
+                plain.DeleteByRangedRank(low, high, Callback());
+            } else if(op < 98) {
+                unsigned long low = rng() % max_value, high = low + rng() % 10;
+                cached.DeleteByRangedValue(low, true, high, false, Callback());
+                plain.DeleteByRangedValue(low, true, high, false, Callback());
+            } else {
+                std::vector<std::pair<std::string, unsigned long>> entries;
+                for(unsigned i = 0; i < max_id; ++i) {
+                    snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 2));
+                    entries.emplace_back(std::string(buf), rng() % max_value);
+                }
+                cached.BulkLoad(entries.begin(), entries.end());
+                plain.BulkLoad(entries.begin(), entries.end());
+            }
+
+            // heads, ranges straddling the cached ranks, and single ranks
+            unsigned long low = rng() % (max_id + 2), high = low + rng() % max_id;
+            std::vector<std::string> a, b;
+            cached.GetElementsByRangedRank(low, high, [&a](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        a.emplace_back(std::to_string(rank) + key + std::to_string(value));
+                    });
+            plain.GetElementsByRangedRank(low, high, [&b](unsigned long rank, const std::string &key, const unsigned long &value) {
+                        b.emplace_back(std::to_string(rank) + key + std::to_string(value));
+                    });
+
+            std::string k1, k2;
+            unsigned long v1 = 0, v2 = 0;
+            same = same && a == b && cached.GetElementByRank(low, k1, v1) == plain.GetElementByRank(low, k2, v2) && k1 == k2 && v1 == v2;
+
+            if(round % 100 == 0) {
+                test_self = test_self && cached.TestSelf();
+            }
+        }
+
+        ZeeTopCacheStats stats = cached.GetTopCacheStats();
+        std::cout << "top cache count=" << cached.Count() << " match=" << same << " TestSelf=" << (test_self && cached.TestSelf())
+            << " hits=" << (stats.HITS > 0) << " misses=" << (stats.MISSES > 0) << " invalidations=" << (stats.INVALIDATIONS > 0)
+            << " rebuilds=" << (stats.REBUILDS > 0) << "\n";
+    }
+
+    {
+        using SetType = ZeeSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+        std::vector<std::unique_ptr<SetType>> boards;
+        std::vector<SetType *> sets;
+        std::vector<double> weights = {1, 2, 3};
+
+        // overlapping boards, large enough for the threaded merge to split key ranges
+        for(unsigned b = 0; b < 4; ++b) {
+            boards.emplace_back(new SetType());
+            sets.emplace_back(boards.back().get());
+
+            for(unsigned i = 0; i < max_id * 200; ++i) {
+                static char buf[1024];
+                snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 400));
+                boards.back()->Update(std::string(buf), rng() % max_value);
+            }
+        }
+
+        bool same = true;
+        bool test_self = true;
+        const char *names[] = {"sum", "min", "max"};
+
+        for(auto aggregate: {SetType::AGGREGATE_SUM, SetType::AGGREGATE_MIN, SetType::AGGREGATE_MAX}) {
+            // key -> (aggregated value, sets holding it), the fourth board weighs 1
+            std::map<std::string, std::pair<unsigned long, size_t>> expected;
+
+            for(size_t b = 0; b < sets.size(); ++b) {
+                unsigned long weight = b < weights.size() ? (unsigned long)weights[b] : 1;
+
+                sets[b]->ForeachElements([&expected, weight, aggregate](unsigned long rank, const std::string &key, const unsigned long &value) {
+                            unsigned long v = value * weight;
+                            auto it = expected.find(key);
+
+                            if(it == expected.end()) {
+                                expected[key] = std::make_pair(v, (size_t)1);
+                                return;
+                            }
+
+                            unsigned long &a = it->second.first;
+                            a = aggregate == SetType::AGGREGATE_SUM ? a + v : aggregate == SetType::AGGREGATE_MIN ? std::min(a, v) : std::max(a, v);
+                            it->second.second++;
+                        });
+            }
+
+            for(unsigned threads: {1u, 4u}) {
+                SetType united, intersected;
+                united.UnionStore(sets, weights, aggregate, threads);
+                intersected.InterStore(sets, weights, aggregate, threads);
+
+                size_t common = 0;
+                for(auto &kv: expected) {
+                    unsigned long v;
+                    bool all = kv.second.second == sets.size();
+
+                    same = same && united.GetValueByKey(kv.first, v) && v == kv.second.first;
+                    same = same && intersected.HasKey(kv.first) == all && (!all || (intersected.GetValueByKey(kv.first, v) && v == kv.second.first));
+                    common += all;
+                }
+
+                same = same && united.Count() == expected.size() && intersected.Count() == common;
+                test_self = test_self && united.TestSelf() && intersected.TestSelf();
+            }
+
+            std::cout << "union " << names[aggregate] << " count=" << expected.size() << " match=" << same << " TestSelf=" << test_self << "\n";
+        }
+
+        // the destination may be one of the sources
+        unsigned long before = sets[0]->Count();
+        sets[0]->EnableSnapshots();
+        sets[0]->UnionStore(sets, {}, SetType::AGGREGATE_MAX, 2);
+        std::cout << "union into source grew=" << (sets[0]->Count() > before) << " TestSelf=" << sets[0]->TestSelf() << "\n";
+    }
+
+    {
+        // negative and fractional weights truncate toward zero, integral products and sums saturate
+        using SignedSet = ZeeSet<std::string, long>;
+        using UnsignedSet = ZeeSet<std::string, unsigned long>;
+        const long most = std::numeric_limits<long>::max();
+        SignedSet a, b, weighted, saturated;
+        long v = 0, x = 0, y = 0, big = 0;
+
+        a.Update("x", 7);
+        a.Update("y", -3);
+        a.Update("big", most);
+        b.Update("x", 5);
+        b.Update("big", most);
+
+        bool negative = weighted.UnionStore(std::vector<SignedSet *>{&a, &b}, {-2, 0.5}) && weighted.GetValueByKey("x", x) && x == -12
+            && weighted.GetValueByKey("y", y) && y == 6 && weighted.GetValueByKey("big", big) && big == -most / 2 - 1;
+        bool saturate = saturated.UnionStore(std::vector<SignedSet *>{&a, &b}, {3}) && saturated.GetValueByKey("big", v) && v == most
+            && saturated.InterStore(std::vector<SignedSet *>{&a, &b}, {-3, -1}) && saturated.GetValueByKey("big", v) && v == std::numeric_limits<long>::lowest();
+
+        // an unsigned set cannot hold a negative product, such weights leave it as it was
+        UnsignedSet u;
+        unsigned long uv = 0;
+        u.Update("x", 1);
+
+        bool rejected = !u.UnionStore(std::vector<UnsignedSet *>{&u}, {-1}) && !a.InterStore(std::vector<SignedSet *>{&a, &b}, {NAN})
+            && u.Count() == 1 && u.GetValueByKey("x", uv) && uv == 1 && a.Count() == 3;
+
+        std::cout << "union weights negative=" << negative << " saturated=" << saturate << " rejected=" << rejected
+            << " TestSelf=" << (weighted.TestSelf() && saturated.TestSelf() && u.TestSelf()) << "\n";
+    }
+
+    {
+        // approximate ranks stay within the bound they report, which stays within the one asked for
+        ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> rank;
+        const unsigned n = 50000;
+
+        for(unsigned i = 0; i < n; ++i) {
+            rank.Update(i, rng() % (n / 10));
+        }
+
+        bool match = true;
+        bool bounded = true;
+        unsigned long worst = 0;
+
+        for(unsigned long max_error: {0UL, 5UL, 100UL, 5000UL}) {
+            for(unsigned i = 0; i < 2000; ++i) {
+                unsigned key = rng() % (n + 100);
+                unsigned long exact = rank.GetRankOfElement(key);
+                unsigned long error = 1;
+                unsigned long approx = rank.GetApproxRankOfElement(key, max_error, &error);
+                unsigned long diff = approx > exact ? approx - exact : exact - approx;
+
+                match = match && (exact != 0) == (approx != 0) && (max_error || approx == exact);
+                bounded = bounded && diff <= error && error <= max_error;
+                worst = std::max(worst, diff);
+            }
+        }
+
+        // nearest-rank percentiles against the sorted values
+        std::vector<unsigned long> values;
+        rank.ForeachElements([&values](unsigned long r, const unsigned &key, const unsigned long &value) {
+                    values.emplace_back(value);
+                });
+
+        for(double p: {0.0, 0.001, 1.0, 3.2, 50.0, 99.9, 100.0}) {
+            unsigned long value;
+            size_t nearest = (size_t)std::max(1.0, std::ceil(p * n / 100));
+
+            match = match && rank.GetValueAtPercentile(p, value) && value == values[nearest - 1];
+        }
+
+        // out-of-range percentiles clamp to the ends, NaN has no answer
+        unsigned long value;
+        match = match && rank.GetValueAtPercentile(100.5, value) && value == values.back() && rank.GetValueAtPercentile(-1, value)
+            && value == values.front() && rank.GetValueAtPercentile(-INFINITY, value) && value == values.front()
+            && !rank.GetValueAtPercentile(NAN, value);
+
+        for(unsigned i = 0; i < 1000; ++i) {
+            unsigned key = rng() % n;
+            double exact = 0, approx = 0;
+
+            match = match && rank.GetPercentileOfElement(key, exact) && exact == 100.0 * rank.GetRankOfElement(key) / n;
+            bounded = bounded && rank.GetPercentileOfElement(key, approx, 0.5) && std::fabs(approx - exact) <= 0.5;
+        }
+
+        // error allowances outside [0, 100] clamp instead of converting out of range
+        double percentile, clamped;
+        match = match && !rank.GetPercentileOfElement(n + 1, percentile);
+        match = match && rank.GetPercentileOfElement(1, percentile) && rank.GetPercentileOfElement(1, clamped, -5) && clamped == percentile
+            && rank.GetPercentileOfElement(1, clamped, NAN) && clamped == percentile;
+        bounded = bounded && rank.GetPercentileOfElement(1, clamped, 1e30) && clamped > 0 && clamped <= 100;
+
+        std::cout << "percentile count=" << rank.Count() << " worst error=" << worst << " match=" << match << " bounded=" << bounded
+            << " TestSelf=" << rank.TestSelf() << "\n";
+    }
+
+#ifdef ZEESET_ENABLE_STATS
+    {
+        ZeeSet<std::string, unsigned long, 32, 25, ZeeSlabAllocator<1024>, ZeeHashDict> counted;
+
+        for(unsigned i = 0; i < max_id * 10; ++i) {
+            static char buf[1024];
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            counted.Update(std::string(buf), rng() % max_value);
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            counted.GetRankOfElement(std::string(buf));
+            snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % (max_id * 20));
+            counted.Delete(std::string(buf));
+        }
+        counted.Optimize(true);
+
+        ZeeSetStats stats = counted.GetStats();
+        unsigned long nodes = 0;
+        for(uint64_t n: stats.NODES_BY_HEIGHT) {
+            nodes += n;
+        }
+
+        std::cout << stats.Dump() << "\n";
+        std::cout << "stats nodes match=" << (nodes == counted.Length())
+            << " bytes match=" << (stats.BYTES_ALLOCATED - stats.BYTES_FREED == counted.NodesMemory()) << "\n";
+
+        counted.Clear();
+        stats = counted.GetStats();
+        std::cout << "stats after clear live bytes=" << stats.BYTES_ALLOCATED - stats.BYTES_FREED << "\n";
+    }
+#endif
 
     return 0;
 }
@@ -0,0 +1,1787 @@
+#ifndef __ZEESETBTREE_H__
+#define __ZEESETBTREE_H__
+
+#include "zeeset.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+// counts the values of a sorted array below value (not above it with inclusive), which is where a
+// lower (upper) bound search lands; other value types keep the binary search
+template<typename ValueType, typename Enable = void>
+struct ZeeValueSearch {
+    static constexpr bool ENABLED = false;
+
+    static int CountBelow(const ValueType *values, int count, const ValueType &value, bool inclusive) {
+        int low = 0, high = count;
+
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(inclusive ? !(value < values[mid]) : values[mid] < value) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        return low;
+    }
+};
+
+// arithmetic values are compared a block at a time instead of one branch per step: 32 bytes a
+// step with AVX2, 16 with SSE4.2 (build with -mavx2 or -msse4.2), a branchless binary search
+// without either
+template<typename ValueType>
+struct ZeeValueSearch<ValueType, typename std::enable_if<std::is_arithmetic<ValueType>::value>::type> {
+    static constexpr bool ENABLED = true;
+
+    static int CountBelow(const ValueType *values, int count, const ValueType &value, bool inclusive) {
+#if defined(__AVX2__) || defined(__SSE4_2__)
+        int n = 0;
+        int i = CountBelowVector(values, count, value, inclusive, n);
+
+        // values are sorted, so a block that is not all below ends the count
+        if(i < 0) {
+            return n;
+        }
+
+        for(; i < count; ++i) {
+            n += inclusive ? !(value < values[i]) : values[i] < value;
+        }
+
+        return n;
+#else
+        // binary search whose halving is a conditional move rather than a branch
+        if(count == 0) {
+            return 0;
+        }
+
+        const ValueType *base = values;
+        while(count > 1) {
+            int half = count / 2;
+            base += (inclusive ? !(value < base[half]) : base[half] < value) ? half : 0;
+            count -= half;
+        }
+
+        return (int)(base - values) + (inclusive ? !(value < *base) : *base < value);
+#endif
+    }
+
+private:
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#if defined(__AVX2__)
+    using VECTOR = __m256i;
+    static VECTOR Load(const void *p) { return _mm256_loadu_si256((const __m256i *)p); }
+    static VECTOR Broadcast32(uint32_t v) { return _mm256_set1_epi32((int)v); }
+    static VECTOR Broadcast64(uint64_t v) { return _mm256_set1_epi64x((long long)v); }
+    static VECTOR Xor(VECTOR a, VECTOR b) { return _mm256_xor_si256(a, b); }
+    static VECTOR Greater32(VECTOR a, VECTOR b) { return _mm256_cmpgt_epi32(a, b); }
+    static VECTOR Greater64(VECTOR a, VECTOR b) { return _mm256_cmpgt_epi64(a, b); }
+    static VECTOR LessFloat(VECTOR a, VECTOR b, bool inclusive) {
+        return _mm256_castps_si256(inclusive ? _mm256_cmp_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_LE_OQ) :
+                _mm256_cmp_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), _CMP_LT_OQ));
+    }
+    static VECTOR LessDouble(VECTOR a, VECTOR b, bool inclusive) {
+        return _mm256_castpd_si256(inclusive ? _mm256_cmp_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_LE_OQ) :
+                _mm256_cmp_pd(_mm256_castsi256_pd(a), _mm256_castsi256_pd(b), _CMP_LT_OQ));
+    }
+    // one bit per byte, so a 4-byte lane counts 4
+    static int Bytes(VECTOR mask) { return __builtin_popcount((unsigned)_mm256_movemask_epi8(mask)); }
+#else
+    using VECTOR = __m128i;
+    static VECTOR Load(const void *p) { return _mm_loadu_si128((const __m128i *)p); }
+    static VECTOR Broadcast32(uint32_t v) { return _mm_set1_epi32((int)v); }
+    static VECTOR Broadcast64(uint64_t v) { return _mm_set1_epi64x((long long)v); }
+    static VECTOR Xor(VECTOR a, VECTOR b) { return _mm_xor_si128(a, b); }
+    static VECTOR Greater32(VECTOR a, VECTOR b) { return _mm_cmpgt_epi32(a, b); }
+    static VECTOR Greater64(VECTOR a, VECTOR b) { return _mm_cmpgt_epi64(a, b); }
+    static VECTOR LessFloat(VECTOR a, VECTOR b, bool inclusive) {
+        return _mm_castps_si128(inclusive ? _mm_cmple_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)) :
+                _mm_cmplt_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+    }
+    static VECTOR LessDouble(VECTOR a, VECTOR b, bool inclusive) {
+        return _mm_castpd_si128(inclusive ? _mm_cmple_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b)) :
+                _mm_cmplt_pd(_mm_castsi128_pd(a), _mm_castsi128_pd(b)));
+    }
+    static int Bytes(VECTOR mask) { return __builtin_popcount((unsigned)_mm_movemask_epi8(mask)); }
+#endif
+
+    static constexpr int LANES = (int)(sizeof(VECTOR) / sizeof(ValueType));
+
+    // lanes of block below value, all ones in a lane that is
+    static VECTOR BelowMask(VECTOR block, VECTOR v, bool inclusive, VECTOR bias) {
+        if(std::is_floating_point<ValueType>::value) {
+            return sizeof(ValueType) == 4 ? LessFloat(block, v, inclusive) : LessDouble(block, v, inclusive);
+        }
+
+        // unsigned lanes are compared as signed ones with the top bit flipped on both sides
+        block = Xor(block, bias);
+        if(sizeof(ValueType) == 4) {
+            // x <= v is !(x > v), the lanes that are not above are counted by the caller
+            return inclusive ? Greater32(block, v) : Greater32(v, block);
+        }
+        return inclusive ? Greater64(block, v) : Greater64(v, block);
+    }
+
+    // counts whole blocks into n, returns the first index left to the scalar loop, or -1 when done
+    static int CountBelowVector(const ValueType *values, int count, const ValueType &value, bool inclusive, int &n) {
+        if(sizeof(ValueType) != 4 && sizeof(ValueType) != 8) {
+            return 0;
+        }
+
+        bool integral = std::is_integral<ValueType>::value;
+        uint64_t top = std::is_unsigned<ValueType>::value ? (uint64_t)1 << (sizeof(ValueType) * 8 - 1) : 0;
+        uint64_t bits = 0;
+        std::memcpy(&bits, &value, sizeof(ValueType));
+
+        VECTOR bias = sizeof(ValueType) == 4 ? Broadcast32((uint32_t)top) : Broadcast64(top);
+        VECTOR v = sizeof(ValueType) == 4 ? Broadcast32((uint32_t)bits) : Broadcast64(bits);
+        if(integral) {
+            v = Xor(v, bias);
+        }
+
+        // an inclusive integer mask marks the lanes above value, so they are subtracted from the block
+        bool above = integral && inclusive;
+        int i = 0;
+
+        for(; i + LANES <= count; i += LANES) {
+            int below = Bytes(BelowMask(Load(values + i), v, inclusive, bias)) / (int)sizeof(ValueType);
+            if(above) {
+                below = LANES - below;
+            }
+
+            n += below;
+            if(below < LANES) {
+                return -1;
+            }
+        }
+
+        return i;
+    }
+#endif
+};
+
+// Order-statistic B+tree ordered by (VALUE, KEY), a drop-in engine for ZeeSet:
+//
+//     ZeeSet<K, V, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeBTree<K, V>>
+//
+// Leaves keep the values of their elements in one array, so a search compares values that sit in a
+// few consecutive cache lines instead of following a pointer per comparison, and inner nodes keep the
+// element count of every child, so rank and select visit O(log n / log Fanout) nodes.
+// Elements live in handles (Node) that never move while the element is in the tree, which lets
+// ZeeSet's dictionary point at them; a handle knows its leaf, and its rank is the handle's slot in the
+// leaf plus the counts left of the path when climbing to the root.
+template<typename KeyType, typename ValueType, int Fanout = 32, typename Allocator = ZeeDefaultAllocator>
+class ZeeBTree {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using ALLOCATOR_TYPE = Allocator;
+
+    // most elements of a leaf (children of an inner node), every node but the root holds at least MIN_FILL
+    static constexpr int FANOUT = Fanout;
+    static constexpr int MIN_FILL = Fanout / 2;
+    // fill of nodes laid out by BuildFromSorted and Optimize, leaves room for inserts before splits
+    static constexpr int BUILD_FILL = Fanout - Fanout / 4;
+
+    static_assert(Fanout >= 4 && Fanout % 2 == 0, "Fanout must be even and at least 4");
+
+private:
+    struct Leaf;
+
+public:
+    // elements are handed out as handles (see Insert, UpdateByNode, DeleteByNode),
+    // KEY and VALUE may be read but must only be changed through the tree
+    struct Node {
+        KEY_TYPE KEY;
+        VALUE_TYPE VALUE;
+        Leaf *LEAF = NULL;
+
+        Node(const KEY_TYPE &key, const VALUE_TYPE &value) :
+            KEY(key), VALUE(value) {}
+
+        Node(KEY_TYPE &&key, VALUE_TYPE &&value) :
+            KEY(std::move(key)), VALUE(std::move(value)) {}
+    };
+
+private:
+    struct Inner;
+
+    struct Base {
+        Inner *PARENT = NULL;
+        int COUNT = 0;
+        bool IS_LEAF = false;
+    };
+
+    struct alignas(64) Leaf : Base {
+        Leaf *PREV = NULL;
+        Leaf *NEXT = NULL;
+        // VALUES[i] is a copy of NODES[i]->VALUE
+        VALUE_TYPE VALUES[FANOUT];
+        Node *NODES[FANOUT];
+    };
+
+    // SEP_VALUES[i], SEP_KEYS[i] (i > 0) is no greater than any element under CHILDREN[i] and
+    // greater than every element under CHILDREN[i - 1], slot 0 is unused
+    struct alignas(64) Inner : Base {
+        unsigned long COUNTS[FANOUT];
+        Base *CHILDREN[FANOUT];
+        VALUE_TYPE SEP_VALUES[FANOUT];
+        KEY_TYPE SEP_KEYS[FANOUT];
+    };
+
+    // position of an element, valid until the tree changes
+    struct Cursor {
+        Leaf *LEAF;
+        int SLOT;
+    };
+
+    Base *m_root = NULL;
+    Leaf *m_first = NULL;
+    Leaf *m_last = NULL;
+    unsigned long m_length = 0;
+    size_t m_leaves = 0;
+    size_t m_inners = 0;
+
+    Allocator m_allocator;
+
+    ZEESET_STATS(ZeeStatsCounters m_stats;)
+public:
+    ZeeBTree() = default;
+
+    ~ZeeBTree() {
+        Clear();
+    }
+
+    ZeeBTree(const ZeeBTree &) = delete;
+    ZeeBTree(ZeeBTree &&) = delete;
+    ZeeBTree &operator=(const ZeeBTree &) = delete;
+    ZeeBTree &operator=(ZeeBTree &&) = delete;
+
+    void Clear() {
+        if(Allocator::RELEASE_ALL) {
+            if(!std::is_trivially_destructible<Node>::value) {
+                for(Leaf *leaf = m_first; leaf; leaf = leaf->NEXT) {
+                    for(int i = 0; i < leaf->COUNT; ++i) {
+                        leaf->NODES[i]->~Node();
+                    }
+                }
+            }
+        } else {
+            for(Leaf *leaf = m_first; leaf; leaf = leaf->NEXT) {
+                for(int i = 0; i < leaf->COUNT; ++i) {
+                    FreeNode(leaf->NODES[i]);
+                }
+            }
+        }
+
+        FreeTree(m_root);
+
+        // after FreeTree, so the counters end up with every byte freed
+        if(Allocator::RELEASE_ALL) {
+            m_allocator.ReleaseAll();
+            ZEESET_STATS(m_stats.AllNodesFreed());
+        }
+
+        m_root = NULL;
+        m_first = NULL;
+        m_last = NULL;
+        m_length = 0;
+    }
+
+    unsigned long Length() {
+        return m_length;
+    }
+
+    unsigned long MaxRank() {
+        return m_length;
+    }
+
+    // zeros unless built with ZEESET_ENABLE_STATS or ZEESET_ENABLE_LATENCY
+    ZeeSetStats GetStats() {
+        ZeeSetStats stats;
+        ZEESET_STATS(m_stats.Snapshot(stats));
+        return stats;
+    }
+
+    // restarts call, traversal, comparison, update and latency counters, memory and heights stay live
+    void ResetStats() {
+        ZEESET_STATS(m_stats.Reset(false));
+    }
+
+private:
+    Node *CreateNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *n = new(m_allocator.Allocate(sizeof(Node))) Node(key, value);
+        ZEESET_STATS(m_stats.NodeAllocated(1, sizeof(Node)));
+        return n;
+    }
+
+    Node *CreateNode(KEY_TYPE &&key, VALUE_TYPE &&value) {
+        Node *n = new(m_allocator.Allocate(sizeof(Node))) Node(std::move(key), std::move(value));
+        ZEESET_STATS(m_stats.NodeAllocated(1, sizeof(Node)));
+        return n;
+    }
+
+    void FreeNode(Node *n) {
+        n->~Node();
+        m_allocator.Deallocate(n, sizeof(Node));
+        ZEESET_STATS(m_stats.NodeFreed(1, sizeof(Node)));
+    }
+
+    // tree nodes live outside the allocator, so ReleaseAll() never takes them
+    Leaf *CreateLeaf() {
+        Leaf *leaf = new Leaf();
+        leaf->IS_LEAF = true;
+        ++m_leaves;
+        ZEESET_STATS(m_stats.Add(m_stats.BYTES_ALLOCATED, sizeof(Leaf)));
+        return leaf;
+    }
+
+    void FreeLeaf(Leaf *leaf) {
+        delete leaf;
+        --m_leaves;
+        ZEESET_STATS(m_stats.Add(m_stats.BYTES_FREED, sizeof(Leaf)));
+    }
+
+    Inner *CreateInner() {
+        Inner *n = new Inner();
+        ++m_inners;
+        ZEESET_STATS(m_stats.Add(m_stats.BYTES_ALLOCATED, sizeof(Inner)));
+        return n;
+    }
+
+    void FreeInner(Inner *n) {
+        delete n;
+        --m_inners;
+        ZEESET_STATS(m_stats.Add(m_stats.BYTES_FREED, sizeof(Inner)));
+    }
+
+    // frees tree nodes only, handles are left alone
+    void FreeTree(Base *b) {
+        if(!b) {
+            return;
+        }
+
+        if(b->IS_LEAF) {
+            FreeLeaf((Leaf *)b);
+            return;
+        }
+
+        Inner *n = (Inner *)b;
+        for(int i = 0; i < n->COUNT; ++i) {
+            FreeTree(n->CHILDREN[i]);
+        }
+        FreeInner(n);
+    }
+
+    bool key_compare_less(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return k1 < k2;
+    }
+
+    bool key_compare_equal(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return k1 == k2;
+    }
+
+    bool value_compare_less(const VALUE_TYPE &v1, const VALUE_TYPE &v2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return v1 < v2;
+    }
+
+    bool value_compare_equal(const VALUE_TYPE &v1, const VALUE_TYPE &v2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return v1 == v2;
+    }
+
+    // (v1, k1) < (v2, k2), keys are only compared on equal values
+    bool element_compare_less(const VALUE_TYPE &v1, const KEY_TYPE &k1, const VALUE_TYPE &v2, const KEY_TYPE &k2) {
+        return value_compare_less(v1, v2) || (value_compare_equal(v1, v2) && key_compare_less(k1, k2));
+    }
+
+    static unsigned long CountOf(Base *b) {
+        if(b->IS_LEAF) {
+            return b->COUNT;
+        }
+
+        Inner *n = (Inner *)b;
+        unsigned long count = 0;
+        for(int i = 0; i < n->COUNT; ++i) {
+            count += n->COUNTS[i];
+        }
+        return count;
+    }
+
+    static Node *FirstNodeOf(Base *b) {
+        while(!b->IS_LEAF) {
+            b = ((Inner *)b)->CHILDREN[0];
+        }
+        return ((Leaf *)b)->NODES[0];
+    }
+
+    int IndexOfChild(Inner *n, Base *child) {
+        int i = 0;
+        while(n->CHILDREN[i] != child) {
+            ++i;
+        }
+        ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        return i;
+    }
+
+    static int IndexInLeaf(Leaf *leaf, Node *x) {
+        int i = 0;
+        while(leaf->NODES[i] != x) {
+            ++i;
+        }
+        return i;
+    }
+
+    // number of values[0, count) below value (not above it with inclusive), for ZeeValueSearch types
+    int CountBelow(const VALUE_TYPE *values, int count, const VALUE_TYPE &value, bool inclusive) {
+        // counted as one comparison per value, what a scan costs
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS, count > 0 ? count : 0));
+        return ZeeValueSearch<VALUE_TYPE>::CountBelow(values, count, value, inclusive);
+    }
+
+    // child of n that holds (or would hold) (value, key)
+    int ChildOfElement(Inner *n, const VALUE_TYPE &value, const KEY_TYPE &key) {
+        int low = 1, high = n->COUNT;
+
+        if(ZeeValueSearch<VALUE_TYPE>::ENABLED) {
+            // values narrow the search to the separators equal to value, keys order those
+            low += CountBelow(n->SEP_VALUES + 1, n->COUNT - 1, value, false);
+            high = low + CountBelow(n->SEP_VALUES + low, n->COUNT - low, value, true);
+        }
+
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(element_compare_less(value, key, n->SEP_VALUES[mid], n->SEP_KEYS[mid])) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+
+        return low - 1;
+    }
+
+    // child of n where the first element with VALUE > value (>= value with inclusive) is, unless
+    // it is the first element after that child
+    int ChildOfValue(Inner *n, const VALUE_TYPE &value, bool inclusive) {
+        if(ZeeValueSearch<VALUE_TYPE>::ENABLED) {
+            return CountBelow(n->SEP_VALUES + 1, n->COUNT - 1, value, !inclusive);
+        }
+
+        int low = 1, high = n->COUNT;
+
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(inclusive ? !value_compare_less(n->SEP_VALUES[mid], value) : value_compare_less(value, n->SEP_VALUES[mid])) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+
+        return low - 1;
+    }
+
+    // first slot whose element is not less than (value, key)
+    int SlotOfElement(Leaf *leaf, const VALUE_TYPE &value, const KEY_TYPE &key) {
+        int low = 0, high = leaf->COUNT;
+
+        if(ZeeValueSearch<VALUE_TYPE>::ENABLED) {
+            low = CountBelow(leaf->VALUES, leaf->COUNT, value, false);
+            high = low + CountBelow(leaf->VALUES + low, leaf->COUNT - low, value, true);
+        }
+
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(element_compare_less(leaf->VALUES[mid], leaf->NODES[mid]->KEY, value, key)) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        return low;
+    }
+
+    // first slot with VALUE > value (>= value with inclusive)
+    int SlotOfValue(Leaf *leaf, const VALUE_TYPE &value, bool inclusive) {
+        if(ZeeValueSearch<VALUE_TYPE>::ENABLED) {
+            return CountBelow(leaf->VALUES, leaf->COUNT, value, !inclusive);
+        }
+
+        int low = 0, high = leaf->COUNT;
+
+        while(low < high) {
+            int mid = (low + high) / 2;
+            if(inclusive ? !value_compare_less(leaf->VALUES[mid], value) : value_compare_less(value, leaf->VALUES[mid])) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+
+        return low;
+    }
+
+    bool StepForward(Cursor &c) {
+        if(++c.SLOT < c.LEAF->COUNT) {
+            return true;
+        }
+
+        c.LEAF = c.LEAF->NEXT;
+        c.SLOT = 0;
+        return c.LEAF != NULL;
+    }
+
+    bool StepBackward(Cursor &c) {
+        if(c.SLOT > 0) {
+            --c.SLOT;
+            return true;
+        }
+
+        c.LEAF = c.LEAF->PREV;
+        if(!c.LEAF) {
+            return false;
+        }
+
+        c.SLOT = c.LEAF->COUNT - 1;
+        return true;
+    }
+
+    static Node *NodeAt(const Cursor &c) {
+        return c.LEAF->NODES[c.SLOT];
+    }
+
+    Node *InsertNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return InsertNodeOnly(CreateNode(key, value));
+    }
+
+    // links n, which must not be in the tree, so a removed handle can be re-inserted as is
+    Node *InsertNodeOnly(Node *n) {
+        if(!m_root) {
+            Leaf *leaf = CreateLeaf();
+            m_root = leaf;
+            m_first = leaf;
+            m_last = leaf;
+        }
+
+        Base *b = m_root;
+
+        // counts on the path are raised on the way down, splits below set exact ones
+        while(!b->IS_LEAF) {
+            Inner *p = (Inner *)b;
+            int i = ChildOfElement(p, n->VALUE, n->KEY);
+            ++p->COUNTS[i];
+            b = p->CHILDREN[i];
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        Leaf *leaf = (Leaf *)b;
+        InsertIntoLeaf(leaf, SlotOfElement(leaf, n->VALUE, n->KEY), n);
+        ++m_length;
+
+        return n;
+    }
+
+    void InsertIntoLeaf(Leaf *leaf, int slot, Node *n) {
+        if(leaf->COUNT < FANOUT) {
+            PutIntoLeaf(leaf, slot, n);
+            return;
+        }
+
+        // split: the upper half moves to a new leaf right of this one
+        Leaf *right = CreateLeaf();
+        const int half = FANOUT / 2;
+
+        for(int i = half; i < FANOUT; ++i) {
+            right->VALUES[i - half] = std::move(leaf->VALUES[i]);
+            right->NODES[i - half] = leaf->NODES[i];
+            right->NODES[i - half]->LEAF = right;
+        }
+        right->COUNT = FANOUT - half;
+        leaf->COUNT = half;
+
+        right->PREV = leaf;
+        right->NEXT = leaf->NEXT;
+        if(leaf->NEXT) {
+            leaf->NEXT->PREV = right;
+        } else {
+            m_last = right;
+        }
+        leaf->NEXT = right;
+
+        if(slot <= half) {
+            PutIntoLeaf(leaf, slot, n);
+        } else {
+            PutIntoLeaf(right, slot - half, n);
+        }
+
+        if(!leaf->PARENT) {
+            GrowRoot(leaf, right, right->VALUES[0], right->NODES[0]->KEY);
+            return;
+        }
+
+        Inner *p = leaf->PARENT;
+        int i = IndexOfChild(p, leaf);
+        p->COUNTS[i] = leaf->COUNT;
+        InsertIntoInner(p, i + 1, right, right->COUNT, right->VALUES[0], right->NODES[0]->KEY);
+    }
+
+    void PutIntoLeaf(Leaf *leaf, int slot, Node *n) {
+        for(int i = leaf->COUNT; i > slot; --i) {
+            leaf->VALUES[i] = std::move(leaf->VALUES[i - 1]);
+            leaf->NODES[i] = leaf->NODES[i - 1];
+        }
+
+        leaf->VALUES[slot] = n->VALUE;
+        leaf->NODES[slot] = n;
+        n->LEAF = leaf;
+        ++leaf->COUNT;
+    }
+
+    // puts child with count elements at slot i of p, whose counts must already include them
+    void InsertIntoInner(Inner *p, int i, Base *child, unsigned long count, const VALUE_TYPE &sep_value, const KEY_TYPE &sep_key) {
+        if(p->COUNT < FANOUT) {
+            PutIntoInner(p, i, child, count, sep_value, sep_key);
+            return;
+        }
+
+        Inner *right = CreateInner();
+        const int half = FANOUT / 2;
+
+        for(int k = half; k < FANOUT; ++k) {
+            right->COUNTS[k - half] = p->COUNTS[k];
+            right->CHILDREN[k - half] = p->CHILDREN[k];
+            right->SEP_VALUES[k - half] = std::move(p->SEP_VALUES[k]);
+            right->SEP_KEYS[k - half] = std::move(p->SEP_KEYS[k]);
+            right->CHILDREN[k - half]->PARENT = right;
+        }
+        right->COUNT = FANOUT - half;
+        p->COUNT = half;
+
+        if(i <= half) {
+            PutIntoInner(p, i, child, count, sep_value, sep_key);
+        } else {
+            PutIntoInner(right, i - half, child, count, sep_value, sep_key);
+        }
+
+        // the first separator of right moves up, where it bounds right from below
+        if(!p->PARENT) {
+            GrowRoot(p, right, right->SEP_VALUES[0], right->SEP_KEYS[0]);
+            return;
+        }
+
+        Inner *g = p->PARENT;
+        int j = IndexOfChild(g, p);
+        g->COUNTS[j] = CountOf(p);
+        InsertIntoInner(g, j + 1, right, CountOf(right), right->SEP_VALUES[0], right->SEP_KEYS[0]);
+    }
+
+    void PutIntoInner(Inner *p, int i, Base *child, unsigned long count, const VALUE_TYPE &sep_value, const KEY_TYPE &sep_key) {
+        for(int k = p->COUNT; k > i; --k) {
+            p->COUNTS[k] = p->COUNTS[k - 1];
+            p->CHILDREN[k] = p->CHILDREN[k - 1];
+            p->SEP_VALUES[k] = std::move(p->SEP_VALUES[k - 1]);
+            p->SEP_KEYS[k] = std::move(p->SEP_KEYS[k - 1]);
+        }
+
+        p->COUNTS[i] = count;
+        p->CHILDREN[i] = child;
+        p->SEP_VALUES[i] = sep_value;
+        p->SEP_KEYS[i] = sep_key;
+        child->PARENT = p;
+        ++p->COUNT;
+    }
+
+    void GrowRoot(Base *left, Base *right, const VALUE_TYPE &sep_value, const KEY_TYPE &sep_key) {
+        Inner *root = CreateInner();
+
+        root->COUNTS[0] = CountOf(left);
+        root->CHILDREN[0] = left;
+        left->PARENT = root;
+        root->COUNT = 1;
+        PutIntoInner(root, 1, right, CountOf(right), sep_value, sep_key);
+
+        m_root = root;
+    }
+
+    // unlinks x from the tree but keeps the handle
+    void RemoveNodeOnly(Node *x) {
+        Leaf *leaf = x->LEAF;
+        int slot = IndexInLeaf(leaf, x);
+
+        for(int i = slot + 1; i < leaf->COUNT; ++i) {
+            leaf->VALUES[i - 1] = std::move(leaf->VALUES[i]);
+            leaf->NODES[i - 1] = leaf->NODES[i];
+        }
+        --leaf->COUNT;
+
+        for(Base *b = leaf; b->PARENT; b = b->PARENT) {
+            --b->PARENT->COUNTS[IndexOfChild(b->PARENT, b)];
+        }
+
+        x->LEAF = NULL;
+        --m_length;
+
+        RebalanceLeaf(leaf);
+    }
+
+    void RebalanceLeaf(Leaf *leaf) {
+        if(!leaf->PARENT) {
+            if(leaf->COUNT == 0) {
+                FreeLeaf(leaf);
+                m_root = NULL;
+                m_first = NULL;
+                m_last = NULL;
+            }
+            return;
+        }
+
+        if(leaf->COUNT >= MIN_FILL) {
+            return;
+        }
+
+        Inner *p = leaf->PARENT;
+        int i = IndexOfChild(p, leaf);
+        Leaf *left = i > 0 ? (Leaf *)p->CHILDREN[i - 1] : NULL;
+        Leaf *right = i + 1 < p->COUNT ? (Leaf *)p->CHILDREN[i + 1] : NULL;
+
+        // borrow one element from a sibling that can spare it
+        if(left && left->COUNT > MIN_FILL) {
+            Node *n = left->NODES[--left->COUNT];
+            PutIntoLeaf(leaf, 0, n);
+            --p->COUNTS[i - 1];
+            ++p->COUNTS[i];
+            p->SEP_VALUES[i] = n->VALUE;
+            p->SEP_KEYS[i] = n->KEY;
+            return;
+        }
+
+        if(right && right->COUNT > MIN_FILL) {
+            PutIntoLeaf(leaf, leaf->COUNT, right->NODES[0]);
+            for(int k = 1; k < right->COUNT; ++k) {
+                right->VALUES[k - 1] = std::move(right->VALUES[k]);
+                right->NODES[k - 1] = right->NODES[k];
+            }
+            --right->COUNT;
+            ++p->COUNTS[i];
+            --p->COUNTS[i + 1];
+            p->SEP_VALUES[i + 1] = right->VALUES[0];
+            p->SEP_KEYS[i + 1] = right->NODES[0]->KEY;
+            return;
+        }
+
+        MergeLeaves(p, left ? i - 1 : i);
+    }
+
+    // moves every element of child i + 1 into child i and drops child i + 1
+    void MergeLeaves(Inner *p, int i) {
+        Leaf *left = (Leaf *)p->CHILDREN[i];
+        Leaf *right = (Leaf *)p->CHILDREN[i + 1];
+
+        for(int k = 0; k < right->COUNT; ++k) {
+            left->VALUES[left->COUNT] = std::move(right->VALUES[k]);
+            left->NODES[left->COUNT] = right->NODES[k];
+            left->NODES[left->COUNT]->LEAF = left;
+            ++left->COUNT;
+        }
+
+        left->NEXT = right->NEXT;
+        if(right->NEXT) {
+            right->NEXT->PREV = left;
+        } else {
+            m_last = left;
+        }
+
+        p->COUNTS[i] += p->COUNTS[i + 1];
+        RemoveFromInner(p, i + 1);
+        FreeLeaf(right);
+
+        RebalanceInner(p);
+    }
+
+    void RemoveFromInner(Inner *p, int i) {
+        for(int k = i + 1; k < p->COUNT; ++k) {
+            p->COUNTS[k - 1] = p->COUNTS[k];
+            p->CHILDREN[k - 1] = p->CHILDREN[k];
+            p->SEP_VALUES[k - 1] = std::move(p->SEP_VALUES[k]);
+            p->SEP_KEYS[k - 1] = std::move(p->SEP_KEYS[k]);
+        }
+        --p->COUNT;
+    }
+
+    void RebalanceInner(Inner *p) {
+        if(!p->PARENT) {
+            // a root with one child gives way to it
+            if(p->COUNT == 1) {
+                m_root = p->CHILDREN[0];
+                m_root->PARENT = NULL;
+                FreeInner(p);
+            }
+            return;
+        }
+
+        if(p->COUNT >= MIN_FILL) {
+            return;
+        }
+
+        Inner *g = p->PARENT;
+        int i = IndexOfChild(g, p);
+        Inner *left = i > 0 ? (Inner *)g->CHILDREN[i - 1] : NULL;
+        Inner *right = i + 1 < g->COUNT ? (Inner *)g->CHILDREN[i + 1] : NULL;
+
+        // separators rotate through g: the one bounding p (or right) comes down, the moved child's goes up
+        if(left && left->COUNT > MIN_FILL) {
+            int last = left->COUNT - 1;
+            unsigned long count = left->COUNTS[last];
+
+            PutIntoInner(p, 0, left->CHILDREN[last], count, g->SEP_VALUES[i], g->SEP_KEYS[i]);
+            // p's former first child, now in slot 1, is bounded by the separator that came down
+            std::swap(p->SEP_VALUES[0], p->SEP_VALUES[1]);
+            std::swap(p->SEP_KEYS[0], p->SEP_KEYS[1]);
+            g->SEP_VALUES[i] = std::move(left->SEP_VALUES[last]);
+            g->SEP_KEYS[i] = std::move(left->SEP_KEYS[last]);
+            --left->COUNT;
+
+            g->COUNTS[i - 1] -= count;
+            g->COUNTS[i] += count;
+            return;
+        }
+
+        if(right && right->COUNT > MIN_FILL) {
+            unsigned long count = right->COUNTS[0];
+
+            PutIntoInner(p, p->COUNT, right->CHILDREN[0], count, g->SEP_VALUES[i + 1], g->SEP_KEYS[i + 1]);
+            g->SEP_VALUES[i + 1] = right->SEP_VALUES[1];
+            g->SEP_KEYS[i + 1] = right->SEP_KEYS[1];
+            RemoveFromInner(right, 0);
+
+            g->COUNTS[i] += count;
+            g->COUNTS[i + 1] -= count;
+            return;
+        }
+
+        MergeInners(g, left ? i - 1 : i);
+    }
+
+    void MergeInners(Inner *g, int i) {
+        Inner *left = (Inner *)g->CHILDREN[i];
+        Inner *right = (Inner *)g->CHILDREN[i + 1];
+
+        // right's first child is bounded by the separator of right in g
+        right->SEP_VALUES[0] = g->SEP_VALUES[i + 1];
+        right->SEP_KEYS[0] = g->SEP_KEYS[i + 1];
+
+        for(int k = 0; k < right->COUNT; ++k) {
+            PutIntoInner(left, left->COUNT, right->CHILDREN[k], right->COUNTS[k], right->SEP_VALUES[k], right->SEP_KEYS[k]);
+        }
+
+        g->COUNTS[i] += g->COUNTS[i + 1];
+        RemoveFromInner(g, i + 1);
+        FreeInner(right);
+
+        RebalanceInner(g);
+    }
+
+    bool FindNode(const KEY_TYPE &key, const VALUE_TYPE &value, Cursor &c, unsigned long &rank) {
+        if(!m_root) {
+            return false;
+        }
+
+        Base *b = m_root;
+        unsigned long traversed = 0;
+
+        while(!b->IS_LEAF) {
+            Inner *p = (Inner *)b;
+            int i = ChildOfElement(p, value, key);
+            for(int k = 0; k < i; ++k) {
+                traversed += p->COUNTS[k];
+            }
+            b = p->CHILDREN[i];
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        Leaf *leaf = (Leaf *)b;
+        int slot = SlotOfElement(leaf, value, key);
+
+        if(slot == leaf->COUNT || !value_compare_equal(leaf->VALUES[slot], value) || !key_compare_equal(leaf->NODES[slot]->KEY, key)) {
+            return false;
+        }
+
+        c.LEAF = leaf;
+        c.SLOT = slot;
+        rank = traversed + slot + 1;
+        return true;
+    }
+
+    bool DeleteNode(const KEY_TYPE &key, const VALUE_TYPE &value, Node **out) {
+        Cursor c;
+        unsigned long rank;
+
+        if(!FindNode(key, value, c, rank)) {
+            return false;
+        }
+
+        Node *x = NodeAt(c);
+        RemoveNodeOnly(x);
+
+        if(out) {
+            *out = x;
+        } else {
+            FreeNode(x);
+        }
+
+        return true;
+    }
+
+    Node *UpdateNode(const KEY_TYPE &key, const VALUE_TYPE &value, const VALUE_TYPE &new_value) {
+        Cursor c;
+        unsigned long rank;
+
+        if(!FindNode(key, value, c, rank)) {
+            return NULL;
+        }
+
+        return UpdateNode(NodeAt(c), new_value);
+    }
+
+    void DeleteNode(Node *x) {
+        RemoveNodeOnly(x);
+        FreeNode(x);
+    }
+
+    // an element keeps its slot only between two neighbours of the same leaf, at a leaf's edge the
+    // new value could cross a separator of an ancestor
+    bool UpdateInPlace(Node *x, const VALUE_TYPE &new_value) {
+        Leaf *leaf = x->LEAF;
+        int slot = IndexInLeaf(leaf, x);
+
+        if(slot > 0 && slot + 1 < leaf->COUNT && value_compare_less(leaf->VALUES[slot - 1], new_value) &&
+                value_compare_less(new_value, leaf->VALUES[slot + 1])) {
+            x->VALUE = new_value;
+            leaf->VALUES[slot] = new_value;
+            ZEESET_STATS(m_stats.Add(m_stats.UPDATES_IN_PLACE));
+            return true;
+        }
+
+        return false;
+    }
+
+    Node *UpdateNode(Node *x, const VALUE_TYPE &new_value) {
+        if(UpdateInPlace(x, new_value)) {
+            return x;
+        }
+
+        RemoveNodeOnly(x);
+        x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
+
+        return InsertNodeOnly(x);
+    }
+
+    // slot in the leaf plus the counts of all children left of the path to the root
+    unsigned long GetRankOfNode(Node *x) {
+        Leaf *leaf = x->LEAF;
+        unsigned long rank = IndexInLeaf(leaf, x) + 1;
+
+        for(Base *b = leaf; b->PARENT; b = b->PARENT) {
+            Inner *p = b->PARENT;
+            int i = IndexOfChild(p, b);
+            for(int k = 0; k < i; ++k) {
+                rank += p->COUNTS[k];
+            }
+        }
+
+        return rank;
+    }
+
+    bool CursorOfRank(unsigned long rank, Cursor &c) {
+        if(rank == 0 || rank > m_length) {
+            return false;
+        }
+
+        Base *b = m_root;
+
+        while(!b->IS_LEAF) {
+            Inner *p = (Inner *)b;
+            int i = 0;
+            while(rank > p->COUNTS[i]) {
+                rank -= p->COUNTS[i];
+                ++i;
+            }
+            b = p->CHILDREN[i];
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        c.LEAF = (Leaf *)b;
+        c.SLOT = (int)(rank - 1);
+        return true;
+    }
+
+    Node *GetNodeByRank(unsigned long rank) {
+        Cursor c;
+        return CursorOfRank(rank, c) ? NodeAt(c) : NULL;
+    }
+
+    // first element with VALUE > value (>= value with inclusive)
+    bool CursorOfFirstGreater(const VALUE_TYPE &value, bool inclusive, Cursor &c, unsigned long &rank) {
+        if(!m_root) {
+            return false;
+        }
+
+        Base *b = m_root;
+        unsigned long traversed = 0;
+
+        while(!b->IS_LEAF) {
+            Inner *p = (Inner *)b;
+            int i = ChildOfValue(p, value, inclusive);
+            for(int k = 0; k < i; ++k) {
+                traversed += p->COUNTS[k];
+            }
+            b = p->CHILDREN[i];
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        Leaf *leaf = (Leaf *)b;
+        int slot = SlotOfValue(leaf, value, inclusive);
+
+        if(slot == leaf->COUNT) {
+            traversed += leaf->COUNT;
+            leaf = leaf->NEXT;
+            slot = 0;
+
+            if(!leaf) {
+                return false;
+            }
+        }
+
+        c.LEAF = leaf;
+        c.SLOT = slot;
+        rank = traversed + slot + 1;
+        return true;
+    }
+
+    // last element with VALUE < value (<= value with inclusive), the one before the first that is not
+    bool CursorOfLastLess(const VALUE_TYPE &value, bool inclusive, Cursor &c, unsigned long &rank) {
+        if(CursorOfFirstGreater(value, !inclusive, c, rank)) {
+            --rank;
+            return StepBackward(c);
+        }
+
+        if(!m_last) {
+            return false;
+        }
+
+        c.LEAF = m_last;
+        c.SLOT = m_last->COUNT - 1;
+        rank = m_length;
+        return true;
+    }
+
+    Node *GetNodeOfFirstGreaterValue(const VALUE_TYPE &value, unsigned long *rank) {
+        Cursor c;
+        unsigned long r;
+
+        if(!CursorOfFirstGreater(value, false, c, r)) {
+            return NULL;
+        }
+
+        if(rank) {
+            *rank = r;
+        }
+        return NodeAt(c);
+    }
+
+    Node *GetNodeOfFirstGreaterEqualValue(const VALUE_TYPE &value, unsigned long *rank) {
+        Cursor c;
+        unsigned long r;
+
+        if(!CursorOfFirstGreater(value, true, c, r)) {
+            return NULL;
+        }
+
+        if(rank) {
+            *rank = r;
+        }
+        return NodeAt(c);
+    }
+
+    Node *GetNodeOfLastLessValue(const VALUE_TYPE &value, unsigned long *rank) {
+        Cursor c;
+        unsigned long r;
+
+        if(!CursorOfLastLess(value, false, c, r)) {
+            return NULL;
+        }
+
+        if(rank) {
+            *rank = r;
+        }
+        return NodeAt(c);
+    }
+
+    Node *GetNodeOfLastLessEqualValue(const VALUE_TYPE &value, unsigned long *rank) {
+        Cursor c;
+        unsigned long r;
+
+        if(!CursorOfLastLess(value, true, c, r)) {
+            return NULL;
+        }
+
+        if(rank) {
+            *rank = r;
+        }
+        return NodeAt(c);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void GetNodeByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        Cursor c;
+
+        if(rank_low > rank_high || !CursorOfRank(rank_low, c)) {
+            return;
+        }
+
+        for(unsigned long rank = rank_low; ; ++rank) {
+            cb(rank, NodeAt(c));
+
+            if(rank == rank_high || !StepForward(c)) {
+                break;
+            }
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void ForeachNode(Function cb) {
+        unsigned long n = 0;
+
+        for(Leaf *leaf = m_first; leaf; leaf = leaf->NEXT) {
+            for(int i = 0; i < leaf->COUNT; ++i) {
+                cb(++n, leaf->NODES[i]);
+            }
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void ForeachNodeReverse(Function cb) {
+        unsigned long n = m_length;
+
+        for(Leaf *leaf = m_last; leaf; leaf = leaf->PREV) {
+            for(int i = leaf->COUNT - 1; i >= 0; --i) {
+                cb(n--, leaf->NODES[i]);
+            }
+        }
+    }
+
+    // cb sees each node after it is unlinked and before it is freed
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void DeleteNodeByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        Cursor c;
+
+        if(rank_low > rank_high || !CursorOfRank(rank_low ? rank_low : 1, c)) {
+            return;
+        }
+
+        unsigned long count = rank_high - rank_low + 1;
+        unsigned long n = 0;
+        Node *x = NodeAt(c);
+
+        // removals rebalance leaves, so the next element is held by its handle, not by a cursor
+        while(x && n < count) {
+            Node *next = StepForward(c) ? NodeAt(c) : NULL;
+            RemoveNodeOnly(x);
+            cb(rank_low + n, x);
+            FreeNode(x);
+
+            x = next;
+            if(x) {
+                c.LEAF = x->LEAF;
+                c.SLOT = IndexInLeaf(x->LEAF, x);
+            }
+            n++;
+        }
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachNearby(Cursor c, unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        pick_cb(rank, NodeAt(c)->KEY, NodeAt(c)->VALUE);
+
+        {
+            Cursor y = c;
+            unsigned long r = rank - 1;
+
+            while(lower_count && StepBackward(y)) {
+                if(pick_cb(r, NodeAt(y)->KEY, NodeAt(y)->VALUE)) {
+                    --lower_count;
+                }
+                --r;
+            }
+        }
+
+        {
+            Cursor y = c;
+            unsigned long r = rank + 1;
+
+            while(upper_count && StepForward(y)) {
+                if(pick_cb(r, NodeAt(y)->KEY, NodeAt(y)->VALUE)) {
+                    --upper_count;
+                }
+                ++r;
+            }
+        }
+    }
+
+    // number of nodes to spread n children (elements) over, so that every node holds at least
+    // MIN_FILL and about BUILD_FILL of them
+    static size_t GroupCount(size_t n) {
+        size_t groups = (n + BUILD_FILL - 1) / BUILD_FILL;
+
+        while(groups > 1 && n / groups < (size_t)MIN_FILL) {
+            --groups;
+        }
+
+        return groups;
+    }
+
+    // lays out nodes, sorted by (VALUE, KEY), as a new tree, the tree must hold no tree node
+    void BuildFromNodes(const std::vector<Node *> &nodes) {
+        std::vector<Base *> level;
+        size_t n = nodes.size();
+        size_t groups = GroupCount(n);
+        size_t pos = 0;
+
+        for(size_t g = 0; g < groups; ++g) {
+            Leaf *leaf = CreateLeaf();
+            size_t size = n / groups + (g < n % groups ? 1 : 0);
+
+            for(size_t i = 0; i < size; ++i) {
+                Node *x = nodes[pos++];
+                leaf->VALUES[i] = x->VALUE;
+                leaf->NODES[i] = x;
+                x->LEAF = leaf;
+            }
+            leaf->COUNT = (int)size;
+
+            if(m_last) {
+                m_last->NEXT = leaf;
+                leaf->PREV = m_last;
+            } else {
+                m_first = leaf;
+            }
+            m_last = leaf;
+
+            level.push_back(leaf);
+        }
+
+        while(level.size() > 1) {
+            std::vector<Base *> parents;
+            n = level.size();
+            groups = GroupCount(n);
+            pos = 0;
+
+            for(size_t g = 0; g < groups; ++g) {
+                Inner *p = CreateInner();
+                size_t size = n / groups + (g < n % groups ? 1 : 0);
+
+                for(size_t i = 0; i < size; ++i) {
+                    Base *child = level[pos++];
+                    Node *first = FirstNodeOf(child);
+                    PutIntoInner(p, (int)i, child, CountOf(child), first->VALUE, first->KEY);
+                }
+
+                parents.push_back(p);
+            }
+
+            level.swap(parents);
+        }
+
+        m_root = level.empty() ? NULL : level[0];
+        m_length = nodes.size();
+    }
+
+public:
+    Node *Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_INSERT));
+        return InsertNode(key, value);
+    }
+
+    bool Delete(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
+        return DeleteNode(key, value, NULL);
+    }
+
+    bool Update(const KEY_TYPE &key, const VALUE_TYPE &value, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
+        return UpdateNode(key, value, new_value) != NULL;
+    }
+
+    // x is a handle returned by Insert/UpdateByNode, no search from the root is needed
+    void DeleteByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
+        DeleteNode(x);
+    }
+
+    // returns x, the handle is re-linked but never re-allocated
+    Node *UpdateByNode(Node *x, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
+        return UpdateNode(x, new_value);
+    }
+
+    // ranks[i] receives the rank of nodes[i]
+    void GetRanksByNodes(Node **nodes, size_t count, unsigned long *ranks) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            ranks[i] = GetRankOfNode(nodes[i]);
+        }
+    }
+
+    // batch updates, same contract as ZeeSkiplist::CreateUnlinked
+    Node *CreateUnlinked(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return CreateNode(key, value);
+    }
+
+    // sets new_value in place and returns NULL if x keeps its slot, otherwise unlinks x,
+    // sets new_value and returns x, which must then be passed to InsertSortedByNodes
+    Node *UnlinkForUpdate(Node *x, const VALUE_TYPE &new_value) {
+        if(UpdateInPlace(x, new_value)) {
+            return NULL;
+        }
+
+        RemoveNodeOnly(x);
+        x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
+
+        return x;
+    }
+
+    // nodes must be unlinked, distinct and sorted by (VALUE, KEY)
+    void InsertSortedByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            InsertNodeOnly(nodes[i]);
+        }
+    }
+
+    void DeleteByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            DeleteNode(nodes[i]);
+        }
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        Cursor c;
+        unsigned long rank;
+        return FindNode(key, value, c, rank) ? rank : 0;
+    }
+
+    // ranks are exact here, *error (if given) is always 0
+    unsigned long GetApproxRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value, unsigned long max_error, unsigned long *error) {
+        if(error) {
+            *error = 0;
+        }
+
+        return GetRankOfElement(key, value);
+    }
+
+    // node of rank 1 (NULL if empty), the following ones are reached through Next
+    Node *First() {
+        return m_first ? m_first->NODES[0] : NULL;
+    }
+
+    // NULL after the last node
+    Node *Next(Node *x) {
+        Cursor c = {x->LEAF, IndexInLeaf(x->LEAF, x)};
+        return StepForward(c) ? NodeAt(c) : NULL;
+    }
+
+    unsigned long GetRankByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        return GetRankOfNode(x);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BY_RANK));
+        Node *n = GetNodeByRank(rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_RANK));
+        GetNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n) {
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
+        ForeachNode([cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsReverse(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
+        ForeachNodeReverse([cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_RANK));
+        DeleteNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Node *n = GetNodeOfFirstGreaterValue(v, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Node *n = GetNodeOfFirstGreaterEqualValue(v, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Node *n = GetNodeOfLastLessValue(v, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Node *n = GetNodeOfLastLessEqualValue(v, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_VALUE));
+        Cursor c, last;
+        unsigned long rank, rank2;
+
+        if(!CursorOfFirstGreater(v_low, include_v_low, c, rank) || !CursorOfLastLess(v_high, include_v_high, last, rank2)) {
+            return;
+        }
+
+        while(rank <= rank2) {
+            cb(rank, NodeAt(c)->KEY, NodeAt(c)->VALUE);
+            StepForward(c);
+            ++rank;
+        }
+    }
+
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_COUNT_RANGED_VALUE));
+        Cursor c, last;
+        unsigned long rank, rank2;
+
+        if(!CursorOfFirstGreater(v_low, include_v_low, c, rank) || !CursorOfLastLess(v_high, include_v_high, last, rank2)) {
+            return 0;
+        }
+
+        return rank <= rank2 ? rank2 - rank + 1 : 0;
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_VALUE));
+        Cursor c, last;
+        unsigned long rank, rank2;
+
+        if(!CursorOfFirstGreater(v_low, include_v_low, c, rank) || !CursorOfLastLess(v_high, include_v_high, last, rank2)) {
+            return;
+        }
+
+        DeleteNodeByRangedRank(rank, rank2, [cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_RANK));
+        Cursor c;
+
+        if(CursorOfRank(rank, c)) {
+            ForeachNearby(c, rank, lower_count, upper_count, pick_cb);
+        }
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_VALUE));
+        Cursor c;
+        unsigned long rank = 0;
+
+        if(CursorOfFirstGreater(value, true, c, rank) || CursorOfLastLess(value, true, c, rank)) {
+            ForeachNearby(c, rank, lower_count, upper_count, pick_cb);
+        }
+    }
+
+    std::string DumpLevels() {
+        std::ostringstream ss;
+        unsigned long i = 0;
+        int height = 0;
+
+        for(Base *b = m_root; b; b = b->IS_LEAF ? NULL : ((Inner *)b)->CHILDREN[0]) {
+            ++height;
+        }
+
+        for(Leaf *leaf = m_first; leaf; leaf = leaf->NEXT) {
+            ss << "(" << ++i << ") " << leaf << ":";
+
+            for(int k = 0; k < leaf->COUNT; ++k) {
+                ss << " [" << leaf->NODES[k]->KEY << "]" << "=" << leaf->VALUES[k];
+            }
+
+            ss << "\n";
+        }
+
+        ss << "(sumary) " << "[height]=" << height << ", " << "[leaves]=" << m_leaves << ", " << "[length]=" << m_length;
+
+        return ss.str();
+    }
+
+    bool TestSelf() {
+        if(!m_root) {
+            return m_length == 0 && !m_first && !m_last;
+        }
+
+        Node *prev = NULL;
+        Leaf *prev_leaf = NULL;
+        int leaf_depth = -1;
+        unsigned long count = 0;
+
+        if(m_root->PARENT || !TestSubtree(m_root, 0, prev, prev_leaf, leaf_depth, count)) {
+            return false;
+        }
+
+        return prev_leaf == m_last && count == m_length;
+    }
+
+private:
+    // walks b in order, prev is the last element seen before it and prev_leaf its leaf
+    bool TestSubtree(Base *b, int depth, Node *&prev, Leaf *&prev_leaf, int &leaf_depth, unsigned long &count) {
+        bool root = b == m_root;
+
+        if(b->COUNT > FANOUT || b->COUNT < (root ? 1 : MIN_FILL)) {
+            return false;
+        }
+
+        if(b->IS_LEAF) {
+            Leaf *leaf = (Leaf *)b;
+
+            if(leaf_depth >= 0 && leaf_depth != depth) {
+                return false;
+            }
+            leaf_depth = depth;
+
+            if(leaf->PREV != prev_leaf || (prev_leaf ? prev_leaf->NEXT != leaf : m_first != leaf)) {
+                return false;
+            }
+            prev_leaf = leaf;
+
+            for(int i = 0; i < leaf->COUNT; ++i) {
+                Node *x = leaf->NODES[i];
+
+                if(x->LEAF != leaf || !(leaf->VALUES[i] == x->VALUE)) {
+                    return false;
+                }
+
+                if(prev && !(prev->VALUE < x->VALUE || (prev->VALUE == x->VALUE && prev->KEY < x->KEY))) {
+                    return false;
+                }
+
+                prev = x;
+            }
+
+            count += leaf->COUNT;
+            return true;
+        }
+
+        Inner *p = (Inner *)b;
+
+        if(root && p->COUNT < 2) {
+            return false;
+        }
+
+        for(int i = 0; i < p->COUNT; ++i) {
+            Base *child = p->CHILDREN[i];
+            unsigned long before = count;
+
+            if(child->PARENT != p) {
+                return false;
+            }
+
+            if(i > 0) {
+                const VALUE_TYPE &sv = p->SEP_VALUES[i];
+                const KEY_TYPE &sk = p->SEP_KEYS[i];
+                Node *first = FirstNodeOf(child);
+
+                // prev < separator <= first
+                if(!(prev->VALUE < sv || (prev->VALUE == sv && prev->KEY < sk))) {
+                    return false;
+                }
+
+                if(first->VALUE < sv || (first->VALUE == sv && first->KEY < sk)) {
+                    return false;
+                }
+            }
+
+            if(!TestSubtree(child, depth + 1, prev, prev_leaf, leaf_depth, count) || count - before != p->COUNTS[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+public:
+    // replaces all elements with [begin, end) of std::pair<KEY_TYPE, VALUE_TYPE>, which must be sorted by
+    // (value, key) with unique keys, nodes are packed BUILD_FILL to a leaf in O(n)
+    template<typename Iterator, typename Function> /* std::function<void(Node *)> */
+    void BuildFromSorted(Iterator begin, Iterator end, Function on_node) {
+        BuildFromSorted([&begin, &end](KEY_TYPE &key, VALUE_TYPE &value) -> bool {
+                    if(begin == end) {
+                        return false;
+                    }
+
+                    key = begin->first;
+                    value = begin->second;
+                    ++begin;
+                    return true;
+                }, on_node);
+    }
+
+    // same as above, elements are pulled from produce until it returns false,
+    // on_node sees every node before the tree is laid out
+    template<typename Producer, typename Function> /* std::function<bool(KEY_TYPE &key, VALUE_TYPE &value)>, std::function<void(Node *)> */
+    void BuildFromSorted(Producer produce, Function on_node) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BUILD));
+        Clear();
+
+        std::vector<Node *> nodes;
+        KEY_TYPE key;
+        VALUE_TYPE value;
+
+        while(produce(key, value)) {
+            Node *x = CreateNode(std::move(key), std::move(value));
+            nodes.push_back(x);
+            on_node(x);
+        }
+
+        BuildFromNodes(nodes);
+    }
+
+    // bytes held by handles and tree nodes
+    size_t NodesMemory() {
+        return m_length * sizeof(Node) + m_leaves * sizeof(Leaf) + m_inners * sizeof(Inner);
+    }
+
+    // bytes per element with every leaf full, inner nodes excluded
+    static size_t FixedNodeSize() {
+        return sizeof(Node) + sizeof(Leaf) / FANOUT;
+    }
+
+    // any value can be held
+    static bool InRange(const VALUE_TYPE &value) {
+        return true;
+    }
+
+    // re-lays out the tree with BUILD_FILL elements per node in one O(n) sweep,
+    // with relocate every handle is re-allocated in rank order so that range scans walk memory sequentially
+    void Optimize(bool relocate = false) {
+        Optimize(relocate, [](Node *n) {});
+    }
+
+    // on_relocate is called with every new handle (only with relocate)
+    template<typename Function> /* std::function<void(Node *)> */
+    void Optimize(bool relocate, Function on_relocate) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_OPTIMIZE));
+        std::vector<Node *> nodes;
+        nodes.reserve(m_length);
+
+        ForeachNode([&nodes](unsigned long rank, Node *n) {
+                    nodes.push_back(n);
+                });
+
+        FreeTree(m_root);
+        m_root = NULL;
+        m_first = NULL;
+        m_last = NULL;
+
+        if(relocate) {
+            std::vector<Node *> old_nodes;
+            old_nodes.swap(nodes);
+            nodes.reserve(old_nodes.size());
+
+            // old handles are kept until all new ones are allocated, so new ones don't reuse their holes
+            for(Node *x: old_nodes) {
+                Node *y = CreateNode(std::move(x->KEY), std::move(x->VALUE));
+                nodes.push_back(y);
+                on_relocate(y);
+            }
+
+            for(Node *x: old_nodes) {
+                FreeNode(x);
+            }
+        }
+
+        BuildFromNodes(nodes);
+    }
+};
+
+#endif
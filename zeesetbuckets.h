@@ -0,0 +1,994 @@
+#ifndef __ZEESETBUCKETS_H__
+#define __ZEESETBUCKETS_H__
+
+#include "zeeset.h"
+
+// Engine for integral scores, a drop-in for ZeeSet:
+//
+//     ZeeSet<K, unsigned, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeScoreBuckets<K, unsigned>>
+//
+// Elements sharing a score form a bucket kept sorted by key (same order as ZeeSkiplist), and a
+// Fenwick tree over the score range counts the elements of every score. Rank of a score, element at
+// a rank and counts of value ranges are O(log range) prefix sums over that tree, no element is
+// compared; changing an element's score moves it between two buckets and adjusts two counts.
+//
+// Scores must lie in [MinValue, MaxValue]: ZeeSet refuses others (Update returns false) and the
+// engine asserts it as a backstop. The tree spans MinValue up to the highest score seen, rounded up
+// to a power of two, at 4 bytes a score (a 0..10M leaderboard costs 64MB), so MaxValue bounds its
+// memory (64MB by default) and it suits bounded score ranges. Queries may name any score.
+// Inserting into a bucket shifts the keys after it, so heavy ties cost O(bucket size).
+template<typename KeyType, typename ValueType, ValueType MinValue = 0, ValueType MaxValue = (ValueType)(MinValue + 0xffffff),
+    typename Allocator = ZeeDefaultAllocator>
+class ZeeScoreBuckets {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using ALLOCATOR_TYPE = Allocator;
+
+    static constexpr VALUE_TYPE MIN_VALUE = MinValue;
+    static constexpr VALUE_TYPE MAX_VALUE = MaxValue;
+
+    static_assert(std::is_integral<ValueType>::value, "ZeeScoreBuckets needs an integral VALUE_TYPE");
+    static_assert(MinValue <= MaxValue, "ZeeScoreBuckets needs MinValue <= MaxValue");
+
+    // scores the engine can hold, ZeeSet checks them before any mutation
+    static bool InRange(const VALUE_TYPE &value) {
+        return MinValue <= value && value <= MaxValue;
+    }
+
+private:
+    struct Bucket;
+
+public:
+    // elements are handed out as handles (see Insert, UpdateByNode, DeleteByNode),
+    // KEY and VALUE may be read but must only be changed through the engine
+    struct Node {
+        KEY_TYPE KEY;
+        VALUE_TYPE VALUE;
+        Bucket *BUCKET = NULL;
+
+        Node(const KEY_TYPE &key, const VALUE_TYPE &value) :
+            KEY(key), VALUE(value) {}
+
+        Node(KEY_TYPE &&key, VALUE_TYPE &&value) :
+            KEY(std::move(key)), VALUE(std::move(value)) {}
+    };
+
+private:
+    // elements of one score, sorted by key, linked in score order
+    struct Bucket {
+        Bucket *PREV = NULL;
+        Bucket *NEXT = NULL;
+        std::vector<Node *> NODES;
+    };
+
+    // position of an element, valid until the engine changes
+    struct Cursor {
+        Bucket *BUCKET;
+        size_t SLOT;
+        unsigned long RANK;
+    };
+
+    // m_counts[i] sums the counts of indexes (i - lowbit(i), i], index 1 is MinValue,
+    // m_capacity (0 or a power of two) indexes are covered
+    std::vector<uint32_t> m_counts;
+    unsigned long m_capacity = 0;
+    ZeeHashDict<VALUE_TYPE, Bucket *> m_buckets;
+    Bucket *m_first = NULL;
+    Bucket *m_last = NULL;
+    unsigned long m_length = 0;
+
+    Allocator m_allocator;
+
+    ZEESET_STATS(ZeeStatsCounters m_stats;)
+public:
+    ZeeScoreBuckets() = default;
+
+    ~ZeeScoreBuckets() {
+        Clear();
+    }
+
+    ZeeScoreBuckets(const ZeeScoreBuckets &) = delete;
+    ZeeScoreBuckets(ZeeScoreBuckets &&) = delete;
+    ZeeScoreBuckets &operator=(const ZeeScoreBuckets &) = delete;
+    ZeeScoreBuckets &operator=(ZeeScoreBuckets &&) = delete;
+
+    void Clear() {
+        ForeachBucket([this](Bucket *b) {
+                    for(Node *x: b->NODES) {
+                        if(Allocator::RELEASE_ALL) {
+                            x->~Node();
+                        } else {
+                            FreeNode(x);
+                        }
+                    }
+                    delete b;
+                });
+
+        if(Allocator::RELEASE_ALL) {
+            m_allocator.ReleaseAll();
+            ZEESET_STATS(m_stats.AllNodesFreed());
+        }
+
+        std::vector<uint32_t>().swap(m_counts);
+        m_capacity = 0;
+        m_buckets.Clear();
+        m_first = m_last = NULL;
+        m_length = 0;
+    }
+
+    unsigned long Length() {
+        return m_length;
+    }
+
+    unsigned long MaxRank() {
+        return m_length;
+    }
+
+    // zeros unless built with ZEESET_ENABLE_STATS or ZEESET_ENABLE_LATENCY
+    ZeeSetStats GetStats() {
+        ZeeSetStats stats;
+        ZEESET_STATS(m_stats.Snapshot(stats));
+        return stats;
+    }
+
+    // restarts call, traversal, comparison, update and latency counters, memory and heights stay live
+    void ResetStats() {
+        ZEESET_STATS(m_stats.Reset(false));
+    }
+
+private:
+    Node *CreateNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *n = new(m_allocator.Allocate(sizeof(Node))) Node(key, value);
+        ZEESET_STATS(m_stats.NodeAllocated(1, sizeof(Node)));
+        return n;
+    }
+
+    Node *CreateNode(KEY_TYPE &&key, VALUE_TYPE &&value) {
+        Node *n = new(m_allocator.Allocate(sizeof(Node))) Node(std::move(key), std::move(value));
+        ZEESET_STATS(m_stats.NodeAllocated(1, sizeof(Node)));
+        return n;
+    }
+
+    void FreeNode(Node *n) {
+        n->~Node();
+        m_allocator.Deallocate(n, sizeof(Node));
+        ZEESET_STATS(m_stats.NodeFreed(1, sizeof(Node)));
+    }
+
+    bool key_compare_less(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return k1 < k2;
+    }
+
+    bool key_compare_equal(const KEY_TYPE &k1, const KEY_TYPE &k2) {
+        ZEESET_STATS(m_stats.Add(m_stats.COMPARISONS));
+        return k1 == k2;
+    }
+
+    // walks buckets in score order
+    template<typename Function> /* std::function<void(Bucket *)> */
+    void ForeachBucket(Function cb) {
+        for(Bucket *b = m_first; b; ) {
+            // cb may free the bucket
+            Bucket *next = b->NEXT;
+            cb(b);
+            b = next;
+        }
+    }
+
+    // value must be in range, anything else would index outside the tree or make it huge
+    static unsigned long IndexOf(const VALUE_TYPE &value) {
+        assert(InRange(value) && "ZeeScoreBuckets score outside [MinValue, MaxValue]");
+        return (unsigned long)value - (unsigned long)MinValue + 1;
+    }
+
+    static VALUE_TYPE ValueOf(unsigned long index) {
+        return (VALUE_TYPE)(MinValue + (VALUE_TYPE)(index - 1));
+    }
+
+    // covers index by doubling: the counts already there keep their ranges, the new upper half
+    // only adds the one entry spanning everything
+    void Grow(unsigned long index) {
+        if(m_capacity == 0) {
+            m_capacity = 1;
+            m_counts.assign(2, 0);
+        }
+
+        while(m_capacity < index) {
+            m_counts.resize(m_capacity * 2 + 1, 0);
+            m_counts[m_capacity * 2] = (uint32_t)m_length;
+            m_capacity *= 2;
+        }
+    }
+
+    void AddCount(unsigned long index, int delta) {
+        for(; index <= m_capacity; index += index & (~index + 1)) {
+            m_counts[index] += delta;
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+    }
+
+    // elements with an index up to index
+    unsigned long Prefix(unsigned long index) {
+        unsigned long count = 0;
+
+        if(index > m_capacity) {
+            index = m_capacity;
+        }
+
+        for(; index; index -= index & (~index + 1)) {
+            count += m_counts[index];
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        return count;
+    }
+
+    // elements with VALUE < value (<= value with inclusive)
+    unsigned long CountBelow(const VALUE_TYPE &value, bool inclusive) {
+        if(value < MinValue) {
+            return 0;
+        }
+
+        // scores past the tree are above everything held, so no index beyond it is formed
+        unsigned long offset = (unsigned long)value - (unsigned long)MinValue;
+        if(offset >= m_capacity) {
+            return m_length;
+        }
+
+        return Prefix(offset + (inclusive ? 1 : 0));
+    }
+
+    // rank must be in [1, m_length]
+    Cursor CursorOfRank(unsigned long rank) {
+        unsigned long index = 0;
+        unsigned long remain = rank;
+
+        for(unsigned long step = m_capacity; step; step >>= 1) {
+            if(index + step <= m_capacity && m_counts[index + step] < remain) {
+                index += step;
+                remain -= m_counts[index];
+            }
+            ZEESET_STATS(m_stats.Add(m_stats.NODES_TRAVERSED));
+        }
+
+        Cursor c;
+        c.BUCKET = *m_buckets.Find(ValueOf(index + 1));
+        c.SLOT = remain - 1;
+        c.RANK = rank;
+        return c;
+    }
+
+    bool StepForward(Cursor &c) {
+        if(c.RANK == m_length) {
+            return false;
+        }
+
+        if(++c.SLOT == c.BUCKET->NODES.size()) {
+            c.BUCKET = c.BUCKET->NEXT;
+            c.SLOT = 0;
+        }
+        ++c.RANK;
+
+        return true;
+    }
+
+    bool StepBackward(Cursor &c) {
+        if(c.RANK == 1) {
+            return false;
+        }
+
+        if(c.SLOT == 0) {
+            c.BUCKET = c.BUCKET->PREV;
+            c.SLOT = c.BUCKET->NODES.size();
+        }
+        --c.SLOT;
+        --c.RANK;
+
+        return true;
+    }
+
+    static Node *NodeAt(const Cursor &c) {
+        return c.BUCKET->NODES[c.SLOT];
+    }
+
+    // first slot of b whose key is not less than key
+    size_t SlotOfKey(Bucket *b, const KEY_TYPE &key) {
+        size_t low = 0, high = b->NODES.size();
+
+        while(low < high) {
+            size_t mid = (low + high) / 2;
+            if(key_compare_less(b->NODES[mid]->KEY, key)) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        return low;
+    }
+
+    size_t SlotOfNode(Node *x) {
+        return SlotOfKey(x->BUCKET, x->KEY);
+    }
+
+    // links an empty bucket after the last one of a lower score, found by rank before value is counted
+    Bucket *CreateBucket(const VALUE_TYPE &value) {
+        unsigned long below = CountBelow(value, false);
+        Bucket *b = new Bucket();
+
+        b->PREV = below ? CursorOfRank(below).BUCKET : NULL;
+        b->NEXT = b->PREV ? b->PREV->NEXT : m_first;
+        (b->PREV ? b->PREV->NEXT : m_first) = b;
+        (b->NEXT ? b->NEXT->PREV : m_last) = b;
+
+        m_buckets.Set(value, b);
+        return b;
+    }
+
+    void FreeBucket(Bucket *b, const VALUE_TYPE &value) {
+        (b->PREV ? b->PREV->NEXT : m_first) = b->NEXT;
+        (b->NEXT ? b->NEXT->PREV : m_last) = b->PREV;
+
+        m_buckets.Erase(value);
+        delete b;
+    }
+
+    Node *InsertNode(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return InsertNodeOnly(CreateNode(key, value));
+    }
+
+    // links n, which must not be in the engine, so a removed handle can be re-inserted as is
+    Node *InsertNodeOnly(Node *n) {
+        unsigned long index = IndexOf(n->VALUE);
+        Bucket **found = m_buckets.Find(n->VALUE);
+        Bucket *b;
+
+        if(found) {
+            b = *found;
+        } else {
+            b = CreateBucket(n->VALUE);
+        }
+
+        b->NODES.insert(b->NODES.begin() + SlotOfKey(b, n->KEY), n);
+        n->BUCKET = b;
+
+        Grow(index);
+        AddCount(index, 1);
+        ++m_length;
+
+        return n;
+    }
+
+    // unlinks x but keeps the handle
+    void RemoveNodeOnly(Node *x) {
+        Bucket *b = x->BUCKET;
+
+        b->NODES.erase(b->NODES.begin() + SlotOfNode(x));
+        x->BUCKET = NULL;
+
+        if(b->NODES.empty()) {
+            FreeBucket(b, x->VALUE);
+        }
+
+        AddCount(IndexOf(x->VALUE), -1);
+        --m_length;
+    }
+
+    bool FindNode(const KEY_TYPE &key, const VALUE_TYPE &value, Cursor &c) {
+        Bucket **found = InRange(value) ? m_buckets.Find(value) : NULL;
+
+        if(!found) {
+            return false;
+        }
+
+        size_t slot = SlotOfKey(*found, key);
+
+        if(slot == (*found)->NODES.size() || !key_compare_equal((*found)->NODES[slot]->KEY, key)) {
+            return false;
+        }
+
+        c.BUCKET = *found;
+        c.SLOT = slot;
+        c.RANK = CountBelow(value, false) + slot + 1;
+        return true;
+    }
+
+    bool DeleteNode(const KEY_TYPE &key, const VALUE_TYPE &value, Node **out) {
+        Cursor c;
+
+        if(!FindNode(key, value, c)) {
+            return false;
+        }
+
+        Node *x = NodeAt(c);
+        RemoveNodeOnly(x);
+
+        if(out) {
+            *out = x;
+        } else {
+            FreeNode(x);
+        }
+
+        return true;
+    }
+
+    Node *UpdateNode(const KEY_TYPE &key, const VALUE_TYPE &value, const VALUE_TYPE &new_value) {
+        Cursor c;
+        return FindNode(key, value, c) ? UpdateNode(NodeAt(c), new_value) : NULL;
+    }
+
+    void DeleteNode(Node *x) {
+        RemoveNodeOnly(x);
+        FreeNode(x);
+    }
+
+    // the handle moves between buckets, nothing is searched but the two buckets' keys
+    Node *UpdateNode(Node *x, const VALUE_TYPE &new_value) {
+        if(x->VALUE == new_value) {
+            ZEESET_STATS(m_stats.Add(m_stats.UPDATES_IN_PLACE));
+            return x;
+        }
+
+        RemoveNodeOnly(x);
+        x->VALUE = new_value;
+        ZEESET_STATS(m_stats.Add(m_stats.UPDATES_REINSERTED));
+
+        return InsertNodeOnly(x);
+    }
+
+    unsigned long GetRankOfNode(Node *x) {
+        return CountBelow(x->VALUE, false) + SlotOfNode(x) + 1;
+    }
+
+    Node *GetNodeByRank(unsigned long rank) {
+        if(rank == 0 || rank > m_length) {
+            return NULL;
+        }
+
+        return NodeAt(CursorOfRank(rank));
+    }
+
+    // first element with VALUE > value (>= value with inclusive)
+    bool CursorOfFirstGreater(const VALUE_TYPE &value, bool inclusive, Cursor &c) {
+        unsigned long rank = CountBelow(value, !inclusive) + 1;
+
+        if(rank > m_length) {
+            return false;
+        }
+
+        c = CursorOfRank(rank);
+        return true;
+    }
+
+    // last element with VALUE < value (<= value with inclusive)
+    bool CursorOfLastLess(const VALUE_TYPE &value, bool inclusive, Cursor &c) {
+        unsigned long rank = CountBelow(value, inclusive);
+
+        if(rank == 0) {
+            return false;
+        }
+
+        c = CursorOfRank(rank);
+        return true;
+    }
+
+    Node *NodeOfBound(bool found, const Cursor &c, unsigned long *rank) {
+        if(!found) {
+            return NULL;
+        }
+
+        if(rank) {
+            *rank = c.RANK;
+        }
+        return NodeAt(c);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void GetNodeByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        if(rank_low == 0 || rank_low > rank_high || rank_low > m_length) {
+            return;
+        }
+
+        Cursor c = CursorOfRank(rank_low);
+
+        do {
+            cb(c.RANK, NodeAt(c));
+        } while(c.RANK < rank_high && StepForward(c));
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void ForeachNode(Function cb) {
+        unsigned long n = 0;
+
+        ForeachBucket([&cb, &n](Bucket *b) {
+                    for(Node *x: b->NODES) {
+                        cb(++n, x);
+                    }
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void ForeachNodeReverse(Function cb) {
+        unsigned long rank = m_length;
+
+        for(Bucket *b = m_last; b; b = b->PREV) {
+            for(size_t i = b->NODES.size(); i > 0; --i) {
+                cb(rank--, b->NODES[i - 1]);
+            }
+        }
+    }
+
+    // cb sees each node after it is unlinked and before it is freed
+    template<typename Function> /* std::function<void(unsigned long rank, Node *)> */
+    void DeleteNodeByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        if(rank_low > rank_high) {
+            return;
+        }
+
+        // removing an element shifts the ones after it down to the same rank
+        unsigned long rank = rank_low ? rank_low : 1;
+        unsigned long count = rank_high - rank_low + 1;
+
+        for(unsigned long n = 0; n < count && rank <= m_length; ++n) {
+            Node *x = NodeAt(CursorOfRank(rank));
+            RemoveNodeOnly(x);
+            cb(rank_low + n, x);
+            FreeNode(x);
+        }
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachNearby(Cursor c, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        pick_cb(c.RANK, NodeAt(c)->KEY, NodeAt(c)->VALUE);
+
+        {
+            Cursor y = c;
+
+            while(lower_count && StepBackward(y)) {
+                if(pick_cb(y.RANK, NodeAt(y)->KEY, NodeAt(y)->VALUE)) {
+                    --lower_count;
+                }
+            }
+        }
+
+        {
+            Cursor y = c;
+
+            while(upper_count && StepForward(y)) {
+                if(pick_cb(y.RANK, NodeAt(y)->KEY, NodeAt(y)->VALUE)) {
+                    --upper_count;
+                }
+            }
+        }
+    }
+
+public:
+    Node *Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_INSERT));
+        return InsertNode(key, value);
+    }
+
+    bool Delete(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
+        return DeleteNode(key, value, NULL);
+    }
+
+    bool Update(const KEY_TYPE &key, const VALUE_TYPE &value, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
+        return UpdateNode(key, value, new_value) != NULL;
+    }
+
+    // x is a handle returned by Insert/UpdateByNode, no search is needed
+    void DeleteByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE));
+        DeleteNode(x);
+    }
+
+    // returns x, the handle is moved but never re-allocated
+    Node *UpdateByNode(Node *x, const VALUE_TYPE &new_value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE));
+        return UpdateNode(x, new_value);
+    }
+
+    // ranks[i] receives the rank of nodes[i]
+    void GetRanksByNodes(Node **nodes, size_t count, unsigned long *ranks) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            ranks[i] = GetRankOfNode(nodes[i]);
+        }
+    }
+
+    // batch updates, same contract as ZeeSkiplist::CreateUnlinked
+    Node *CreateUnlinked(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return CreateNode(key, value);
+    }
+
+    // moving between buckets costs no more inside a batch than outside, so x is always moved
+    // right away and NULL returned
+    Node *UnlinkForUpdate(Node *x, const VALUE_TYPE &new_value) {
+        UpdateNode(x, new_value);
+        return NULL;
+    }
+
+    // nodes must be unlinked and distinct
+    void InsertSortedByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_UPDATE_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            InsertNodeOnly(nodes[i]);
+        }
+    }
+
+    void DeleteByNodes(Node **nodes, size_t count) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_BATCH));
+        for(size_t i = 0; i < count; ++i) {
+            DeleteNode(nodes[i]);
+        }
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        Cursor c;
+        return FindNode(key, value, c) ? c.RANK : 0;
+    }
+
+    // ranks are exact here, *error (if given) is always 0
+    unsigned long GetApproxRankOfElement(const KEY_TYPE &key, const VALUE_TYPE &value, unsigned long max_error, unsigned long *error) {
+        if(error) {
+            *error = 0;
+        }
+
+        return GetRankOfElement(key, value);
+    }
+
+    // node of rank 1 (NULL if empty), the following ones are reached through Next
+    Node *First() {
+        return GetNodeByRank(1);
+    }
+
+    // NULL after the last node
+    Node *Next(Node *x) {
+        size_t slot = SlotOfNode(x);
+
+        if(slot + 1 < x->BUCKET->NODES.size()) {
+            return x->BUCKET->NODES[slot + 1];
+        }
+
+        return x->BUCKET->NEXT ? x->BUCKET->NEXT->NODES[0] : NULL;
+    }
+
+    unsigned long GetRankByNode(Node *x) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANK));
+        return GetRankOfNode(x);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BY_RANK));
+        Node *n = GetNodeByRank(rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_RANK));
+        GetNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n) {
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
+        ForeachNode([cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsReverse(Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_FOREACH));
+        ForeachNodeReverse([cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<void(unsigned long, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_RANK));
+        DeleteNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Cursor c;
+        Node *n = NodeOfBound(CursorOfFirstGreater(v, false, c), c, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Cursor c;
+        Node *n = NodeOfBound(CursorOfFirstGreater(v, true, c), c, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Cursor c;
+        Node *n = NodeOfBound(CursorOfLastLess(v, false, c), c, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BOUND_VALUE));
+        Cursor c;
+        Node *n = NodeOfBound(CursorOfLastLess(v, true, c), c, rank);
+
+        if(n) {
+            key = n->KEY;
+            value = n->VALUE;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_RANGED_VALUE));
+        unsigned long rank_high = CountBelow(v_high, include_v_high);
+
+        GetNodeByRangedRank(CountBelow(v_low, !include_v_low) + 1, rank_high, [cb](unsigned long rank, Node *n) {
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    // two prefix sums, no element is visited
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_COUNT_RANGED_VALUE));
+        unsigned long below = CountBelow(v_low, !include_v_low);
+        unsigned long upto = CountBelow(v_high, include_v_high);
+
+        return upto > below ? upto - below : 0;
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_DELETE_RANGED_VALUE));
+        unsigned long rank_low = CountBelow(v_low, !include_v_low) + 1;
+        unsigned long rank_high = CountBelow(v_high, include_v_high);
+
+        if(rank_low > rank_high) {
+            return;
+        }
+
+        DeleteNodeByRangedRank(rank_low, rank_high, [cb](unsigned long rank, Node *n){
+                    cb(rank, n->KEY, n->VALUE);
+                });
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_RANK));
+
+        if(rank > 0 && rank <= m_length) {
+            ForeachNearby(CursorOfRank(rank), lower_count, upper_count, pick_cb);
+        }
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_NEARBY_VALUE));
+        Cursor c;
+
+        if(CursorOfFirstGreater(value, true, c) || CursorOfLastLess(value, true, c)) {
+            ForeachNearby(c, lower_count, upper_count, pick_cb);
+        }
+    }
+
+    std::string DumpLevels() {
+        std::ostringstream ss;
+
+        ForeachBucket([&ss](Bucket *b) {
+                    ss << "(" << b->NODES[0]->VALUE << ")";
+
+                    for(Node *x: b->NODES) {
+                        ss << " [" << x->KEY << "]";
+                    }
+
+                    ss << "\n";
+                });
+
+        ss << "(sumary) " << "[buckets]=" << m_buckets.Size() << ", " << "[capacity]=" << m_capacity << ", " << "[length]=" << m_length;
+
+        return ss.str();
+    }
+
+    bool TestSelf() {
+        size_t buckets = 0;
+        unsigned long count = 0;
+        bool ok = !m_first == !m_last && (!m_first || (!m_first->PREV && !m_last->NEXT));
+
+        ForeachBucket([this, &buckets, &count, &ok](Bucket *b) {
+                    ok = ok && !b->NODES.empty() && (!b->NEXT || (b->NEXT->PREV == b && b->NODES[0]->VALUE < b->NEXT->NODES[0]->VALUE));
+
+                    VALUE_TYPE value = b->NODES[0]->VALUE;
+                    Bucket **found = m_buckets.Find(value);
+                    unsigned long index = IndexOf(value);
+
+                    ok = ok && found && *found == b && Prefix(index) - Prefix(index - 1) == b->NODES.size();
+
+                    for(size_t i = 0; i < b->NODES.size(); ++i) {
+                        Node *x = b->NODES[i];
+                        ok = ok && x->BUCKET == b && x->VALUE == value && (i == 0 || b->NODES[i - 1]->KEY < x->KEY);
+                    }
+
+                    ++buckets;
+                    count += b->NODES.size();
+                });
+
+        return ok && buckets == m_buckets.Size() && count == m_length && Prefix(m_capacity) == m_length &&
+            (!m_length || CursorOfRank(m_length).BUCKET == m_last);
+    }
+
+    // replaces all elements with [begin, end) of std::pair<KEY_TYPE, VALUE_TYPE>, which must be sorted by
+    // (value, key) with unique keys, each bucket is filled in key order without searching
+    template<typename Iterator, typename Function> /* std::function<void(Node *)> */
+    void BuildFromSorted(Iterator begin, Iterator end, Function on_node) {
+        BuildFromSorted([&begin, &end](KEY_TYPE &key, VALUE_TYPE &value) -> bool {
+                    if(begin == end) {
+                        return false;
+                    }
+
+                    key = begin->first;
+                    value = begin->second;
+                    ++begin;
+                    return true;
+                }, on_node);
+    }
+
+    // same as above, elements are pulled from produce until it returns false
+    template<typename Producer, typename Function> /* std::function<bool(KEY_TYPE &key, VALUE_TYPE &value)>, std::function<void(Node *)> */
+    void BuildFromSorted(Producer produce, Function on_node) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_BUILD));
+        Clear();
+
+        KEY_TYPE key;
+        VALUE_TYPE value;
+        Bucket *b = NULL;
+
+        while(produce(key, value)) {
+            Node *x = CreateNode(std::move(key), std::move(value));
+
+            // scores arrive ascending, so every new bucket goes last
+            if(!b || !(b->NODES[0]->VALUE == x->VALUE)) {
+                b = new Bucket();
+                b->PREV = m_last;
+                (m_last ? m_last->NEXT : m_first) = b;
+                m_last = b;
+                m_buckets.Set(x->VALUE, b);
+            }
+
+            b->NODES.push_back(x);
+            x->BUCKET = b;
+
+            unsigned long index = IndexOf(x->VALUE);
+            Grow(index);
+            AddCount(index, 1);
+            ++m_length;
+
+            on_node(x);
+        }
+    }
+
+    // bytes held by handles, buckets and the count tree
+    size_t NodesMemory() {
+        size_t bytes = m_length * sizeof(Node) + m_counts.capacity() * sizeof(uint32_t);
+
+        ForeachBucket([&bytes](Bucket *b) {
+                    bytes += sizeof(Bucket) + b->NODES.capacity() * sizeof(Node *);
+                });
+
+        return bytes;
+    }
+
+    // bytes per element with one element a score, the count tree excluded
+    static size_t FixedNodeSize() {
+        return sizeof(Node) + sizeof(Bucket) + sizeof(Node *);
+    }
+
+    // trims buckets and shrinks the count tree to the highest score held,
+    // with relocate every handle is re-allocated in rank order
+    void Optimize(bool relocate = false) {
+        Optimize(relocate, [](Node *n) {});
+    }
+
+    // on_relocate is called with every new handle (only with relocate)
+    template<typename Function> /* std::function<void(Node *)> */
+    void Optimize(bool relocate, Function on_relocate) {
+        ZEESET_STATS(ZeeStatsScope stats_scope(m_stats, ZeeSetStats::OP_OPTIMIZE));
+        std::vector<Node *> old_nodes;
+
+        ForeachBucket([this, relocate, &on_relocate, &old_nodes](Bucket *b) {
+                    b->NODES.shrink_to_fit();
+
+                    if(!relocate) {
+                        return;
+                    }
+
+                    // old handles are kept until all new ones are allocated, so new ones don't reuse their holes
+                    for(Node *&x: b->NODES) {
+                        Node *y = CreateNode(std::move(x->KEY), std::move(x->VALUE));
+                        y->BUCKET = b;
+                        old_nodes.push_back(x);
+                        x = y;
+                        on_relocate(y);
+                    }
+                });
+
+        for(Node *x: old_nodes) {
+            FreeNode(x);
+        }
+
+        // counts are rebuilt in O(capacity): each index passes its sum to the one covering it next
+        unsigned long top = m_last ? IndexOf(m_last->NODES[0]->VALUE) : 0;
+        std::vector<uint32_t> counts;
+        unsigned long capacity = 0;
+
+        if(top) {
+            capacity = 1;
+            while(capacity < top) {
+                capacity *= 2;
+            }
+
+            counts.assign(capacity + 1, 0);
+            ForeachBucket([&counts](Bucket *b) {
+                        counts[IndexOf(b->NODES[0]->VALUE)] = (uint32_t)b->NODES.size();
+                    });
+
+            for(unsigned long i = 1; i <= capacity; ++i) {
+                unsigned long parent = i + (i & (~i + 1));
+                if(parent <= capacity) {
+                    counts[parent] += counts[i];
+                }
+            }
+        }
+
+        m_counts.swap(counts);
+        m_capacity = capacity;
+    }
+};
+
+#endif
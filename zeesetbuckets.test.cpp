@@ -0,0 +1,294 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <functional>
+#include "zeesetbuckets.h"
+
+using SkiplistSet = ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+using Element = std::tuple<unsigned long, unsigned, unsigned long>;
+using Callback = std::function<void(unsigned long, const unsigned &, const unsigned long &)>;
+
+template<typename SetType>
+static std::vector<Element> Elements(SetType &rank) {
+    std::vector<Element> elements;
+    rank.ForeachElements([&elements](unsigned long n, const unsigned &key, const unsigned long &value) {
+                elements.emplace_back(n, key, value);
+            });
+    return elements;
+}
+
+// every query of the bucketed set must answer as the skiplist set does
+template<typename SetType>
+static bool SameAnswers(SkiplistSet &expected, SetType &rank, std::mt19937 &rng, unsigned keys, unsigned values) {
+    if(Elements(expected) != Elements(rank) || expected.Length() != rank.Length()) {
+        return false;
+    }
+
+    std::vector<Element> reversed_expected, reversed;
+    expected.ForeachElementsReverse([&reversed_expected](unsigned long n, const unsigned &key, const unsigned long &value) {
+                reversed_expected.emplace_back(n, key, value);
+            });
+    rank.ForeachElementsReverse([&reversed](unsigned long n, const unsigned &key, const unsigned long &value) {
+                reversed.emplace_back(n, key, value);
+            });
+    if(reversed_expected != reversed) {
+        return false;
+    }
+
+    for(unsigned i = 0; i < 50; ++i) {
+        unsigned key = rng() % keys;
+        unsigned long value = rng() % values;
+        unsigned long r = rng() % (expected.Length() + 2);
+
+        if(expected.GetRankOfElement(key) != rank.GetRankOfElement(key)) {
+            return false;
+        }
+
+        unsigned k1 = 0, k2 = 0;
+        unsigned long v1 = 0, v2 = 0, r1 = 0, r2 = 0;
+
+        if(expected.GetElementByRank(r, k1, v1) != rank.GetElementByRank(r, k2, v2) || k1 != k2 || v1 != v2) {
+            return false;
+        }
+
+        if(expected.GetElementOfFirstGreaterValue(value, k1, v1, &r1) != rank.GetElementOfFirstGreaterValue(value, k2, v2, &r2) ||
+                k1 != k2 || v1 != v2 || r1 != r2) {
+            return false;
+        }
+
+        if(expected.GetElementOfFirstGreaterEqualValue(value, k1, v1, &r1) != rank.GetElementOfFirstGreaterEqualValue(value, k2, v2, &r2) ||
+                k1 != k2 || v1 != v2 || r1 != r2) {
+            return false;
+        }
+
+        if(expected.GetElementOfLastLessValue(value, k1, v1, &r1) != rank.GetElementOfLastLessValue(value, k2, v2, &r2) ||
+                k1 != k2 || v1 != v2 || r1 != r2) {
+            return false;
+        }
+
+        if(expected.GetElementOfLastLessEqualValue(value, k1, v1, &r1) != rank.GetElementOfLastLessEqualValue(value, k2, v2, &r2) ||
+                k1 != k2 || v1 != v2 || r1 != r2) {
+            return false;
+        }
+
+        unsigned long high = value + rng() % 20;
+        unsigned long r_high = r + rng() % 40;
+        bool include_low = rng() % 2, include_high = rng() % 2;
+
+        if(expected.GetElementsCountByRangedValue(value, include_low, high, include_high) !=
+                rank.GetElementsCountByRangedValue(value, include_low, high, include_high)) {
+            return false;
+        }
+
+        std::vector<Element> a, b;
+        auto collect = [](std::vector<Element> &out) {
+            return [&out](unsigned long n, const unsigned &key, const unsigned long &value) {
+                out.emplace_back(n, key, value);
+            };
+        };
+        auto pick = [](std::vector<Element> &out) {
+            return [&out](unsigned long n, const unsigned &key, const unsigned long &value) -> bool {
+                out.emplace_back(n, key, value);
+                return key % 3 != 0;
+            };
+        };
+
+        expected.GetElementsByRangedValue(value, include_low, high, include_high, collect(a));
+        rank.GetElementsByRangedValue(value, include_low, high, include_high, collect(b));
+        expected.GetElementsByRangedRank(r, r_high, collect(a));
+        rank.GetElementsByRangedRank(r, r_high, collect(b));
+        if(a != b) {
+            return false;
+        }
+
+        unsigned lower = rng() % 10, upper = rng() % 10;
+        expected.ForeachElementsOfNearbyRank(r, lower, upper, pick(a));
+        rank.ForeachElementsOfNearbyRank(r, lower, upper, pick(b));
+        expected.ForeachElementsOfNearbyValue(value, lower, upper, pick(a));
+        rank.ForeachElementsOfNearbyValue(value, lower, upper, pick(b));
+        if(a != b) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// replays the same random mix on both sets, checking answers and structure as it goes
+template<typename SetType>
+static void Run(const char *name, unsigned keys, unsigned values, unsigned rounds) {
+    SkiplistSet expected;
+    SetType rank;
+    std::mt19937 rng;
+    rng.seed(keys + values);
+
+    bool match = true;
+    bool test_self = true;
+
+    rank.EnableSnapshots();
+
+    for(unsigned i = 0; i < rounds && match; ++i) {
+        unsigned op = rng() % 100;
+
+        if(op < 60) {
+            unsigned key = rng() % keys;
+            unsigned long value = rng() % values;
+            expected.Update(key, value);
+            rank.Update(key, value);
+        } else if(op < 85) {
+            unsigned key = rng() % keys;
+            expected.Delete(key);
+            rank.Delete(key);
+        } else if(op < 90) {
+            std::vector<std::pair<unsigned, unsigned long>> batch(rng() % 200);
+            for(auto &kv: batch) {
+                kv = std::make_pair((unsigned)(rng() % keys), (unsigned long)(rng() % values));
+            }
+            expected.UpdateBatch(batch.begin(), batch.end());
+            rank.UpdateBatch(batch.begin(), batch.end());
+        } else if(op < 93) {
+            std::vector<unsigned> batch(rng() % 100);
+            for(auto &k: batch) {
+                k = rng() % keys;
+            }
+            expected.DeleteBatch(batch.begin(), batch.end());
+            rank.DeleteBatch(batch.begin(), batch.end());
+        } else if(op < 96) {
+            unsigned long low = rng() % (expected.Length() + 1);
+            unsigned long high = low + rng() % 30;
+            std::vector<Element> a, b;
+            expected.DeleteByRangedRank(low, high, Callback([&a](unsigned long n, const unsigned &key, const unsigned long &value) {
+                        a.emplace_back(n, key, value);
+                    }));
+            rank.DeleteByRangedRank(low, high, Callback([&b](unsigned long n, const unsigned &key, const unsigned long &value) {
+                        b.emplace_back(n, key, value);
+                    }));
+            match = match && a == b;
+        } else if(op < 99) {
+            unsigned long low = rng() % values;
+            unsigned long high = low + rng() % 5;
+            std::vector<Element> a, b;
+            expected.DeleteByRangedValue(low, true, high, false, Callback([&a](unsigned long n, const unsigned &key, const unsigned long &value) {
+                        a.emplace_back(n, key, value);
+                    }));
+            rank.DeleteByRangedValue(low, true, high, false, Callback([&b](unsigned long n, const unsigned &key, const unsigned long &value) {
+                        b.emplace_back(n, key, value);
+                    }));
+            match = match && a == b;
+        } else {
+            rank.Optimize(rng() % 2);
+        }
+
+        if(i % 500 == 0) {
+            match = match && SameAnswers(expected, rank, rng, keys, values);
+            test_self = test_self && rank.TestSelf();
+        }
+    }
+
+    match = match && SameAnswers(expected, rank, rng, keys, values);
+    test_self = test_self && rank.TestSelf();
+
+    // snapshots mirror the buckets, and saved buckets load back into either engine
+    bool snapshot_match = true;
+    {
+        std::vector<Element> viewed;
+        rank.Snapshot().ForeachElements([&viewed](unsigned long n, const unsigned &key, const unsigned long &value) {
+                    viewed.emplace_back(n, key, value);
+                });
+        snapshot_match = viewed == Elements(expected);
+
+        std::stringstream ss;
+        SetType loaded;
+        SkiplistSet loaded_skiplist;
+
+        snapshot_match = snapshot_match && rank.SaveSnapshot(ss);
+        std::string saved = ss.str();
+        std::istringstream is1(saved), is2(saved);
+
+        snapshot_match = snapshot_match && loaded.LoadSnapshot(is1) && loaded_skiplist.LoadSnapshot(is2);
+        snapshot_match = snapshot_match && Elements(loaded) == Elements(expected) && Elements(loaded_skiplist) == Elements(expected);
+        test_self = test_self && loaded.TestSelf();
+    }
+
+    // bulk load lays out the same order as element-wise updates
+    {
+        std::vector<std::pair<unsigned, unsigned long>> entries;
+        for(unsigned k = 0; k < keys; ++k) {
+            entries.emplace_back(rng() % keys, rng() % values);
+        }
+
+        expected.BulkLoad(entries.begin(), entries.end());
+        rank.BulkLoad(entries.begin(), entries.end());
+        match = match && SameAnswers(expected, rank, rng, keys, values);
+        test_self = test_self && rank.TestSelf();
+    }
+
+    std::cout << name << " keys=" << keys << " count=" << rank.Count() << " match=" << match
+        << " snapshot match=" << snapshot_match << " TestSelf=" << test_self << "\n";
+}
+
+int main() {
+    // few scores make long buckets, many scores make the count tree grow and shrink
+    Run<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeScoreBuckets<unsigned, unsigned long>>>("buckets ties", 3000, 20, 40000);
+    Run<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeMapDict, ZeeScoreBuckets<unsigned, unsigned long>>>("buckets values=500", 2000, 500, 40000);
+    Run<ZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeScoreBuckets<unsigned, unsigned long>>>("buckets values=100000", 20000, 100000, 60000);
+    Run<ZeeSet<unsigned, unsigned long, 32, 25, ZeeSlabAllocator<>, ZeeHashDict,
+        ZeeScoreBuckets<unsigned, unsigned long, 0, 100000, ZeeSlabAllocator<>>>>("buckets slab", 10000, 1000, 40000);
+
+    {
+        // signed scores start the count tree at MinValue
+        using SignedSet = ZeeSet<std::string, int, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeScoreBuckets<std::string, int, -100>>;
+        SignedSet rank;
+
+        for(int i = 0; i < 1000; ++i) {
+            rank.Update("player" + std::to_string(i), i % 37 - 18);
+        }
+        for(int i = 0; i < 1000; i += 3) {
+            rank.Delete("player" + std::to_string(i));
+        }
+
+        std::string key;
+        int value = 0;
+        bool found = rank.GetElementByRank(1, key, value);
+
+        std::cout << "buckets string count=" << rank.Count() << " first=" << (found ? key : "") << " value=" << value << " rank="
+            << rank.GetRankOfElement(key) << " below=" << rank.GetElementsCountByRangedValue(-1000, true, -1, true)
+            << " TestSelf=" << rank.TestSelf() << "\n";
+    }
+
+    {
+        // scores at both ends of [MinValue, MaxValue], queries past them count as beyond every element
+        using BoundedSet = ZeeSet<unsigned, int, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ZeeScoreBuckets<unsigned, int, -1000, 1000>>;
+        BoundedSet rank;
+
+        for(unsigned i = 0; i < 100; ++i) {
+            rank.Update(i, i % 2 ? 1000 : -1000);
+        }
+        rank.Update(7, -1000);
+        rank.Update(8, 1000);
+
+        unsigned key = 0;
+        int value = 0;
+        bool low = rank.GetElementByRank(1, key, value) && key == 0 && value == -1000;
+        bool high = rank.GetElementByRank(100, key, value) && key == 99 && value == 1000;
+
+        std::cout << "buckets bounds low=" << low << " high=" << high << " lowest=" << rank.GetElementsCountByRangedValue(-1000000, true, -1000, true)
+            << " highest=" << rank.GetElementsCountByRangedValue(1000, true, 1000000, true) << " outside="
+            << rank.GetElementsCountByRangedValue(1001, true, 1000000, true) + rank.GetElementsCountByRangedValue(-1000000, true, -1001, true)
+            << " memory bounded=" << (rank.NodesMemory() < (1 << 20)) << " TestSelf=" << rank.TestSelf() << "\n";
+
+        // scores outside the range are refused before anything changes, in release builds too
+        std::vector<std::pair<unsigned, int>> batch = {{1, 5}, {2, 1001}};
+        bool refused = !rank.Update(2, -1001) && !rank.Update(200, 1001) && !rank.UpdateBatch(batch.begin(), batch.end())
+            && !rank.BulkLoad(batch.begin(), batch.end());
+        bool unchanged = rank.Count() == 100 && rank.GetValueByKey(1, value) && value == 1000 && rank.GetValueByKey(2, value) && value == -1000
+            && !rank.HasKey(200);
+
+        std::cout << "buckets out of range refused=" << refused << " match=" << unchanged << " TestSelf=" << rank.TestSelf() << "\n";
+    }
+
+    return 0;
+}
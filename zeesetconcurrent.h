@@ -0,0 +1,396 @@
+#ifndef __ZEESETCONCURRENT_H__
+#define __ZEESETCONCURRENT_H__
+
+// thread-safe ZeeSet: many concurrent readers, one writer at a time
+
+#include "zeeset.h"
+#include <mutex>
+#include <condition_variable>
+
+// Fair reader-writer lock. A waiting writer holds back new readers, so writers never starve
+// under a steady read load; when a writer unlocks, the readers that queued behind it are let in
+// before the next writer, so readers never starve under a steady write load either.
+class ZeeRWLock {
+public:
+    ZeeRWLock() = default;
+
+    ZeeRWLock(const ZeeRWLock &) = delete;
+    ZeeRWLock &operator=(const ZeeRWLock &) = delete;
+
+    void LockShared() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        ++m_readers_waiting;
+        m_read_cv.wait(lock, [this] {
+                    return !m_writer && (m_writers_waiting == 0 || m_reader_passes > 0);
+                });
+        --m_readers_waiting;
+
+        if(m_reader_passes > 0) {
+            --m_reader_passes;
+        }
+
+        ++m_readers;
+    }
+
+    void UnlockShared() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if(--m_readers == 0 && m_writers_waiting > 0) {
+            lock.unlock();
+            m_write_cv.notify_one();
+        }
+    }
+
+    void Lock() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        ++m_writers_waiting;
+        m_write_cv.wait(lock, [this] {
+                    return !m_writer && m_readers == 0 && m_reader_passes == 0;
+                });
+        --m_writers_waiting;
+
+        m_writer = true;
+    }
+
+    void Unlock() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        m_writer = false;
+        m_reader_passes = m_readers_waiting;
+        bool wake_readers = m_reader_passes > 0;
+        lock.unlock();
+
+        if(wake_readers) {
+            m_read_cv.notify_all();
+        } else {
+            m_write_cv.notify_one();
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_read_cv;
+    std::condition_variable m_write_cv;
+    unsigned m_readers = 0;
+    unsigned m_readers_waiting = 0;
+    unsigned m_writers_waiting = 0;
+    // readers admitted ahead of waiting writers, handed out by Unlock()
+    unsigned m_reader_passes = 0;
+    bool m_writer = false;
+};
+
+// plain mutex with the ZeeRWLock interface, readers are serialized too (baseline for benchmarks)
+class ZeeMutexLock {
+public:
+    void LockShared() {
+        m_mutex.lock();
+    }
+
+    void UnlockShared() {
+        m_mutex.unlock();
+    }
+
+    void Lock() {
+        m_mutex.lock();
+    }
+
+    void Unlock() {
+        m_mutex.unlock();
+    }
+
+private:
+    std::mutex m_mutex;
+};
+
+// Every call takes the lock for its whole duration: queries take it shared, mutations exclusive.
+// Callbacks run under the lock and must not call back into the same set, use Read/Write
+// to run several calls as one atomic step instead.
+//
+// The set is not split into key shards: ranks are global, so every rank query would have to
+// visit all shards.
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25, typename Allocator = ZeeDefaultAllocator,
+    template<typename, typename> class Dict = ZeeMapDict, typename Lock = ZeeRWLock,
+    typename Engine = ZeeSkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator>>
+class ConcurrentZeeSet {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using SET_TYPE = ZeeSet<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator, Dict, Engine>;
+
+    ConcurrentZeeSet() = default;
+    ~ConcurrentZeeSet() = default;
+
+    ConcurrentZeeSet(const ConcurrentZeeSet &) = delete;
+    ConcurrentZeeSet(ConcurrentZeeSet &&) = delete;
+    ConcurrentZeeSet &operator=(const ConcurrentZeeSet &) = delete;
+    ConcurrentZeeSet &operator=(ConcurrentZeeSet &&) = delete;
+
+    // f(SET_TYPE &) runs under the shared lock and must only query the set
+    template<typename Function>
+    auto Read(Function f) -> decltype(f(std::declval<SET_TYPE &>())) {
+        ReadGuard guard(m_lock);
+        return f(m_set);
+    }
+
+    // f(SET_TYPE &) runs under the exclusive lock
+    template<typename Function>
+    auto Write(Function f) -> decltype(f(std::declval<SET_TYPE &>())) {
+        WriteGuard guard(m_lock);
+        return f(m_set);
+    }
+
+    unsigned long Length() {
+        ReadGuard guard(m_lock);
+        return m_set.Length();
+    }
+
+    unsigned long MaxRank() {
+        ReadGuard guard(m_lock);
+        return m_set.MaxRank();
+    }
+
+    size_t Count() {
+        ReadGuard guard(m_lock);
+        return m_set.Count();
+    }
+
+    void Clear() {
+        WriteGuard guard(m_lock);
+        m_set.Clear();
+    }
+
+    void SetLog(ZeeSetLog<KEY_TYPE, VALUE_TYPE> *log) {
+        WriteGuard guard(m_lock);
+        m_set.SetLog(log);
+    }
+
+    bool Update(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        WriteGuard guard(m_lock);
+        return m_set.Update(key, value);
+    }
+
+    void Delete(const KEY_TYPE &key) {
+        WriteGuard guard(m_lock);
+        m_set.Delete(key);
+    }
+
+    template<typename Iterator>
+    bool UpdateBatch(Iterator begin, Iterator end) {
+        WriteGuard guard(m_lock);
+        return m_set.UpdateBatch(begin, end);
+    }
+
+    template<typename Iterator>
+    void DeleteBatch(Iterator begin, Iterator end) {
+        WriteGuard guard(m_lock);
+        m_set.DeleteBatch(begin, end);
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key) {
+        ReadGuard guard(m_lock);
+        return m_set.GetRankOfElement(key);
+    }
+
+    unsigned long GetApproxRankOfElement(const KEY_TYPE &key, unsigned long max_error, unsigned long *error = NULL) {
+        ReadGuard guard(m_lock);
+        return m_set.GetApproxRankOfElement(key, max_error, error);
+    }
+
+    bool GetPercentileOfElement(const KEY_TYPE &key, double &percentile, double max_error_percent = 0) {
+        ReadGuard guard(m_lock);
+        return m_set.GetPercentileOfElement(key, percentile, max_error_percent);
+    }
+
+    bool GetValueAtPercentile(double percentile, VALUE_TYPE &value) {
+        ReadGuard guard(m_lock);
+        return m_set.GetValueAtPercentile(percentile, value);
+    }
+
+    template<typename Iterator>
+    void GetRanksOfElements(Iterator begin, Iterator end, unsigned long *ranks) {
+        ReadGuard guard(m_lock);
+        m_set.GetRanksOfElements(begin, end, ranks);
+    }
+
+    bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
+        ReadGuard guard(m_lock);
+        return m_set.GetValueByKey(key, value);
+    }
+
+    bool HasKey(const KEY_TYPE &key) {
+        ReadGuard guard(m_lock);
+        return m_set.HasKey(key);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementByRank(rank, key, value);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ReadGuard guard(m_lock);
+        m_set.GetElementsByRangedRank(rank_low, rank_high, cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        ReadGuard guard(m_lock);
+        m_set.ForeachElements(cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsReverse(Function cb) {
+        ReadGuard guard(m_lock);
+        m_set.ForeachElementsReverse(cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        WriteGuard guard(m_lock);
+        m_set.DeleteByRangedRank(rank_low, rank_high, cb);
+    }
+
+    bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementOfFirstGreaterValue(v, key, value, rank);
+    }
+
+    bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementOfFirstGreaterEqualValue(v, key, value, rank);
+    }
+
+    bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementOfLastLessValue(v, key, value, rank);
+    }
+
+    bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementOfLastLessEqualValue(v, key, value, rank);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        ReadGuard guard(m_lock);
+        m_set.GetElementsByRangedValue(v_low, include_v_low, v_high, include_v_high, cb);
+    }
+
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        ReadGuard guard(m_lock);
+        return m_set.GetElementsCountByRangedValue(v_low, include_v_low, v_high, include_v_high);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void DeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        WriteGuard guard(m_lock);
+        m_set.DeleteByRangedValue(v_low, include_v_low, v_high, include_v_high, cb);
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ReadGuard guard(m_lock);
+        m_set.ForeachElementsOfNearbyRank(rank, lower_count, upper_count, pick_cb);
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        ReadGuard guard(m_lock);
+        m_set.ForeachElementsOfNearbyValue(value, lower_count, upper_count, pick_cb);
+    }
+
+    bool TestSelf() {
+        ReadGuard guard(m_lock);
+        return m_set.TestSelf();
+    }
+
+    template<typename Iterator>
+    bool BulkLoad(Iterator begin, Iterator end, unsigned threads = 1) {
+        WriteGuard guard(m_lock);
+        return m_set.BulkLoad(begin, end, threads);
+    }
+
+    bool SaveSnapshot(std::ostream &os) {
+        ReadGuard guard(m_lock);
+        return m_set.SaveSnapshot(os);
+    }
+
+    bool LoadSnapshot(std::istream &is) {
+        WriteGuard guard(m_lock);
+        return m_set.LoadSnapshot(is);
+    }
+
+    void Optimize(bool relocate = false) {
+        WriteGuard guard(m_lock);
+        m_set.Optimize(relocate);
+    }
+
+    size_t NodesMemory() {
+        ReadGuard guard(m_lock);
+        return m_set.NodesMemory();
+    }
+
+    void EnableSnapshots() {
+        WriteGuard guard(m_lock);
+        m_set.EnableSnapshots();
+    }
+
+    // only bumps the root's reference count, so concurrent readers may take snapshots
+    typename SET_TYPE::SNAPSHOT_TYPE Snapshot() {
+        ReadGuard guard(m_lock);
+        return m_set.Snapshot();
+    }
+
+    void EnableTopCache(size_t size) {
+        WriteGuard guard(m_lock);
+        m_set.EnableTopCache(size);
+    }
+
+    void DisableTopCache() {
+        WriteGuard guard(m_lock);
+        m_set.DisableTopCache();
+    }
+
+    ZeeTopCacheStats GetTopCacheStats() {
+        ReadGuard guard(m_lock);
+        return m_set.GetTopCacheStats();
+    }
+
+    ZeeSetStats GetStats() {
+        ReadGuard guard(m_lock);
+        return m_set.GetStats();
+    }
+
+private:
+    struct ReadGuard {
+        Lock &LOCK;
+
+        explicit ReadGuard(Lock &lock) : LOCK(lock) {
+            LOCK.LockShared();
+        }
+
+        ~ReadGuard() {
+            LOCK.UnlockShared();
+        }
+    };
+
+    struct WriteGuard {
+        Lock &LOCK;
+
+        explicit WriteGuard(Lock &lock) : LOCK(lock) {
+            LOCK.Lock();
+        }
+
+        ~WriteGuard() {
+            LOCK.Unlock();
+        }
+    };
+
+    Lock m_lock;
+    SET_TYPE m_set;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "zeesetconcurrent.h"
+
+using SetType = ConcurrentZeeSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>;
+
+int main() {
+    const unsigned writers = 2;
+    const unsigned readers = 4;
+    const unsigned keys_per_writer = 2000;
+    const unsigned rounds = 20000;
+
+    SetType rank;
+    std::atomic<bool> consistent(true);
+    std::vector<std::thread> threads;
+
+    // writer w owns keys [w * keys_per_writer, (w + 1) * keys_per_writer), its last write for key k is k
+    for(unsigned w = 0; w < writers; ++w) {
+        threads.emplace_back([&rank, w, keys_per_writer, rounds] {
+                    std::mt19937 rng;
+                    rng.seed(w);
+
+                    for(unsigned i = 0; i < rounds; ++i) {
+                        unsigned key = w * keys_per_writer + rng() % keys_per_writer;
+
+                        if(rng() % 4) {
+                            rank.Update(key, rng() % 100000);
+                        } else {
+                            rank.Delete(key);
+                        }
+                    }
+
+                    for(unsigned k = w * keys_per_writer; k < (w + 1) * keys_per_writer; ++k) {
+                        rank.Update(k, k);
+                    }
+                });
+    }
+
+    for(unsigned r = 0; r < readers; ++r) {
+        threads.emplace_back([&rank, &consistent, r, rounds] {
+                    std::mt19937 rng;
+                    rng.seed(100 + r);
+
+                    for(unsigned i = 0; i < rounds; ++i) {
+                        unsigned key = rng() % (writers * keys_per_writer);
+
+                        // rank and element read under one shared lock must agree
+                        bool ok = rank.Read([key](SetType::SET_TYPE &set) {
+                                    unsigned long n = set.GetRankOfElement(key);
+                                    unsigned k;
+                                    unsigned long v;
+
+                                    return n == 0 || (set.GetElementByRank(n, k, v) && k == key);
+                                });
+
+                        unsigned long previous = 0;
+                        bool first = true;
+                        rank.GetElementsByRangedRank(rng() % 100 + 1, rng() % 100 + 20, [&ok, &previous, &first](unsigned long n, const unsigned &key, const unsigned long &value) {
+                                    ok = ok && (first || previous <= value);
+                                    previous = value;
+                                    first = false;
+                                });
+
+                        if(!ok) {
+                            consistent = false;
+                        }
+                    }
+                });
+    }
+
+    for(auto &t: threads) {
+        t.join();
+    }
+
+    bool final_ok = rank.Count() == writers * keys_per_writer;
+    rank.ForeachElements([&final_ok](unsigned long n, const unsigned &key, const unsigned long &value) {
+                final_ok = final_ok && key == value && n == key + 1;
+            });
+
+    std::cout << "concurrent readers=" << readers << " writers=" << writers << " consistent=" << consistent
+        << " count=" << rank.Count() << " final match=" << final_ok << " TestSelf=" << rank.TestSelf() << "\n";
+
+    {
+        // pages read from one snapshot neither overlap nor skip while writers move elements
+        SetType paged;
+        std::atomic<bool> writing(true);
+        std::atomic<bool> pages_ok(true);
+
+        for(unsigned k = 0; k < 5000; ++k) {
+            paged.Update(k, k);
+        }
+        paged.EnableSnapshots();
+
+        std::thread writer([&paged, &writing] {
+                    std::mt19937 rng;
+                    rng.seed(7);
+
+                    for(unsigned i = 0; i < 50000; ++i) {
+                        paged.Update(rng() % 5000, rng() % 100000);
+                    }
+
+                    writing = false;
+                });
+
+        std::thread reader([&paged, &writing, &pages_ok] {
+                    while(writing) {
+                        SetType::SET_TYPE::SNAPSHOT_TYPE view = paged.Snapshot();
+                        std::vector<bool> seen(5000, false);
+                        unsigned long next_rank = 1;
+
+                        for(unsigned long page = 0; page * 100 < view.Length(); ++page) {
+                            view.GetElementsByRangedRank(page * 100 + 1, page * 100 + 100, [&](unsigned long n, const unsigned &key, const unsigned long &value) {
+                                        if(n != next_rank++ || seen[key]) {
+                                            pages_ok = false;
+                                        }
+                                        seen[key] = true;
+                                    });
+
+                            std::this_thread::yield();
+                        }
+
+                        if(next_rank != 5001) {
+                            pages_ok = false;
+                        }
+                    }
+                });
+
+        writer.join();
+        reader.join();
+
+        std::cout << "snapshot pages consistent=" << pages_ok << " TestSelf=" << paged.TestSelf() << "\n";
+    }
+
+    {
+        ZeeRWLock lock;
+        unsigned long counter = 0;
+        std::vector<std::thread> workers;
+
+        for(unsigned t = 0; t < 4; ++t) {
+            workers.emplace_back([&lock, &counter, t] {
+                        for(unsigned i = 0; i < 20000; ++i) {
+                            if(i % 10 == t) {
+                                lock.Lock();
+                                ++counter;
+                                lock.Unlock();
+                            } else {
+                                lock.LockShared();
+                                volatile unsigned long seen = counter;
+                                (void)seen;
+                                lock.UnlockShared();
+                            }
+                        }
+                    });
+        }
+
+        for(auto &t: workers) {
+            t.join();
+        }
+
+        std::cout << "rwlock exclusive increments=" << counter << " expected=" << 4 * 2000 << "\n";
+    }
+
+    return 0;
+}
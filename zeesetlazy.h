@@ -0,0 +1,872 @@
+#ifndef __ZEESETLAZY_H__
+#define __ZEESETLAZY_H__
+
+// concurrent sorted set without a global lock: lazy skiplist with per-node locks,
+// epoch-based reclamation and approximate ranks with a reported error bound
+
+#include "zeeset.h"
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+
+// dense index of the calling thread in [0, ZEE_MAX_THREADS), released when the thread exits.
+// More live threads than that abort the process, in release builds too, as their epoch slots would overflow
+static constexpr unsigned ZEE_MAX_THREADS = 256;
+
+inline unsigned ZeeThreadIndex() {
+    struct Registry {
+        std::mutex MUTEX;
+        bool USED[ZEE_MAX_THREADS] = {};
+    };
+
+    struct Holder {
+        Registry &REGISTRY;
+        unsigned INDEX = ZEE_MAX_THREADS;
+
+        explicit Holder(Registry &registry) : REGISTRY(registry) {
+            std::lock_guard<std::mutex> lock(REGISTRY.MUTEX);
+
+            for(unsigned i = 0; i < ZEE_MAX_THREADS; ++i) {
+                if(!REGISTRY.USED[i]) {
+                    REGISTRY.USED[i] = true;
+                    INDEX = i;
+                    break;
+                }
+            }
+
+            if(INDEX == ZEE_MAX_THREADS) {
+                fprintf(stderr, "ZeeThreadIndex: more than %u live threads\n", ZEE_MAX_THREADS);
+                abort();
+            }
+        }
+
+        ~Holder() {
+            std::lock_guard<std::mutex> lock(REGISTRY.MUTEX);
+            REGISTRY.USED[INDEX] = false;
+        }
+    };
+
+    static Registry registry;
+    thread_local Holder holder(registry);
+    return holder.INDEX;
+}
+
+// Epoch-based reclamation: readers run inside Enter()/Leave(), memory unlinked by a writer is
+// handed to Retire() and freed only once every thread has left the epoch it was retired in,
+// so a reader can never see it freed under its feet.
+class ZeeEpochReclaimer {
+public:
+    // a thread frees its retired memory once this many pieces are pending
+    static constexpr size_t RETIRE_BATCH = 64;
+
+    ZeeEpochReclaimer() = default;
+
+    ZeeEpochReclaimer(const ZeeEpochReclaimer &) = delete;
+    ZeeEpochReclaimer &operator=(const ZeeEpochReclaimer &) = delete;
+
+    // no thread may be inside an epoch any more
+    ~ZeeEpochReclaimer() {
+        for(Slot &slot: m_slots) {
+            for(Retired &r: slot.RETIRED) {
+                r.FREE(r.PTR);
+            }
+        }
+    }
+
+    // calls nest
+    void Enter() {
+        Slot &slot = m_slots[ZeeThreadIndex()];
+
+        if(slot.NESTING++ == 0) {
+            uint64_t epoch = m_epoch.load(std::memory_order_seq_cst);
+
+            // announce an epoch that is still current after the announcement is visible
+            while(true) {
+                slot.EPOCH.store(epoch << 1 | 1, std::memory_order_seq_cst);
+                uint64_t now = m_epoch.load(std::memory_order_seq_cst);
+
+                if(now == epoch) {
+                    break;
+                }
+
+                epoch = now;
+            }
+        }
+    }
+
+    void Leave() {
+        Slot &slot = m_slots[ZeeThreadIndex()];
+
+        if(--slot.NESTING == 0) {
+            slot.EPOCH.store(0, std::memory_order_release);
+        }
+    }
+
+    void Retire(void *ptr, void (*free_cb)(void *)) {
+        Slot &slot = m_slots[ZeeThreadIndex()];
+
+        slot.RETIRED.emplace_back(Retired{ptr, free_cb, m_epoch.load(std::memory_order_acquire)});
+
+        if(slot.RETIRED.size() >= RETIRE_BATCH) {
+            TryAdvance();
+            Collect(slot);
+        }
+    }
+
+private:
+    struct Retired {
+        void *PTR;
+        void (*FREE)(void *);
+        uint64_t EPOCH;
+    };
+
+    struct alignas(64) Slot {
+        // (epoch << 1 | 1) while inside, 0 outside
+        std::atomic<uint64_t> EPOCH{0};
+        unsigned NESTING = 0;
+        // touched only by the owning thread
+        std::vector<Retired> RETIRED;
+    };
+
+    // the global epoch moves on once every thread inside has observed it
+    void TryAdvance() {
+        uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+
+        for(Slot &slot: m_slots) {
+            uint64_t e = slot.EPOCH.load(std::memory_order_acquire);
+
+            if((e & 1) && (e >> 1) != epoch) {
+                return;
+            }
+        }
+
+        m_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+    }
+
+    // retired in epoch e, nobody can still hold it once the global epoch reaches e + 2
+    void Collect(Slot &slot) {
+        uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+        size_t kept = 0;
+
+        for(size_t i = 0; i < slot.RETIRED.size(); ++i) {
+            Retired r = slot.RETIRED[i];
+
+            if(r.EPOCH + 2 <= epoch) {
+                r.FREE(r.PTR);
+            } else {
+                slot.RETIRED[kept++] = r;
+            }
+        }
+
+        slot.RETIRED.resize(kept);
+    }
+
+    std::atomic<uint64_t> m_epoch{2};
+    Slot m_slots[ZEE_MAX_THREADS];
+};
+
+// Lazy skiplist (Herlihy, Lev, Luchangco, Shavit) ordered by (value, key): searches take no lock,
+// Insert/Remove lock only the predecessors they relink and validate them, a node is logically
+// removed by MARKED before it is unlinked and handed to the reclaimer.
+//
+// Every call must run inside m_reclaimer's epoch (see ZeeLazySet). There are no spans, ranks
+// are answered by ZeeLazySet's sampled index.
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25>
+class ZeeLazySkiplist {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+
+    static constexpr int MAX_LEVEL = MaxLevel;
+    static constexpr int BRANCH_PROB_PERCENT = BranchProbPercent;
+
+    // KEY and VALUE never change after the node is linked
+    struct Node {
+        KEY_TYPE KEY;
+        VALUE_TYPE VALUE;
+        int HEIGHT = 0;
+        std::atomic<bool> MARKED{false};
+        std::atomic<bool> FULLY_LINKED{false};
+        std::atomic_flag LOCK = ATOMIC_FLAG_INIT;
+
+        // HEIGHT levels, allocated in one block with the node
+        std::atomic<Node *> NEXT[];
+
+        Node(const KEY_TYPE &key, const VALUE_TYPE &value) : KEY(key), VALUE(value) {}
+        Node() = default;
+
+        void Lock() {
+            while(LOCK.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+
+        void Unlock() {
+            LOCK.clear(std::memory_order_release);
+        }
+    };
+
+    explicit ZeeLazySkiplist(ZeeEpochReclaimer &reclaimer) : m_reclaimer(reclaimer) {
+        m_header = CreateNode(MAX_LEVEL);
+        m_header->FULLY_LINKED.store(true, std::memory_order_relaxed);
+    }
+
+    // no other thread may use the skiplist any more
+    ~ZeeLazySkiplist() {
+        Node *x = m_header;
+
+        while(x) {
+            Node *next = x->NEXT[0].load(std::memory_order_relaxed);
+            FreeNode(x);
+            x = next;
+        }
+    }
+
+    ZeeLazySkiplist(const ZeeLazySkiplist &) = delete;
+    ZeeLazySkiplist &operator=(const ZeeLazySkiplist &) = delete;
+
+    // false if (key, value) is present already
+    bool Insert(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        int height = RandomLevel();
+        Node *preds[MAX_LEVEL];
+        Node *succs[MAX_LEVEL];
+
+        while(true) {
+            int found = Find(key, value, preds, succs);
+
+            if(found >= 0) {
+                Node *x = succs[found];
+
+                if(!x->MARKED.load(std::memory_order_acquire)) {
+                    while(!x->FULLY_LINKED.load(std::memory_order_acquire)) {
+                        std::this_thread::yield();
+                    }
+                    return false;
+                }
+
+                // being removed, retry once it is unlinked
+                continue;
+            }
+
+            int highest_locked = -1;
+            bool valid = true;
+            Node *prev = NULL;
+
+            for(int i = 0; valid && i < height; ++i) {
+                Node *pred = preds[i];
+                Node *succ = succs[i];
+
+                if(pred != prev) {
+                    pred->Lock();
+                    highest_locked = i;
+                    prev = pred;
+                }
+
+                valid = !pred->MARKED.load(std::memory_order_acquire) &&
+                    (!succ || !succ->MARKED.load(std::memory_order_acquire)) &&
+                    pred->NEXT[i].load(std::memory_order_acquire) == succ;
+            }
+
+            if(!valid) {
+                UnlockPreds(preds, highest_locked);
+                continue;
+            }
+
+            Node *x = CreateNode(height, key, value);
+
+            for(int i = 0; i < height; ++i) {
+                x->NEXT[i].store(succs[i], std::memory_order_relaxed);
+            }
+
+            for(int i = 0; i < height; ++i) {
+                preds[i]->NEXT[i].store(x, std::memory_order_release);
+            }
+
+            x->FULLY_LINKED.store(true, std::memory_order_release);
+            UnlockPreds(preds, highest_locked);
+            return true;
+        }
+    }
+
+    // false if (key, value) is not present
+    bool Remove(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *victim = NULL;
+        bool marked = false;
+        int height = 0;
+        Node *preds[MAX_LEVEL];
+        Node *succs[MAX_LEVEL];
+
+        while(true) {
+            int found = Find(key, value, preds, succs);
+
+            if(!marked) {
+                if(found < 0) {
+                    return false;
+                }
+
+                victim = succs[found];
+
+                if(!victim->FULLY_LINKED.load(std::memory_order_acquire) || victim->HEIGHT - 1 != found ||
+                        victim->MARKED.load(std::memory_order_acquire)) {
+                    return false;
+                }
+
+                height = victim->HEIGHT;
+                victim->Lock();
+
+                if(victim->MARKED.load(std::memory_order_acquire)) {
+                    victim->Unlock();
+                    return false;
+                }
+
+                victim->MARKED.store(true, std::memory_order_release);
+                marked = true;
+            }
+
+            int highest_locked = -1;
+            bool valid = true;
+            Node *prev = NULL;
+
+            for(int i = 0; valid && i < height; ++i) {
+                Node *pred = preds[i];
+
+                if(pred != prev) {
+                    pred->Lock();
+                    highest_locked = i;
+                    prev = pred;
+                }
+
+                valid = !pred->MARKED.load(std::memory_order_acquire) &&
+                    pred->NEXT[i].load(std::memory_order_acquire) == victim;
+            }
+
+            if(!valid) {
+                UnlockPreds(preds, highest_locked);
+                continue;
+            }
+
+            for(int i = height - 1; i >= 0; --i) {
+                preds[i]->NEXT[i].store(victim->NEXT[i].load(std::memory_order_relaxed), std::memory_order_release);
+            }
+
+            victim->Unlock();
+            UnlockPreds(preds, highest_locked);
+            m_reclaimer.Retire(victim, &ZeeLazySkiplist::FreeRetired);
+            return true;
+        }
+    }
+
+    // first live node not ordered before (value, key), NULL if none
+    Node *LowerBound(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *x = m_header;
+        Node *next = NULL;
+
+        for(int i = MAX_LEVEL - 1; i >= 0; --i) {
+            next = x->NEXT[i].load(std::memory_order_acquire);
+
+            while(next && Less(next, key, value)) {
+                x = next;
+                next = x->NEXT[i].load(std::memory_order_acquire);
+            }
+        }
+
+        return LiveFrom(next);
+    }
+
+    // first live node whose value is not less (or, with strict, greater) than value
+    Node *LowerBoundOfValue(const VALUE_TYPE &value, bool strict) {
+        Node *x = m_header;
+        Node *next = NULL;
+
+        for(int i = MAX_LEVEL - 1; i >= 0; --i) {
+            next = x->NEXT[i].load(std::memory_order_acquire);
+
+            while(next && (strict ? !(value < next->VALUE) : next->VALUE < value)) {
+                x = next;
+                next = x->NEXT[i].load(std::memory_order_acquire);
+            }
+        }
+
+        return LiveFrom(next);
+    }
+
+    Node *First() {
+        return NextLive(m_header);
+    }
+
+    // live successor of x on level 0
+    Node *NextLive(Node *x) {
+        return LiveFrom(x->NEXT[0].load(std::memory_order_acquire));
+    }
+
+    // y or its first live successor; the bounds above start from the node their descent compared,
+    // reloading the predecessor's link could return a node inserted before the bound meanwhile
+    Node *LiveFrom(Node *y) {
+        while(y && !IsLive(y)) {
+            y = y->NEXT[0].load(std::memory_order_acquire);
+        }
+
+        return y;
+    }
+
+    static bool IsLive(Node *x) {
+        return x->FULLY_LINKED.load(std::memory_order_acquire) && !x->MARKED.load(std::memory_order_acquire);
+    }
+
+    static bool Less(Node *x, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        return x->VALUE < value || (x->VALUE == value && x->KEY < key);
+    }
+
+    // single-threaded check: every level sorted, each level a subsequence of the one below
+    bool TestSelf() {
+        for(int i = 0; i < MAX_LEVEL; ++i) {
+            Node *below = m_header;
+
+            for(Node *x = m_header->NEXT[i].load(); x; x = x->NEXT[i].load()) {
+                Node *next = x->NEXT[i].load();
+
+                if(next && !Less(x, next->KEY, next->VALUE)) {
+                    return false;
+                }
+
+                if(x->MARKED.load() || !x->FULLY_LINKED.load()) {
+                    return false;
+                }
+
+                while(below && below != x) {
+                    below = i > 0 ? below->NEXT[i - 1].load() : x;
+                }
+
+                if(!below) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+private:
+    static size_t NodeSize(int height) {
+        return sizeof(Node) + sizeof(std::atomic<Node *>) * height;
+    }
+
+    static void InitLevels(Node *n, int height) {
+        n->HEIGHT = height;
+
+        for(int i = 0; i < height; ++i) {
+            new(&n->NEXT[i]) std::atomic<Node *>(NULL);
+        }
+    }
+
+    Node *CreateNode(int height, const KEY_TYPE &key, const VALUE_TYPE &value) {
+        Node *n = new(::operator new(NodeSize(height))) Node(key, value);
+        InitLevels(n, height);
+        return n;
+    }
+
+    Node *CreateNode(int height) {
+        Node *n = new(::operator new(NodeSize(height))) Node();
+        InitLevels(n, height);
+        return n;
+    }
+
+    static void FreeNode(Node *n) {
+        n->~Node();
+        ::operator delete(n);
+    }
+
+    static void FreeRetired(void *n) {
+        FreeNode(static_cast<Node *>(n));
+    }
+
+    static int RandomLevel() {
+        thread_local std::mt19937 rng((unsigned)time(NULL) ^ (ZeeThreadIndex() * 2654435761u));
+        int level = 1;
+
+        while(level < MAX_LEVEL && ((unsigned)rng() & 0xffff) < (unsigned)(BRANCH_PROB_PERCENT / 100.f * 0xffff)) {
+            ++level;
+        }
+
+        return level;
+    }
+
+    // highest level where (key, value) was found, or -1; preds/succs bracket it on every level
+    int Find(const KEY_TYPE &key, const VALUE_TYPE &value, Node *preds[MAX_LEVEL], Node *succs[MAX_LEVEL]) {
+        int found = -1;
+        Node *pred = m_header;
+
+        for(int i = MAX_LEVEL - 1; i >= 0; --i) {
+            Node *x = pred->NEXT[i].load(std::memory_order_acquire);
+
+            while(x && Less(x, key, value)) {
+                pred = x;
+                x = pred->NEXT[i].load(std::memory_order_acquire);
+            }
+
+            if(found < 0 && x && x->KEY == key && x->VALUE == value) {
+                found = i;
+            }
+
+            preds[i] = pred;
+            succs[i] = x;
+        }
+
+        return found;
+    }
+
+    // preds repeat across levels, each distinct one was locked once
+    static void UnlockPreds(Node *preds[MAX_LEVEL], int highest_locked) {
+        Node *prev = NULL;
+
+        for(int i = 0; i <= highest_locked; ++i) {
+            if(preds[i] != prev) {
+                preds[i]->Unlock();
+                prev = preds[i];
+            }
+        }
+    }
+
+    ZeeEpochReclaimer &m_reclaimer;
+    Node *m_header = NULL;
+};
+
+// Concurrent ZeeSet without a global lock. Update/Delete on different keys run in parallel and
+// scans take no lock. The key dictionary is split into STRIPES, each behind its own mutex, which
+// serializes mutations of the same key; key lookups hold their key's stripe briefly.
+//
+// Update of an existing key removes the old (value, key) node before inserting the new one, so a
+// concurrent scan may miss that key for a moment but never sees it twice.
+//
+// Ranks are approximate: a sample of every SAMPLE_STRIDE-th element and its rank is rebuilt by
+// an O(n) walk, and a rank is found by counting forward from the nearest sample. Each insert or
+// remove not finished when the walk began moves a rank by at most one, so that count is returned as
+// the error bound; changes are counted before they relink nodes, so a reader never sees an uncounted
+// one. The index is rebuilt by the mutating thread once the bound exceeds rank_error_bound (0 to
+// rebuild only through RebuildRankIndex()), so smaller bounds cost more walks per update.
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25,
+    template<typename, typename> class Dict = ZeeHashDict>
+class ZeeLazySet {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using SKIPLIST_TYPE = ZeeLazySkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent>;
+    using NODE_TYPE = typename SKIPLIST_TYPE::Node;
+    using DICT_TYPE = Dict<KeyType, ValueType>;
+
+    static constexpr unsigned STRIPES = 64;
+    static constexpr unsigned long SAMPLE_STRIDE = 64;
+
+    explicit ZeeLazySet(unsigned long rank_error_bound = 4096) :
+        m_skiplist(m_reclaimer), m_rank_error_bound(rank_error_bound) {
+        std::atomic_store(&m_rank_index, std::make_shared<const RankIndex>());
+    }
+
+    ~ZeeLazySet() = default;
+
+    ZeeLazySet(const ZeeLazySet &) = delete;
+    ZeeLazySet &operator=(const ZeeLazySet &) = delete;
+
+    size_t Count() {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    void Update(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        EpochGuard guard(m_reclaimer);
+        Stripe &stripe = StripeOf(key);
+        std::unique_lock<std::mutex> lock(stripe.MUTEX);
+
+        VALUE_TYPE *old = stripe.DICT.Find(key);
+
+        if(old) {
+            if(*old == value) {
+                return;
+            }
+
+            Modifying();
+            m_skiplist.Remove(key, *old);
+            Modified();
+            *old = value;
+        } else {
+            stripe.DICT.Set(key, value);
+            m_count.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        Modifying();
+        m_skiplist.Insert(key, value);
+        Modified();
+        lock.unlock();
+
+        MaybeRebuildRankIndex();
+    }
+
+    bool Delete(const KEY_TYPE &key) {
+        EpochGuard guard(m_reclaimer);
+        Stripe &stripe = StripeOf(key);
+        std::unique_lock<std::mutex> lock(stripe.MUTEX);
+
+        VALUE_TYPE *old = stripe.DICT.Find(key);
+
+        if(!old) {
+            return false;
+        }
+
+        Modifying();
+        m_skiplist.Remove(key, *old);
+        Modified();
+        stripe.DICT.Erase(key);
+        m_count.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+
+        MaybeRebuildRankIndex();
+        return true;
+    }
+
+    bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
+        Stripe &stripe = StripeOf(key);
+        std::lock_guard<std::mutex> lock(stripe.MUTEX);
+        VALUE_TYPE *v = stripe.DICT.Find(key);
+
+        if(!v) {
+            return false;
+        }
+
+        value = *v;
+        return true;
+    }
+
+    bool HasKey(const KEY_TYPE &key) {
+        VALUE_TYPE value;
+        return GetValueByKey(key, value);
+    }
+
+    // approximate 1-based rank, 0 if key is absent, error (if given) bounds |rank - exact rank|
+    unsigned long GetRankOfElement(const KEY_TYPE &key, unsigned long *error = NULL) {
+        EpochGuard guard(m_reclaimer);
+        Stripe &stripe = StripeOf(key);
+        // the stripe keeps the key's node in place while counting towards it
+        std::lock_guard<std::mutex> lock(stripe.MUTEX);
+        VALUE_TYPE *v = stripe.DICT.Find(key);
+
+        if(!v) {
+            return 0;
+        }
+
+        const VALUE_TYPE &value = *v;
+        std::shared_ptr<const RankIndex> index = std::atomic_load(&m_rank_index);
+
+        // last sample ordered before (value, key)
+        auto iter = std::lower_bound(index->SAMPLES.begin(), index->SAMPLES.end(), std::make_pair(value, key));
+        unsigned long rank = 0;
+        NODE_TYPE *x;
+
+        if(iter == index->SAMPLES.begin()) {
+            x = m_skiplist.First();
+        } else {
+            --iter;
+            rank = (iter - index->SAMPLES.begin()) * SAMPLE_STRIDE;
+            x = m_skiplist.LowerBound(iter->second, iter->first);
+        }
+
+        while(x && SKIPLIST_TYPE::Less(x, key, value)) {
+            ++rank;
+            x = m_skiplist.NextLive(x);
+        }
+
+        if(error) {
+            *error = m_modifications.load(std::memory_order_acquire) - index->VERSION;
+        }
+
+        return x && x->KEY == key ? rank + 1 : 0;
+    }
+
+    // approximate element at rank, error (if given) bounds how far the element's exact rank may be
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *error = NULL) {
+        if(rank == 0) {
+            return false;
+        }
+
+        EpochGuard guard(m_reclaimer);
+        std::shared_ptr<const RankIndex> index = std::atomic_load(&m_rank_index);
+
+        unsigned long sample = (rank - 1) / SAMPLE_STRIDE;
+        unsigned long steps = rank - 1;
+        NODE_TYPE *x;
+
+        if(sample == 0 || index->SAMPLES.empty()) {
+            x = m_skiplist.First();
+        } else {
+            if(sample >= index->SAMPLES.size()) {
+                sample = index->SAMPLES.size() - 1;
+            }
+
+            auto &s = index->SAMPLES[sample];
+            x = m_skiplist.LowerBound(s.second, s.first);
+            steps -= sample * SAMPLE_STRIDE;
+        }
+
+        while(x && steps--) {
+            x = m_skiplist.NextLive(x);
+        }
+
+        if(!x) {
+            return false;
+        }
+
+        key = x->KEY;
+        value = x->VALUE;
+
+        if(error) {
+            *error = m_modifications.load(std::memory_order_acquire) - index->VERSION;
+        }
+
+        return true;
+    }
+
+    // weakly consistent: elements changed during the scan may or may not be seen, no rank is given
+    template<typename Function> /* std::function<void(const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        EpochGuard guard(m_reclaimer);
+
+        for(NODE_TYPE *x = m_skiplist.LowerBoundOfValue(v_low, !include_v_low); x; x = m_skiplist.NextLive(x)) {
+            if(include_v_high ? v_high < x->VALUE : !(x->VALUE < v_high)) {
+                break;
+            }
+
+            cb(x->KEY, x->VALUE);
+        }
+    }
+
+    // weakly consistent as above, rank counts the elements passed
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        EpochGuard guard(m_reclaimer);
+        unsigned long rank = 0;
+
+        for(NODE_TYPE *x = m_skiplist.First(); x; x = m_skiplist.NextLive(x)) {
+            cb(++rank, x->KEY, x->VALUE);
+        }
+    }
+
+    // samples every SAMPLE_STRIDE-th element in one walk, error bounds restart from its beginning
+    void RebuildRankIndex() {
+        std::lock_guard<std::mutex> lock(m_rebuild_mutex);
+        RebuildRankIndexLocked();
+    }
+
+    // single-threaded check: skiplist structure, and dictionary and skiplist hold the same elements
+    bool TestSelf() {
+        if(!m_skiplist.TestSelf()) {
+            return false;
+        }
+
+        size_t n = 0;
+        bool ok = true;
+
+        ForeachElements([this, &n, &ok](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                    VALUE_TYPE v;
+                    ok = ok && GetValueByKey(key, v) && v == value;
+                    ++n;
+                });
+
+        return ok && n == Count();
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::mutex MUTEX;
+        DICT_TYPE DICT;
+    };
+
+    struct RankIndex {
+        // (value, key) of the elements at rank 1, 1 + SAMPLE_STRIDE, 1 + 2 * SAMPLE_STRIDE, ...
+        std::vector<std::pair<VALUE_TYPE, KEY_TYPE>> SAMPLES;
+        // m_completed when the walk began, every change counted there is in SAMPLES
+        uint64_t VERSION = 0;
+    };
+
+    struct EpochGuard {
+        ZeeEpochReclaimer &RECLAIMER;
+
+        explicit EpochGuard(ZeeEpochReclaimer &reclaimer) : RECLAIMER(reclaimer) {
+            RECLAIMER.Enter();
+        }
+
+        ~EpochGuard() {
+            RECLAIMER.Leave();
+        }
+    };
+
+    // ZeeHashDict takes the high bits of the key hash, stripes take the low bits of a remix
+    Stripe &StripeOf(const KEY_TYPE &key) {
+        uint64_t h = ZeeHash<KEY_TYPE>()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return m_stripes[h % STRIPES];
+    }
+
+    // counts an insert or remove before it relinks nodes, so a reader seeing the change also sees the count
+    void Modifying() {
+        m_modifications.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // counts it again once done, a walk starting later includes it
+    void Modified() {
+        m_completed.fetch_add(1, std::memory_order_release);
+    }
+
+    void MaybeRebuildRankIndex() {
+        if(m_rank_error_bound == 0) {
+            return;
+        }
+
+        std::shared_ptr<const RankIndex> index = std::atomic_load(&m_rank_index);
+
+        if(m_modifications.load(std::memory_order_relaxed) - index->VERSION <= m_rank_error_bound) {
+            return;
+        }
+
+        // one rebuild at a time, other threads go on with the old index
+        std::unique_lock<std::mutex> lock(m_rebuild_mutex, std::try_to_lock);
+
+        if(lock.owns_lock()) {
+            RebuildRankIndexLocked();
+        }
+    }
+
+    void RebuildRankIndexLocked() {
+        std::shared_ptr<RankIndex> index = std::make_shared<RankIndex>();
+        index->VERSION = m_completed.load(std::memory_order_acquire);
+        index->SAMPLES.reserve(Count() / SAMPLE_STRIDE + 1);
+
+        {
+            EpochGuard guard(m_reclaimer);
+            unsigned long n = 0;
+
+            for(NODE_TYPE *x = m_skiplist.First(); x; x = m_skiplist.NextLive(x)) {
+                if(n++ % SAMPLE_STRIDE == 0) {
+                    index->SAMPLES.emplace_back(x->VALUE, x->KEY);
+                }
+            }
+        }
+
+        std::atomic_store(&m_rank_index, std::shared_ptr<const RankIndex>(index));
+    }
+
+    // reclaimer outlives the skiplist, whose destructor frees the remaining nodes
+    ZeeEpochReclaimer m_reclaimer;
+    SKIPLIST_TYPE m_skiplist;
+    Stripe m_stripes[STRIPES];
+    std::atomic<size_t> m_count{0};
+    // inserts and removes started, and finished (see Modifying, Modified)
+    std::atomic<uint64_t> m_modifications{0};
+    std::atomic<uint64_t> m_completed{0};
+    unsigned long m_rank_error_bound;
+    std::mutex m_rebuild_mutex;
+    std::shared_ptr<const RankIndex> m_rank_index;
+};
+
+#endif
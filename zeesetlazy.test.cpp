@@ -0,0 +1,208 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "zeesetlazy.h"
+
+using LazyType = ZeeLazySet<unsigned, unsigned long>;
+
+int main() {
+    const unsigned writers = 4;
+    const unsigned readers = 4;
+    const unsigned keys_per_writer = 5000;
+    const unsigned rounds = 50000;
+    const unsigned phases = 20;
+
+    LazyType rank(256);
+    std::atomic<bool> ordered(true);
+    std::atomic<bool> bounded(true);
+    std::atomic<bool> writing(true);
+    unsigned long max_paused_error = 0;
+
+    // writer w owns keys [w * keys_per_writer, (w + 1) * keys_per_writer) and mirrors them in expected
+    std::vector<std::vector<long>> expected(writers, std::vector<long>(keys_per_writer, -1));
+    std::vector<std::mt19937> writer_rngs(writers);
+
+    for(unsigned w = 0; w < writers; ++w) {
+        writer_rngs[w].seed(w);
+    }
+
+    // writers run in phases and pause between them, exact ranks are known while they are paused
+    for(unsigned phase = 0; phase < phases; ++phase) {
+        std::vector<std::thread> threads;
+        writing = true;
+
+        for(unsigned w = 0; w < writers; ++w) {
+            threads.emplace_back([&rank, &expected, &writer_rngs, w, keys_per_writer, rounds, phases] {
+                        std::mt19937 &rng = writer_rngs[w];
+
+                        for(unsigned i = 0; i < rounds / phases; ++i) {
+                            unsigned k = rng() % keys_per_writer;
+                            unsigned key = w * keys_per_writer + k;
+
+                            if(rng() % 4) {
+                                unsigned long value = rng() % 1000;
+                                rank.Update(key, value);
+                                expected[w][k] = (long)value;
+                            } else {
+                                rank.Delete(key);
+                                expected[w][k] = -1;
+                            }
+                        }
+                    });
+        }
+
+        for(unsigned r = 0; r < readers; ++r) {
+            threads.emplace_back([&rank, &ordered, &writing, phase, r] {
+                        std::mt19937 rng;
+                        rng.seed(100 + phase * readers + r);
+
+                        while(writing) {
+                            // concurrent scans must stay sorted by (value, key)
+                            unsigned long low = rng() % 1000;
+                            bool first = true;
+                            std::pair<unsigned long, unsigned> previous;
+
+                            rank.GetElementsByRangedValue(low, true, low + 20, true, [&](const unsigned &key, const unsigned long &value) {
+                                        std::pair<unsigned long, unsigned> current(value, key);
+
+                                        if(!first && !(previous < current)) {
+                                            ordered = false;
+                                        }
+
+                                        if(value < low || value > low + 20) {
+                                            ordered = false;
+                                        }
+
+                                        previous = current;
+                                        first = false;
+                                    });
+                        }
+                    });
+        }
+
+        for(unsigned w = 0; w < writers; ++w) {
+            threads[w].join();
+        }
+
+        writing = false;
+
+        for(unsigned r = 0; r < readers; ++r) {
+            threads[writers + r].join();
+        }
+
+        // writers paused: ranks from the stale index must be within the reported error of the exact ones
+        std::vector<unsigned long> exact(writers * keys_per_writer, 0);
+
+        rank.ForeachElements([&exact](unsigned long n, const unsigned &key, const unsigned long &value) {
+                    exact[key] = n;
+                });
+
+        std::vector<std::thread> checkers;
+        std::vector<unsigned long> errors(readers, 0);
+
+        for(unsigned r = 0; r < readers; ++r) {
+            checkers.emplace_back([&rank, &bounded, &exact, &errors, r] {
+                        for(unsigned key = r; key < exact.size(); key += readers) {
+                            unsigned long error = 0;
+                            unsigned long n = rank.GetRankOfElement(key, &error);
+                            unsigned long diff = n > exact[key] ? n - exact[key] : exact[key] - n;
+
+                            if((n == 0) != (exact[key] == 0) || diff > error) {
+                                bounded = false;
+                            }
+
+                            errors[r] = std::max(errors[r], error);
+                        }
+                    });
+        }
+
+        for(auto &checker: checkers) {
+            checker.join();
+        }
+
+        for(unsigned long error: errors) {
+            max_paused_error = std::max(max_paused_error, error);
+        }
+    }
+
+    size_t count = 0;
+    bool values_ok = true;
+
+    for(unsigned w = 0; w < writers; ++w) {
+        for(unsigned k = 0; k < keys_per_writer; ++k) {
+            unsigned long value;
+            bool found = rank.GetValueByKey(w * keys_per_writer + k, value);
+
+            if(expected[w][k] >= 0) {
+                values_ok = values_ok && found && (long)value == expected[w][k];
+                ++count;
+            } else {
+                values_ok = values_ok && !found;
+            }
+        }
+    }
+
+    std::cout << "lazy writers=" << writers << " readers=" << readers << " ordered=" << ordered << " bounded=" << bounded
+        << " paused max error=" << max_paused_error << " count=" << rank.Count() << " expected=" << count << " values match=" << values_ok << " TestSelf=" << rank.TestSelf() << "\n";
+
+    // quiescent, so a fresh index gives exact ranks
+    rank.RebuildRankIndex();
+
+    bool ranks_ok = true;
+    unsigned long max_error = 0;
+
+    rank.ForeachElements([&rank, &ranks_ok, &max_error](unsigned long n, const unsigned &key, const unsigned long &value) {
+                unsigned long error;
+                unsigned k;
+                unsigned long v;
+
+                ranks_ok = ranks_ok && rank.GetRankOfElement(key, &error) == n;
+                max_error = std::max(max_error, error);
+                ranks_ok = ranks_ok && rank.GetElementByRank(n, k, v) && k == key && v == value;
+            });
+
+    std::cout << "lazy ranks match=" << ranks_ok << " max error=" << max_error << "\n";
+
+    {
+        // deleting the lowest elements after a rebuild moves every other rank by exactly their count
+        LazyType tight(0);
+
+        for(unsigned key = 0; key < 1000; ++key) {
+            tight.Update(key, key);
+        }
+        tight.RebuildRankIndex();
+        for(unsigned key = 0; key < 100; ++key) {
+            tight.Delete(key);
+        }
+
+        unsigned long error = 0;
+        unsigned long n = tight.GetRankOfElement(999, &error);
+        unsigned long diff = n > 900 ? n - 900 : 900 - n;
+
+        std::cout << "lazy stale rank=" << n << " exact=900 error=" << error << " bounded=" << (diff <= error) << "\n";
+    }
+
+    {
+        // thread slots are given back when threads exit, so more threads than ZEE_MAX_THREADS may come and go
+        LazyType churn;
+        unsigned total = 0;
+
+        while(total < 2 * ZEE_MAX_THREADS) {
+            std::vector<std::thread> batch;
+
+            for(unsigned i = 0; i < 64; ++i, ++total) {
+                batch.emplace_back([&churn, total] {
+                            churn.Update(total, total % 10);
+                        });
+            }
+            for(auto &t: batch) {
+                t.join();
+            }
+        }
+
+        std::cout << "lazy thread churn threads=" << total << " match=" << (churn.Count() == total) << " TestSelf=" << churn.TestSelf() << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+#ifndef __ZEESETROLLING_H__
+#define __ZEESETROLLING_H__
+
+#include "zeeset.h"
+
+// A ZeeSet ranking the sum of each key's score deltas over the last N time buckets ("last 60 minutes").
+//
+// Deltas are appended to the current bucket of a ring and added to the key's total in the ranked set
+// at once. Rotate starts a new bucket in place of the oldest one, whose deltas leave the totals as a
+// single UpdateBatch (and a DeleteBatch for keys with no delta left in any bucket), so a rotation
+// costs one sort of that bucket and one batched pass over the set, not an Update per delta.
+//
+// ValueType must be arithmetic, deltas may be negative for signed types. With an engine that bounds
+// its values (ZeeScoreBuckets) every total the window can leave must fit, Add only checks the new one.
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25, typename Allocator = ZeeDefaultAllocator,
+    template<typename, typename> class Dict = ZeeMapDict, typename Engine = ZeeSkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator>>
+class ZeeRollingSet {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using SET_TYPE = ZeeSet<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator, Dict, Engine>;
+    using BUCKET_TYPE = std::vector<std::pair<KEY_TYPE, VALUE_TYPE>>;
+
+    static_assert(std::is_arithmetic<VALUE_TYPE>::value, "ZeeRollingSet sums arithmetic values");
+
+    explicit ZeeRollingSet(size_t buckets) : m_buckets(buckets ? buckets : 1) {}
+
+    ~ZeeRollingSet() = default;
+
+    ZeeRollingSet(const ZeeRollingSet &) = delete;
+    ZeeRollingSet(ZeeRollingSet &&) = delete;
+    ZeeRollingSet &operator=(const ZeeRollingSet &) = delete;
+    ZeeRollingSet &operator=(ZeeRollingSet &&) = delete;
+
+    size_t BucketCount() const {
+        return m_buckets.size();
+    }
+
+    // adds delta to key in the current bucket, false (nothing added) if the engine cannot hold the total
+    bool Add(const KEY_TYPE &key, const VALUE_TYPE &delta) {
+        VALUE_TYPE total = VALUE_TYPE();
+
+        m_set.GetValueByKey(key, total);
+        if(!m_set.Update(key, total + delta)) {
+            return false;
+        }
+
+        m_buckets[m_current].emplace_back(key, delta);
+        return true;
+    }
+
+    // same result as calling Add for each (key, delta) of [begin, end), as one UpdateBatch,
+    // false (nothing added) if the engine cannot hold one of the totals
+    template<typename Iterator>
+    bool AddBatch(Iterator begin, Iterator end) {
+        BUCKET_TYPE added(begin, end);
+        BUCKET_TYPE deltas(added);
+
+        Merge(deltas);
+
+        for(auto &kv: deltas) {
+            VALUE_TYPE total = VALUE_TYPE();
+            m_set.GetValueByKey(kv.first, total);
+            kv.second += total;
+        }
+
+        if(!m_set.UpdateBatch(deltas.begin(), deltas.end())) {
+            return false;
+        }
+
+        m_buckets[m_current].insert(m_buckets[m_current].end(), added.begin(), added.end());
+        return true;
+    }
+
+    // closes the current bucket and reuses the oldest one, whose deltas are taken out of the totals
+    void Rotate() {
+        Close(m_buckets[m_current]);
+        m_current = (m_current + 1) % m_buckets.size();
+
+        BUCKET_TYPE &oldest = m_buckets[m_current];
+        std::vector<KEY_TYPE> expired;
+
+        for(auto &kv: oldest) {
+            unsigned long *refs = m_refs.Find(kv.first);
+
+            if(--*refs == 0) {
+                m_refs.Erase(kv.first);
+                expired.emplace_back(kv.first);
+                continue;
+            }
+
+            VALUE_TYPE total = VALUE_TYPE();
+            m_set.GetValueByKey(kv.first, total);
+            kv.second = total - kv.second;
+        }
+
+        // oldest now holds the new totals of the keys still in the window
+        oldest.erase(std::remove_if(oldest.begin(), oldest.end(), [this](const std::pair<KEY_TYPE, VALUE_TYPE> &kv) {
+                    return !this->m_refs.Find(kv.first);
+                }), oldest.end());
+
+        m_set.UpdateBatch(oldest.begin(), oldest.end());
+        m_set.DeleteBatch(expired.begin(), expired.end());
+
+        oldest.clear();
+    }
+
+    void Clear() {
+        for(auto &bucket: m_buckets) {
+            bucket.clear();
+        }
+
+        m_set.Clear();
+        m_refs.Clear();
+        m_current = 0;
+    }
+
+    size_t Count() {
+        return m_set.Count();
+    }
+
+    // sum of key's deltas over the window
+    bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
+        return m_set.GetValueByKey(key, value);
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key) {
+        return m_set.GetRankOfElement(key);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        return m_set.GetElementByRank(rank, key, value);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        m_set.GetElementsByRangedRank(rank_low, rank_high, cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        m_set.ForeachElements(cb);
+    }
+
+    // f(SET_TYPE &) runs on the totals and must only query the set
+    template<typename Function>
+    auto Read(Function f) -> decltype(f(std::declval<SET_TYPE &>())) {
+        return f(m_set);
+    }
+
+    // every total is the sum of its key's deltas in the ring
+    bool TestSelf() {
+        if(!m_set.TestSelf()) {
+            return false;
+        }
+
+        BUCKET_TYPE all;
+        for(auto &bucket: m_buckets) {
+            all.insert(all.end(), bucket.begin(), bucket.end());
+        }
+        Merge(all);
+
+        if(all.size() != m_set.Count()) {
+            return false;
+        }
+
+        for(auto &kv: all) {
+            VALUE_TYPE total;
+
+            if(!m_set.GetValueByKey(kv.first, total) || !(total == kv.second)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    // sorts deltas by key and sums repeated keys
+    static void Merge(BUCKET_TYPE &deltas) {
+        std::stable_sort(deltas.begin(), deltas.end(), [](const std::pair<KEY_TYPE, VALUE_TYPE> &a, const std::pair<KEY_TYPE, VALUE_TYPE> &b) {
+                    return a.first < b.first;
+                });
+
+        size_t n = 0;
+        for(size_t i = 0; i < deltas.size(); ++i) {
+            if(n && deltas[n - 1].first == deltas[i].first) {
+                deltas[n - 1].second += deltas[i].second;
+            } else {
+                deltas[n++] = deltas[i];
+            }
+        }
+
+        deltas.resize(n);
+    }
+
+    // merges a bucket that stops taking deltas and counts it in m_refs, once per key
+    void Close(BUCKET_TYPE &bucket) {
+        Merge(bucket);
+
+        for(auto &kv: bucket) {
+            unsigned long *refs = m_refs.Find(kv.first);
+
+            if(refs) {
+                ++*refs;
+            } else {
+                m_refs.Set(kv.first, 1);
+            }
+        }
+    }
+
+    std::vector<BUCKET_TYPE> m_buckets;
+    size_t m_current = 0;
+    SET_TYPE m_set;
+    // key -> closed buckets holding a delta of it, keys of the current bucket alone are not counted yet
+    Dict<KEY_TYPE, unsigned long> m_refs;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <tuple>
+#include "zeesetrolling.h"
+
+using Element = std::tuple<unsigned long, unsigned, long>;
+
+// one map of summed deltas per bucket, the last one is current
+using Model = std::deque<std::map<unsigned, long>>;
+
+template<typename SetType>
+static std::vector<Element> Elements(SetType &rank) {
+    std::vector<Element> elements;
+    rank.ForeachElements([&elements](unsigned long n, const unsigned &key, const long &value) {
+                elements.emplace_back(n, key, value);
+            });
+    return elements;
+}
+
+// the rolling set must rank the sums over the buckets still in the ring
+template<typename SetType>
+static bool SameAnswers(Model &model, SetType &rank, std::mt19937 &rng, unsigned keys) {
+    ZeeSet<unsigned, long> expected;
+
+    for(auto &bucket: model) {
+        for(auto &kv: bucket) {
+            long total = 0;
+            expected.GetValueByKey(kv.first, total);
+            expected.Update(kv.first, total + kv.second);
+        }
+    }
+
+    if(Elements(expected) != Elements(rank) || expected.Count() != rank.Count()) {
+        return false;
+    }
+
+    for(int i = 0; i < 50; ++i) {
+        unsigned key = rng() % keys;
+        long a = 0, b = 0;
+
+        if(expected.GetRankOfElement(key) != rank.GetRankOfElement(key) || expected.GetValueByKey(key, a) != rank.GetValueByKey(key, b) || a != b) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<typename SetType>
+static void Run(const char *name, unsigned keys, size_t buckets, long deltas, int ops) {
+    std::mt19937 rng(keys + buckets);
+    SetType rank(buckets);
+    Model model(buckets);
+
+    bool match = true;
+    bool test_self = true;
+    unsigned long rotations = 0;
+
+    for(int i = 0; i < ops; ++i) {
+        unsigned op = rng() % 100;
+
+        if(op < 60) {
+            unsigned key = rng() % keys;
+            long delta = (long)(rng() % deltas) - deltas / 4;
+
+            rank.Add(key, delta);
+            model.back()[key] += delta;
+        } else if(op < 95) {
+            std::vector<std::pair<unsigned, long>> batch(rng() % 100);
+            for(auto &kv: batch) {
+                kv = std::make_pair((unsigned)(rng() % keys), (long)(rng() % deltas) - deltas / 4);
+                model.back()[kv.first] += kv.second;
+            }
+            rank.AddBatch(batch.begin(), batch.end());
+        } else {
+            rank.Rotate();
+            model.pop_front();
+            model.emplace_back();
+            rotations++;
+        }
+
+        if(i % 500 == 0) {
+            match = match && SameAnswers(model, rank, rng, keys);
+            test_self = test_self && rank.TestSelf();
+        }
+    }
+
+    match = match && SameAnswers(model, rank, rng, keys);
+    test_self = test_self && rank.TestSelf();
+
+    // a full turn of the ring leaves nothing
+    for(size_t i = 0; i < buckets; ++i) {
+        rank.Rotate();
+    }
+    bool drained = rank.Count() == 0 && rank.TestSelf();
+
+    std::cout << name << " keys=" << keys << " buckets=" << buckets << " rotations=" << rotations << " match=" << match
+        << " drained=" << drained << " TestSelf=" << test_self << "\n";
+}
+
+int main() {
+    Run<ZeeRollingSet<unsigned, long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>("rolling", 2000, 60, 1000, 40000);
+    Run<ZeeRollingSet<unsigned, long, 32, 25, ZeeDefaultAllocator, ZeeMapDict>>("rolling few keys", 50, 5, 20, 30000);
+    Run<ZeeRollingSet<unsigned, long, 32, 25, ZeeDefaultAllocator, ZeeHashDict>>("rolling one bucket", 500, 1, 100, 20000);
+
+    {
+        // an hourly board of minute buckets: points scored an hour ago no longer count
+        ZeeRollingSet<std::string, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict> hourly(60);
+
+        for(int minute = 0; minute < 90; ++minute) {
+            for(int i = 0; i < 10; ++i) {
+                hourly.Add("player" + std::to_string((minute + i) % 40), minute < 30 ? 1000 : 1);
+            }
+            hourly.Rotate();
+        }
+
+        std::string key;
+        unsigned long value = 0;
+        bool found = hourly.GetElementByRank(hourly.Count(), key, value);
+
+        std::cout << "rolling hourly count=" << hourly.Count() << " last=" << (found ? key : "") << " value=" << value
+            << " TestSelf=" << hourly.TestSelf() << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,459 @@
+#ifndef __ZEESETVIEW_H__
+#define __ZEESETVIEW_H__
+
+// read-only, memory-mapped image of a ZeeSet
+
+#include "zeeset.h"
+#include <fstream>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// image layout, every section aligned to 64 bytes, all offsets relative to file start (host byte order):
+//   ZeeSetImageHeader
+//   COUNT entries {KEY, VALUE} in rank order
+//   INDEX_COUNT values, the value of every INDEX_STRIDE-th entry (rank/score index)
+//   HASH_CAPACITY u32 slots, rank of the key hashed there (0 for empty slot), linear probing
+struct ZeeSetImageHeader {
+    char MAGIC[8];
+    uint32_t VERSION;
+    uint32_t KEY_SIZE;
+    uint32_t VALUE_SIZE;
+    uint32_t ENTRY_SIZE;
+    uint64_t COUNT;
+    uint64_t ENTRIES_OFFSET;
+    uint64_t INDEX_OFFSET;
+    uint64_t INDEX_COUNT;
+    uint64_t INDEX_STRIDE;
+    uint64_t HASH_OFFSET;
+    uint64_t HASH_CAPACITY;
+    uint64_t FILE_SIZE;
+    // checksum of all bytes after the header, see ZeeSetView::Verify
+    uint64_t CHECKSUM;
+};
+
+// KeyType and ValueType must be trivially copyable and KeyType free of padding bytes,
+// since keys are hashed by their bytes so the image is valid in every process
+template<typename KeyType, typename ValueType>
+class ZeeSetView {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+
+    static_assert(std::is_trivially_copyable<KEY_TYPE>::value, "image keys must be trivially copyable");
+    static_assert(std::is_trivially_copyable<VALUE_TYPE>::value, "image values must be trivially copyable");
+
+    static constexpr uint32_t IMAGE_VERSION = 1;
+    static constexpr uint64_t INDEX_STRIDE = 16;
+    static constexpr uint64_t SECTION_ALIGN = 64;
+
+    struct Entry {
+        KEY_TYPE KEY;
+        VALUE_TYPE VALUE;
+    };
+
+    ZeeSetView() = default;
+
+    ~ZeeSetView() {
+        Close();
+    }
+
+    ZeeSetView(const ZeeSetView &) = delete;
+    ZeeSetView(ZeeSetView &&) = delete;
+    ZeeSetView &operator=(const ZeeSetView &) = delete;
+    ZeeSetView &operator=(ZeeSetView &&) = delete;
+
+    // writes set to path (through a temporary file renamed into place)
+    template<typename SetType>
+    static bool Export(SetType &set, const std::string &path) {
+        uint64_t count = set.Length();
+
+        if(count >= 0xffffffffull) {
+            return false;
+        }
+
+        ZeeSetImageHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.MAGIC, "ZSETVIEW", 8);
+        header.VERSION = IMAGE_VERSION;
+        header.KEY_SIZE = sizeof(KEY_TYPE);
+        header.VALUE_SIZE = sizeof(VALUE_TYPE);
+        header.ENTRY_SIZE = sizeof(Entry);
+        header.COUNT = count;
+        header.ENTRIES_OFFSET = Align(sizeof(ZeeSetImageHeader));
+        header.INDEX_OFFSET = Align(header.ENTRIES_OFFSET + count * sizeof(Entry));
+        header.INDEX_COUNT = (count + INDEX_STRIDE - 1) / INDEX_STRIDE;
+        header.INDEX_STRIDE = INDEX_STRIDE;
+        header.HASH_OFFSET = Align(header.INDEX_OFFSET + header.INDEX_COUNT * sizeof(VALUE_TYPE));
+        header.HASH_CAPACITY = 16;
+        while(header.HASH_CAPACITY < count * 2) {
+            header.HASH_CAPACITY *= 2;
+        }
+        header.FILE_SIZE = header.HASH_OFFSET + header.HASH_CAPACITY * sizeof(uint32_t);
+
+        std::string tmp_path = path + ".tmp";
+        std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+        ZeeWriter w(os);
+
+        os.write((const char *)&header, sizeof(header));
+
+        std::vector<VALUE_TYPE> index;
+        std::vector<uint32_t> slots(header.HASH_CAPACITY, 0);
+        uint64_t mask = header.HASH_CAPACITY - 1;
+        uint64_t offset = sizeof(header);
+
+        index.reserve(header.INDEX_COUNT);
+
+        WritePadding(w, offset, header.ENTRIES_OFFSET);
+        set.ForeachElements([&](unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value) {
+                    Entry entry;
+                    memset(&entry, 0, sizeof(entry));
+                    entry.KEY = key;
+                    entry.VALUE = value;
+                    w.Write(&entry, sizeof(entry));
+
+                    if((rank - 1) % INDEX_STRIDE == 0) {
+                        index.emplace_back(value);
+                    }
+
+                    uint64_t i = HashKey(key) & mask;
+                    while(slots[i]) {
+                        i = (i + 1) & mask;
+                    }
+                    slots[i] = (uint32_t)rank;
+                });
+        offset += count * sizeof(Entry);
+
+        WritePadding(w, offset, header.INDEX_OFFSET);
+        w.Write(index.data(), index.size() * sizeof(VALUE_TYPE));
+        offset += index.size() * sizeof(VALUE_TYPE);
+
+        WritePadding(w, offset, header.HASH_OFFSET);
+        w.Write(slots.data(), slots.size() * sizeof(uint32_t));
+
+        header.CHECKSUM = w.Checksum().Digest();
+        os.seekp(0);
+        os.write((const char *)&header, sizeof(header));
+        os.close();
+
+        if(!os || index.size() != header.INDEX_COUNT) {
+            remove(tmp_path.c_str());
+            return false;
+        }
+
+        return rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    bool Open(const std::string &path) {
+        Close();
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(ZeeSetImageHeader)) {
+            close(fd);
+            return false;
+        }
+
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if(base == MAP_FAILED) {
+            return false;
+        }
+
+        m_base = (const char *)base;
+        m_size = st.st_size;
+
+        const ZeeSetImageHeader *header = (const ZeeSetImageHeader *)m_base;
+
+        // Verify is optional, so the header alone must keep every lookup in bounds: ranks fit the u32
+        // slots, the hash table has room for an empty slot (probes also stop after a full turn, as the
+        // slots themselves are not checked), and the index covers every stride
+        if(memcmp(header->MAGIC, "ZSETVIEW", 8) != 0 || header->VERSION != IMAGE_VERSION ||
+                header->KEY_SIZE != sizeof(KEY_TYPE) || header->VALUE_SIZE != sizeof(VALUE_TYPE) ||
+                header->ENTRY_SIZE != sizeof(Entry) || header->FILE_SIZE != m_size ||
+                header->COUNT >= 0xffffffffull || header->INDEX_STRIDE == 0 ||
+                header->INDEX_COUNT != header->COUNT / header->INDEX_STRIDE + (header->COUNT % header->INDEX_STRIDE != 0) ||
+                header->HASH_CAPACITY <= header->COUNT ||
+                (header->HASH_CAPACITY & (header->HASH_CAPACITY - 1)) != 0 ||
+                !SectionFits(header->ENTRIES_OFFSET, header->COUNT, sizeof(Entry), alignof(Entry)) ||
+                !SectionFits(header->INDEX_OFFSET, header->INDEX_COUNT, sizeof(VALUE_TYPE), alignof(VALUE_TYPE)) ||
+                !SectionFits(header->HASH_OFFSET, header->HASH_CAPACITY, sizeof(uint32_t), alignof(uint32_t))) {
+            Close();
+            return false;
+        }
+
+        m_entries = (const Entry *)(m_base + header->ENTRIES_OFFSET);
+        m_index = (const VALUE_TYPE *)(m_base + header->INDEX_OFFSET);
+        m_slots = (const uint32_t *)(m_base + header->HASH_OFFSET);
+        m_length = header->COUNT;
+        m_index_count = header->INDEX_COUNT;
+        m_index_stride = header->INDEX_STRIDE;
+        m_mask = header->HASH_CAPACITY - 1;
+
+        return true;
+    }
+
+    void Close() {
+        if(m_base) {
+            munmap((void *)m_base, m_size);
+        }
+
+        m_base = NULL;
+        m_size = 0;
+        m_entries = NULL;
+        m_index = NULL;
+        m_slots = NULL;
+        m_length = 0;
+        m_index_count = 0;
+        m_index_stride = 0;
+        m_mask = 0;
+    }
+
+    // reads the whole image to check its checksum
+    bool Verify() {
+        if(!m_base) {
+            return false;
+        }
+
+        ZeeChecksum checksum;
+        checksum.Update(m_base + sizeof(ZeeSetImageHeader), m_size - sizeof(ZeeSetImageHeader));
+        return checksum.Digest() == ((const ZeeSetImageHeader *)m_base)->CHECKSUM;
+    }
+
+    unsigned long Length() {
+        return m_length;
+    }
+
+    unsigned long MaxRank() {
+        return m_length;
+    }
+
+    size_t Count() {
+        return m_length;
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key) {
+        if(!m_length) {
+            return 0;
+        }
+
+        // a valid table ends every probe at an empty slot, a corrupt one may have none, so stop after a full turn
+        uint64_t i = HashKey(key) & m_mask;
+        for(uint64_t probes = 0; probes <= m_mask && m_slots[i]; ++probes, i = (i + 1) & m_mask) {
+            // a rank past the entries only comes from a corrupt image
+            if(m_slots[i] > m_length) {
+                return 0;
+            }
+
+            if(m_entries[m_slots[i] - 1].KEY == key) {
+                return m_slots[i];
+            }
+        }
+
+        return 0;
+    }
+
+    bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
+        unsigned long rank = GetRankOfElement(key);
+
+        if(!rank) {
+            return false;
+        }
+
+        value = m_entries[rank - 1].VALUE;
+        return true;
+    }
+
+    bool HasKey(const KEY_TYPE &key) {
+        return GetRankOfElement(key) != 0;
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        if(rank == 0 || rank > m_length) {
+            return false;
+        }
+
+        key = m_entries[rank - 1].KEY;
+        value = m_entries[rank - 1].VALUE;
+        return true;
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        if(rank_low > rank_high || rank_low == 0) {
+            return;
+        }
+
+        for(unsigned long r = rank_low; r <= rank_high && r <= m_length; ++r) {
+            cb(r, m_entries[r - 1].KEY, m_entries[r - 1].VALUE);
+        }
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        GetElementsByRangedRank(1, m_length, cb);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsReverse(Function cb) {
+        for(unsigned long r = m_length; r > 0; --r) {
+            cb(r, m_entries[r - 1].KEY, m_entries[r - 1].VALUE);
+        }
+    }
+
+    bool GetElementOfFirstGreaterValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        return PickElement(FirstRankOf(v, false), key, value, rank);
+    }
+
+    bool GetElementOfFirstGreaterEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        return PickElement(FirstRankOf(v, true), key, value, rank);
+    }
+
+    bool GetElementOfLastLessValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        return PickElement(FirstRankOf(v, true) - 1, key, value, rank);
+    }
+
+    bool GetElementOfLastLessEqualValue(const VALUE_TYPE &v, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank) {
+        return PickElement(FirstRankOf(v, false) - 1, key, value, rank);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high, Function cb) {
+        unsigned long rank = FirstRankOf(v_low, include_v_low);
+        unsigned long rank2 = FirstRankOf(v_high, !include_v_high) - 1;
+
+        GetElementsByRangedRank(rank, rank2, cb);
+    }
+
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        unsigned long rank = FirstRankOf(v_low, include_v_low);
+        unsigned long rank2 = FirstRankOf(v_high, !include_v_high) - 1;
+
+        return rank <= rank2 ? rank2 - rank + 1 : 0;
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyRank(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        if(rank == 0 || rank > m_length) {
+            return;
+        }
+
+        PickNearby(rank, lower_count, upper_count, pick_cb);
+    }
+
+    template<typename Function> /* std::function<bool(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElementsOfNearbyValue(const VALUE_TYPE &value, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        unsigned long rank = FirstRankOf(value, true);
+
+        if(rank > m_length) {
+            rank = FirstRankOf(value, false) - 1;
+
+            if(rank == 0) {
+                return;
+            }
+        }
+
+        PickNearby(rank, lower_count, upper_count, pick_cb);
+    }
+
+private:
+    static uint64_t Align(uint64_t offset) {
+        return (offset + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+    }
+
+    // count items of size bytes at offset lie in the mapping and are aligned, without overflowing
+    bool SectionFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t align) const {
+        return offset % align == 0 && offset <= m_size && count <= (m_size - offset) / size;
+    }
+
+    static void WritePadding(ZeeWriter &w, uint64_t &offset, uint64_t target) {
+        static const char zeros[SECTION_ALIGN] = {};
+        w.Write(zeros, target - offset);
+        offset = target;
+    }
+
+    static uint64_t HashKey(const KEY_TYPE &key) {
+        ZeeChecksum checksum;
+        checksum.Update(&key, sizeof(key));
+        return checksum.Digest();
+    }
+
+    // rank of the first entry with value >= v (inclusive) or > v, m_length + 1 if none
+    unsigned long FirstRankOf(const VALUE_TYPE &v, bool inclusive) {
+        auto before = [&v, inclusive](const VALUE_TYPE &x) {
+            return inclusive ? x < v : !(v < x);
+        };
+
+        // the sampled index narrows the search to one stride of entries
+        uint64_t lo = 0, hi = m_index_count;
+        while(lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if(before(m_index[mid])) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        uint64_t first = lo ? (lo - 1) * m_index_stride + 1 : 0;
+        uint64_t last = lo * m_index_stride < m_length ? lo * m_index_stride : m_length;
+
+        while(first < last) {
+            uint64_t mid = (first + last) / 2;
+            if(before(m_entries[mid].VALUE)) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+
+        return first + 1;
+    }
+
+    bool PickElement(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value, unsigned long *rank_out) {
+        if(!GetElementByRank(rank, key, value)) {
+            return false;
+        }
+
+        if(rank_out) {
+            *rank_out = rank;
+        }
+        return true;
+    }
+
+    template<typename Function>
+    void PickNearby(unsigned long rank, unsigned long lower_count, unsigned long upper_count, Function pick_cb) {
+        pick_cb(rank, m_entries[rank - 1].KEY, m_entries[rank - 1].VALUE);
+
+        for(unsigned long r = rank - 1; r > 0 && lower_count; --r) {
+            if(pick_cb(r, m_entries[r - 1].KEY, m_entries[r - 1].VALUE)) {
+                --lower_count;
+            }
+        }
+
+        for(unsigned long r = rank + 1; r <= m_length && upper_count; ++r) {
+            if(pick_cb(r, m_entries[r - 1].KEY, m_entries[r - 1].VALUE)) {
+                --upper_count;
+            }
+        }
+    }
+
+    const char *m_base = NULL;
+    uint64_t m_size = 0;
+    const Entry *m_entries = NULL;
+    const VALUE_TYPE *m_index = NULL;
+    const uint32_t *m_slots = NULL;
+    unsigned long m_length = 0;
+    uint64_t m_index_count = 0;
+    uint64_t m_index_stride = 0;
+    uint64_t m_mask = 0;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include "zeesetview.h"
+
+using Element = std::tuple<unsigned long, unsigned, unsigned long>;
+
+int main() {
+    ZeeSet<unsigned, unsigned long> rank;
+    ZeeSetView<unsigned, unsigned long> view;
+    std::mt19937 rng;
+    rng.seed(time(NULL));
+
+    unsigned max_id = 3000;
+    unsigned max_value = 500;
+    std::string path = "zeesetview.test.image";
+
+    for(unsigned i = 0; i < max_id; ++i) {
+        rank.Update(rng() % (max_id * 2), rng() % max_value);
+    }
+
+    bool exported = ZeeSetView<unsigned, unsigned long>::Export(rank, path);
+    bool opened = view.Open(path);
+
+    std::cout << "export=" << exported << " open=" << opened << " verify=" << view.Verify() << " count=" << view.Count() << " expect=" << rank.Count() << "\n";
+
+    {
+        bool same = true;
+
+        for(unsigned id = 0; id < max_id * 2; ++id) {
+            unsigned long v1 = 0, v2 = 0;
+            same = same && rank.GetRankOfElement(id) == view.GetRankOfElement(id);
+            same = same && rank.GetValueByKey(id, v1) == view.GetValueByKey(id, v2) && v1 == v2;
+            same = same && rank.HasKey(id) == view.HasKey(id);
+        }
+
+        std::cout << "keys match=" << same << "\n";
+    }
+
+    {
+        bool same = true;
+
+        for(unsigned long r = 0; r <= rank.Count() + 1; ++r) {
+            unsigned k1 = 0, k2 = 0;
+            unsigned long v1 = 0, v2 = 0;
+            same = same && rank.GetElementByRank(r, k1, v1) == view.GetElementByRank(r, k2, v2) && k1 == k2 && v1 == v2;
+        }
+
+        std::vector<Element> e1, e2;
+        auto collect = [](std::vector<Element> &out) {
+            return [&out](unsigned long r, const unsigned &key, const unsigned long &value) {
+                out.emplace_back(r, key, value);
+            };
+        };
+
+        rank.GetElementsByRangedRank(5, 100, collect(e1));
+        view.GetElementsByRangedRank(5, 100, collect(e2));
+        rank.GetElementsByRangedRank(rank.Count() - 3, rank.Count() + 3, collect(e1));
+        view.GetElementsByRangedRank(rank.Count() - 3, rank.Count() + 3, collect(e2));
+        rank.ForeachElementsReverse(collect(e1));
+        view.ForeachElementsReverse(collect(e2));
+
+        std::cout << "ranks match=" << (same && e1 == e2) << "\n";
+    }
+
+    {
+        bool same = true;
+
+        for(unsigned long v = 0; v <= max_value; ++v) {
+            unsigned long v_high = v + rng() % 50;
+
+            for(int flags = 0; flags < 4; ++flags) {
+                std::vector<Element> e1, e2;
+                auto collect = [](std::vector<Element> &out) {
+                    return [&out](unsigned long r, const unsigned &key, const unsigned long &value) {
+                        out.emplace_back(r, key, value);
+                    };
+                };
+
+                rank.GetElementsByRangedValue(v, flags & 1, v_high, flags & 2, collect(e1));
+                view.GetElementsByRangedValue(v, flags & 1, v_high, flags & 2, collect(e2));
+
+                same = same && e1 == e2 &&
+                    rank.GetElementsCountByRangedValue(v, flags & 1, v_high, flags & 2) == view.GetElementsCountByRangedValue(v, flags & 1, v_high, flags & 2);
+            }
+
+            unsigned k1 = 0, k2 = 0;
+            unsigned long x1 = 0, x2 = 0, r1 = 0, r2 = 0;
+            same = same && rank.GetElementOfFirstGreaterValue(v, k1, x1, &r1) == view.GetElementOfFirstGreaterValue(v, k2, x2, &r2) && k1 == k2 && r1 == r2;
+            same = same && rank.GetElementOfFirstGreaterEqualValue(v, k1, x1, &r1) == view.GetElementOfFirstGreaterEqualValue(v, k2, x2, &r2) && k1 == k2 && r1 == r2;
+            same = same && rank.GetElementOfLastLessValue(v, k1, x1, &r1) == view.GetElementOfLastLessValue(v, k2, x2, &r2) && k1 == k2 && r1 == r2;
+            same = same && rank.GetElementOfLastLessEqualValue(v, k1, x1, &r1) == view.GetElementOfLastLessEqualValue(v, k2, x2, &r2) && k1 == k2 && r1 == r2;
+        }
+
+        std::cout << "values match=" << same << "\n";
+    }
+
+    {
+        bool same = true;
+
+        for(int j = 0; j < 100; ++j) {
+            unsigned long r = rng() % (rank.Count() + 2);
+            unsigned long v = rng() % (max_value + 10);
+            std::vector<Element> e1, e2;
+            auto pick = [](std::vector<Element> &out) {
+                return [&out](unsigned long r, const unsigned &key, const unsigned long &value) -> bool {
+                    out.emplace_back(r, key, value);
+                    return value % 3 != 0;
+                };
+            };
+
+            rank.ForeachElementsOfNearbyRank(r, 5, 7, pick(e1));
+            view.ForeachElementsOfNearbyRank(r, 5, 7, pick(e2));
+            rank.ForeachElementsOfNearbyValue(v, 6, 4, pick(e1));
+            view.ForeachElementsOfNearbyValue(v, 6, 4, pick(e2));
+
+            same = same && e1 == e2;
+        }
+
+        std::cout << "nearby match=" << same << "\n";
+    }
+
+    {
+        ZeeSet<unsigned, unsigned long> empty;
+        ZeeSetView<unsigned, unsigned long> empty_view;
+        bool ok = ZeeSetView<unsigned, unsigned long>::Export(empty, path) && empty_view.Open(path);
+        unsigned k;
+        unsigned long v;
+
+        std::cout << "empty open=" << ok << " count=" << empty_view.Count() << " rank=" << empty_view.GetRankOfElement(1)
+            << " first=" << empty_view.GetElementOfFirstGreaterEqualValue(0, k, v, NULL) << "\n";
+    }
+
+    {
+        // images whose header or hash slots do not match their entries are refused or miss, never read out of bounds
+        ZeeSet<unsigned, unsigned long> small;
+        for(unsigned i = 0; i < 100; ++i) {
+            small.Update(i, i % 7);
+        }
+
+        auto corrupt = [&small, &path](std::function<void(ZeeSetImageHeader &, std::string &)> change) {
+            ZeeSetView<unsigned, unsigned long>::Export(small, path);
+            std::ifstream is(path, std::ios::binary);
+            std::string image((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+            ZeeSetImageHeader header;
+
+            memcpy(&header, image.data(), sizeof(header));
+            change(header, image);
+            memcpy(&image[0], &header, sizeof(header));
+            std::ofstream(path, std::ios::binary | std::ios::trunc).write(image.data(), image.size());
+
+            ZeeSetView<unsigned, unsigned long> bad;
+            return bad.Open(path) ? (long)bad.GetRankOfElement(1000) + (long)bad.GetRankOfElement(5) : -1L;
+        };
+
+        long full_table = corrupt([](ZeeSetImageHeader &h, std::string &image) { h.COUNT = h.HASH_CAPACITY; });
+        long short_index = corrupt([](ZeeSetImageHeader &h, std::string &image) { h.INDEX_COUNT--; });
+        long wrapped = corrupt([](ZeeSetImageHeader &h, std::string &image) { h.ENTRIES_OFFSET = ~0ull - 63; });
+        long bad_slots = corrupt([](ZeeSetImageHeader &h, std::string &image) {
+                    for(uint64_t i = 0; i < h.HASH_CAPACITY; ++i) {
+                        uint32_t rank = 0xfffffff0;
+                        memcpy(&image[h.HASH_OFFSET + i * sizeof(rank)], &rank, sizeof(rank));
+                    }
+                });
+
+        // every slot holds an in-range rank, so no probe meets an empty slot
+        long no_empty_slot = corrupt([](ZeeSetImageHeader &h, std::string &image) {
+                    for(uint64_t i = 0; i < h.HASH_CAPACITY; ++i) {
+                        uint32_t rank = 1;
+                        memcpy(&image[h.HASH_OFFSET + i * sizeof(rank)], &rank, sizeof(rank));
+                    }
+                });
+
+        std::cout << "corrupt full table=" << full_table << " short index=" << short_index << " wrapped offset=" << wrapped
+            << " bad slots=" << bad_slots << " no empty slot=" << no_empty_slot << "\n";
+    }
+
+    view.Close();
+    remove(path.c_str());
+
+    return 0;
+}
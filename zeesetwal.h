@@ -0,0 +1,441 @@
+#ifndef __ZEESETWAL_H__
+#define __ZEESETWAL_H__
+
+// append-only write-ahead log of ZeeSet mutations, with group commit and crash recovery
+
+#include "zeeset.h"
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Attach with ZeeSet::SetLog. Records are appended to an in-memory buffer on the update path,
+// a background thread writes and fdatasync()s the buffer every sync_interval_ms (group commit),
+// so an update is durable at most sync_interval_ms after it returns.
+//
+// record layout (host byte order):
+//   u32 body length | body: u64 sequence, u8 type, payload | u64 checksum of body
+//
+// Checkpoint() saves a snapshot tagged with the last sequence, syncs it and its directory entry,
+// then truncates the log; Recover() loads that snapshot and replays the records after it.
+template<typename KeyType, typename ValueType>
+class ZeeSetWal : public ZeeSetLog<KeyType, ValueType> {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+
+    enum RecordType : uint8_t {
+        RECORD_UPDATE = 1,
+        RECORD_DELETE = 2,
+        RECORD_DELETE_BY_RANGED_RANK = 3,
+        RECORD_DELETE_BY_RANGED_VALUE = 4,
+        RECORD_CLEAR = 5,
+    };
+
+    // update path writes the buffer itself once it grows beyond this
+    static constexpr size_t MAX_BUFFER_BYTES = 64 * 1024 * 1024;
+
+    ZeeSetWal() = default;
+
+    ~ZeeSetWal() {
+        Close();
+    }
+
+    ZeeSetWal(const ZeeSetWal &) = delete;
+    ZeeSetWal(ZeeSetWal &&) = delete;
+    ZeeSetWal &operator=(const ZeeSetWal &) = delete;
+    ZeeSetWal &operator=(ZeeSetWal &&) = delete;
+
+    // appends to the log at path, sequence continues from last_sequence (see Recover)
+    bool Open(const std::string &path, unsigned sync_interval_ms = 10, uint64_t last_sequence = 0) {
+        Close();
+
+        m_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if(m_fd < 0) {
+            return false;
+        }
+
+        m_sync_interval = std::chrono::milliseconds(sync_interval_ms);
+        m_sequence = last_sequence;
+        m_stop = false;
+        m_failed = false;
+        m_flusher = std::thread([this]() { FlushLoop(); });
+
+        return true;
+    }
+
+    // writes and syncs everything logged so far, then stops the flusher
+    void Close() {
+        if(m_fd < 0) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_flusher.join();
+
+        // the flusher may have seen m_stop only after its last write
+        {
+            std::lock_guard<std::mutex> write_lock(m_write_mutex);
+            WriteBuffer(true);
+        }
+
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    // blocks until everything logged so far is on disk
+    bool Sync() {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        return WriteBuffer(true);
+    }
+
+    // false once a write or sync failed
+    bool Good() {
+        return !m_failed.load();
+    }
+
+    uint64_t LastSequence() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_sequence;
+    }
+
+    // must run on the thread updating set: the snapshot then holds every record logged so far,
+    // snapshot is replaced atomically and the log is truncated
+    template<typename SetType>
+    bool Checkpoint(SetType &set, const std::string &snapshot_path) {
+        std::lock_guard<std::mutex> write_lock(m_write_mutex);
+        uint64_t sequence = LastSequence();
+
+        if(!SaveSnapshotFile(set, snapshot_path, sequence)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_buffer.clear();
+
+        // the snapshot and its directory entry are durable by now, so records past it may go
+        if(ftruncate(m_fd, 0) != 0 || fsync(m_fd) != 0) {
+            m_failed = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    // rebuilds set from the snapshot (if the file exists) and the log records after it,
+    // a torn or corrupted log tail is cut off; set must not have a log attached.
+    // last_sequence is the sequence to pass to Open to keep appending to log_path
+    template<typename SetType>
+    static bool Recover(SetType &set, const std::string &snapshot_path, const std::string &log_path, uint64_t *last_sequence) {
+        uint64_t sequence = 0;
+
+        set.Clear();
+
+        {
+            std::ifstream is(snapshot_path, std::ios::binary);
+
+            if(is) {
+                if(!set.LoadSnapshot(is) || !is.read((char *)&sequence, sizeof(sequence))) {
+                    return false;
+                }
+            }
+        }
+
+        std::ifstream is(log_path, std::ios::binary | std::ios::ate);
+        uint64_t file_bytes = is ? (uint64_t)is.tellg() : 0;
+        uint64_t good_bytes = 0;
+
+        is.seekg(0);
+
+        while(is) {
+            uint32_t length;
+            std::string body;
+            uint64_t checksum;
+
+            if(!is.read((char *)&length, sizeof(length)) || length > file_bytes - good_bytes) {
+                break;
+            }
+
+            body.resize(length);
+            if(!is.read(&body[0], length) || !is.read((char *)&checksum, sizeof(checksum))) {
+                break;
+            }
+
+            ZeeChecksum whole;
+            whole.Update(body.data(), body.size());
+
+            if(whole.Digest() != checksum) {
+                break;
+            }
+
+            ZeeReader r(body.data(), body.size());
+            uint64_t record_sequence;
+
+            if(!r.Read(&record_sequence, sizeof(record_sequence))) {
+                break;
+            }
+
+            // records up to the snapshot's sequence are already in the snapshot
+            if(record_sequence > sequence) {
+                if(!Replay(set, r)) {
+                    break;
+                }
+
+                sequence = record_sequence;
+            }
+
+            good_bytes += sizeof(length) + length + sizeof(checksum);
+        }
+
+        is.close();
+
+        if(access(log_path.c_str(), F_OK) == 0 && truncate(log_path.c_str(), good_bytes) != 0) {
+            return false;
+        }
+
+        if(last_sequence) {
+            *last_sequence = sequence;
+        }
+
+        return true;
+    }
+
+    void OnUpdate(const KEY_TYPE &key, const VALUE_TYPE &value) override {
+        Append(RECORD_UPDATE, [&key, &value](ZeeWriter &w) {
+                    ZeeSerializer<KEY_TYPE>::Write(w, key);
+                    ZeeSerializer<VALUE_TYPE>::Write(w, value);
+                });
+    }
+
+    void OnDelete(const KEY_TYPE &key) override {
+        Append(RECORD_DELETE, [&key](ZeeWriter &w) {
+                    ZeeSerializer<KEY_TYPE>::Write(w, key);
+                });
+    }
+
+    void OnDeleteByRangedRank(unsigned long rank_low, unsigned long rank_high) override {
+        Append(RECORD_DELETE_BY_RANGED_RANK, [rank_low, rank_high](ZeeWriter &w) {
+                    uint64_t low = rank_low, high = rank_high;
+                    w.Write(&low, sizeof(low));
+                    w.Write(&high, sizeof(high));
+                });
+    }
+
+    void OnDeleteByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) override {
+        Append(RECORD_DELETE_BY_RANGED_VALUE, [&](ZeeWriter &w) {
+                    uint8_t flags = (include_v_low ? 1 : 0) | (include_v_high ? 2 : 0);
+                    ZeeSerializer<VALUE_TYPE>::Write(w, v_low);
+                    ZeeSerializer<VALUE_TYPE>::Write(w, v_high);
+                    w.Write(&flags, sizeof(flags));
+                });
+    }
+
+    void OnClear() override {
+        Append(RECORD_CLEAR, [](ZeeWriter &w) {});
+    }
+
+private:
+    template<typename Function>
+    void Append(RecordType type, Function write_payload) {
+        bool full;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            size_t start = m_buffer.size();
+            uint32_t length = 0;
+
+            m_buffer.append((const char *)&length, sizeof(length));
+
+            ZeeWriter w(m_buffer);
+            uint64_t sequence = ++m_sequence;
+            uint8_t record_type = type;
+            w.Write(&sequence, sizeof(sequence));
+            w.Write(&record_type, sizeof(record_type));
+            write_payload(w);
+
+            length = (uint32_t)(m_buffer.size() - start - sizeof(length));
+            memcpy(&m_buffer[start], &length, sizeof(length));
+
+            uint64_t checksum = w.Checksum().Digest();
+            m_buffer.append((const char *)&checksum, sizeof(checksum));
+
+            full = m_buffer.size() >= MAX_BUFFER_BYTES;
+        }
+
+        if(full) {
+            std::lock_guard<std::mutex> lock(m_write_mutex);
+            WriteBuffer(false);
+        }
+    }
+
+    template<typename SetType>
+    static bool Replay(SetType &set, ZeeReader &r) {
+        uint8_t type;
+
+        if(!r.Read(&type, sizeof(type))) {
+            return false;
+        }
+
+        std::function<void(unsigned long, const KEY_TYPE &, const VALUE_TYPE &)> ignore;
+
+        switch(type) {
+            case RECORD_UPDATE:
+                {
+                    KEY_TYPE key;
+                    VALUE_TYPE value;
+                    if(!ZeeSerializer<KEY_TYPE>::Read(r, key) || !ZeeSerializer<VALUE_TYPE>::Read(r, value)) {
+                        return false;
+                    }
+                    // only values the set took were logged
+                    return set.Update(key, value);
+                }
+            case RECORD_DELETE:
+                {
+                    KEY_TYPE key;
+                    if(!ZeeSerializer<KEY_TYPE>::Read(r, key)) {
+                        return false;
+                    }
+                    set.Delete(key);
+                }
+                return true;
+            case RECORD_DELETE_BY_RANGED_RANK:
+                {
+                    uint64_t low, high;
+                    if(!r.Read(&low, sizeof(low)) || !r.Read(&high, sizeof(high))) {
+                        return false;
+                    }
+                    set.DeleteByRangedRank(low, high, ignore);
+                }
+                return true;
+            case RECORD_DELETE_BY_RANGED_VALUE:
+                {
+                    VALUE_TYPE v_low, v_high;
+                    uint8_t flags;
+                    if(!ZeeSerializer<VALUE_TYPE>::Read(r, v_low) || !ZeeSerializer<VALUE_TYPE>::Read(r, v_high) ||
+                            !r.Read(&flags, sizeof(flags))) {
+                        return false;
+                    }
+                    set.DeleteByRangedValue(v_low, flags & 1, v_high, flags & 2, ignore);
+                }
+                return true;
+            case RECORD_CLEAR:
+                set.Clear();
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    template<typename SetType>
+    static bool SaveSnapshotFile(SetType &set, const std::string &path, uint64_t sequence) {
+        std::string tmp_path = path + ".tmp";
+
+        {
+            std::ofstream os(tmp_path, std::ios::binary | std::ios::trunc);
+
+            if(!set.SaveSnapshot(os) || !os.write((const char *)&sequence, sizeof(sequence)) || !os.flush()) {
+                return false;
+            }
+        }
+
+        int fd = open(tmp_path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        close(fd);
+
+        return synced && rename(tmp_path.c_str(), path.c_str()) == 0 && SyncDirectory(path);
+    }
+
+    // makes a rename into the directory holding path durable
+    static bool SyncDirectory(const std::string &path) {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if(fd < 0) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        close(fd);
+
+        return synced;
+    }
+
+    // called with m_write_mutex held, so buffers reach the file in order
+    bool WriteBuffer(bool sync) {
+        std::string buffer;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            buffer.swap(m_buffer);
+        }
+
+        const char *p = buffer.data();
+        size_t left = buffer.size();
+
+        while(left) {
+            ssize_t n = write(m_fd, p, left);
+
+            if(n < 0) {
+                m_failed = true;
+                return false;
+            }
+
+            p += n;
+            left -= n;
+        }
+
+        if(sync && fdatasync(m_fd) != 0) {
+            m_failed = true;
+            return false;
+        }
+
+        return true;
+    }
+
+    void FlushLoop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while(!m_stop) {
+            m_cond.wait_for(lock, m_sync_interval);
+            bool stop = m_stop;
+            lock.unlock();
+
+            {
+                std::lock_guard<std::mutex> write_lock(m_write_mutex);
+                WriteBuffer(true);
+            }
+
+            lock.lock();
+            if(stop) {
+                break;
+            }
+        }
+    }
+
+    int m_fd = -1;
+    std::chrono::milliseconds m_sync_interval{10};
+    std::thread m_flusher;
+
+    // guards m_buffer, m_sequence and m_stop
+    std::mutex m_mutex;
+    // serializes file writes and truncation
+    std::mutex m_write_mutex;
+    std::condition_variable m_cond;
+    std::string m_buffer;
+    uint64_t m_sequence = 0;
+    bool m_stop = false;
+    std::atomic<bool> m_failed{false};
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <sstream>
+#include <functional>
+#include "zeesetwal.h"
+
+using SetType = ZeeSet<std::string, unsigned long>;
+using Element = std::tuple<unsigned long, std::string, unsigned long>;
+
+static std::vector<Element> Elements(SetType &rank) {
+    std::vector<Element> out;
+    rank.ForeachElements([&out](unsigned long r, const std::string &key, const unsigned long &value) {
+                out.emplace_back(r, key, value);
+            });
+    return out;
+}
+
+static void RandomOps(SetType &rank, std::mt19937 &rng, unsigned n) {
+    std::function<void(unsigned long, const std::string &, const unsigned long &)> ignore;
+
+    for(unsigned i = 0; i < n; ++i) {
+        static char buf[1024];
+        snprintf(buf, sizeof(buf), "K%u", (unsigned)rng() % 500);
+        unsigned op = rng() % 100;
+
+        if(op < 70) {
+            rank.Update(std::string(buf), rng() % 1000);
+        } else if(op < 95) {
+            rank.Delete(std::string(buf));
+        } else if(op < 97) {
+            unsigned long low = rng() % 300;
+            rank.DeleteByRangedRank(low, low + rng() % 5, ignore);
+        } else if(op < 99) {
+            unsigned long low = rng() % 1000;
+            rank.DeleteByRangedValue(low, rng() % 2, low + rng() % 10, rng() % 2, ignore);
+        } else {
+            // bulk replacements and stores are logged as a clear plus the elements they leave
+            std::vector<std::pair<std::string, unsigned long>> entries(rng() % 20);
+            for(auto &kv: entries) {
+                kv = std::make_pair("B" + std::to_string(rng() % 50), (unsigned long)(rng() % 1000));
+            }
+
+            unsigned how = rng() % 5;
+            if(how == 0) {
+                rank.Clear();
+            } else if(how == 1) {
+                rank.BulkLoad(entries.begin(), entries.end());
+            } else if(how == 2) {
+                SetType loaded;
+                std::stringstream ss;
+                loaded.BulkLoad(entries.begin(), entries.end());
+                loaded.SaveSnapshot(ss);
+                rank.LoadSnapshot(ss);
+            } else {
+                SetType other;
+                other.BulkLoad(entries.begin(), entries.end());
+
+                if(how == 3) {
+                    rank.UnionStore(std::vector<SetType *>{&rank, &other}, {1, 2});
+                } else {
+                    rank.InterStore(std::vector<SetType *>{&rank, &other}, {}, SetType::AGGREGATE_MAX);
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    std::mt19937 rng;
+    rng.seed(time(NULL));
+
+    std::string snapshot_path = "zeesetwal.test.snapshot";
+    std::string log_path = "zeesetwal.test.log";
+    remove(snapshot_path.c_str());
+    remove(log_path.c_str());
+
+    SetType rank;
+
+    {
+        ZeeSetWal<std::string, unsigned long> wal;
+        bool opened = wal.Open(log_path, 5);
+        rank.SetLog(&wal);
+
+        RandomOps(rank, rng, 3000);
+        bool checkpoint = wal.Checkpoint(rank, snapshot_path);
+        RandomOps(rank, rng, 3000);
+
+        rank.SetLog(NULL);
+        std::cout << "open=" << opened << " checkpoint=" << checkpoint << " sequence=" << wal.LastSequence() << " good=" << wal.Good() << "\n";
+    }
+
+    {
+        // torn record at the tail
+        FILE *f = fopen(log_path.c_str(), "ab");
+        fwrite("\x20\x00\x00\x00garbage", 1, 11, f);
+        fclose(f);
+    }
+
+    SetType recovered;
+    uint64_t sequence = 0;
+    bool recover_ok = ZeeSetWal<std::string, unsigned long>::Recover(recovered, snapshot_path, log_path, &sequence);
+
+    std::cout << "recover=" << recover_ok << " sequence=" << sequence << " count=" << recovered.Count()
+        << " match=" << (Elements(rank) == Elements(recovered)) << " TestSelf=" << recovered.TestSelf() << "\n";
+
+    {
+        ZeeSetWal<std::string, unsigned long> wal;
+        wal.Open(log_path, 5, sequence);
+        recovered.SetLog(&wal);
+
+        std::mt19937 rng2 = rng;
+        RandomOps(recovered, rng, 2000);
+        RandomOps(rank, rng2, 2000);
+
+        wal.Sync();
+        recovered.SetLog(NULL);
+    }
+
+    SetType recovered_again;
+    recover_ok = ZeeSetWal<std::string, unsigned long>::Recover(recovered_again, snapshot_path, log_path, &sequence);
+
+    std::cout << "recover again=" << recover_ok << " sequence=" << sequence << " count=" << recovered_again.Count()
+        << " match=" << (Elements(rank) == Elements(recovered_again)) << " TestSelf=" << recovered_again.TestSelf() << "\n";
+
+    remove(snapshot_path.c_str());
+    remove(log_path.c_str());
+
+    {
+        // stores read the set before replacing it, the log must carry what they leave
+        SetType stored, other;
+        for(unsigned i = 0; i < 100; ++i) {
+            stored.Update("K" + std::to_string(i), i);
+            if(i % 2) {
+                other.Update("K" + std::to_string(i), i * 3);
+            }
+        }
+
+        {
+            ZeeSetWal<std::string, unsigned long> wal;
+            wal.Open(log_path, 5);
+            stored.SetLog(&wal);
+
+            stored.UnionStore(std::vector<SetType *>{&stored, &other}, {1, 2});
+            stored.InterStore(std::vector<SetType *>{&stored, &other}, {}, SetType::AGGREGATE_MAX);
+            stored.SetLog(NULL);
+        }
+
+        SetType replayed;
+        recover_ok = ZeeSetWal<std::string, unsigned long>::Recover(replayed, snapshot_path, log_path, &sequence);
+
+        std::cout << "store recover=" << recover_ok << " count=" << replayed.Count() << " match=" << (Elements(stored) == Elements(replayed))
+            << " TestSelf=" << replayed.TestSelf() << "\n";
+    }
+
+    remove(log_path.c_str());
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#ifndef __ZEESETWINDOW_H__
+#define __ZEESETWINDOW_H__
+
+#include "zeeset.h"
+
+// milliseconds of a monotonic clock, the default time source of ZeeWindowedSet
+struct ZeeSteadyClock {
+    uint64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+// A ZeeSet whose elements expire TTL clock units after their last Update (daily and weekly boards).
+//
+// Every key is also held in a second ZeeSet ordered by its last-updated timestamp, so the expired
+// elements are always its first ranks: expiring k of them is one ranged delete there and one
+// DeleteBatch in the set, never a scan of the board.
+//
+// Expiry is incremental: each Update first expires at most expire_per_update elements, and
+// ExpireSome(budget) lets a timer spread the work further. Queries answer over live elements only:
+// they expire whatever is still due first, which is nothing while the budgets keep up with the rate
+// elements age out, so no call pays for a whole window at once.
+//
+// Clock must provide uint64_t Now(), non-decreasing.
+template<typename KeyType, typename ValueType, int MaxLevel = 32, int BranchProbPercent = 25, typename Allocator = ZeeDefaultAllocator,
+    template<typename, typename> class Dict = ZeeMapDict, typename Clock = ZeeSteadyClock,
+    typename Engine = ZeeSkiplist<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator>>
+class ZeeWindowedSet {
+public:
+    using KEY_TYPE = KeyType;
+    using VALUE_TYPE = ValueType;
+    using SET_TYPE = ZeeSet<KeyType, ValueType, MaxLevel, BranchProbPercent, Allocator, Dict, Engine>;
+    // key -> last-updated timestamp, ranked oldest first
+    using INDEX_TYPE = ZeeSet<KeyType, uint64_t, MaxLevel, BranchProbPercent, Allocator, Dict>;
+
+    explicit ZeeWindowedSet(uint64_t ttl, unsigned long expire_per_update = 16, const Clock &clock = Clock()) :
+        m_ttl(ttl), m_expire_per_update(expire_per_update), m_clock(clock) {}
+
+    ~ZeeWindowedSet() = default;
+
+    ZeeWindowedSet(const ZeeWindowedSet &) = delete;
+    ZeeWindowedSet(ZeeWindowedSet &&) = delete;
+    ZeeWindowedSet &operator=(const ZeeWindowedSet &) = delete;
+    ZeeWindowedSet &operator=(ZeeWindowedSet &&) = delete;
+
+    uint64_t TTL() const {
+        return m_ttl;
+    }
+
+    Clock &GetClock() {
+        return m_clock;
+    }
+
+    // sets value and restarts the key's window, false (key unchanged) if the engine cannot hold value
+    bool Update(const KEY_TYPE &key, const VALUE_TYPE &value) {
+        uint64_t now = m_clock.Now();
+
+        ExpireUpTo(now, m_expire_per_update);
+        if(!m_set.Update(key, value)) {
+            return false;
+        }
+
+        m_index.Update(key, now);
+        return true;
+    }
+
+    void Delete(const KEY_TYPE &key) {
+        m_set.Delete(key);
+        m_index.Delete(key);
+    }
+
+    void Clear() {
+        m_set.Clear();
+        m_index.Clear();
+    }
+
+    // expires at most budget elements that are past the TTL, returns how many
+    unsigned long ExpireSome(unsigned long budget) {
+        return ExpireUpTo(m_clock.Now(), budget);
+    }
+
+    // elements past the TTL not expired yet, 0 means queries run without expiring anything
+    unsigned long ExpiredBacklog() {
+        return DueCount(m_clock.Now());
+    }
+
+    // when key expires (0 if absent)
+    uint64_t GetExpireTime(const KEY_TYPE &key) {
+        uint64_t timestamp;
+        return m_index.GetValueByKey(key, timestamp) ? timestamp + m_ttl : 0;
+    }
+
+    // elements expired so far by the budgets and by queries catching up
+    uint64_t ExpiredCount() const {
+        return m_expired;
+    }
+
+    size_t Count() {
+        ExpireDue();
+        return m_set.Count();
+    }
+
+    bool GetValueByKey(const KEY_TYPE &key, VALUE_TYPE &value) {
+        ExpireDue();
+        return m_set.GetValueByKey(key, value);
+    }
+
+    unsigned long GetRankOfElement(const KEY_TYPE &key) {
+        ExpireDue();
+        return m_set.GetRankOfElement(key);
+    }
+
+    bool GetElementByRank(unsigned long rank, KEY_TYPE &key, VALUE_TYPE &value) {
+        ExpireDue();
+        return m_set.GetElementByRank(rank, key, value);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void GetElementsByRangedRank(unsigned long rank_low, unsigned long rank_high, Function cb) {
+        ExpireDue();
+        m_set.GetElementsByRangedRank(rank_low, rank_high, cb);
+    }
+
+    unsigned long GetElementsCountByRangedValue(const VALUE_TYPE &v_low, bool include_v_low, const VALUE_TYPE &v_high, bool include_v_high) {
+        ExpireDue();
+        return m_set.GetElementsCountByRangedValue(v_low, include_v_low, v_high, include_v_high);
+    }
+
+    template<typename Function> /* std::function<void(unsigned long rank, const KEY_TYPE &key, const VALUE_TYPE &value)> */
+    void ForeachElements(Function cb) {
+        ExpireDue();
+        m_set.ForeachElements(cb);
+    }
+
+    // f(SET_TYPE &) runs on the live elements and must only query the set
+    template<typename Function>
+    auto Read(Function f) -> decltype(f(std::declval<SET_TYPE &>())) {
+        ExpireDue();
+        return f(m_set);
+    }
+
+    bool TestSelf() {
+        if(!m_set.TestSelf() || !m_index.TestSelf() || m_set.Count() != m_index.Count()) {
+            return false;
+        }
+
+        bool ok = true;
+        m_index.ForeachElements([this, &ok](unsigned long rank, const KEY_TYPE &key, const uint64_t &timestamp) {
+                    ok = ok && this->m_set.HasKey(key);
+                });
+
+        return ok;
+    }
+
+private:
+    // elements last updated at or before now - TTL, one rank count on the index
+    unsigned long DueCount(uint64_t now) {
+        return now < m_ttl ? 0 : m_index.GetElementsCountByRangedValue(0, true, now - m_ttl, true);
+    }
+
+    // expires at most budget due elements, the index is ordered by timestamp so they are its first ranks
+    unsigned long ExpireUpTo(uint64_t now, unsigned long budget) {
+        unsigned long due = budget ? DueCount(now) : 0;
+        if(due == 0) {
+            return 0;
+        }
+
+        std::vector<KEY_TYPE> keys;
+        keys.reserve(std::min(due, budget));
+        m_index.GetElementsByRangedRank(1, std::min(due, budget), [&keys](unsigned long rank, const KEY_TYPE &key, const uint64_t &timestamp) {
+                    keys.emplace_back(key);
+                });
+
+        m_index.DeleteByRangedRank(1, keys.size(), std::function<void(unsigned long, const KEY_TYPE &, const uint64_t &)>());
+        m_set.DeleteBatch(keys.begin(), keys.end());
+        m_expired += keys.size();
+
+        return keys.size();
+    }
+
+    void ExpireDue() {
+        ExpireUpTo(m_clock.Now(), (unsigned long)-1);
+    }
+
+    uint64_t m_ttl;
+    unsigned long m_expire_per_update;
+    Clock m_clock;
+    SET_TYPE m_set;
+    INDEX_TYPE m_index;
+    uint64_t m_expired = 0;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include "zeesetwindow.h"
+
+// time moves only when the test says so
+struct ManualClock {
+    uint64_t NOW = 0;
+
+    uint64_t Now() const {
+        return NOW;
+    }
+};
+
+using WindowSet = ZeeWindowedSet<unsigned, unsigned long, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ManualClock>;
+using PlainSet = ZeeSet<unsigned, unsigned long>;
+
+using Element = std::tuple<unsigned long, unsigned, unsigned long>;
+
+// key -> (value, last updated)
+using Model = std::map<unsigned, std::pair<unsigned long, uint64_t>>;
+
+template<typename SetType>
+static std::vector<Element> Elements(SetType &rank) {
+    std::vector<Element> elements;
+    rank.ForeachElements([&elements](unsigned long n, const unsigned &key, const unsigned long &value) {
+                elements.emplace_back(n, key, value);
+            });
+    return elements;
+}
+
+static unsigned long Backlog(const Model &model, uint64_t now, uint64_t ttl) {
+    unsigned long backlog = 0;
+    for(auto &kv: model) {
+        backlog += kv.second.second + ttl <= now;
+    }
+    return backlog;
+}
+
+// the windowed set must rank exactly the entries updated within the last ttl
+static bool SameAnswers(Model &model, WindowSet &rank, std::mt19937 &rng, unsigned keys, unsigned values) {
+    uint64_t now = rank.GetClock().NOW;
+    PlainSet expected;
+
+    for(auto &kv: model) {
+        if(kv.second.second + rank.TTL() > now) {
+            expected.Update(kv.first, kv.second.first);
+        }
+    }
+
+    if(Elements(expected) != Elements(rank) || expected.Count() != rank.Count() || rank.ExpiredBacklog() != 0) {
+        return false;
+    }
+
+    for(int i = 0; i < 50; ++i) {
+        unsigned key = rng() % keys;
+        unsigned long low = rng() % values;
+        unsigned long high = low + rng() % 50;
+        unsigned long a = 0, b = 0;
+
+        if(expected.GetRankOfElement(key) != rank.GetRankOfElement(key)
+            || expected.GetValueByKey(key, a) != rank.GetValueByKey(key, b) || a != b
+            || expected.GetElementsCountByRangedValue(low, true, high, false) != rank.GetElementsCountByRangedValue(low, true, high, false)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void Run(const char *name, unsigned keys, unsigned values, uint64_t ttl, unsigned long per_update, int ops) {
+    std::mt19937 rng(keys + ttl);
+    WindowSet rank(ttl, per_update);
+    Model model;
+
+    bool match = true;
+    bool bounded = true;
+    bool test_self = true;
+
+    for(int i = 0; i < ops; ++i) {
+        unsigned op = rng() % 100;
+        uint64_t now = rank.GetClock().NOW;
+
+        if(op < 75) {
+            unsigned key = rng() % keys;
+            unsigned long value = rng() % values;
+            unsigned long backlog = rank.ExpiredBacklog();
+            uint64_t expired = rank.ExpiredCount();
+
+            rank.Update(key, value);
+            model[key] = std::make_pair(value, now);
+            bounded = bounded && rank.ExpiredCount() - expired == std::min(backlog, per_update);
+        } else if(op < 80) {
+            unsigned key = rng() % keys;
+            rank.Delete(key);
+            model.erase(key);
+        } else if(op < 95) {
+            rank.GetClock().NOW += rng() % (ttl / 10 + 1);
+        } else {
+            unsigned long budget = rng() % 20;
+            unsigned long backlog = rank.ExpiredBacklog();
+            bounded = bounded && rank.ExpireSome(budget) == std::min(backlog, budget);
+        }
+
+        // the set may still hold expired entries, never more than the model holds, and keeps every live one
+        bounded = bounded && rank.ExpiredBacklog() <= Backlog(model, rank.GetClock().NOW, ttl);
+        for(auto it = model.begin(); it != model.end() && i % 97 == 0; ++it) {
+            if(it->second.second + ttl > rank.GetClock().NOW) {
+                match = match && rank.GetExpireTime(it->first) == it->second.second + ttl;
+            }
+        }
+
+        if(i % 500 == 0) {
+            match = match && SameAnswers(model, rank, rng, keys, values);
+            test_self = test_self && rank.TestSelf();
+        }
+    }
+
+    match = match && SameAnswers(model, rank, rng, keys, values);
+    test_self = test_self && rank.TestSelf();
+
+    // once every entry is older than ttl nothing ranks
+    rank.GetClock().NOW += ttl;
+    bool drained = rank.Count() == 0 && rank.TestSelf();
+
+    std::cout << name << " keys=" << keys << " ttl=" << ttl << " expired=" << rank.ExpiredCount() << " match=" << match
+        << " bounded=" << bounded << " drained=" << drained << " TestSelf=" << test_self << "\n";
+}
+
+int main() {
+    Run("window short ttl", 2000, 1000, 100, 16, 40000);
+    Run("window long ttl", 5000, 100000, 5000, 4, 40000);
+    Run("window no per-update expiry", 1000, 50, 300, 0, 30000);
+
+    {
+        // a daily board with string keys: yesterday's players drop out, today's keep their ranks
+        ZeeWindowedSet<std::string, int, 32, 25, ZeeDefaultAllocator, ZeeHashDict, ManualClock> daily(24 * 3600 * 1000);
+
+        for(int i = 0; i < 100; ++i) {
+            daily.Update("player" + std::to_string(i), i);
+        }
+        daily.GetClock().NOW += 12 * 3600 * 1000;
+        for(int i = 0; i < 100; i += 2) {
+            daily.Update("player" + std::to_string(i), i);
+        }
+        daily.GetClock().NOW += 12 * 3600 * 1000;
+
+        std::string key;
+        int value = 0;
+        bool found = daily.GetElementByRank(1, key, value);
+
+        std::cout << "window daily count=" << daily.Count() << " first=" << (found ? key : "") << " rank of player99="
+            << daily.GetRankOfElement("player99") << " TestSelf=" << daily.TestSelf() << "\n";
+    }
+
+    return 0;
+}